@@ -3,10 +3,28 @@
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 
+#include <algorithm>
+#include <chrono>
+#include <cctype>
+#include <cmath>
+#include <condition_variable>
 #include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
@@ -20,20 +38,14 @@
 // ---------------
 
 /// <summary>
-/// Creates a shader program based on the provided file paths for the vertex and fragment shaders.
+/// Reads a shader source file, replacing every #include "file" line by the contents of that file
+/// (relative to the including file). Each file is included at most once per shader.
 /// </summary>
-/// <param name="vertexShaderFilePath">Vertex shader file path</param>
-/// <param name="fragmentShaderFilePath">Fragment shader file path</param>
-/// <returns>OpenGL handle to the created shader program</returns>
-GLuint CreateShaderProgram(const std::string& vertexShaderFilePath, const std::string& fragmentShaderFilePath);
-
-/// <summary>
-/// Creates a shader based on the provided shader type and the path to the file containing the shader source.
-/// </summary>
-/// <param name="shaderType">Shader type</param>
 /// <param name="shaderFilePath">Path to the file containing the shader source</param>
-/// <returns>OpenGL handle to the created shader</returns>
-GLuint CreateShaderFromFile(const GLuint& shaderType, const std::string& shaderFilePath);
+/// <param name="shaderSource">String the source is appended to</param>
+/// <param name="includedFiles">Files already part of the shader</param>
+/// <returns>True if the file and everything it includes could be read</returns>
+bool LoadShaderSource(const std::string& shaderFilePath, std::string& shaderSource, std::vector<std::string>& includedFiles);
 
 /// <summary>
 /// Creates a shader based on the provided shader type and the string containing the shader source.
@@ -43,6 +55,14 @@ GLuint CreateShaderFromFile(const GLuint& shaderType, const std::string& shaderF
 /// <returns>OpenGL handle to the created shader</returns>
 GLuint CreateShaderFromSource(const GLuint& shaderType, const std::string& shaderSource);
 
+/// <summary>
+/// 64-bit FNV-1a hash.
+/// </summary>
+/// <param name="data">Bytes to hash</param>
+/// <param name="size">Number of bytes</param>
+/// <returns>Hash</returns>
+static uint64_t HashBytes(const unsigned char* data, size_t size);
+
 /// <summary>
 /// Function for handling the event when the size of the framebuffer changed.
 /// </summary>
@@ -65,1476 +85,3458 @@ struct Vertex
     GLfloat nx, ny, nz; // Normal vector coordinates
 };
 
-glm::vec3 cameraPosition = glm::vec3(0.0f, 20.0f, 80.0f);
-glm::vec3 cameraFront = glm::vec3(0.0f, 0.0f, -1.0f);
-glm::vec3 cameraUp = glm::vec3(0.0f, 1.0f, 0.0f);
+/// <summary>
+/// Compact vertex layout used by the mesh buffers when packing is enabled (24 bytes instead of 36)
+/// </summary>
+struct PackedVertex
+{
+	GLfloat x, y, z;		// Position
+	GLubyte r, g, b, a;		// Color (alpha is padding so that the UVs stay 4-byte aligned)
+	GLhalf u, v;			// UV coordinates as half floats
+	GLuint normal;			// Normal in GL_INT_2_10_10_10_REV format
+};
+static_assert(sizeof(PackedVertex) == 24, "PackedVertex must stay tightly packed");
 
-glm::vec3 directionalLightPosition = glm::vec3(50.0f, 60.0f, -100.0f);
+/// <summary>
+/// Shader program wrapper. The locations of all active uniforms are looked up once after linking,
+/// and the last value uploaded to every location is remembered so that unchanged values are not sent again.
+/// </summary>
+struct ShaderProgram
+{
+	GLuint id = 0;											// OpenGL handle to the program
+	std::unordered_map<std::string, GLint> uniformLocations;	// Active uniform name -> location
+	std::vector<std::vector<unsigned char>> uniformValues;	// Last value uploaded to each location (empty if none yet)
+
+	/// <summary>
+	/// Queries the locations of all active uniforms and clears the value cache.
+	/// Must be called again whenever the program is relinked.
+	/// </summary>
+	void ReflectUniforms()
+	{
+		uniformLocations.clear();
+		uniformValues.clear();
+
+		GLint uniformCount = 0;
+		glGetProgramiv(id, GL_ACTIVE_UNIFORMS, &uniformCount);
+		for (GLint i = 0; i < uniformCount; ++i)
+		{
+			char name[256];
+			GLsizei nameLength = 0;
+			GLint arraySize = 0;
+			GLenum type;
+			glGetActiveUniform(id, i, sizeof(name), &nameLength, &arraySize, &type, name);
+
+			// Arrays are reported as "name[0]"; register the plain name and every element
+			std::string baseName(name, nameLength);
+			size_t bracket = baseName.find('[');
+			if (bracket != std::string::npos)
+			{
+				baseName.erase(bracket);
+			}
+			for (GLint element = 0; element < arraySize; ++element)
+			{
+				std::string elementName = arraySize > 1 ? baseName + "[" + std::to_string(element) + "]" : baseName;
+				GLint location = glGetUniformLocation(id, elementName.c_str());
+				if (location < 0)
+				{
+					continue; // Uniforms inside uniform blocks have no location
+				}
+				uniformLocations[elementName] = location;
+				if (element == 0)
+				{
+					uniformLocations[baseName] = location;
+				}
+				if (location >= static_cast<GLint>(uniformValues.size()))
+				{
+					uniformValues.resize(location + 1);
+				}
+			}
+		}
+	}
 
-float deltaTime = 0.0f;
-float lastFrame = 0.0f;
+	/// <summary>
+	/// Makes this program the current one.
+	/// </summary>
+	void Use() const
+	{
+		glUseProgram(id);
+	}
 
-bool firstMouseMovement = true;
-float lastX = 800.0f / 2.0;
-float lastY = 600.0f / 2.0;
+	/// <summary>
+	/// Gets the cached location of a uniform.
+	/// </summary>
+	/// <param name="name">Uniform name</param>
+	/// <returns>Location of the uniform, or -1 if the program has no active uniform with that name</returns>
+	GLint GetUniformLocation(const std::string& name) const
+	{
+		auto found = uniformLocations.find(name);
+		return found != uniformLocations.end() ? found->second : -1;
+	}
 
-float yaw = -90.0f;
-float pitch = 0.0f;
-float fov = 50.0f;
+	/// <summary>
+	/// Records a value for a location.
+	/// </summary>
+	/// <param name="location">Uniform location</param>
+	/// <param name="data">Value to upload</param>
+	/// <param name="size">Size of the value in bytes</param>
+	/// <returns>True if the value differs from the last one uploaded to the location (and so has to be uploaded)</returns>
+	bool UpdateCachedValue(GLint location, const void* data, size_t size)
+	{
+		if (location < 0 || location >= static_cast<GLint>(uniformValues.size()))
+		{
+			return false;
+		}
+		std::vector<unsigned char>& cached = uniformValues[location];
+		if (cached.size() == size && std::memcmp(cached.data(), data, size) == 0)
+		{
+			return false;
+		}
+		cached.assign(static_cast<const unsigned char*>(data), static_cast<const unsigned char*>(data) + size);
+		return true;
+	}
 
-/// <summary>
-/// Main function.
-/// </summary>
-/// <returns>An integer indicating whether the program ended successfully or not.
-/// A value of 0 indicates the program ended succesfully, while a non-zero value indicates
-/// something wrong happened during execution.</returns>
-int main()
-{
-	// Initialize GLFW
-	int glfwInitStatus = glfwInit();
-	if (glfwInitStatus == GLFW_FALSE)
+	/// <summary>
+	/// Connects a uniform block of the program to a uniform buffer binding point.
+	/// </summary>
+	/// <param name="name">Uniform block name</param>
+	/// <param name="binding">Binding point the buffer is bound to with glBindBufferBase</param>
+	void BindUniformBlock(const char* name, GLuint binding) const
 	{
-		std::cerr << "Failed to initialize GLFW!" << std::endl;
-		return 1;
+		GLuint blockIndex = glGetUniformBlockIndex(id, name);
+		if (blockIndex != GL_INVALID_INDEX)
+		{
+			glUniformBlockBinding(id, blockIndex, binding);
+		}
 	}
 
-	// Tell GLFW that we prefer to use OpenGL 3.3
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+	// Uniform uploads. The program must be in use; values that did not change since the last upload are skipped.
 
-	// Tell GLFW that we prefer to use the modern OpenGL
-	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GLFW_TRUE);
-	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	void SetUniform(GLint location, GLint value)
+	{
+		if (UpdateCachedValue(location, &value, sizeof(value)))
+		{
+			glUniform1i(location, value);
+		}
+	}
 
-	// Tell GLFW to create a window
-	float windowWidth = 1024;
-	float windowHeight = 576;
-	GLFWwindow* window = glfwCreateWindow(windowWidth, windowHeight, "Final Project", nullptr, nullptr);
-	if (window == nullptr)
+	void SetUniform(GLint location, GLfloat value)
 	{
-		std::cerr << "Failed to create GLFW window!" << std::endl;
-		glfwTerminate();
-		return 1;
+		if (UpdateCachedValue(location, &value, sizeof(value)))
+		{
+			glUniform1f(location, value);
+		}
 	}
 
-	// Tell GLFW to use the OpenGL context that was assigned to the window that we just created
-	glfwMakeContextCurrent(window);
+	void SetUniform(GLint location, const glm::vec3& value)
+	{
+		if (UpdateCachedValue(location, glm::value_ptr(value), sizeof(GLfloat) * 3))
+		{
+			glUniform3fv(location, 1, glm::value_ptr(value));
+		}
+	}
 
-	// Register the callback function that handles when the framebuffer size has changed
-	glfwSetFramebufferSizeCallback(window, FramebufferSizeChangedCallback);
+	void SetUniform(GLint location, const glm::mat4& value)
+	{
+		if (UpdateCachedValue(location, glm::value_ptr(value), sizeof(GLfloat) * 16))
+		{
+			glUniformMatrix4fv(location, 1, GL_FALSE, glm::value_ptr(value));
+		}
+	}
 
-	glfwSetCursorPosCallback(window, mouse_callback);
+	/// <summary>
+	/// Uploads a uniform by name. Convenient for one-off values; per-frame code should keep the location instead.
+	/// </summary>
+	/// <param name="name">Uniform name</param>
+	/// <param name="value">Value to upload</param>
+	template <typename T>
+	void SetUniform(const std::string& name, const T& value)
+	{
+		SetUniform(GetUniformLocation(name), value);
+	}
+};
 
-	glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
-	// Tell GLAD to load the OpenGL function pointers
-	if (!gladLoadGLLoader(reinterpret_cast<GLADloadproc>(glfwGetProcAddress)))
+// Program binaries are GL 4.1 / ARB_get_program_binary, outside of the GL 3.3 core headers; they are loaded at run time when available
+#ifndef GL_PROGRAM_BINARY_RETRIEVABLE_HINT
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#endif
+#ifndef GL_PROGRAM_BINARY_LENGTH
+#define GL_PROGRAM_BINARY_LENGTH 0x8741
+#endif
+#ifndef GL_NUM_PROGRAM_BINARY_FORMATS
+#define GL_NUM_PROGRAM_BINARY_FORMATS 0x87FE
+#endif
+typedef void (APIENTRYP GetProgramBinaryFunction)(GLuint program, GLsizei bufSize, GLsizei* length, GLenum* binaryFormat, void* binary);
+typedef void (APIENTRYP ProgramBinaryFunction)(GLuint program, GLenum binaryFormat, const void* binary, GLsizei length);
+typedef void (APIENTRYP ProgramParameteriFunction)(GLuint program, GLenum pname, GLint value);
+
+/// <summary>
+/// Header of a program binary cache file, followed by the binary itself
+/// </summary>
+struct ProgramCacheHeader
+{
+	char magic[4];			// "PGC1"
+	uint32_t binaryFormat;	// Format returned by glGetProgramBinary
+	uint64_t sourceHash;	// Hash of the preprocessed vertex and fragment sources
+	uint64_t driverHash;	// Hash of GL_VENDOR, GL_RENDERER and GL_VERSION
+	uint32_t binarySize;	// Size of the binary in bytes
+	uint32_t reserved;		// Padding, zero
+};
+
+/// <summary>
+/// Loads shader programs from binary cache files next to their vertex shaders, keyed on the preprocessed sources and the
+/// driver. Programs whose cache is missing or stale (or that the driver rejects) are compiled from source, split between
+/// the GL thread and a worker thread with a hidden shared context, and their binaries are written back.
+/// Without ARB_get_program_binary every program is compiled, still in parallel.
+/// </summary>
+struct ProgramCache
+{
+	/// <summary>
+	/// One program to load
+	/// </summary>
+	struct Entry
 	{
-		std::cerr << "Failed to initialize GLAD!" << std::endl;
-		return 1;
+		ShaderProgram* program = nullptr;	// Program receiving the result
+		std::string vertexShaderFilePath;	// Vertex shader file path
+		std::string fragmentShaderFilePath;	// Fragment shader file path
+		std::string vertexSource;			// Vertex shader source with the includes expanded
+		std::string fragmentSource;			// Fragment shader source with the includes expanded
+		uint64_t sourceHash = 0;			// Hash of both sources
+		bool fromCache = false;				// True if the program was loaded from its binary
+	};
+
+	GetProgramBinaryFunction getProgramBinary = nullptr;	// glGetProgramBinary, null if unsupported
+	ProgramBinaryFunction programBinary = nullptr;			// glProgramBinary, null if unsupported
+	ProgramParameteriFunction programParameteri = nullptr;	// glProgramParameteri, null if unsupported
+	uint64_t driverHash = 0;								// Hash of the driver strings
+	std::vector<Entry> entries;								// Programs added since the last Load
+
+	/// <summary>
+	/// Loads the program binary entry points if the driver supports at least one binary format. Must be called on the GL thread.
+	/// </summary>
+	void Initialize()
+	{
+		std::string driver;
+		for (GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION })
+		{
+			driver += reinterpret_cast<const char*>(glGetString(name));
+			driver += '\n';
+		}
+		driverHash = HashBytes(reinterpret_cast<const unsigned char*>(driver.data()), driver.size());
+
+		GLint extensionCount = 0;
+		glGetIntegerv(GL_NUM_EXTENSIONS, &extensionCount);
+		for (GLint i = 0; i < extensionCount; ++i)
+		{
+			if (std::strcmp(reinterpret_cast<const char*>(glGetStringi(GL_EXTENSIONS, i)), "GL_ARB_get_program_binary") == 0)
+			{
+				GLint formatCount = 0;
+				glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formatCount);
+				if (formatCount > 0)
+				{
+					getProgramBinary = reinterpret_cast<GetProgramBinaryFunction>(glfwGetProcAddress("glGetProgramBinary"));
+					programBinary = reinterpret_cast<ProgramBinaryFunction>(glfwGetProcAddress("glProgramBinary"));
+					programParameteri = reinterpret_cast<ProgramParameteriFunction>(glfwGetProcAddress("glProgramParameteri"));
+				}
+				break;
+			}
+		}
+		if (getProgramBinary == nullptr || programBinary == nullptr || programParameteri == nullptr)
+		{
+			getProgramBinary = nullptr;
+			programBinary = nullptr;
+			programParameteri = nullptr;
+		}
 	}
 
-	// --- VERTEX SPECIFICATION ---
-    
-    Vertex floorVertices[6];
-    
-    // Bottom face of cube
-    floorVertices[0] = { 1.0f, -1.0f, -1.0f,      255, 255, 255,     1.0f, 0.5f }; // bottom left
-    floorVertices[1] = { -1.0f, -1.0f, 1.0f,      255, 255, 255,     0.5f, 1.0f }; // top right
-    floorVertices[2] = { 1.0f, -1.0f, 1.0f,       255, 255, 255,     0.5f, 0.5f }; // top left
-    floorVertices[3] = { -1.0f, -1.0f, -1.0f,     255, 255, 255,     1.0f, 1.0f }; // bottom right
-    floorVertices[4] = { 1.0f, -1.0f, -1.0f,      255, 255, 255,     1.0f, 0.5f }; // bottom left
-    floorVertices[5] = { -1.0f, -1.0f, 1.0f,      255, 255, 255,     0.5f, 1.0f }; // top right
-    
-    // Loop to calculate normal vertices per face
-    for( int i=0; i < (sizeof(floorVertices)/sizeof(floorVertices[0])); i+=6 )
-    {
-        glm::vec3 v1( floorVertices[i].x, floorVertices[i].y, floorVertices[i].z );
-        glm::vec3 v2( floorVertices[i+1].x, floorVertices[i+1].y, floorVertices[i+1].z );
-        glm::vec3 v3( floorVertices[i+2].x, floorVertices[i+2].y, floorVertices[i+2].z );
-        
-        glm::vec3 a;
-        a.x = v2.x - v1.x;
-        a.y = v2.y - v1.y;
-        a.z = v2.z - v1.z;
-        
-        glm::vec3 b;
-        b.x = v3.x - v1.x;
-        b.y = v3.y - v1.y;
-        b.z = v3.z - v1.z;
-        
-        glm::vec3 crossProd( glm::cross(b, a) );
-        
-        for( int j=i; j < (i+6); j+=1 )
-        {
-            floorVertices[j].nx = crossProd.x;
-            floorVertices[j].ny = crossProd.y;
-            floorVertices[j].nz = crossProd.z;
-        }
-    }
-    
+	/// <summary>
+	/// Queues a program for the next Load call.
+	/// </summary>
+	/// <param name="program">Program receiving the result</param>
+	/// <param name="vertexShaderFilePath">Vertex shader file path</param>
+	/// <param name="fragmentShaderFilePath">Fragment shader file path</param>
+	void Add(ShaderProgram& program, const std::string& vertexShaderFilePath, const std::string& fragmentShaderFilePath)
+	{
+		Entry entry;
+		entry.program = &program;
+		entry.vertexShaderFilePath = vertexShaderFilePath;
+		entry.fragmentShaderFilePath = fragmentShaderFilePath;
+		entries.push_back(entry);
+	}
 
-    Vertex cubeVertices[36];
+	/// <summary>
+	/// Path of the cache file of a program: the vertex shader path followed by the fragment shader file name.
+	/// </summary>
+	static std::string CachePath(const Entry& entry)
+	{
+		size_t separator = entry.fragmentShaderFilePath.find_last_of("/\\");
+		std::string fragmentName = separator == std::string::npos ? entry.fragmentShaderFilePath : entry.fragmentShaderFilePath.substr(separator + 1);
+		return entry.vertexShaderFilePath + "." + fragmentName + ".progcache";
+	}
 
-    // NOTE: NEGATIVE Z FACING FORWARD
+	/// <summary>
+	/// Creates the program of an entry from its cache file.
+	/// </summary>
+	/// <returns>True if the cache was up to date and the driver accepted the binary</returns>
+	bool LoadBinary(Entry& entry)
+	{
+		std::ifstream cache(CachePath(entry), std::ios::binary);
+		ProgramCacheHeader header;
+		if (!cache.read(reinterpret_cast<char*>(&header), sizeof(header)) || std::memcmp(header.magic, "PGC1", 4) != 0 ||
+			header.sourceHash != entry.sourceHash || header.driverHash != driverHash)
+		{
+			return false;
+		}
+		std::vector<char> binary(header.binarySize);
+		if (!cache.read(binary.data(), binary.size()))
+		{
+			return false;
+		}
+
+		GLuint program = glCreateProgram();
+		programBinary(program, header.binaryFormat, binary.data(), static_cast<GLsizei>(binary.size()));
+		GLint linkStatus = GL_FALSE;
+		glGetProgramiv(program, GL_LINK_STATUS, &linkStatus);
+		if (linkStatus != GL_TRUE)
+		{
+			// E.g. the driver was updated without changing its version string
+			glDeleteProgram(program);
+			return false;
+		}
+		entry.program->id = program;
+		return true;
+	}
 
-    // right
-    cubeVertices[0] = { 1.0f, -1.0f, -1.0f,       255, 255, 255,     0.0f, 0.5f }; // bottom left
-    cubeVertices[1] = { 1.0f, 1.0f, 1.0f,         255, 255, 255,     0.5f, 1.0f }; // top right
-    cubeVertices[2] = { 1.0f, 1.0f, -1.0f,        255, 255, 255,     0.0f, 1.0f }; // top left
-    cubeVertices[3] = { 1.0f, -1.0f, 1.0f,        255, 255, 255,     0.5f, 0.5f }; // bottom right
-    cubeVertices[4] = { 1.0f, 1.0f, 1.0f,         255, 255, 255,     0.5f, 1.0f }; // top right
-    cubeVertices[5] = { 1.0f, -1.0f, -1.0f,       255, 255, 255,     0.0f, 0.5f }; // bottom left
+	/// <summary>
+	/// Compiles and links the program of an entry from its sources. Completion is not waited for, so that drivers
+	/// compiling in the background can overlap the programs; the link status is checked by Load.
+	/// </summary>
+	void Build(Entry& entry) const
+	{
+		GLuint vertexShader = CreateShaderFromSource(GL_VERTEX_SHADER, entry.vertexSource);
+		GLuint fragmentShader = CreateShaderFromSource(GL_FRAGMENT_SHADER, entry.fragmentSource);
+
+		GLuint program = glCreateProgram();
+		if (programParameteri != nullptr)
+		{
+			programParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+		}
+		glAttachShader(program, vertexShader);
+		glAttachShader(program, fragmentShader);
+		glLinkProgram(program);
+		glDetachShader(program, vertexShader);
+		glDeleteShader(vertexShader);
+		glDetachShader(program, fragmentShader);
+		glDeleteShader(fragmentShader);
+		entry.program->id = program;
+	}
 
-    // top
-    cubeVertices[6] = { -1.0f, 1.0f, -1.0f,       255, 255, 255,     1.0f, 1.0f }; // bottom left
-    cubeVertices[7] = { 1.0f, 1.0f, 1.0f,         255, 255, 255,     0.5f, 0.5f }; // top right
-    cubeVertices[8] = { -1.0f, 1.0f, 1.0f,        255, 255, 255,     0.5f, 1.0f }; // top left
-    cubeVertices[9] = { 1.0f, 1.0f, -1.0f,        255, 255, 255,     1.0f, 0.5f }; // bottom right
-    cubeVertices[10] = { -1.0f, 1.0f, -1.0f,      255, 255, 255,     1.0f, 1.0f }; // bottom left
-    cubeVertices[11] = { 1.0f, 1.0f, 1.0f,        255, 255, 255,     0.5f, 0.5f }; // top right
+	/// <summary>
+	/// Writes the binary of a linked program to its cache file.
+	/// </summary>
+	void WriteBinary(const Entry& entry) const
+	{
+		GLint binarySize = 0;
+		glGetProgramiv(entry.program->id, GL_PROGRAM_BINARY_LENGTH, &binarySize);
+		if (binarySize <= 0)
+		{
+			return;
+		}
+		std::vector<char> binary(binarySize);
+		GLenum binaryFormat = 0;
+		GLsizei length = 0;
+		getProgramBinary(entry.program->id, binarySize, &length, &binaryFormat, binary.data());
+
+		ProgramCacheHeader header = {};
+		std::memcpy(header.magic, "PGC1", 4);
+		header.binaryFormat = binaryFormat;
+		header.sourceHash = entry.sourceHash;
+		header.driverHash = driverHash;
+		header.binarySize = static_cast<uint32_t>(length);
+		std::ofstream cache(CachePath(entry), std::ios::binary);
+		cache.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		cache.write(binary.data(), length);
+		if (!cache)
+		{
+			std::cerr << "Failed to write program cache " << CachePath(entry) << std::endl;
+		}
+	}
 
-    // left
-    cubeVertices[12] = { -1.0f, -1.0f, 1.0f,      255, 255, 255,     0.5f, 0.5f }; // bottom left
-    cubeVertices[13] = { -1.0f, 1.0f, -1.0f,      255, 255, 255,     0.0f, 1.0f }; // top right
-    cubeVertices[14] = { -1.0f, 1.0f, 1.0f,       255, 255, 255,     0.5f, 1.0f }; // top left
-    cubeVertices[15] = { -1.0f, -1.0f, -1.0f,     255, 255, 255,     0.0f, 0.5f }; // bottom right
-    cubeVertices[16] = { -1.0f, 1.0f, -1.0f,      255, 255, 255,     0.0f, 1.0f }; // top right
-    cubeVertices[17] = { -1.0f, -1.0f, 1.0f,      255, 255, 255,     0.5f, 0.5f }; // bottom left
+	/// <summary>
+	/// Loads every queued program, then reflects its uniforms. Must be called on the GL thread, with the window's context current.
+	/// </summary>
+	/// <param name="window">Window whose context the worker context shares objects with</param>
+	/// <returns>True if every program was read and linked</returns>
+	bool Load(GLFWwindow* window)
+	{
+		auto start = std::chrono::steady_clock::now();
+		bool success = true;
+
+		// Sources and their hashes (the hash covers the included files too)
+		std::vector<Entry*> stale;
+		for (Entry& entry : entries)
+		{
+			std::vector<std::string> vertexIncludes, fragmentIncludes;
+			if (!LoadShaderSource(entry.vertexShaderFilePath, entry.vertexSource, vertexIncludes) ||
+				!LoadShaderSource(entry.fragmentShaderFilePath, entry.fragmentSource, fragmentIncludes))
+			{
+				success = false;
+				continue;
+			}
+			std::string sources = entry.vertexSource + '\0' + entry.fragmentSource;
+			entry.sourceHash = HashBytes(reinterpret_cast<const unsigned char*>(sources.data()), sources.size());
+			entry.fromCache = programBinary != nullptr && LoadBinary(entry);
+			if (!entry.fromCache)
+			{
+				stale.push_back(&entry);
+			}
+		}
+
+		// Stale programs: every other one is built by the worker on a hidden context sharing objects with the window
+		GLFWwindow* workerContext = nullptr;
+		if (stale.size() > 1)
+		{
+			glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+			workerContext = glfwCreateWindow(1, 1, "", nullptr, window);
+			glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
+		}
+		std::thread worker;
+		if (workerContext != nullptr)
+		{
+			worker = std::thread([&]()
+			{
+				glfwMakeContextCurrent(workerContext);
+				for (size_t i = 1; i < stale.size(); i += 2)
+				{
+					Build(*stale[i]);
+				}
+				// Finished objects are visible to the GL thread once the commands that created them completed
+				glFinish();
+				glfwMakeContextCurrent(nullptr);
+			});
+		}
+		for (size_t i = 0; i < stale.size(); i += workerContext != nullptr ? 2 : 1)
+		{
+			Build(*stale[i]);
+		}
+		if (worker.joinable())
+		{
+			worker.join();
+			glfwDestroyWindow(workerContext);
+		}
+
+		// Check the links, write the new binaries, and reflect the uniforms
+		for (Entry* entry : stale)
+		{
+			GLint linkStatus;
+			glGetProgramiv(entry->program->id, GL_LINK_STATUS, &linkStatus);
+			if (linkStatus != GL_TRUE)
+			{
+				char infoLog[512];
+				GLsizei infoLogLen = sizeof(infoLog);
+				glGetProgramInfoLog(entry->program->id, infoLogLen, &infoLogLen, infoLog);
+				std::cerr << entry->vertexShaderFilePath << " + " << entry->fragmentShaderFilePath << ": program link error: " << infoLog << std::endl;
+				success = false;
+				continue;
+			}
+			if (getProgramBinary != nullptr)
+			{
+				WriteBinary(*entry);
+			}
+		}
+		for (Entry& entry : entries)
+		{
+			entry.program->ReflectUniforms();
+		}
+
+		double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		std::cout << "Loaded " << entries.size() << " shader programs (" << entries.size() - stale.size() << " from cache) in " << milliseconds << " ms" << std::endl;
+		entries.clear();
+		return success;
+	}
+};
 
-    // bottom
-    cubeVertices[18] = { 1.0f, -1.0f, -1.0f,      255, 255, 255,     1.0f, 0.5f }; // bottom left
-    cubeVertices[19] = { -1.0f, -1.0f, 1.0f,      255, 255, 255,     0.5f, 1.0f }; // top right
-    cubeVertices[20] = { 1.0f, -1.0f, 1.0f,       255, 255, 255,     0.5f, 0.5f }; // top left
-    cubeVertices[21] = { -1.0f, -1.0f, -1.0f,     255, 255, 255,     1.0f, 1.0f }; // bottom right
-    cubeVertices[22] = { 1.0f, -1.0f, -1.0f,      255, 255, 255,     1.0f, 0.5f }; // bottom left
-    cubeVertices[23] = { -1.0f, -1.0f, 1.0f,      255, 255, 255,     0.5f, 1.0f }; // top right
+/// <summary>
+/// View volume given by the six planes of a view-projection matrix (plane normals point inside)
+/// </summary>
+struct Frustum
+{
+	glm::vec4 planes[6];	// Left, right, bottom, top, near, far: dot(plane.xyz, p) + plane.w >= 0 inside
 
-    // back
-    cubeVertices[24] = { 1.0f, -1.0f, 1.0f,       255, 255, 255,     0.0f, 0.5f }; // bottom left
-    cubeVertices[25] = { -1.0f, 1.0f, 1.0f,       255, 255, 255,     0.5f, 1.0f }; // top right
-    cubeVertices[26] = { 1.0f, 1.0f, 1.0f,        255, 255, 255,     0.0f, 1.0f }; // top left
-    cubeVertices[27] = { -1.0f, -1.0f, 1.0f,      255, 255, 255,     0.5f, 0.5f }; // bottom right
-    cubeVertices[28] = { -1.0f, 1.0f, 1.0f,       255, 255, 255,     0.5f, 1.0f }; // top right
-    cubeVertices[29] = { 1.0f, -1.0f, 1.0f,       255, 255, 255,     0.0f, 0.5f }; // bottom left
-    
-    // front
-    cubeVertices[30] = { -1.0f, -1.0f, -1.0f,     255, 255, 255,     0.5f, 0.5f }; // bottom left
-    cubeVertices[31] = { 1.0f, 1.0f, -1.0f,       255, 255, 255,     0.0f, 1.0f }; // top right
-    cubeVertices[32] = { -1.0f, 1.0f, -1.0f,      255, 255, 255,     0.5f, 1.0f }; // top left
-    cubeVertices[33] = { 1.0f, -1.0f, -1.0f,      255, 255, 255,     0.0f, 0.5f }; // bottom right
-    cubeVertices[34] = { 1.0f, 1.0f, -1.0f,       255, 255, 255,     0.0f, 1.0f }; // top right
-    cubeVertices[35] = { -1.0f, -1.0f, -1.0f,     255, 255, 255,     0.5f, 0.5f }; // bottom left
-    
-    // Loop to calculate normal vertices per face
-    for( int i=0; i < (sizeof(cubeVertices)/sizeof(cubeVertices[0])); i+=6 )
-    {
-        glm::vec3 v1( cubeVertices[i].x, cubeVertices[i].y, cubeVertices[i].z );
-        glm::vec3 v2( cubeVertices[i+1].x, cubeVertices[i+1].y, cubeVertices[i+1].z );
-        glm::vec3 v3( cubeVertices[i+2].x, cubeVertices[i+2].y, cubeVertices[i+2].z );
-        
-        glm::vec3 a;
-        a.x = v2.x - v1.x;
-        a.y = v2.y - v1.y;
-        a.z = v2.z - v1.z;
-        
-        glm::vec3 b;
-        b.x = v3.x - v1.x;
-        b.y = v3.y - v1.y;
-        b.z = v3.z - v1.z;
-        
-        glm::vec3 crossProd( glm::cross(b, a) );
-        
-        for( int j=i; j < (i+6); j+=1 )
-        {
-            cubeVertices[j].nx = crossProd.x;
-            cubeVertices[j].ny = crossProd.y;
-            cubeVertices[j].nz = crossProd.z;
-        }
-    }
+	/// <summary>
+	/// Extracts the planes of the clip volume of a view-projection matrix
+	/// </summary>
+	/// <param name="viewProjection">View-projection matrix</param>
+	explicit Frustum(const glm::mat4& viewProjection)
+	{
+		glm::vec4 rows[4];
+		for (int row = 0; row < 4; ++row)
+		{
+			rows[row] = glm::vec4(viewProjection[0][row], viewProjection[1][row], viewProjection[2][row], viewProjection[3][row]);
+		}
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			planes[2 * axis] = rows[3] + rows[axis];
+			planes[2 * axis + 1] = rows[3] - rows[axis];
+		}
+	}
 
-    
-	Vertex pyramidVertices[18];
+	/// <summary>
+	/// Conservative test of an axis-aligned box against the volume
+	/// </summary>
+	/// <param name="center">Center of the box</param>
+	/// <param name="extent">Half size of the box along each axis</param>
+	/// <returns>False only if the box is completely outside</returns>
+	bool IntersectsBox(const glm::vec3& center, const glm::vec3& extent) const
+	{
+		for (const glm::vec4& plane : planes)
+		{
+			glm::vec3 normal(plane);
+			float distance = glm::dot(normal, center) + plane.w;
+			float radius = glm::dot(glm::abs(normal), extent);
+			if (distance + radius < 0.0f)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
 
-	// base
-	pyramidVertices[0] = { 1.0f, 0.0f, -1.0f,      255, 255, 255,     1.0f, 0.5f }; // bottom left
-	pyramidVertices[1] = { -1.0f, 0.0f, 1.0f,      255, 255, 255,     0.5f, 1.0f }; // top right
-	pyramidVertices[2] = { 1.0f, 0.0f, 1.0f,       255, 255, 255,     0.5f, 0.5f }; // top left
-	pyramidVertices[3] = { -1.0f, 0.0f, -1.0f,     255, 255, 255,     1.0f, 1.0f }; // bottom right
-	pyramidVertices[4] = { 1.0f, 0.0f, -1.0f,      255, 255, 255,     1.0f, 0.5f }; // bottom left
-	pyramidVertices[5] = { -1.0f, 0.0f, 1.0f,      255, 255, 255,     0.5f, 1.0f }; // top right
+	/// <summary>
+	/// Conservative test of a transformed box against the volume
+	/// </summary>
+	/// <param name="modelMatrix">Transform of the box</param>
+	/// <param name="center">Center of the box before the transform</param>
+	/// <param name="extent">Half size of the box before the transform</param>
+	/// <returns>False only if the transformed box is completely outside</returns>
+	bool IntersectsBox(const glm::mat4& modelMatrix, const glm::vec3& center, const glm::vec3& extent) const
+	{
+		// World-space box enclosing the transformed one
+		glm::vec3 worldCenter(modelMatrix * glm::vec4(center, 1.0f));
+		glm::vec3 worldExtent = glm::abs(glm::vec3(modelMatrix[0])) * extent.x + glm::abs(glm::vec3(modelMatrix[1])) * extent.y +
+			glm::abs(glm::vec3(modelMatrix[2])) * extent.z;
+		return IntersectsBox(worldCenter, worldExtent);
+	}
+};
 
-	// back
-	pyramidVertices[6] = { 1.0f, 0.0f, 1.0f,	255, 255, 255,		0.0f, 0.0f }; 
-	pyramidVertices[7] = { -1.0f, 0.0f, 1.0f,	255, 255, 255,		1.0f, 0.0f }; 
-	pyramidVertices[8] = { 0.0f, 1.0f, 0.0f,	255, 255, 255,		0.5f, 1.0f }; 
+/// <summary>
+/// Draw calls and state changes issued during a frame, reset by the profiler at the end of every frame
+/// </summary>
+struct RenderCounters
+{
+	uint64_t drawCalls = 0;				// Instanced draw calls
+	uint64_t instances = 0;				// Instances drawn
+	uint64_t programChanges = 0;		// glUseProgram calls from the render queue
+	uint64_t textureBinds = 0;			// Texture binds from the render queue
+	uint64_t vertexArrayBinds = 0;		// Vertex array object binds before draws
+	uint64_t framebufferBinds = 0;		// Shadow map render target changes
+	uint64_t instanceUploads = 0;		// Instance data writes into the stream buffer
+	uint64_t instanceUploadBytes = 0;	// Bytes written by those writes
+	uint64_t streamWaits = 0;			// Times the CPU had to wait for the GPU to release a stream buffer segment
+};
 
-	// right 
-	pyramidVertices[9] = { 1.0f, 0.0f, -1.0f,	255, 255, 255,		0.0f, 0.0f };
-	pyramidVertices[10] = { 1.0f, 0.0f, 1.0f,	255, 255, 255,		1.0f, 0.0f };
-	pyramidVertices[11] = { 0.0f, 1.0f, 0.0f,	255, 255, 255,		0.5f, 1.0f };
+RenderCounters renderCounters;
 
-	// front
-	pyramidVertices[12] = { -1.0f, 0.0f, -1.0f,	255, 255, 255,		0.0f, 0.0f };
-	pyramidVertices[13] = { 1.0f, 0.0f, -1.0f,	255, 255, 255,		1.0f, 0.0f };
-	pyramidVertices[14] = { 0.0f, 1.0f, 0.0f,	255, 255, 255,		0.5f, 1.0f };
+// glBufferStorage is GL 4.4 / ARB_buffer_storage, outside of the GL 3.3 core headers; it is loaded at run time when available
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#endif
+#ifndef GL_MAP_COHERENT_BIT
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+typedef void (APIENTRYP BufferStorageFunction)(GLenum target, GLsizeiptr size, const void* data, GLbitfield flags);
 
-	// left
-	pyramidVertices[15] = { -1.0f, 0.0f, 1.0f,	255, 255, 255,		0.0f, 0.0f };
-	pyramidVertices[16] = { -1.0f, 0.0f, -1.0f,	255, 255, 255,		1.0f, 0.0f };
-	pyramidVertices[17] = { 0.0f, 1.0f, 0.0f,	255, 255, 255,		0.5f, 1.0f };
-    
-    // Loop to calculate normal vertices per face
-    for( int i=0; i < (sizeof(pyramidVertices)/sizeof(pyramidVertices[0])); i+=6 )
-    {
-        glm::vec3 v1( pyramidVertices[i].x, pyramidVertices[i].y, pyramidVertices[i].z );
-        glm::vec3 v2( pyramidVertices[i+1].x, pyramidVertices[i+1].y, pyramidVertices[i+1].z );
-        glm::vec3 v3( pyramidVertices[i+2].x, pyramidVertices[i+2].y, pyramidVertices[i+2].z );
-        
-        glm::vec3 a;
-        a.x = v2.x - v1.x;
-        a.y = v2.y - v1.y;
-        a.z = v2.z - v1.z;
-        
-        glm::vec3 b;
-        b.x = v3.x - v1.x;
-        b.y = v3.y - v1.y;
-        b.z = v3.z - v1.z;
-        
-        glm::vec3 crossProd( glm::cross(b, a) );
-        
-        for( int j=i; j < (i+6); j+=1 )
-        {
-            pyramidVertices[j].nx = crossProd.x;
-            pyramidVertices[j].ny = crossProd.y;
-            pyramidVertices[j].nz = crossProd.z;
-        }
-    }
-
-    
-    Vertex hexVertices[52];
-
-    // front hexagon
-    hexVertices[0] = { 0.0f, 0.0f, 0.0f,	255, 255, 255,		0.5f, 0.5f };
-    hexVertices[1] = { 0.5f, 1.0f, 0.0f,	255, 255, 255,		0.75f, 1.0f };
-    hexVertices[2] = { 1.0f, 0.0f, 0.0f,	255, 255, 255,		1.0f, 0.5f };
-    hexVertices[3] = { 0.5f, -1.0f, 0.0f,	255, 255, 255,		0.75f, 0.0f };
-    hexVertices[4] = { -0.5f, -1.0f, 0.0f,	255, 255, 255,		0.25f, 0.0f };
-    hexVertices[5] = { -1.0f, 0.0f, 0.0f,	255, 255, 255,		0.0f, 0.5f };
-    hexVertices[6] = { -0.5f, 1.0f, 0.0f,	255, 255, 255,		0.25f, 1.0f };
-    hexVertices[7] = { 0.5f, 1.0f, 0.0f,	255, 255, 255,		0.75f, 1.0f };
-
-    // back hexagon
-    hexVertices[8] = { 0.0f, 0.0f, 2.0f,	255, 255, 255,		0.5f, 0.5f };
-    hexVertices[9] = { 0.5f, 1.0f, 2.0f,	255, 255, 255,		0.75f, 1.0f };
-    hexVertices[10] = { 1.0f, 0.0f, 2.0f,	255, 255, 255,		1.0f, 0.5f };
-    hexVertices[11] = { 0.5f, -1.0f, 2.0f,	255, 255, 255,		0.75f, 0.0f };
-    hexVertices[12] = { -0.5f, -1.0f, 2.0f,	255, 255, 255,		0.25f, 0.0f };
-    hexVertices[13] = { -1.0f, 0.0f, 2.0f,	255, 255, 255,		0.0f, 0.5f };
-    hexVertices[14] = { -0.5f, 1.0f, 2.0f,	255, 255, 255,		0.25f, 1.0f };
-    hexVertices[15] = { 0.5f, 1.0f, 2.0f,	255, 255, 255,		0.75f, 1.0f };
-
-    // top right
-    hexVertices[16] = { 1.0f, 0.0f, 0.0f,	255, 255, 255,		1.0f, 0.25f };
-    hexVertices[17] = { 0.5f, 1.0f, 2.0f,	255, 255, 255,		0.0f, 0.75f };
-    hexVertices[18] = { 0.5f, 1.0f, 0.0f,	255, 255, 255,		1.0f, 0.75f };
-    hexVertices[19] = { 1.0f, 0.0f, 0.0f,	255, 255, 255,		1.0f, 0.25f };
-    hexVertices[20] = { 0.5f, 1.0f, 2.0f,	255, 255, 255,		0.0f, 0.75f };
-    hexVertices[21] = { 1.0f, 0.0f, 2.0f,	255, 255, 255,		0.0f, 0.25f };
-
-    // top
-    hexVertices[22] = { 0.5f, 1.0f, 2.0f,	255, 255, 255,		0.25f, 0.15f };
-    hexVertices[23] = { -0.5f, 1.0f, 0.0f,	255, 255, 255,		0.25f, 0.15f };
-    hexVertices[24] = { 0.5f, 1.0f, 0.0f,	255, 255, 255,		0.25f, 0.15f };
-    hexVertices[25] = { -0.5f, 1.0f, 0.0f,	255, 255, 255,		0.25f, 0.15f };
-    hexVertices[26] = { -0.5f, 1.0f, 2.0f,	255, 255, 255,		0.25f, 0.15f };
-    hexVertices[27] = { 0.5f, 1.0f, 2.0f,	255, 255, 255,		0.25f, 0.15f };
-
-    // top left
-    hexVertices[28] = { -1.0f, 0.0f, 2.0f,	255, 255, 255,		1.0f, 0.25f };
-    hexVertices[29] = { -0.5f, 1.0f, 0.0f,	255, 255, 255,		0.0f, 0.75f };
-    hexVertices[30] = { -0.5f, 1.0f, 2.0f,	255, 255, 255,		1.0f, 0.75f };
-    hexVertices[31] = { -1.0f, 0.0f, 2.0f,	255, 255, 255,		1.0f, 0.25f };
-    hexVertices[32] = { -0.5f, 1.0f, 0.0f,	255, 255, 255,		0.0f, 0.75f };
-    hexVertices[33] = { -1.0f, 0.0f, 0.0f,	255, 255, 255,		0.0f, 0.25f };
-
-    // bottom left
-    hexVertices[34] = { -0.5f, -1.0f, 2.0f,	255, 255, 255,		0.25f, 0.15f }; // bottom right
-    hexVertices[35] = { -1.0f, 0.0f, 0.0f,	255, 255, 255,		0.25f, 0.15f }; // top left
-    hexVertices[36] = { -1.0f, 0.0f, 2.0f,	255, 255, 255,		0.25f, 0.15f }; // top right
-    hexVertices[37] = { -0.5f, -1.0f, 2.0f,	255, 255, 255,		0.25f, 0.15f }; // bottom right
-    hexVertices[38] = { -1.0f, 0.0f, 0.0f,	255, 255, 255,		0.25f, 0.15f }; // top left
-    hexVertices[39] = { -0.5f, -1.0f, 0.0f,	255, 255, 255,		0.25f, 0.15f }; // bottom left
-
-    // bottom
-    hexVertices[40] = { 0.5f, -1.0f, 2.0f,	255, 255, 255,		1.0f, 0.75f }; // bottom right
-    hexVertices[41] = { -0.5f, -1.0f, 0.0f,	255, 255, 255,		0.0f, 0.25f }; // top left
-    hexVertices[42] = { 0.5f, -1.0f, 0.0f,	255, 255, 255,		0.0f, 0.75f }; // top right
-    hexVertices[43] = { -0.5f, -1.0f, 0.0f,	255, 255, 255,		0.0f, 0.25f };
-    hexVertices[44] = { -0.5f, -1.0f, 2.0f,	255, 255, 255,		1.0f, 0.25f };
-    hexVertices[45] = { 0.5f, -1.0f, 2.0f,	255, 255, 255,		1.0f, 0.75f };
-
-    // bottom right
-    hexVertices[46] = { 0.5f, -1.0f, 0.0f,	255, 255, 255,		0.25f, 0.15f }; // bottom right
-    hexVertices[47] = { 1.0f, 0.0f, 2.0f,	255, 255, 255,		0.25f, 0.15f }; // top left
-    hexVertices[48] = { 1.0f, 0.0f, 0.0f,	255, 255, 255,		0.25f, 0.15f }; // top right
-    hexVertices[49] = { 0.5f, -1.0f, 0.0f,	255, 255, 255,		0.25f, 0.15f };
-    hexVertices[50] = { 1.0f, 0.0f, 2.0f,	255, 255, 255,		0.25f, 0.15f };
-    hexVertices[51] = { 0.5f, -1.0f, 2.0f,	255, 255, 255,		0.25f, 0.15f };
-    
-    // Loop to calculate normal vertices per face
-    for( int i=0; i < (sizeof(hexVertices)/sizeof(hexVertices[0])); i+=6 )
-    {
-        glm::vec3 v1( hexVertices[i].x, hexVertices[i].y, hexVertices[i].z );
-        glm::vec3 v2( hexVertices[i+1].x, hexVertices[i+1].y, hexVertices[i+1].z );
-        glm::vec3 v3( hexVertices[i+2].x, hexVertices[i+2].y, hexVertices[i+2].z );
-        
-        glm::vec3 a;
-        a.x = v2.x - v1.x;
-        a.y = v2.y - v1.y;
-        a.z = v2.z - v1.z;
-        
-        glm::vec3 b;
-        b.x = v3.x - v1.x;
-        b.y = v3.y - v1.y;
-        b.z = v3.z - v1.z;
-        
-        glm::vec3 crossProd( glm::cross(b, a) );
-        
-        for( int j=i; j < (i+6); j+=1 )
-        {
-            hexVertices[j].nx = crossProd.x;
-            hexVertices[j].ny = crossProd.y;
-            hexVertices[j].nz = crossProd.z;
-        }
-    }
-
-    
-    
-    // --- SETTING UP OF VBOs, VAOs ---
-    
-    // FLOOR VBO, VAO
-
-    // Create a vertex buffer object (VBO), and upload our vertices data to the VBO
-    GLuint vboFloor;
-    glGenBuffers(1, &vboFloor);
-    glBindBuffer(GL_ARRAY_BUFFER, vboFloor);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(floorVertices), floorVertices, GL_STATIC_DRAW);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-    // Create a vertex array object that contains data on how to map vertex attributes
-    // (e.g., position, color) to vertex shader properties.
-    GLuint vaoFloor;
-    glGenVertexArrays(1, &vaoFloor);
-    glBindVertexArray(vaoFloor);
-
-    glBindBuffer(GL_ARRAY_BUFFER, vboFloor);
-
-    // Vertex attribute 0 - Position
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, x));
-
-    // Vertex attribute 1 - Color
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(1, 3, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Vertex), (void*)(offsetof(Vertex, r)));
-
-    // Vertex attribute 2 - UV coordinate
-    glEnableVertexAttribArray(2);
-    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(offsetof(Vertex, u)));
-
-    glBindVertexArray(0);
-    
-
-	// CUBE VBO, VAO
-
-	// Create a vertex buffer object (VBO), and upload our vertices data to the VBO
-	GLuint vboCube;
-	glGenBuffers(1, &vboCube);
-	glBindBuffer(GL_ARRAY_BUFFER, vboCube);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(cubeVertices), cubeVertices, GL_STATIC_DRAW);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-	// Create a vertex array object that contains data on how to map vertex attributes
-	// (e.g., position, color) to vertex shader properties.
-	GLuint vaoCube;
-	glGenVertexArrays(1, &vaoCube);
-	glBindVertexArray(vaoCube);
-
-	glBindBuffer(GL_ARRAY_BUFFER, vboCube);
-
-	// Vertex attribute 0 - Position
-	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, x));
-
-	// Vertex attribute 1 - Color
-	glEnableVertexAttribArray(1);
-	glVertexAttribPointer(1, 3, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Vertex), (void*)(offsetof(Vertex, r)));
-
-	// Vertex attribute 2 - UV coordinate
-	glEnableVertexAttribArray(2);
-	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(offsetof(Vertex, u)));
-
-	glBindVertexArray(0);
-
-
-	// PYRAMID VBO, VAO
-
-	GLuint vboPyramid;
-	glGenBuffers(1, &vboPyramid);
-	glBindBuffer(GL_ARRAY_BUFFER, vboPyramid);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(pyramidVertices), pyramidVertices, GL_STATIC_DRAW);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-	// Create a vertex array object that contains data on how to map vertex attributes
-	// (e.g., position, color) to vertex shader properties.
-	GLuint vaoPyramid;
-	glGenVertexArrays(1, &vaoPyramid);
-	glBindVertexArray(vaoPyramid);
-
-	glBindBuffer(GL_ARRAY_BUFFER, vboPyramid);
-
-	// Vertex attribute 0 - Position
-	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, x));
-
-	// Vertex attribute 1 - Color
-	glEnableVertexAttribArray(1);
-	glVertexAttribPointer(1, 3, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Vertex), (void*)(offsetof(Vertex, r)));
-
-	// Vertex attribute 2 - UV coordinate
-	glEnableVertexAttribArray(2);
-	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(offsetof(Vertex, u)));
-
-	glBindVertexArray(0);
-
-
-	// HEXAGONAL PRISM VBO, VAO
-
-	GLuint vboHex;
-	glGenBuffers(1, &vboHex);
-	glBindBuffer(GL_ARRAY_BUFFER, vboHex);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(hexVertices), hexVertices, GL_STATIC_DRAW);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-	// Create a vertex array object that contains data on how to map vertex attributes
-	// (e.g., position, color) to vertex shader properties.
-	GLuint vaoHex;
-	glGenVertexArrays(1, &vaoHex);
-	glBindVertexArray(vaoHex);
-
-	glBindBuffer(GL_ARRAY_BUFFER, vboHex);
-
-	// Vertex attribute 0 - Position
-	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, x));
-
-	// Vertex attribute 1 - Color
-	glEnableVertexAttribArray(1);
-	glVertexAttribPointer(1, 3, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Vertex), (void*)(offsetof(Vertex, r)));
+/// <summary>
+/// Ring buffer for the data streamed every frame (per-instance attributes, the FrameUniforms block), split into
+/// one segment per frame in flight. A frame only writes into its own segment, and a fence placed at the end of the
+/// frame tells when the GPU is done with it, so writes never synchronize with the GPU: the buffer is persistently
+/// mapped when ARB_buffer_storage is available, otherwise each write maps its range unsynchronized.
+/// Data is bound by offset (vertex attribute pointers, glBindBufferRange).
+/// </summary>
+struct StreamBuffer
+{
+	static const int segmentCount = 3;		// Frames in flight
+	GLuint buffer = 0;						// OpenGL handle to the buffer
+	size_t segmentSize = 0;					// Bytes available to one frame
+	size_t alignment = 16;					// Alignment of every allocation (at least the uniform buffer offset alignment)
+	bool persistent = false;				// True if the buffer stays mapped
+	unsigned char* persistentPointer = nullptr;	// Start of the mapping when persistent
+	int segment = 0;						// Segment of the current frame
+	size_t writeOffset = 0;					// Next free byte in the segment
+	GLsync fences[segmentCount] = {};		// Signaled when the GPU finished the frame that last used each segment
+	GLintptr mappedOffset = -1;				// Range mapped by Map, unmapped by Unmap (non-persistent mode)
+	bool overflowReported = false;			// True once a full segment was reported
+
+	/// <summary>
+	/// Creates the buffer. Must be called on the GL thread.
+	/// </summary>
+	/// <param name="bytesPerFrame">Largest amount of data written in one frame, without alignment padding</param>
+	/// <param name="allocationsPerFrame">Largest number of Map calls in one frame, to account for the padding</param>
+	void Create(size_t bytesPerFrame, size_t allocationsPerFrame)
+	{
+		GLint uniformAlignment = 0;
+		glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &uniformAlignment);
+		alignment = std::max<size_t>(alignment, uniformAlignment);
+		segmentSize = (bytesPerFrame + allocationsPerFrame * alignment + alignment - 1) / alignment * alignment;
+		size_t bufferSize = segmentSize * segmentCount;
+
+		BufferStorageFunction bufferStorage = nullptr;
+		GLint extensionCount = 0;
+		glGetIntegerv(GL_NUM_EXTENSIONS, &extensionCount);
+		for (GLint i = 0; i < extensionCount; ++i)
+		{
+			if (std::strcmp(reinterpret_cast<const char*>(glGetStringi(GL_EXTENSIONS, i)), "GL_ARB_buffer_storage") == 0)
+			{
+				bufferStorage = reinterpret_cast<BufferStorageFunction>(glfwGetProcAddress("glBufferStorage"));
+				break;
+			}
+		}
+
+		glGenBuffers(1, &buffer);
+		glBindBuffer(GL_ARRAY_BUFFER, buffer);
+		if (bufferStorage != nullptr)
+		{
+			const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			bufferStorage(GL_ARRAY_BUFFER, bufferSize, nullptr, flags);
+			persistentPointer = static_cast<unsigned char*>(glMapBufferRange(GL_ARRAY_BUFFER, 0, bufferSize, flags));
+			persistent = persistentPointer != nullptr;
+		}
+		if (!persistent)
+		{
+			glBufferData(GL_ARRAY_BUFFER, bufferSize, nullptr, GL_STREAM_DRAW);
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
 
-	// Vertex attribute 2 - UV coordinate
-	glEnableVertexAttribArray(2);
-	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(offsetof(Vertex, u)));
+	/// <summary>
+	/// Moves to the next segment, waiting for the GPU only if it still uses that segment (more than
+	/// segmentCount - 1 frames behind).
+	/// </summary>
+	void BeginFrame()
+	{
+		segment = (segment + 1) % segmentCount;
+		writeOffset = 0;
+		GLsync& fence = fences[segment];
+		if (fence != nullptr)
+		{
+			if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+			{
+				++renderCounters.streamWaits;
+				while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+				{
+				}
+			}
+			glDeleteSync(fence);
+			fence = nullptr;
+		}
+	}
 
-	glBindVertexArray(0);
-    
-    
-    
-    // FRAME BUFFER OBJECT
+	/// <summary>
+	/// Reserves space in the current segment and returns a pointer to write it. Unmap must be called before the
+	/// next Map and before drawing with the data.
+	/// </summary>
+	/// <param name="size">Bytes to write</param>
+	/// <param name="offset">Receives the offset of the data in the buffer</param>
+	/// <returns>Pointer to write the data to, or nullptr if the segment is full</returns>
+	unsigned char* Map(size_t size, GLintptr& offset)
+	{
+		if (writeOffset + size > segmentSize)
+		{
+			if (!overflowReported)
+			{
+				std::cerr << "Stream buffer segment of " << segmentSize << " bytes is full; some instances are not drawn" << std::endl;
+				overflowReported = true;
+			}
+			return nullptr;
+		}
+		offset = static_cast<GLintptr>(segment * segmentSize + writeOffset);
+		writeOffset = (writeOffset + size + alignment - 1) / alignment * alignment;
+		if (persistent)
+		{
+			return persistentPointer + offset;
+		}
+
+		// The fences guarantee that the GPU is not reading this range, so the driver does not need to synchronize
+		glBindBuffer(GL_ARRAY_BUFFER, buffer);
+		mappedOffset = offset;
+		return static_cast<unsigned char*>(glMapBufferRange(GL_ARRAY_BUFFER, offset, size,
+			GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT));
+	}
 
-    GLuint framebuffer;
-    glGenFramebuffers(1, &framebuffer);
-    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	/// <summary>
+	/// Ends the write started by Map.
+	/// </summary>
+	void Unmap()
+	{
+		if (mappedOffset >= 0)
+		{
+			glBindBuffer(GL_ARRAY_BUFFER, buffer);
+			glUnmapBuffer(GL_ARRAY_BUFFER);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+			mappedOffset = -1;
+		}
+	}
 
-    GLuint depthTex;
-    glGenTextures(1, &depthTex);
-    glBindTexture(GL_TEXTURE_2D, depthTex);
+	/// <summary>
+	/// Copies data into the current segment.
+	/// </summary>
+	/// <param name="data">Data to copy</param>
+	/// <param name="size">Size of the data in bytes</param>
+	/// <returns>Offset of the data in the buffer, or -1 if the segment is full</returns>
+	GLintptr Write(const void* data, size_t size)
+	{
+		GLintptr offset = -1;
+		unsigned char* destination = Map(size, offset);
+		if (destination == nullptr)
+		{
+			return -1;
+		}
+		std::memcpy(destination, data, size);
+		Unmap();
+		return offset;
+	}
 
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, 1024, 1024, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_BYTE, nullptr);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glBindTexture(GL_TEXTURE_2D, 0);
+	/// <summary>
+	/// Fences the current segment. Call after the last command of the frame using the buffer.
+	/// </summary>
+	void EndFrame()
+	{
+		fences[segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
 
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthTex, 0);
-    glDrawBuffer(GL_NONE);
-    
-    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
-    {
-        std::cout << "Error! Framebuffer not complete!" << std::endl;
-    }
+	/// <summary>
+	/// Deletes the fences and the buffer.
+	/// </summary>
+	void Destroy()
+	{
+		for (GLsync& fence : fences)
+		{
+			if (fence != nullptr)
+			{
+				glDeleteSync(fence);
+				fence = nullptr;
+			}
+		}
+		if (persistent)
+		{
+			glBindBuffer(GL_ARRAY_BUFFER, buffer);
+			glUnmapBuffer(GL_ARRAY_BUFFER);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+		}
+		glDeleteBuffers(1, &buffer);
+	}
+};
 
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+/// <summary>
+/// Cascaded shadow maps for a directional light: the camera view range is split into slices,
+/// and each slice gets its own orthographic light projection and layer of a depth texture array.
+/// </summary>
+struct ShadowCascades
+{
+	static const int maxCascades = 4;		// Must match MAX_CASCADES in frame.glsl
+	int count = 3;							// Number of cascades, 1 to maxCascades
+	GLsizei resolution = 1024;				// Width and height of each cascade
+	float distance = 300.0f;				// Camera distance covered by the last cascade
+	float splitLambda = 0.75f;				// Blend between uniform (0) and logarithmic (1) split distances
+	float casterDistance = 200.0f;			// How far towards the light casters outside a slice are still included
+	GLenum depthFormat = GL_DEPTH_COMPONENT24;	// Sized depth format: GL_DEPTH_COMPONENT24 or GL_DEPTH_COMPONENT32F
+	int pcfRadius = 1;						// PCF kernel of (2 * pcfRadius + 1)^2 taps, each a bilinear 2x2 hardware compare
+	float slopeBias = 0.002f;				// Depth bias at grazing angles, in [0, 1] depth units of the cascade
+	float minBias = 0.0002f;				// Depth bias facing the light
+	GLuint depthTexture = 0;				// GL_TEXTURE_2D_ARRAY with one depth layer per cascade, sampled by the main pass
+	GLuint staticDepthTexture = 0;			// Same layout, holding only the static casters
+	GLuint framebuffer = 0;					// Framebuffer rendering into a layer of depthTexture
+	GLuint staticFramebuffer = 0;			// Framebuffer rendering into a layer of staticDepthTexture
+	glm::mat4 lightSpaceMatrices[maxCascades];	// World to light clip space of each cascade
+	float splits[maxCascades];				// Far view depth of each cascade
+
+	// Shadow map cache: a layer is only re-rendered when its light-space matrix or the static casters changed
+	glm::mat4 cachedLightSpaceMatrices[maxCascades];	// Matrix each static layer was rendered with
+	bool staticLayerValid[maxCascades] = {};			// False if the static layer must be re-rendered
+	bool layerHasDynamicCasters[maxCascades] = {};		// True if dynamic casters were drawn into the final layer
+
+	/// <summary>
+	/// Creates the depth texture arrays and their framebuffers. Call again after changing count or resolution.
+	/// </summary>
+	void CreateTextures()
+	{
+		if (depthTexture != 0)
+		{
+			glDeleteTextures(1, &depthTexture);
+			glDeleteTextures(1, &staticDepthTexture);
+			glDeleteFramebuffers(1, &framebuffer);
+			glDeleteFramebuffers(1, &staticFramebuffer);
+		}
+		GLuint textures[2];
+		glGenTextures(2, textures);
+		depthTexture = textures[0];
+		staticDepthTexture = textures[1];
+		for (GLuint texture : textures)
+		{
+			glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+			glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, depthFormat, resolution, resolution, count, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		}
+
+		// The sampled array is read through a sampler2DArrayShadow: linear filtering of the depth comparison
+		// gives a 2x2 percentage-closer filter per lookup
+		glBindTexture(GL_TEXTURE_2D_ARRAY, depthTexture);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+		// Depth-only framebuffers; the layer rendered into is selected by attaching it
+		glGenFramebuffers(1, &framebuffer);
+		glGenFramebuffers(1, &staticFramebuffer);
+		GLuint framebuffers[2] = { framebuffer, staticFramebuffer };
+		for (int i = 0; i < 2; ++i)
+		{
+			glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[i]);
+			glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, textures[i], 0, 0);
+			glDrawBuffer(GL_NONE);
+			glReadBuffer(GL_NONE);
+			if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+			{
+				std::cout << "Error! Framebuffer not complete!" << std::endl;
+			}
+		}
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		InvalidateStaticCasters();
+	}
 
+	/// <summary>
+	/// Forces every static layer to be re-rendered, e.g. after a static object was moved or added.
+	/// </summary>
+	void InvalidateStaticCasters()
+	{
+		for (int cascade = 0; cascade < maxCascades; ++cascade)
+		{
+			staticLayerValid[cascade] = false;
+		}
+	}
 
-    
-	// Create a shader program
-	GLuint mainProgram = CreateShaderProgram("main.vsh", "main.fsh");
-    GLuint depthProgram = CreateShaderProgram("depth.vsh", "depth.fsh");
-    
-    glm::vec3 floorNormal = glm::vec3(floorVertices[6].nx, floorVertices[6].ny, floorVertices[6].nz);
-    GLint floorNormalUniformLocation = glGetUniformLocation(mainProgram, "floorNormal");
-    glUniform3fv(floorNormalUniformLocation, 1, glm::value_ptr(floorNormal));
+	/// <summary>
+	/// Tells whether the static layer of a cascade is out of date with its current light-space matrix.
+	/// </summary>
+	/// <param name="cascade">Cascade index</param>
+	/// <returns>True if the static casters must be rendered again</returns>
+	bool StaticLayerNeedsUpdate(int cascade) const
+	{
+		return !staticLayerValid[cascade] || cachedLightSpaceMatrices[cascade] != lightSpaceMatrices[cascade];
+	}
 
-	// Tell OpenGL the dimensions of the region where stuff will be drawn.
-	// For now, tell OpenGL to use the whole screen
-    
-    // FOR WINDOWS
-	// glViewport(0, 0, windowWidth, windowHeight);
-    
-    // FOR MAC
-    int framebufferWidth, framebufferHeight;
-    glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
-    glViewport(0, 0, framebufferWidth, framebufferHeight);
-    
-    
-    
-    // --- TEXTURES ---
-    
-    // Create a variable that will contain the ID for our texture,
-    // and use glGenTextures() to generate the texture itself
-    GLuint floorTex;
-    glGenTextures(1, &floorTex);
-
-    // --- Load our image using stb_image ---
-
-    // Im image-space (pixels), (0, 0) is the upper-left corner of the image
-    // However, in u-v coordinates, (0, 0) is the lower-left corner of the image
-    // This means that the image will appear upside-down when we use the image data as is
-    // This function tells stbi to flip the image vertically so that it is not upside-down when we use it
-    stbi_set_flip_vertically_on_load(true);
-    
-    // 'imageWidth' and imageHeight will contain the width and height of the loaded image respectively
-    int imageWidth, imageHeight, numChannels;
+	/// <summary>
+	/// Binds the static layer of a cascade as the depth target and clears it.
+	/// </summary>
+	/// <param name="cascade">Cascade index</param>
+	void BeginStaticLayer(int cascade)
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, staticFramebuffer);
+		glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, staticDepthTexture, 0, cascade);
+		glClear(GL_DEPTH_BUFFER_BIT);
+		++renderCounters.framebufferBinds;
+		cachedLightSpaceMatrices[cascade] = lightSpaceMatrices[cascade];
+		staticLayerValid[cascade] = true;
+	}
 
-    // Read the image data and store it in an unsigned char array
-    unsigned char* imageData = stbi_load("sand texture.jpeg", &imageWidth, &imageHeight, &numChannels, 0);
+	/// <summary>
+	/// Copies the static layer of a cascade into the sampled texture and leaves that layer bound as the depth target,
+	/// ready for the dynamic casters to be drawn on top.
+	/// </summary>
+	/// <param name="cascade">Cascade index</param>
+	/// <param name="hasDynamicCasters">True if dynamic casters are going to be drawn into the layer</param>
+	void BeginFinalLayer(int cascade, bool hasDynamicCasters)
+	{
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, staticFramebuffer);
+		glFramebufferTextureLayer(GL_READ_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, staticDepthTexture, 0, cascade);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffer);
+		glFramebufferTextureLayer(GL_DRAW_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, depthTexture, 0, cascade);
+		glBlitFramebuffer(0, 0, resolution, resolution, 0, 0, resolution, resolution, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		++renderCounters.framebufferBinds;
+		layerHasDynamicCasters[cascade] = hasDynamicCasters;
+	}
 
-    // Make sure that we actually loaded the image before uploading the data to the GPU
-    if (imageData != nullptr)
-    {
-        // Our texture is 2D, so we bind our texture to the GL_TEXTURE_2D target
-        glBindTexture(GL_TEXTURE_2D, floorTex);
+	/// <summary>
+	/// Deletes the textures and framebuffers.
+	/// </summary>
+	void Destroy()
+	{
+		GLuint textures[2] = { depthTexture, staticDepthTexture };
+		glDeleteTextures(2, textures);
+		glDeleteFramebuffers(1, &framebuffer);
+		glDeleteFramebuffers(1, &staticFramebuffer);
+	}
 
-        // Set the filtering methods for magnification and minification
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	/// <summary>
+	/// Fits the cascades to the camera frustum (without changing the cascades, so that it can run on any thread). Each cascade bounds its slice with a sphere, so its size does not change
+	/// when the camera rotates, and its origin is snapped to whole texels so that shadow edges do not shimmer when it moves.
+	/// </summary>
+	/// <param name="viewMatrix">Camera view matrix</param>
+	/// <param name="fovY">Camera vertical field of view in radians</param>
+	/// <param name="aspect">Camera aspect ratio</param>
+	/// <param name="nearPlane">Camera near plane distance</param>
+	/// <param name="lightDirection">Direction the light travels in</param>
+	/// <param name="fittedMatrices">Receives the light-space matrix of each cascade</param>
+	/// <param name="fittedSplits">Receives the far view depth of each cascade</param>
+	void Fit(const glm::mat4& viewMatrix, float fovY, float aspect, float nearPlane, const glm::vec3& lightDirection,
+		glm::mat4* fittedMatrices, float* fittedSplits) const
+	{
+		glm::vec3 direction = glm::normalize(lightDirection);
+		glm::vec3 up = std::abs(direction.y) > 0.99f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+		glm::mat4 lightRotation = glm::lookAt(glm::vec3(0.0f), direction, up);
+		glm::mat4 inverseView = glm::inverse(viewMatrix);
+		float tanHalfFov = std::tan(fovY * 0.5f);
+
+		float sliceNear = nearPlane;
+		for (int cascade = 0; cascade < count; ++cascade)
+		{
+			float fraction = float(cascade + 1) / count;
+			float logarithmicSplit = nearPlane * std::pow(distance / nearPlane, fraction);
+			float uniformSplit = nearPlane + (distance - nearPlane) * fraction;
+			float sliceFar = splitLambda * logarithmicSplit + (1.0f - splitLambda) * uniformSplit;
+			fittedSplits[cascade] = sliceFar;
+
+			// Corners of the slice in world space, and a sphere around them
+			glm::vec3 corners[8];
+			glm::vec3 center(0.0f);
+			for (int i = 0; i < 8; ++i)
+			{
+				float depth = i < 4 ? sliceNear : sliceFar;
+				float halfHeight = depth * tanHalfFov;
+				float halfWidth = halfHeight * aspect;
+				glm::vec4 corner((i & 1) ? halfWidth : -halfWidth, (i & 2) ? halfHeight : -halfHeight, -depth, 1.0f);
+				corners[i] = glm::vec3(inverseView * corner);
+				center += corners[i] / 8.0f;
+			}
+			float radius = 0.0f;
+			for (const glm::vec3& corner : corners)
+			{
+				radius = std::max(radius, glm::length(corner - center));
+			}
+			radius = std::ceil(radius * 16.0f) / 16.0f;
+
+			// Snap the center to the texel grid of the cascade in light space. Snapping the depth too keeps the matrix
+			// identical for small camera moves, which lets the cached static layer be reused.
+			glm::vec3 lightCenter(lightRotation * glm::vec4(center, 1.0f));
+			float texelSize = 2.0f * radius / resolution;
+			lightCenter = glm::floor(lightCenter / texelSize) * texelSize;
+
+			// The light looks down -z, so the depth range is measured along -z from the light-space origin
+			glm::mat4 lightProjection = glm::ortho(lightCenter.x - radius, lightCenter.x + radius, lightCenter.y - radius, lightCenter.y + radius,
+				-lightCenter.z - radius - casterDistance, -lightCenter.z + radius);
+			fittedMatrices[cascade] = lightProjection * lightRotation;
+			sliceNear = sliceFar;
+		}
+	}
+};
 
-        // Set the wrapping method for the s-axis (x-axis) and t-axis (y-axis)
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+/// <summary>
+/// Per-instance vertex attributes: the model matrix and its normal matrix, computed once per instance on the CPU
+/// </summary>
+struct InstanceData
+{
+	glm::mat4 modelMatrix;		// Attributes 4 to 7
+	glm::vec4 normalMatrix[3];	// Attributes 8 to 10: columns of the inverse transpose of the model matrix (w is padding)
+};
 
-        // Upload the image data to GPU memory
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, imageWidth, imageHeight, 0, GL_RGB, GL_UNSIGNED_BYTE, imageData);
+/// <summary>
+/// Instances of a batch drawn into one depth-only view, e.g. one shadow cascade
+/// </summary>
+struct DepthView
+{
+	GLuint vao = 0;					// Vertex array object: position plus the model matrix
+	GLuint instanceBuffer = 0;		// Stream buffer holding the model matrices of the instances inside the view volume
+	GLintptr instanceOffset = 0;	// Offset of those model matrices in instanceBuffer
+	GLsizei instanceCount = 0;		// Number of instances uploaded by the last UploadDepth call
+};
 
-        // If we set minification to use mipmaps, we can tell OpenGL to generate the mipmaps for us
-        //glGenerateMipmap(GL_TEXTURE_2D);
+/// <summary>
+/// Instance data of one batch for one frame, produced by the frame preparation and uploaded by the GL thread
+/// </summary>
+struct BatchFrameData
+{
+	std::vector<InstanceData> instances;				// Attributes of the instances inside the camera frustum
+	std::vector<std::vector<glm::mat4>> depthViews;		// Model matrices of the instances inside each depth-only view volume
+};
 
-        // Once we have copied the data over to the GPU, we can delete
-        // the data on the CPU side, since we won't be using it anymore
-        stbi_image_free(imageData);
-        imageData = nullptr;
-    }
-    else
-    {
-        std::cerr << "Failed to load image" << std::endl;
-    }
-    
+/// <summary>
+/// Copies of one mesh with one texture, drawn with a single instanced draw call.
+/// The instance transforms and culling belong to the frame preparation (which may run on a worker thread);
+/// the OpenGL objects and the uploaded ranges belong to the GL thread.
+/// </summary>
+struct InstanceBatch
+{
+	GLuint vao;								// Vertex array object: mesh attributes plus the per-instance model matrix
+	GLuint vbo;								// Vertex buffer object of the mesh
+	GLsizei indexCount;						// Number of indices of the mesh (a triangle list)
+	GLenum indexType;						// GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+	GLuint texture;							// Texture shared by all instances
+	GLuint program = 0;						// Shader program used by the batch in the main pass
+	bool dynamic = false;					// True if the instances move every frame
+	glm::vec3 boundsCenter;					// Center of the mesh bounding box
+	glm::vec3 boundsExtent;					// Half size of the mesh bounding box
+	GLuint ebo;								// Index buffer object of the mesh
+	GLsizei vertexStride;					// Size of one vertex of the mesh
+
+	// Frame preparation
+	std::vector<glm::mat4> modelMatrices;	// Model matrix of each instance
+	std::vector<InstanceData> instances;	// Instance attributes of each instance
+
+	// GL thread
+	GLuint instanceBuffer = 0;				// Stream buffer holding this frame's InstanceData of the visible instances
+	GLintptr instanceOffset = 0;			// Offset of that InstanceData in instanceBuffer
+	GLsizei visibleCount = 0;				// Number of instances uploaded by the last Upload call
+	std::vector<DepthView> depthViews;		// Uploaded instances of each depth-only view (one per shadow cascade)
+
+	/// <summary>
+	/// Computes the instance attributes (model and normal matrices) from the model matrices. Call again after changing them;
+	/// the next culling calls pick them up.
+	/// </summary>
+	void UpdateInstances()
+	{
+		instances.resize(modelMatrices.size());
+		for (size_t i = 0; i < modelMatrices.size(); ++i)
+		{
+			glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(modelMatrices[i])));
+			instances[i].modelMatrix = modelMatrices[i];
+			for (int column = 0; column < 3; ++column)
+			{
+				instances[i].normalMatrix[column] = glm::vec4(normalMatrix[column], 0.0f);
+			}
+		}
+	}
 
-	// Create a variable that will contain the ID for our texture,
-	// and use glGenTextures() to generate the texture itself
-	GLuint pyramidTex;
-	glGenTextures(1, &pyramidTex);
+	/// <summary>
+	/// Collects the attributes of the instances intersecting the camera frustum. Makes no OpenGL calls.
+	/// </summary>
+	/// <param name="frustum">Camera frustum</param>
+	/// <param name="visible">Receives the attributes of the visible instances</param>
+	void CullInstances(const Frustum& frustum, std::vector<InstanceData>& visible) const
+	{
+		visible.clear();
+		for (size_t i = 0; i < modelMatrices.size(); ++i)
+		{
+			if (frustum.IntersectsBox(modelMatrices[i], boundsCenter, boundsExtent))
+			{
+				visible.push_back(instances[i]);
+			}
+		}
+	}
 
-	// --- Load our image using stb_image ---
+	/// <summary>
+	/// Collects the model matrices of the instances intersecting the volume of a depth-only view. Makes no OpenGL calls.
+	/// </summary>
+	/// <param name="frustum">Volume seen by the view</param>
+	/// <param name="visible">Receives the model matrices of the instances inside the volume</param>
+	void CullDepthInstances(const Frustum& frustum, std::vector<glm::mat4>& visible) const
+	{
+		visible.clear();
+		for (size_t i = 0; i < modelMatrices.size(); ++i)
+		{
+			if (frustum.IntersectsBox(modelMatrices[i], boundsCenter, boundsExtent))
+			{
+				visible.push_back(modelMatrices[i]);
+			}
+		}
+	}
 
-	// Im image-space (pixels), (0, 0) is the upper-left corner of the image
-	// However, in u-v coordinates, (0, 0) is the lower-left corner of the image
-	// This means that the image will appear upside-down when we use the image data as is
-	// This function tells stbi to flip the image vertically so that it is not upside-down when we use it
-	stbi_set_flip_vertically_on_load(true);
+	/// <summary>
+	/// Writes the visible instances prepared for this frame to the stream buffer for the next Draw call.
+	/// </summary>
+	/// <param name="visible">Attributes of the visible instances</param>
+	/// <param name="stream">Stream buffer of the frame</param>
+	void Upload(const std::vector<InstanceData>& visible, StreamBuffer& stream)
+	{
+		visibleCount = 0;
+		if (visible.empty())
+		{
+			return;
+		}
+		size_t size = visible.size() * sizeof(InstanceData);
+		instanceOffset = stream.Write(visible.data(), size);
+		if (instanceOffset < 0)
+		{
+			return;
+		}
+		instanceBuffer = stream.buffer;
+		visibleCount = static_cast<GLsizei>(visible.size());
+		++renderCounters.instanceUploads;
+		renderCounters.instanceUploadBytes += size;
+	}
 
-	// Read the image data and store it in an unsigned char array
-	imageData = stbi_load("pyramid texture.jpeg", &imageWidth, &imageHeight, &numChannels, 0);
+	/// <summary>
+	/// Writes the instances prepared for a depth-only view to the stream buffer for the next DrawDepth call.
+	/// The view is created on first use.
+	/// </summary>
+	/// <param name="viewIndex">Index of the depth-only view</param>
+	/// <param name="visible">Model matrices of the instances inside the view volume</param>
+	/// <param name="stream">Stream buffer of the frame</param>
+	/// <returns>Number of instances uploaded</returns>
+	size_t UploadDepth(size_t viewIndex, const std::vector<glm::mat4>& visible, StreamBuffer& stream)
+	{
+		if (viewIndex >= depthViews.size())
+		{
+			depthViews.resize(viewIndex + 1);
+		}
+		DepthView& view = depthViews[viewIndex];
+		if (view.vao == 0)
+		{
+			CreateDepthView(view);
+		}
+
+		view.instanceCount = 0;
+		if (visible.empty())
+		{
+			return 0;
+		}
+		size_t size = visible.size() * sizeof(glm::mat4);
+		view.instanceOffset = stream.Write(visible.data(), size);
+		if (view.instanceOffset < 0)
+		{
+			return 0;
+		}
+		view.instanceBuffer = stream.buffer;
+		view.instanceCount = static_cast<GLsizei>(visible.size());
+		++renderCounters.instanceUploads;
+		renderCounters.instanceUploadBytes += size;
+		return visible.size();
+	}
 
-	// Make sure that we actually loaded the image before uploading the data to the GPU
-	if (imageData != nullptr)
+	/// <summary>
+	/// Draws the instances uploaded by the last UploadDepth call for a view.
+	/// </summary>
+	/// <param name="viewIndex">Index of the depth-only view</param>
+	void DrawDepth(size_t viewIndex) const
 	{
-		// Our texture is 2D, so we bind our texture to the GL_TEXTURE_2D target
-		glBindTexture(GL_TEXTURE_2D, pyramidTex);
+		if (viewIndex >= depthViews.size() || depthViews[viewIndex].instanceCount == 0)
+		{
+			return;
+		}
+		const DepthView& view = depthViews[viewIndex];
+		glBindVertexArray(view.vao);
+		PointModelMatrixAttributes(view.instanceBuffer, view.instanceOffset, sizeof(glm::mat4));
+		glDrawElementsInstanced(GL_TRIANGLES, indexCount, indexType, nullptr, view.instanceCount);
+		++renderCounters.vertexArrayBinds;
+		++renderCounters.drawCalls;
+		renderCounters.instances += view.instanceCount;
+	}
 
-		// Set the filtering methods for magnification and minification
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	/// <summary>
+	/// Creates the vertex array object of a depth-only view:
+	/// vertex attribute 0 - Position, and attributes 4 to 7 - Model matrix (pointed at the stream buffer when drawing)
+	/// </summary>
+	/// <param name="view">View to initialize</param>
+	void CreateDepthView(DepthView& view) const
+	{
+		glGenVertexArrays(1, &view.vao);
+		glBindVertexArray(view.vao);
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, vertexStride, (void*)0);
+		for (GLuint column = 0; column < 4; ++column)
+		{
+			glEnableVertexAttribArray(4 + column);
+			glVertexAttribDivisor(4 + column, 1);
+		}
+		glBindVertexArray(0);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	}
 
-		// Set the wrapping method for the s-axis (x-axis) and t-axis (y-axis)
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	/// <summary>
+	/// Draws the instances uploaded by the last Upload call. Binds the batch's vertex array object but not its texture.
+	/// </summary>
+	void Draw() const
+	{
+		if (visibleCount == 0)
+		{
+			return;
+		}
+		glBindVertexArray(vao);
+		PointModelMatrixAttributes(instanceBuffer, instanceOffset, sizeof(InstanceData));
+		for (GLuint column = 0; column < 3; ++column)
+		{
+			glVertexAttribPointer(8 + column, 3, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+				(void*)(instanceOffset + offsetof(InstanceData, normalMatrix) + sizeof(glm::vec4) * column));
+		}
+		glDrawElementsInstanced(GL_TRIANGLES, indexCount, indexType, nullptr, visibleCount);
+		++renderCounters.vertexArrayBinds;
+		++renderCounters.drawCalls;
+		renderCounters.instances += visibleCount;
+	}
 
-		// Upload the image data to GPU memory
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, imageWidth, imageHeight, 0, GL_RGB, GL_UNSIGNED_BYTE, imageData);
+	/// <summary>
+	/// Points the model matrix attributes (4 to 7) of the bound vertex array object at instance data in a buffer.
+	/// The stream buffer moves every frame, so this is done before every draw (GL 3.3 has no base instance).
+	/// Leaves the buffer bound to GL_ARRAY_BUFFER.
+	/// </summary>
+	/// <param name="buffer">Buffer holding the instance data</param>
+	/// <param name="offset">Offset of the first instance's model matrix</param>
+	/// <param name="stride">Size of one instance's data</param>
+	static void PointModelMatrixAttributes(GLuint buffer, GLintptr offset, GLsizei stride)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, buffer);
+		for (GLuint column = 0; column < 4; ++column)
+		{
+			glVertexAttribPointer(4 + column, 4, GL_FLOAT, GL_FALSE, stride, (void*)(offset + sizeof(glm::vec4) * column));
+		}
+	}
+};
 
-		// If we set minification to use mipmaps, we can tell OpenGL to generate the mipmaps for us
-		//glGenerateMipmap(GL_TEXTURE_2D);
+/// <summary>
+/// Indexed triangle list stored in GPU buffers
+/// </summary>
+struct Mesh
+{
+	GLuint vbo;				// Vertex buffer object (Vertex or PackedVertex layout)
+	GLuint ebo;				// Index buffer object
+	GLsizei vertexCount;	// Number of unique vertices
+	GLsizei indexCount;		// Number of indices
+	GLenum indexType;		// GL_UNSIGNED_SHORT when every index fits, GL_UNSIGNED_INT otherwise
+	bool packed;			// True if the vertices use the PackedVertex layout
+	glm::vec3 boundsMin;	// Minimum corner of the bounding box
+	glm::vec3 boundsMax;	// Maximum corner of the bounding box
+};
 
-		// Once we have copied the data over to the GPU, we can delete
-		// the data on the CPU side, since we won't be using it anymore
-		stbi_image_free(imageData);
-		imageData = nullptr;
-	}
-	else
+/// <summary>
+/// Object of the scene file: a mesh drawn with a texture at a transform
+/// </summary>
+struct SceneObject
+{
+	std::string mesh;		// Name of the mesh
+	std::string texture;	// Name of the texture
+	glm::mat4 modelMatrix;	// Model matrix without the spin
+	glm::vec3 spinAxis;		// Axis the object keeps rotating around
+	float spinSpeed;		// Rotation speed in degrees per second, 0 for objects that do not move
+
+	/// <summary>
+	/// Returns the model matrix of the object at the provided time
+	/// </summary>
+	/// <param name="time">Time in seconds</param>
+	/// <returns>Model matrix</returns>
+	glm::mat4 GetModelMatrix(float time) const
 	{
-		std::cerr << "Failed to load image" << std::endl;
+		if (spinSpeed == 0.0f)
+		{
+			return modelMatrix;
+		}
+		return glm::rotate(modelMatrix, glm::radians(spinSpeed * time), spinAxis);
 	}
+};
 
-    // Create a variable that will contain the ID for our texture,
-    // and use glGenTextures() to generate the texture itself
-    GLuint pillarTex;
-    glGenTextures(1, &pillarTex);
-
-    // --- Load our image using stb_image ---
+/// <summary>
+/// Point light of the scene file
+/// </summary>
+struct PointLight
+{
+	glm::vec3 position;		// World position
+	glm::vec3 color;		// Color
+	float radius;			// Distance where the light's contribution reaches zero
+	float intensity;		// Multiplier of the color
+};
 
-    // Im image-space (pixels), (0, 0) is the upper-left corner of the image
-    // However, in u-v coordinates, (0, 0) is the lower-left corner of the image
-    // This means that the image will appear upside-down when we use the image data as is
-    // This function tells stbi to flip the image vertically so that it is not upside-down when we use it
-    stbi_set_flip_vertically_on_load(true);
+/// <summary>
+/// Scene loaded from a scene file: named textures, the objects using them and the point lights
+/// </summary>
+struct Scene
+{
+	std::unordered_map<std::string, GLuint> textures;	// Texture name -> OpenGL handle
+	std::vector<SceneObject> objects;					// Objects of the scene
+	std::vector<PointLight> lights;						// Point lights of the scene
+};
 
-    // Read the image data and store it in an unsigned char array
-    imageData = stbi_load("pillar texture.jpg", &imageWidth, &imageHeight, &numChannels, 0);
+/// <summary>
+/// Result of culling a render queue against the camera frustum
+/// </summary>
+struct CullingStats
+{
+	size_t drawnObjects = 0;	// Instances inside the frustum
+	size_t culledObjects = 0;	// Instances dropped
+	size_t drawCalls = 0;		// Batches with at least one visible instance
+	size_t culledDrawCalls = 0;	// Batches dropped entirely
 
-    // Make sure that we actually loaded the image before uploading the data to the GPU
-    if (imageData != nullptr)
-    {
-        // Our texture is 2D, so we bind our texture to the GL_TEXTURE_2D target
-        glBindTexture(GL_TEXTURE_2D, pillarTex);
+	bool operator!=(const CullingStats& other) const
+	{
+		return drawnObjects != other.drawnObjects || culledObjects != other.culledObjects ||
+			drawCalls != other.drawCalls || culledDrawCalls != other.culledDrawCalls;
+	}
+};
 
-        // Set the filtering methods for magnification and minification
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+/// <summary>
+/// Instance batches of a scene, sorted by program, mesh and texture so that consecutive draws share as much state as possible.
+/// Both the shadow pass and the main pass draw from the same queue.
+/// </summary>
+struct RenderQueue
+{
+	std::vector<InstanceBatch> batches;				// Batches in draw order
+	std::vector<std::vector<size_t>> batchObjects;	// Indices of the scene objects of each batch, in instance order
+	std::vector<size_t> animatedBatches;			// Indices of the dynamic batches (spinning objects)
+
+	/// <summary>
+	/// Recomputes the model matrices of the batches containing spinning objects.
+	/// </summary>
+	/// <param name="scene">Scene the queue was built from</param>
+	/// <param name="time">Time in seconds</param>
+	void Update(const Scene& scene, float time)
+	{
+		for (size_t batchIndex : animatedBatches)
+		{
+			InstanceBatch& batch = batches[batchIndex];
+			const std::vector<size_t>& objects = batchObjects[batchIndex];
+			for (size_t i = 0; i < objects.size(); ++i)
+			{
+				batch.modelMatrices[i] = scene.objects[objects[i]].GetModelMatrix(time);
+			}
+			batch.UpdateInstances();
+		}
+	}
 
-        // Set the wrapping method for the s-axis (x-axis) and t-axis (y-axis)
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	/// <summary>
+	/// Collects the instances of every batch that intersect the camera frustum. Makes no OpenGL calls.
+	/// </summary>
+	/// <param name="frustum">Camera frustum</param>
+	/// <param name="frame">Per-batch frame data receiving the visible instances (resized to the batch count)</param>
+	/// <returns>Number of objects and draw calls kept and dropped</returns>
+	CullingStats Cull(const Frustum& frustum, std::vector<BatchFrameData>& frame) const
+	{
+		frame.resize(batches.size());
+		CullingStats stats;
+		for (size_t i = 0; i < batches.size(); ++i)
+		{
+			batches[i].CullInstances(frustum, frame[i].instances);
+			size_t visible = frame[i].instances.size();
+			stats.drawnObjects += visible;
+			stats.culledObjects += batches[i].modelMatrices.size() - visible;
+			if (visible > 0)
+			{
+				++stats.drawCalls;
+			}
+			else
+			{
+				++stats.culledDrawCalls;
+			}
+		}
+		return stats;
+	}
 
-        // Upload the image data to GPU memory
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, imageWidth, imageHeight, 0, GL_RGB, GL_UNSIGNED_BYTE, imageData);
+	/// <summary>
+	/// Collects the instances of every batch that intersect the volume of a depth-only view. Makes no OpenGL calls.
+	/// </summary>
+	/// <param name="viewIndex">Index of the depth-only view (e.g. the shadow cascade)</param>
+	/// <param name="frustum">Volume seen by the depth pass</param>
+	/// <param name="frame">Per-batch frame data, as filled by Cull</param>
+	void CullDepth(size_t viewIndex, const Frustum& frustum, std::vector<BatchFrameData>& frame) const
+	{
+		for (size_t i = 0; i < batches.size(); ++i)
+		{
+			if (frame[i].depthViews.size() <= viewIndex)
+			{
+				frame[i].depthViews.resize(viewIndex + 1);
+			}
+			batches[i].CullDepthInstances(frustum, frame[i].depthViews[viewIndex]);
+		}
+	}
 
-        // If we set minification to use mipmaps, we can tell OpenGL to generate the mipmaps for us
-        //glGenerateMipmap(GL_TEXTURE_2D);
+	/// <summary>
+	/// Uploads the instances visible in the camera frustum for the next Draw call.
+	/// </summary>
+	/// <param name="frame">Per-batch frame data filled by Cull</param>
+	/// <param name="stream">Stream buffer of the frame</param>
+	void Upload(const std::vector<BatchFrameData>& frame, StreamBuffer& stream)
+	{
+		for (size_t i = 0; i < batches.size(); ++i)
+		{
+			batches[i].Upload(frame[i].instances, stream);
+		}
+	}
 
-        // Once we have copied the data over to the GPU, we can delete
-        // the data on the CPU side, since we won't be using it anymore
-        stbi_image_free(imageData);
-        imageData = nullptr;
-    }
-    else
-    {
-        std::cerr << "Failed to load image" << std::endl;
-    }
+	/// <summary>
+	/// Uploads the instances of the static or of the dynamic batches for the next DrawDepth call of a depth-only view.
+	/// </summary>
+	/// <param name="viewIndex">Index of the depth-only view (e.g. the shadow cascade)</param>
+	/// <param name="frame">Per-batch frame data filled by CullDepth</param>
+	/// <param name="dynamic">True for the dynamic batches, false for the static ones</param>
+	/// <param name="stream">Stream buffer of the frame</param>
+	/// <returns>Number of instances uploaded</returns>
+	size_t UploadDepth(size_t viewIndex, const std::vector<BatchFrameData>& frame, bool dynamic, StreamBuffer& stream)
+	{
+		size_t instanceCount = 0;
+		for (size_t i = 0; i < batches.size(); ++i)
+		{
+			if (batches[i].dynamic == dynamic)
+			{
+				instanceCount += batches[i].UploadDepth(viewIndex, frame[i].depthViews[viewIndex], stream);
+			}
+		}
+		return instanceCount;
+	}
 
-    // Create a variable that will contain the ID for our texture,
-    // and use glGenTextures() to generate the texture itself
-    GLuint cubeTex;
-    glGenTextures(1, &cubeTex);
+	/// <summary>
+	/// Draws the instances uploaded by the last UploadDepth call with the program currently in use and without binding
+	/// textures (for depth-only passes).
+	/// </summary>
+	/// <param name="viewIndex">Index of the depth-only view (e.g. the shadow cascade)</param>
+	/// <param name="dynamic">True for the dynamic batches, false for the static ones</param>
+	void DrawDepth(size_t viewIndex, bool dynamic) const
+	{
+		for (const InstanceBatch& batch : batches)
+		{
+			if (batch.dynamic == dynamic)
+			{
+				batch.DrawDepth(viewIndex);
+			}
+		}
+		glBindVertexArray(0);
+	}
 
-    // --- Load our image using stb_image ---
+	/// <summary>
+	/// Largest amount of instance data written to the stream buffer in one frame: every instance in the main pass
+	/// and in every depth-only view.
+	/// </summary>
+	/// <param name="viewCount">Number of depth-only views</param>
+	/// <param name="allocations">Receives the largest number of writes in one frame (one per batch and view)</param>
+	/// <returns>Size in bytes</returns>
+	size_t StreamBytesPerFrame(size_t viewCount, size_t& allocations) const
+	{
+		size_t size = 0;
+		for (const InstanceBatch& batch : batches)
+		{
+			size += batch.modelMatrices.size() * (sizeof(InstanceData) + viewCount * sizeof(glm::mat4));
+		}
+		allocations = batches.size() * (1 + viewCount);
+		return size;
+	}
 
-    // Im image-space (pixels), (0, 0) is the upper-left corner of the image
-    // However, in u-v coordinates, (0, 0) is the lower-left corner of the image
-    // This means that the image will appear upside-down when we use the image data as is
-    // This function tells stbi to flip the image vertically so that it is not upside-down when we use it
-    stbi_set_flip_vertically_on_load(true);
+	/// <summary>
+	/// Draws the instances uploaded by the last Upload call, each batch with its own program and texture
+	/// (bound to the active texture unit). Programs and textures are only rebound when they change between
+	/// consecutive batches, and batches without visible instances are skipped.
+	/// </summary>
+	void Draw() const
+	{
+		GLuint currentProgram = 0;
+		GLuint currentTexture = 0;
+		for (const InstanceBatch& batch : batches)
+		{
+			if (batch.visibleCount == 0)
+			{
+				continue;
+			}
+			if (batch.program != currentProgram)
+			{
+				glUseProgram(batch.program);
+				currentProgram = batch.program;
+				++renderCounters.programChanges;
+			}
+			if (batch.texture != currentTexture)
+			{
+				glBindTexture(GL_TEXTURE_2D, batch.texture);
+				currentTexture = batch.texture;
+				++renderCounters.textureBinds;
+			}
+			batch.Draw();
+		}
+		glBindVertexArray(0);
+	}
+};
 
-    // Read the image data and store it in an unsigned char array
-    imageData = stbi_load("cube texture.png", &imageWidth, &imageHeight, &numChannels, 0);
+/// <summary>
+/// Uniform buffer binding points of the blocks shared by the programs
+/// </summary>
+enum UniformBlockBinding : GLuint
+{
+	FrameUniformsBinding = 0,	// FrameUniforms block of frame.glsl
+	PointLightsBinding = 1		// PointLights block of lighting.glsl
+};
 
-    // Make sure that we actually loaded the image before uploading the data to the GPU
-    if (imageData != nullptr)
-    {
-        // Our texture is 2D, so we bind our texture to the GL_TEXTURE_2D target
-        glBindTexture(GL_TEXTURE_2D, cubeTex);
+/// <summary>
+/// Per-frame shader parameters, uploaded once per frame into a uniform buffer.
+/// Laid out like the std140 FrameUniforms block in frame.glsl: only mat4, vec4 and ivec4 members, so no padding is needed.
+/// </summary>
+struct FrameUniforms
+{
+	glm::mat4 viewMatrix;									// World to view space
+	glm::mat4 viewProjection;								// World to clip space
+	glm::mat4 inverseViewProjection;						// Clip to world space, for reconstructing positions from depth
+	glm::mat4 lightSpaceMatrices[ShadowCascades::maxCascades];	// World to light clip space of each cascade
+	glm::vec4 cascadeSplits;								// Far view depth of each cascade
+	glm::vec4 eyePosition;									// xyz: camera position
+	glm::vec4 directionalLightDirection;					// xyz: direction the light travels in
+	glm::vec4 ambientColor;									// rgb: ambient intensity * component
+	glm::vec4 diffuseColor;									// rgb: diffuse intensity * component
+	glm::vec4 specularColor;								// rgb: specular intensity * component, a: shininess
+	glm::vec4 viewportSize;									// xy: framebuffer size, zw: 1 / size
+	glm::vec4 clusterDepthParameters;						// x, y: depth slice = log(view depth) * x + y
+	glm::vec4 shadowParameters;								// x: slope bias, y: minimum bias, z: PCF radius, w: 1 / cascade resolution
+	glm::ivec4 clusterCounts;								// x, y: screen tiles, z: depth slices
+	glm::ivec4 lightCounts;									// x: point lights, y: shadow cascades
+};
 
-        // Set the filtering methods for magnification and minification
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+static_assert(ShadowCascades::maxCascades == 4, "FrameUniforms::cascadeSplits holds one split per vec4 component");
+static_assert(sizeof(FrameUniforms) == 7 * 64 + 9 * 16 + 2 * 16, "FrameUniforms must match the std140 layout");
 
-        // Set the wrapping method for the s-axis (x-axis) and t-axis (y-axis)
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+/// <summary>
+/// Point light as stored in the std140 PointLights block of lighting.glsl
+/// </summary>
+struct PointLightData
+{
+	glm::vec4 positionRadius;	// xyz: world position, w: radius
+	glm::vec4 colorIntensity;	// rgb: color, a: intensity
+};
 
-        // Upload the image data to GPU memory
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, imageWidth, imageHeight, 0, GL_RGB, GL_UNSIGNED_BYTE, imageData);
+/// <summary>
+/// Per-cluster light lists of one frame, built by LightClusters::Bin
+/// </summary>
+struct ClusterLists
+{
+	std::vector<GLuint> ranges;			// Offset and count in indices of every cluster
+	std::vector<GLubyte> indices;		// Light indices grouped by cluster
+	std::vector<glm::ivec3> lightMin;	// First tile and slice overlapped by each light
+	std::vector<glm::ivec3> lightMax;	// Last tile and slice overlapped by each light
+	size_t binnedLights = 0;			// Lights overlapping the view frustum
+};
 
-        // If we set minification to use mipmaps, we can tell OpenGL to generate the mipmaps for us
-        //glGenerateMipmap(GL_TEXTURE_2D);
+/// <summary>
+/// Point lights binned into clusters: the view frustum is split into screen tiles, and each tile into depth slices
+/// with logarithmic spacing. Every cluster lists the lights whose sphere overlaps it, so a fragment only evaluates
+/// the lights that can reach it. The lights are stored in a uniform buffer; the cluster ranges and the light index
+/// lists in texture buffers (GL 3.3 has no storage buffers).
+/// </summary>
+struct LightClusters
+{
+	static const int maxLights = 256;	// Must match MAX_POINT_LIGHTS in lighting.glsl; indices are stored as bytes
+	int tilesX = 16;					// Screen tiles across
+	int tilesY = 9;						// Screen tiles down
+	int slices = 24;					// Depth slices between the near and far planes
 
-        // Once we have copied the data over to the GPU, we can delete
-        // the data on the CPU side, since we won't be using it anymore
-        stbi_image_free(imageData);
-        imageData = nullptr;
-    }
-    else
-    {
-        std::cerr << "Failed to load image" << std::endl;
-    }
+	GLuint lightBuffer = 0;				// Uniform buffer with the PointLightData array
+	GLuint clusterBuffer = 0;			// Offset and count in lightIndices of every cluster (GL_RG32UI)
+	GLuint clusterTexture = 0;			// Texture buffer view of clusterBuffer
+	GLuint indexBuffer = 0;				// Light indices grouped by cluster (GL_R8UI)
+	GLuint indexTexture = 0;			// Texture buffer view of indexBuffer
 
+	int lightCount = 0;					// Lights uploaded to lightBuffer
 
-	glEnable(GL_DEPTH_TEST);
+	static_assert(maxLights <= 256, "Light indices are stored as GL_R8UI");
 
-	// Render loop
-	while (!glfwWindowShouldClose(window))
+	/// <summary>
+	/// Creates the buffers.
+	/// </summary>
+	void Create()
 	{
-		keyboardInput(window);
-		float time = glfwGetTime();
-		deltaTime = time - lastFrame;
-		lastFrame = time;
-
-		
-        
-        // --- SHADOW MAPPING ---
-        glm::mat4 lightProjection = glm::ortho(-100.0f, 100.0f, -50.0f, 20.0f, -100.0f, 100.0f);
-        
-        glm::vec3 directionalLightDirection = glm::vec3(1.0f, -1.0f, 0.0f);
-        GLint directionalLightDirectionUniformLocation = glGetUniformLocation(mainProgram, "directionalLightDirection");
-        glUniform3fv(directionalLightDirectionUniformLocation, 1, glm::value_ptr(directionalLightDirection));
-
-        glm::mat4 lightViewMatrix = glm::lookAt(directionalLightPosition, directionalLightPosition + directionalLightDirection, glm::vec3(0.0f, 1.0f, 0.0f));
-        
-        
-        // FIRST PASS
-        
-        glUseProgram(depthProgram);
-        
-        GLint lightProjectionUniformLocation = glGetUniformLocation(depthProgram, "lightProjection");
-        glUniformMatrix4fv(lightProjectionUniformLocation, 1, GL_FALSE, glm::value_ptr(lightProjection));
-
-        GLint lightViewMatrixUniformLocation = glGetUniformLocation(depthProgram, "lightViewMatrix");
-        glUniformMatrix4fv(lightViewMatrixUniformLocation, 1, GL_FALSE, glm::value_ptr(lightViewMatrix));
-
-        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
-
-        // Clear the color and depth buffer
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		glGenBuffers(1, &lightBuffer);
+		glBindBuffer(GL_UNIFORM_BUFFER, lightBuffer);
+		glBufferData(GL_UNIFORM_BUFFER, maxLights * sizeof(PointLightData), nullptr, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+		GLuint buffers[2];
+		GLuint textures[2];
+		glGenBuffers(2, buffers);
+		glGenTextures(2, textures);
+		clusterBuffer = buffers[0];
+		indexBuffer = buffers[1];
+		clusterTexture = textures[0];
+		indexTexture = textures[1];
+
+		// The texture buffers keep referencing the buffers when their storage is reallocated
+		GLenum formats[2] = { GL_RG32UI, GL_R8UI };
+		for (int i = 0; i < 2; ++i)
+		{
+			glBindBuffer(GL_TEXTURE_BUFFER, buffers[i]);
+			glBufferData(GL_TEXTURE_BUFFER, 16, nullptr, GL_STREAM_DRAW);
+			glBindTexture(GL_TEXTURE_BUFFER, textures[i]);
+			glTexBuffer(GL_TEXTURE_BUFFER, formats[i], buffers[i]);
+		}
+		glBindTexture(GL_TEXTURE_BUFFER, 0);
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	}
 
-        glViewport(0, 0, 1024, 1024);
-        
-        // FLOOR
+	/// <summary>
+	/// Uploads the lights. Only the first maxLights lights are kept.
+	/// </summary>
+	/// <param name="lights">Point lights of the scene</param>
+	void SetLights(const std::vector<PointLight>& lights)
+	{
+		lightCount = static_cast<int>(std::min<size_t>(lights.size(), maxLights));
+		std::vector<PointLightData> data(lightCount);
+		for (int i = 0; i < lightCount; ++i)
+		{
+			data[i].positionRadius = glm::vec4(lights[i].position, lights[i].radius);
+			data[i].colorIntensity = glm::vec4(lights[i].color, lights[i].intensity);
+		}
+		glBindBuffer(GL_UNIFORM_BUFFER, lightBuffer);
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, data.size() * sizeof(PointLightData), data.data());
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	}
 
-        // Use the vertex array object that we created
-        glBindVertexArray(vaoFloor);
+	/// <summary>
+	/// Scale of the logarithmic depth slicing: slice = log(view depth) * scale + bias
+	/// </summary>
+	float DepthSliceScale(float nearPlane, float farPlane) const
+	{
+		return slices / std::log(farPlane / nearPlane);
+	}
 
-        // Bind our texture to texture unit 0
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, floorTex);
+	/// <summary>
+	/// Bias of the logarithmic depth slicing: slice = log(view depth) * scale + bias
+	/// </summary>
+	float DepthSliceBias(float nearPlane, float farPlane) const
+	{
+		return -slices * std::log(nearPlane) / std::log(farPlane / nearPlane);
+	}
 
-        // Make our sampler in the fragment shader use texture unit 0
-        GLint texUniformLocation = glGetUniformLocation(depthProgram, "tex");
-        glUniform1i(texUniformLocation, 0);
+	/// <summary>
+	/// Bins the lights into the clusters of the camera. Makes no OpenGL calls, so it can run on any thread.
+	/// Each light's sphere is bounded by a view-space box whose projection gives the tile range (conservatively,
+	/// since x / depth over the box is extreme at its corners), and whose depth range gives the slice range.
+	/// </summary>
+	/// <param name="lights">Point lights of the scene, as passed to SetLights</param>
+	/// <param name="viewMatrix">World to view space</param>
+	/// <param name="projectionMatrix">Symmetric perspective projection of the camera</param>
+	/// <param name="nearPlane">Near plane distance of the projection</param>
+	/// <param name="farPlane">Far plane distance of the projection</param>
+	/// <param name="lists">Receives the cluster lists</param>
+	void Bin(const std::vector<PointLight>& lights, const glm::mat4& viewMatrix, const glm::mat4& projectionMatrix, float nearPlane, float farPlane,
+		ClusterLists& lists) const
+	{
+		const int clusterCount = tilesX * tilesY * slices;
+		const float sliceScale = DepthSliceScale(nearPlane, farPlane);
+		const float sliceBias = DepthSliceBias(nearPlane, farPlane);
+
+		// Cluster range of every light overlapping the view frustum
+		lists.lightMin.assign(lightCount, glm::ivec3(0));
+		lists.lightMax.assign(lightCount, glm::ivec3(-1));
+		lists.binnedLights = 0;
+		for (int i = 0; i < lightCount; ++i)
+		{
+			glm::vec3 center(viewMatrix * glm::vec4(lights[i].position, 1.0f));
+			float radius = lights[i].radius;
+			float nearDepth = std::max(-center.z - radius, nearPlane);
+			float farDepth = std::min(-center.z + radius, farPlane);
+			if (nearDepth > farDepth)
+			{
+				continue;
+			}
+
+			// Smallest and largest value of coordinate / depth over the box
+			auto projectMin = [&](float coordinate) { return coordinate < 0.0f ? coordinate / nearDepth : coordinate / farDepth; };
+			auto projectMax = [&](float coordinate) { return coordinate > 0.0f ? coordinate / nearDepth : coordinate / farDepth; };
+			glm::vec2 ndcMin(projectionMatrix[0][0] * projectMin(center.x - radius), projectionMatrix[1][1] * projectMin(center.y - radius));
+			glm::vec2 ndcMax(projectionMatrix[0][0] * projectMax(center.x + radius), projectionMatrix[1][1] * projectMax(center.y + radius));
+			if (ndcMax.x < -1.0f || ndcMin.x > 1.0f || ndcMax.y < -1.0f || ndcMin.y > 1.0f)
+			{
+				continue;
+			}
+
+			glm::ivec3 tilesAndSlices(tilesX, tilesY, slices);
+			glm::vec3 clusterMin((ndcMin * 0.5f + 0.5f) * glm::vec2(tilesX, tilesY), std::log(nearDepth) * sliceScale + sliceBias);
+			glm::vec3 clusterMax((ndcMax * 0.5f + 0.5f) * glm::vec2(tilesX, tilesY), std::log(farDepth) * sliceScale + sliceBias);
+			lists.lightMin[i] = glm::clamp(glm::ivec3(glm::floor(clusterMin)), glm::ivec3(0), tilesAndSlices - 1);
+			lists.lightMax[i] = glm::clamp(glm::ivec3(glm::floor(clusterMax)), glm::ivec3(0), tilesAndSlices - 1);
+			++lists.binnedLights;
+		}
+
+		// Count the lights of every cluster, turn the counts into offsets, then fill the lists (counting sort)
+		lists.ranges.assign(clusterCount * 2, 0);
+		for (int i = 0; i < lightCount; ++i)
+		{
+			ForEachCluster(lists, i, [&](int cluster) { ++lists.ranges[cluster * 2 + 1]; });
+		}
+		GLuint offset = 0;
+		for (int cluster = 0; cluster < clusterCount; ++cluster)
+		{
+			lists.ranges[cluster * 2] = offset;
+			offset += lists.ranges[cluster * 2 + 1];
+			lists.ranges[cluster * 2 + 1] = 0;
+		}
+		lists.indices.resize(std::max<GLuint>(offset, 1));
+		for (int i = 0; i < lightCount; ++i)
+		{
+			ForEachCluster(lists, i, [&](int cluster)
+			{
+				GLuint& count = lists.ranges[cluster * 2 + 1];
+				lists.indices[lists.ranges[cluster * 2] + count] = static_cast<GLubyte>(i);
+				++count;
+			});
+		}
+	}
 
-        glm::mat4 floorModelMatrix = glm::mat4(1.0f);
-        floorModelMatrix = glm::translate(floorModelMatrix, glm::vec3(0.0f, 40.0f, -50.0f));
-        floorModelMatrix = glm::scale(floorModelMatrix, glm::vec3(100.0f, 50.0f, 150.0f));
-        floorModelMatrix = glm::rotate(floorModelMatrix, glm::radians(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-        
-        glm::mat4 viewMatrix = glm::lookAt(cameraPosition, cameraPosition + cameraFront, cameraUp);
-        glm::mat4 projectionMatrix = glm::perspective(glm::radians(fov), windowWidth / windowHeight, 0.1f, 500.0f);
-        glm::mat4 finalMatrix = projectionMatrix * viewMatrix * floorModelMatrix;
+	/// <summary>
+	/// Uploads cluster lists built by Bin, orphaning the texture buffers.
+	/// </summary>
+	/// <param name="lists">Cluster lists of the frame</param>
+	void Upload(const ClusterLists& lists)
+	{
+		glBindBuffer(GL_TEXTURE_BUFFER, clusterBuffer);
+		glBufferData(GL_TEXTURE_BUFFER, lists.ranges.size() * sizeof(GLuint), lists.ranges.data(), GL_STREAM_DRAW);
+		glBindBuffer(GL_TEXTURE_BUFFER, indexBuffer);
+		glBufferData(GL_TEXTURE_BUFFER, lists.indices.size(), lists.indices.data(), GL_STREAM_DRAW);
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	}
 
-        GLint matUniformLocation = glGetUniformLocation(depthProgram, "mat");
-        glUniformMatrix4fv(matUniformLocation, 1, GL_FALSE, glm::value_ptr(finalMatrix));
-        
-        GLint modelUniformLocation = glGetUniformLocation(depthProgram, "model");
-        glUniformMatrix4fv(modelUniformLocation, 1, GL_FALSE, glm::value_ptr(floorModelMatrix));
-        
-        glDrawArrays(GL_TRIANGLES, 0, 6);
-        
+	/// <summary>
+	/// Calls a function with the index of every cluster overlapped by a light (none if the light is outside the frustum).
+	/// </summary>
+	template <typename Function>
+	void ForEachCluster(const ClusterLists& lists, int light, Function function) const
+	{
+		for (int slice = lists.lightMin[light].z; slice <= lists.lightMax[light].z; ++slice)
+		{
+			for (int y = lists.lightMin[light].y; y <= lists.lightMax[light].y; ++y)
+			{
+				for (int x = lists.lightMin[light].x; x <= lists.lightMax[light].x; ++x)
+				{
+					function((slice * tilesY + y) * tilesX + x);
+				}
+			}
+		}
+	}
 
-        // MIDDLE PYRAMID
+	/// <summary>
+	/// Binds the light buffer to its binding point and the cluster texture buffers to two texture units.
+	/// </summary>
+	/// <param name="clusterUnit">Texture unit of the clusterLights sampler</param>
+	/// <param name="indexUnit">Texture unit of the lightIndices sampler</param>
+	void Bind(GLenum clusterUnit, GLenum indexUnit) const
+	{
+		glBindBufferBase(GL_UNIFORM_BUFFER, PointLightsBinding, lightBuffer);
+		glActiveTexture(clusterUnit);
+		glBindTexture(GL_TEXTURE_BUFFER, clusterTexture);
+		glActiveTexture(indexUnit);
+		glBindTexture(GL_TEXTURE_BUFFER, indexTexture);
+	}
 
-        glBindVertexArray(vaoPyramid);
-        glBindTexture(GL_TEXTURE_2D, pyramidTex);
+	/// <summary>
+	/// Deletes the buffers and texture buffers.
+	/// </summary>
+	void Destroy()
+	{
+		GLuint buffers[3] = { lightBuffer, clusterBuffer, indexBuffer };
+		GLuint textures[2] = { clusterTexture, indexTexture };
+		glDeleteBuffers(3, buffers);
+		glDeleteTextures(2, textures);
+	}
+};
 
-        glm::mat4 pyramidMiddleModelMatrix = glm::mat4(1.0f);
-        pyramidMiddleModelMatrix = glm::translate(pyramidMiddleModelMatrix, glm::vec3(0.0f, -10.0f, -80.0f));
-        pyramidMiddleModelMatrix = glm::scale(pyramidMiddleModelMatrix, glm::vec3(30.0f, 40.0f, 30.0f));
-        
-        finalMatrix = projectionMatrix * viewMatrix * pyramidMiddleModelMatrix;
+/// <summary>
+/// Render targets of the deferred path: surface color, world-space normal and depth, read back by the lighting pass
+/// </summary>
+struct GBuffer
+{
+	int width = 0;				// Width in pixels
+	int height = 0;				// Height in pixels
+	GLuint framebuffer = 0;		// Framebuffer with the three attachments
+	GLuint albedoTexture = 0;	// GL_RGBA8 texture color
+	GLuint normalTexture = 0;	// GL_RGBA16F world-space normal
+	GLuint depthTexture = 0;	// GL_DEPTH_COMPONENT24 depth
+
+	/// <summary>
+	/// (Re)creates the render targets if the size changed.
+	/// </summary>
+	/// <param name="newWidth">Framebuffer width</param>
+	/// <param name="newHeight">Framebuffer height</param>
+	void Resize(int newWidth, int newHeight)
+	{
+		if (newWidth == width && newHeight == height && framebuffer != 0)
+		{
+			return;
+		}
+		Destroy();
+		width = newWidth;
+		height = newHeight;
+
+		GLuint textures[3];
+		glGenTextures(3, textures);
+		albedoTexture = textures[0];
+		normalTexture = textures[1];
+		depthTexture = textures[2];
+		const GLenum internalFormats[3] = { GL_RGBA8, GL_RGBA16F, GL_DEPTH_COMPONENT24 };
+		const GLenum formats[3] = { GL_RGBA, GL_RGBA, GL_DEPTH_COMPONENT };
+		const GLenum types[3] = { GL_UNSIGNED_BYTE, GL_HALF_FLOAT, GL_FLOAT };
+		for (int i = 0; i < 3; ++i)
+		{
+			glBindTexture(GL_TEXTURE_2D, textures[i]);
+			glTexImage2D(GL_TEXTURE_2D, 0, internalFormats[i], width, height, 0, formats[i], types[i], nullptr);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		}
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		glGenFramebuffers(1, &framebuffer);
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, albedoTexture, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, normalTexture, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthTexture, 0);
+		const GLenum drawBuffers[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+		glDrawBuffers(2, drawBuffers);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		{
+			std::cout << "Error! G-buffer not complete!" << std::endl;
+		}
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
 
-        matUniformLocation = glGetUniformLocation(depthProgram, "mat");
-        glUniformMatrix4fv(matUniformLocation, 1, GL_FALSE, glm::value_ptr(finalMatrix));
-        glDrawArrays(GL_TRIANGLES, 0, 18);
-        
+	/// <summary>
+	/// Binds the three render targets for reading, to texture units 0, 2 and 3 (unit 1 holds the shadow cascades).
+	/// </summary>
+	void BindTextures() const
+	{
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, albedoTexture);
+		glActiveTexture(GL_TEXTURE2);
+		glBindTexture(GL_TEXTURE_2D, normalTexture);
+		glActiveTexture(GL_TEXTURE3);
+		glBindTexture(GL_TEXTURE_2D, depthTexture);
+	}
 
-        // LEFT PYRAMID
+	/// <summary>
+	/// Deletes the render targets.
+	/// </summary>
+	void Destroy()
+	{
+		if (framebuffer == 0)
+		{
+			return;
+		}
+		GLuint textures[3] = { albedoTexture, normalTexture, depthTexture };
+		glDeleteTextures(3, textures);
+		glDeleteFramebuffers(1, &framebuffer);
+		framebuffer = 0;
+	}
+};
 
-        glBindVertexArray(vaoPyramid);
-        glBindTexture(GL_TEXTURE_2D, pyramidTex);
+/// <summary>
+/// State sampled on the GL thread that a frame is prepared from
+/// </summary>
+struct FrameInput
+{
+	glm::vec3 cameraPosition;		// Eye position
+	glm::vec3 cameraFront;			// View direction
+	glm::vec3 cameraUp;				// Up vector
+	float fov = 50.0f;				// Vertical field of view in degrees
+	float aspect = 1.0f;			// Width over height of the projection
+	float time = 0.0f;				// Animation time in seconds
+	int framebufferWidth = 1;		// Width of the default framebuffer
+	int framebufferHeight = 1;		// Height of the default framebuffer
+};
 
-        glm::mat4 pyramidLeftModelMatrix = glm::mat4(1.0f);
-        pyramidLeftModelMatrix = glm::translate(pyramidLeftModelMatrix, glm::vec3(-40.0f, -10.0f, -150.0f));
-        pyramidLeftModelMatrix = glm::scale(pyramidLeftModelMatrix, glm::vec3(30.0f, 40.0f, 30.0f));
-         
-        finalMatrix = projectionMatrix * viewMatrix * pyramidLeftModelMatrix;
+/// <summary>
+/// Everything the GL thread needs to submit one frame, produced by PrepareFrame without any OpenGL calls
+/// </summary>
+struct FramePacket
+{
+	FrameInput input;											// State the frame was prepared from
+	float nearPlane = 0.1f;										// Camera near plane distance
+	float farPlane = 500.0f;									// Camera far plane distance
+	glm::mat4 viewMatrix;										// World to view space
+	glm::mat4 projectionMatrix;									// View to clip space
+	glm::mat4 lightSpaceMatrices[ShadowCascades::maxCascades];	// World to light clip space of each cascade
+	float cascadeSplits[ShadowCascades::maxCascades];			// Far view depth of each cascade
+	FrameUniforms uniforms;										// Contents of the FrameUniforms block
+	std::vector<BatchFrameData> batches;						// Visible instances of every batch in every view
+	CullingStats cullingStats;									// Main pass culling results
+	ClusterLists clusters;										// Point lights binned into the clusters of the camera
+	double prepareMilliseconds = 0.0;							// CPU time spent in PrepareFrame
+};
 
-        matUniformLocation = glGetUniformLocation(depthProgram, "mat");
-        glUniformMatrix4fv(matUniformLocation, 1, GL_FALSE, glm::value_ptr(finalMatrix));
-        glDrawArrays(GL_TRIANGLES, 0, 18);
-        
-        
-        // RIGHT PYRAMID
+/// <summary>
+/// Runs one job at a time on a thread of its own, so that the next frame can be prepared while the current one is submitted
+/// </summary>
+struct FrameWorker
+{
+	std::thread thread;					// Worker thread
+	std::mutex mutex;					// Guards the members below
+	std::condition_variable condition;	// Signalled when a job is queued, finished, or the worker must quit
+	std::function<void()> job;			// Job to run next, empty if none
+	bool busy = false;					// True from Run until the job finished
+	bool quit = false;					// True once Stop was called
+
+	/// <summary>
+	/// Starts the worker thread.
+	/// </summary>
+	void Start()
+	{
+		thread = std::thread([this]()
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while (true)
+			{
+				condition.wait(lock, [this]() { return quit || job; });
+				if (!job)
+				{
+					return;
+				}
+				std::function<void()> current = std::move(job);
+				job = nullptr;
+				lock.unlock();
+				current();
+				lock.lock();
+				busy = false;
+				condition.notify_all();
+			}
+		});
+	}
 
-        glBindVertexArray(vaoPyramid);
-        glBindTexture(GL_TEXTURE_2D, pyramidTex);
-        
-        glm::mat4 pyramidRightModelMatrix = glm::mat4(1.0f);
-        pyramidRightModelMatrix = glm::translate(pyramidRightModelMatrix, glm::vec3(40.0f, -10.0f, -150.0f));
-        pyramidRightModelMatrix = glm::scale(pyramidRightModelMatrix, glm::vec3(30.0f, 40.0f, 30.0f));
-         
-        finalMatrix = projectionMatrix * viewMatrix * pyramidRightModelMatrix;
-
-        matUniformLocation = glGetUniformLocation(depthProgram, "mat");
-        glUniformMatrix4fv(matUniformLocation, 1, GL_FALSE, glm::value_ptr(finalMatrix));
-        glDrawArrays(GL_TRIANGLES, 0, 18);
-        
+	/// <summary>
+	/// Queues a job. The previous job must have finished (see Wait).
+	/// </summary>
+	/// <param name="newJob">Job to run on the worker thread</param>
+	void Run(std::function<void()> newJob)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		job = std::move(newJob);
+		busy = true;
+		condition.notify_all();
+	}
 
-        // LEFT SHORT PILLAR 1
+	/// <summary>
+	/// Blocks until the queued job finished.
+	/// </summary>
+	void Wait()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		condition.wait(lock, [this]() { return !busy; });
+	}
 
-        glBindVertexArray(vaoHex);
-        glBindTexture(GL_TEXTURE_2D, pillarTex);
+	/// <summary>
+	/// Finishes the queued job and joins the worker thread.
+	/// </summary>
+	void Stop()
+	{
+		if (!thread.joinable())
+		{
+			return;
+		}
+		Wait();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+			condition.notify_all();
+		}
+		thread.join();
+	}
+};
 
-        glm::mat4 pillarModelMatrix = glm::mat4(1.0f);
-        pillarModelMatrix = glm::translate(pillarModelMatrix, glm::vec3(-30.0f, 10.0f, 70.0f));
-        pillarModelMatrix = glm::scale(pillarModelMatrix, glm::vec3(2.0f, 10.0f, 2.0f));
-        pillarModelMatrix = glm::rotate(pillarModelMatrix, glm::radians(90.0f), glm::vec3(1.0f, 0.0f, 0.0f));
+/// <summary>
+/// Swap interval and frame rate limit of the render loop
+/// </summary>
+struct FramePacing
+{
+	bool vsync = true;										// Wait for the vertical blank on every swap
+	double targetFps = 0.0;									// Frame rate limit applied on the CPU, 0 for none
+	std::chrono::steady_clock::time_point nextFrame;		// Earliest start of the next frame when limited
+
+	/// <summary>
+	/// Sets the swap interval of the current context and restarts the limiter. Call again after changing vsync.
+	/// </summary>
+	void Apply()
+	{
+		glfwSwapInterval(vsync ? 1 : 0);
+		nextFrame = std::chrono::steady_clock::now();
+	}
 
-        finalMatrix = projectionMatrix * viewMatrix * pillarModelMatrix;
+	/// <summary>
+	/// Blocks until the next frame may start. Sleeps until shortly before the deadline, then yields until it passes,
+	/// since sleeps are only accurate to a millisecond or so. Deadlines advance by exactly one period, so the average
+	/// rate matches the target, unless the loop fell behind by more than a frame.
+	/// </summary>
+	void Wait()
+	{
+		if (targetFps <= 0.0)
+		{
+			return;
+		}
+		auto now = std::chrono::steady_clock::now();
+		if (nextFrame > now + std::chrono::milliseconds(2))
+		{
+			std::this_thread::sleep_for(nextFrame - now - std::chrono::milliseconds(1));
+		}
+		while ((now = std::chrono::steady_clock::now()) < nextFrame)
+		{
+			std::this_thread::yield();
+		}
+		auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / targetFps));
+		nextFrame += period;
+		if (nextFrame < now)
+		{
+			nextFrame = now + period;
+		}
+	}
+};
 
-        matUniformLocation = glGetUniformLocation(depthProgram, "mat");
-        glUniformMatrix4fv(matUniformLocation, 1, GL_FALSE, glm::value_ptr(finalMatrix));
+/// <summary>
+/// Scripted benchmark: the camera follows a fixed orbit around the scene and the animation advances a fixed step per frame,
+/// so every run draws the same images. After a warm-up, the time between consecutive swaps is recorded for a fixed
+/// number of frames, then the average and 1% low frame times are reported.
+/// </summary>
+struct Benchmark
+{
+	int frameCount = 0;										// Frames to measure, 0 when not benchmarking
+	int warmupFrames = 60;									// Frames drawn before measuring (texture uploads, shadow cache fill)
+	int frame = 0;											// Frames swapped so far
+	std::vector<double> frameMilliseconds;					// Measured frame times
+	std::chrono::steady_clock::time_point lastSwap;			// End of the previous frame
+
+	/// <summary>
+	/// True when benchmarking
+	/// </summary>
+	bool Active() const
+	{
+		return frameCount > 0;
+	}
 
-        glDrawArrays(GL_TRIANGLE_FAN, 0, 8);
-        glDrawArrays(GL_TRIANGLE_FAN, 8, 8);
-        glDrawArrays(GL_TRIANGLES, 16, 36);
+	/// <summary>
+	/// True once every frame has been measured
+	/// </summary>
+	bool Finished() const
+	{
+		return frame >= warmupFrames + frameCount;
+	}
 
-        
-        // LEFT SHORT PILLAR 2
+	/// <summary>
+	/// Sets the camera and animation time of a frame: one revolution around the pyramids over the whole run,
+	/// bobbing up and down twice, and 60 animation steps per second.
+	/// </summary>
+	/// <param name="preparedFrame">Number of the frame, counting the warm-up</param>
+	/// <param name="input">Receives the camera and time</param>
+	void SetFrameInput(int preparedFrame, FrameInput& input) const
+	{
+		const glm::vec3 center(0.0f, 0.0f, -90.0f);
+		const float radius = 110.0f;
+		float angle = glm::radians(360.0f) * preparedFrame / (warmupFrames + frameCount);
+		input.cameraPosition = center + glm::vec3(radius * std::sin(angle), 30.0f + 15.0f * std::sin(2.0f * angle), radius * std::cos(angle));
+		input.cameraFront = glm::normalize(center - input.cameraPosition);
+		input.cameraUp = glm::vec3(0.0f, 1.0f, 0.0f);
+		input.time = preparedFrame / 60.0f;
+	}
 
-        pillarModelMatrix = glm::mat4(1.0f);
-        pillarModelMatrix = glm::translate(pillarModelMatrix, glm::vec3(-50.0f, 10.0f, 70.0f));
-        pillarModelMatrix = glm::scale(pillarModelMatrix, glm::vec3(2.0f, 10.0f, 2.0f));
-        pillarModelMatrix = glm::rotate(pillarModelMatrix, glm::radians(90.0f), glm::vec3(1.0f, 0.0f, 0.0f));
+	/// <summary>
+	/// Records the end of a frame, right after its swap.
+	/// </summary>
+	void EndFrame()
+	{
+		auto now = std::chrono::steady_clock::now();
+		if (frame >= warmupFrames)
+		{
+			frameMilliseconds.push_back(std::chrono::duration<double, std::milli>(now - lastSwap).count());
+		}
+		lastSwap = now;
+		++frame;
+	}
 
-        finalMatrix = projectionMatrix * viewMatrix * pillarModelMatrix;
+	/// <summary>
+	/// Prints the average, 1% low (mean of the slowest 1% of frames) and worst frame times, and their frame rates.
+	/// </summary>
+	void Report() const
+	{
+		if (frameMilliseconds.empty())
+		{
+			std::cout << "Benchmark: no frames measured" << std::endl;
+			return;
+		}
+		std::vector<double> sorted = frameMilliseconds;
+		std::sort(sorted.begin(), sorted.end(), std::greater<double>());
+		size_t lowCount = std::max<size_t>(sorted.size() / 100, 1);
+		double total = 0.0;
+		for (double milliseconds : sorted)
+		{
+			total += milliseconds;
+		}
+		double lowTotal = 0.0;
+		for (size_t i = 0; i < lowCount; ++i)
+		{
+			lowTotal += sorted[i];
+		}
+		double average = total / sorted.size();
+		double low = lowTotal / lowCount;
+		std::cout << "Benchmark: " << sorted.size() << " frames" << std::endl;
+		std::cout << "  average: " << average << " ms (" << 1000.0 / average << " fps)" << std::endl;
+		std::cout << "  1% low:  " << low << " ms (" << 1000.0 / low << " fps)" << std::endl;
+		std::cout << "  worst:   " << sorted.front() << " ms" << std::endl;
+	}
+};
 
-        matUniformLocation = glGetUniformLocation(depthProgram, "mat");
-        glUniformMatrix4fv(matUniformLocation, 1, GL_FALSE, glm::value_ptr(finalMatrix));
+/// <summary>
+/// Reads the command line options:
+///   --benchmark [frames]	run the scripted benchmark uncapped (default 1000 frames) and exit
+///   --no-vsync			swap without waiting for the vertical blank
+///   --fps limit			cap the frame rate
+/// </summary>
+/// <param name="argc">Number of arguments</param>
+/// <param name="argv">Arguments, starting with the program name</param>
+/// <param name="pacing">Receives the frame pacing options</param>
+/// <param name="benchmark">Receives the benchmark options</param>
+/// <returns>True if every option was understood</returns>
+bool ParseCommandLine(int argc, char* argv[], FramePacing& pacing, Benchmark& benchmark);
 
-        glDrawArrays(GL_TRIANGLE_FAN, 0, 8);
-        glDrawArrays(GL_TRIANGLE_FAN, 8, 8);
-        glDrawArrays(GL_TRIANGLES, 16, 36);
-        
+/// <summary>
+/// Prepares a frame without any OpenGL calls, so that it can run on a worker thread while the GL thread submits
+/// the previous frame: animates the spinning objects, sets up the camera, fits the shadow cascades, bins the point lights,
+/// fills the frame uniforms, and culls every batch against the camera frustum and every cascade.
+/// </summary>
+/// <param name="input">Camera and time of the frame</param>
+/// <param name="scene">Scene being drawn</param>
+/// <param name="renderQueue">Render queue; only its frame preparation members are touched</param>
+/// <param name="shadowCascades">Shadow cascade settings</param>
+/// <param name="lightClusters">Light cluster settings</param>
+/// <param name="packet">Receives the prepared frame</param>
+void PrepareFrame(const FrameInput& input, const Scene& scene, RenderQueue& renderQueue, const ShadowCascades& shadowCascades,
+	const LightClusters& lightClusters, FramePacket& packet);
 
-        // LEFT SHORT PILLAR 3
+/// <summary>
+/// Reorders the triangles of an indexed triangle list so that consecutive triangles reuse recently transformed vertices
+/// (Tom Forsyth's linear-speed vertex cache optimization).
+/// </summary>
+/// <param name="indices">Triangle list indices, reordered in place</param>
+/// <param name="vertexCount">Number of vertices referenced by the indices</param>
+void OptimizeVertexCache(std::vector<GLuint>& indices, size_t vertexCount);
 
-        pillarModelMatrix = glm::mat4(1.0f);
-        pillarModelMatrix = glm::translate(pillarModelMatrix, glm::vec3(-70.0f, 10.0f, 70.0f));
-        pillarModelMatrix = glm::scale(pillarModelMatrix, glm::vec3(2.0f, 10.0f, 2.0f));
-        pillarModelMatrix = glm::rotate(pillarModelMatrix, glm::radians(90.0f), glm::vec3(1.0f, 0.0f, 0.0f));
+/// <summary>
+/// Creates an indexed mesh from a triangle list: identical vertices are merged, the triangles are reordered
+/// for the post-transform vertex cache, and the vertices are renumbered in the order they are first used.
+/// </summary>
+/// <param name="vertices">Triangle list vertices</param>
+/// <param name="vertexCount">Number of vertices</param>
+/// <param name="packed">True to upload the vertices in the PackedVertex layout</param>
+/// <returns>Mesh with its vertex and index buffers</returns>
+Mesh CreateMesh(const Vertex* vertices, size_t vertexCount, bool packed);
 
-        finalMatrix = projectionMatrix * viewMatrix * pillarModelMatrix;
+/// <summary>
+/// Creates an instance batch for a mesh: an empty instance buffer and a vertex array object that reads
+/// the vertex attributes and indices from the mesh and the model and normal matrices of each instance (attributes 4 to 10) from the instance buffer.
+/// </summary>
+/// <param name="mesh">Mesh of the instances</param>
+/// <param name="texture">Texture of the instances</param>
+/// <returns>Batch without any instances</returns>
+InstanceBatch CreateInstanceBatch(const Mesh& mesh, GLuint texture);
 
-        matUniformLocation = glGetUniformLocation(depthProgram, "mat");
-        glUniformMatrix4fv(matUniformLocation, 1, GL_FALSE, glm::value_ptr(finalMatrix));
+/// <summary>
+/// Texture image prepared by a worker thread and waiting to be uploaded by the GL thread
+/// </summary>
+struct TextureData
+{
+	GLuint texture = 0;								// Texture receiving the image
+	std::string filePath;							// Source image file
+	std::string error;								// Non-empty if the image could not be loaded
+	uint64_t sourceHash = 0;						// Hash of the source file, stored in the cache
+	bool compressed = false;						// True if the levels are compressed data read from the cache
+	GLenum internalFormat = GL_RGBA8;				// Compressed format of the cached levels
+	std::vector<GLsizei> widths, heights;			// Size of each mipmap level
+	std::vector<std::vector<unsigned char>> levels;	// Mipmap levels, RGBA8 rows or compressed blocks
+};
 
-        glDrawArrays(GL_TRIANGLE_FAN, 0, 8);
-        glDrawArrays(GL_TRIANGLE_FAN, 8, 8);
-        glDrawArrays(GL_TRIANGLES, 16, 36);
-        
+/// <summary>
+/// Reads an image on a worker thread: from its compressed cache file if it is up to date and in a supported format,
+/// otherwise by decoding the image and building its mipmaps with a box filter. No OpenGL calls are made.
+/// </summary>
+/// <param name="filePath">Path to the image file</param>
+/// <param name="compressedFormats">Compressed formats supported by the GL context</param>
+/// <param name="useCache">True to try the cache file first</param>
+/// <returns>Image data; error is set on failure</returns>
+TextureData LoadTextureData(const std::string& filePath, const std::vector<GLenum>& compressedFormats, bool useCache);
 
-        // RIGHT SHORT PILLAR 1
+/// <summary>
+/// Writes the compressed levels of an uploaded texture to its cache file. Does nothing if the driver did not compress it.
+/// </summary>
+/// <param name="data">Data the texture was uploaded from</param>
+void WriteTextureCache(const TextureData& data);
 
-        pillarModelMatrix = glm::mat4(1.0f);
-        pillarModelMatrix = glm::translate(pillarModelMatrix, glm::vec3(30.0f, 10.0f, 70.0f));
-        pillarModelMatrix = glm::scale(pillarModelMatrix, glm::vec3(2.0f, 10.0f, 2.0f));
-        pillarModelMatrix = glm::rotate(pillarModelMatrix, glm::radians(90.0f), glm::vec3(1.0f, 0.0f, 0.0f));
+/// <summary>
+/// Loads textures asynchronously. Images are decoded on worker threads; the GL thread uploads finished images
+/// through a pixel buffer object, with their full mipmap chain, in a GPU-compressed format when caching is enabled.
+/// The compressed levels are saved next to the image (".texcache") so later runs skip decoding entirely.
+/// </summary>
+struct TextureManager
+{
+	static const unsigned maxWorkers = 4;				// Upper limit of decoding threads, however many textures are requested
 
-        finalMatrix = projectionMatrix * viewMatrix * pillarModelMatrix;
+	/// <summary>
+	/// Texture waiting for a worker
+	/// </summary>
+	struct TextureRequest
+	{
+		GLuint texture = 0;								// Texture the image will be uploaded into
+		std::string filePath;							// Path to the image file
+		bool useCache = true;							// True to try the cache file first
+	};
+
+	bool useCache = true;								// Upload compressed and keep the on-disk cache
+	std::vector<GLenum> compressedFormats;				// Compressed formats supported by the context
+	std::vector<std::thread> workers;					// Decoding threads, started by Initialize
+	std::mutex mutex;									// Guards the members below
+	std::condition_variable condition;					// Signalled when a request is queued or finished, or the workers must quit
+	std::deque<TextureRequest> requests;				// Images waiting for a worker
+	std::vector<TextureData> finished;					// Images loaded by the workers, waiting for upload
+	size_t outstanding = 0;								// Requests queued or being loaded
+	bool quit = false;									// True once Destroy was called
+	GLuint pixelUnpackBuffer = 0;						// Staging buffer for the uploads
+
+	/// <summary>
+	/// Queries the supported compressed formats, creates the staging buffer and starts the decoding threads.
+	/// Must be called on the GL thread.
+	/// </summary>
+	void Initialize()
+	{
+		GLint formatCount = 0;
+		glGetIntegerv(GL_NUM_COMPRESSED_TEXTURE_FORMATS, &formatCount);
+		std::vector<GLint> formats(formatCount);
+		if (formatCount > 0)
+		{
+			glGetIntegerv(GL_COMPRESSED_TEXTURE_FORMATS, formats.data());
+		}
+		compressedFormats.assign(formats.begin(), formats.end());
+
+		glGenBuffers(1, &pixelUnpackBuffer);
+
+		// The flag is global in stb_image, so set it once here rather than from the workers
+		stbi_set_flip_vertically_on_load(true);
+
+		// One core stays with the GL thread
+		unsigned hardwareThreads = std::thread::hardware_concurrency();
+		unsigned workerCount = std::max(1u, std::min(maxWorkers, hardwareThreads > 1 ? hardwareThreads - 1 : 1u));
+		for (unsigned i = 0; i < workerCount; ++i)
+		{
+			workers.emplace_back([this]() { WorkerLoop(); });
+		}
+	}
 
-        matUniformLocation = glGetUniformLocation(depthProgram, "mat");
-        glUniformMatrix4fv(matUniformLocation, 1, GL_FALSE, glm::value_ptr(finalMatrix));
+	/// <summary>
+	/// Body of a decoding thread: loads queued images until Destroy is called.
+	/// </summary>
+	void WorkerLoop()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true)
+		{
+			condition.wait(lock, [this]() { return quit || !requests.empty(); });
+			if (quit)
+			{
+				return;
+			}
+			TextureRequest request = std::move(requests.front());
+			requests.pop_front();
+			lock.unlock();
+
+			TextureData data = LoadTextureData(request.filePath, compressedFormats, request.useCache);
+			data.texture = request.texture;
+
+			lock.lock();
+			finished.push_back(std::move(data));
+			--outstanding;
+			condition.notify_all();
+		}
+	}
 
-        glDrawArrays(GL_TRIANGLE_FAN, 0, 8);
-        glDrawArrays(GL_TRIANGLE_FAN, 8, 8);
-        glDrawArrays(GL_TRIANGLES, 16, 36);
-        
+	/// <summary>
+	/// Creates a texture holding a 1x1 white placeholder and queues the image for the decoding threads.
+	/// </summary>
+	/// <param name="filePath">Path to the image file</param>
+	/// <returns>OpenGL handle to the texture</returns>
+	GLuint Request(const std::string& filePath)
+	{
+		GLuint texture;
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		const unsigned char white[4] = { 255, 255, 255, 255 };
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, white);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		TextureRequest request;
+		request.texture = texture;
+		request.filePath = filePath;
+		request.useCache = useCache;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			requests.push_back(std::move(request));
+			++outstanding;
+		}
+		condition.notify_all();
+		return texture;
+	}
 
-        // RIGHT SHORT PILLAR 2
+	/// <summary>
+	/// Uploads the images whose loading finished. Must be called on the GL thread, typically once per frame.
+	/// </summary>
+	/// <param name="wait">True to block until every pending image is uploaded</param>
+	void Update(bool wait = false)
+	{
+		std::vector<TextureData> ready;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			if (wait)
+			{
+				condition.wait(lock, [this]() { return outstanding == 0; });
+			}
+			ready.swap(finished);
+		}
+
+		for (const TextureData& data : ready)
+		{
+			if (!data.error.empty())
+			{
+				std::cerr << "Failed to load image " << data.filePath << ": " << data.error << std::endl;
+				continue;
+			}
+			Upload(data);
+		}
+	}
 
-        pillarModelMatrix = glm::mat4(1.0f);
-        pillarModelMatrix = glm::translate(pillarModelMatrix, glm::vec3(50.0f, 10.0f, 70.0f));
-        pillarModelMatrix = glm::scale(pillarModelMatrix, glm::vec3(2.0f, 10.0f, 2.0f));
-        pillarModelMatrix = glm::rotate(pillarModelMatrix, glm::radians(90.0f), glm::vec3(1.0f, 0.0f, 0.0f));
+	/// <summary>
+	/// Uploads every mipmap level of an image through the staging buffer.
+	/// </summary>
+	/// <param name="data">Image data</param>
+	void Upload(const TextureData& data)
+	{
+		size_t totalSize = 0;
+		for (const std::vector<unsigned char>& level : data.levels)
+		{
+			totalSize += level.size();
+		}
+
+		// Orphan the staging buffer so that a previous upload still in flight does not stall the copy
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixelUnpackBuffer);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, totalSize, nullptr, GL_STREAM_DRAW);
+		unsigned char* staging = static_cast<unsigned char*>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, totalSize, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
+		if (staging == nullptr)
+		{
+			std::cerr << "Failed to map the texture staging buffer" << std::endl;
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			return;
+		}
+		std::vector<size_t> offsets;
+		size_t offset = 0;
+		for (const std::vector<unsigned char>& level : data.levels)
+		{
+			std::memcpy(staging + offset, level.data(), level.size());
+			offsets.push_back(offset);
+			offset += level.size();
+		}
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+		glBindTexture(GL_TEXTURE_2D, data.texture);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		GLint levelCount = static_cast<GLint>(data.levels.size());
+		for (GLint level = 0; level < levelCount; ++level)
+		{
+			const void* source = reinterpret_cast<const void*>(offsets[level]);
+			if (data.compressed)
+			{
+				glCompressedTexImage2D(GL_TEXTURE_2D, level, data.internalFormat, data.widths[level], data.heights[level], 0,
+					static_cast<GLsizei>(data.levels[level].size()), source);
+			}
+			else
+			{
+				// With the cache enabled, let the driver pick a compressed format (BC/ETC) and read it back afterwards
+				GLenum internalFormat = useCache ? GL_COMPRESSED_RGBA : GL_RGBA8;
+				glTexImage2D(GL_TEXTURE_2D, level, internalFormat, data.widths[level], data.heights[level], 0, GL_RGBA, GL_UNSIGNED_BYTE, source);
+			}
+		}
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 
-        finalMatrix = projectionMatrix * viewMatrix * pillarModelMatrix;
+		// Set the filtering methods for magnification and minification
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levelCount - 1);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 
-        matUniformLocation = glGetUniformLocation(depthProgram, "mat");
-        glUniformMatrix4fv(matUniformLocation, 1, GL_FALSE, glm::value_ptr(finalMatrix));
+		// Set the wrapping method for the s-axis (x-axis) and t-axis (y-axis)
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 
-        glDrawArrays(GL_TRIANGLE_FAN, 0, 8);
-        glDrawArrays(GL_TRIANGLE_FAN, 8, 8);
-        glDrawArrays(GL_TRIANGLES, 16, 36);
-        
+		if (!data.compressed && useCache)
+		{
+			WriteTextureCache(data);
+		}
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
 
-        // RIGHT SHORT PILLAR 3
+	/// <summary>
+	/// Drops the images nobody started loading yet, joins the workers and deletes the staging buffer.
+	/// The textures themselves are owned by the caller.
+	/// </summary>
+	void Destroy()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			requests.clear();
+			quit = true;
+		}
+		condition.notify_all();
+		for (std::thread& worker : workers)
+		{
+			worker.join();
+		}
+		workers.clear();
+		finished.clear();
+		glDeleteBuffers(1, &pixelUnpackBuffer);
+	}
+};
 
-        pillarModelMatrix = glm::mat4(1.0f);
-        pillarModelMatrix = glm::translate(pillarModelMatrix, glm::vec3(70.0f, 10.0f, 70.0f));
-        pillarModelMatrix = glm::scale(pillarModelMatrix, glm::vec3(2.0f, 10.0f, 2.0f));
-        pillarModelMatrix = glm::rotate(pillarModelMatrix, glm::radians(90.0f), glm::vec3(1.0f, 0.0f, 0.0f));
+/// <summary>
+/// Parts of a frame measured by the profiler
+/// </summary>
+enum ProfilerSection
+{
+	ProfileUpdate,		// Texture uploads and waiting for the frame preparation
+	ProfilePrepare,		// Frame preparation on the worker thread (CPU only, overlaps the other sections)
+	ProfileShadowPass,	// Shadow cascades
+	ProfileMainPass,	// Lit scene (forward) or G-buffer (deferred)
+	ProfileLightingPass,	// Deferred lighting
+	ProfileOverlay,		// Profiler overlay
+	ProfileSwap,		// glfwSwapBuffers and event polling (CPU only)
+	ProfileSectionCount
+};
 
-        finalMatrix = projectionMatrix * viewMatrix * pillarModelMatrix;
+/// <summary>
+/// Frame profiler: CPU time of every section, GPU time of the sections wrapped in GL_TIME_ELAPSED queries,
+/// and the render counters. Queries are read back a few frames later, and only once their results are available,
+/// so reading them never stalls the pipeline. Every resolved frame is appended to a CSV log.
+/// </summary>
+struct FrameProfiler
+{
+	static const int latency = 3;	// Frames in flight; a frame's queries are read back when its slot is reused
 
-        matUniformLocation = glGetUniformLocation(depthProgram, "mat");
-        glUniformMatrix4fv(matUniformLocation, 1, GL_FALSE, glm::value_ptr(finalMatrix));
+	/// <summary>
+	/// Measurements of one frame waiting for its GPU results
+	/// </summary>
+	struct FrameRecord
+	{
+		uint64_t frame = 0;									// Frame number
+		bool pending = false;								// True until the record is resolved
+		double frameMilliseconds = 0.0;						// CPU time of the whole frame
+		double cpuMilliseconds[ProfileSectionCount] = {};	// CPU time of each section
+		GLuint queries[ProfileSectionCount] = {};			// GL_TIME_ELAPSED query of each section
+		bool queryIssued[ProfileSectionCount] = {};			// True if the section was measured on the GPU this frame
+		RenderCounters counters;							// Counters of the frame
+	};
+
+	FrameRecord records[latency];							// Ring of frames in flight
+	uint64_t frame = 0;										// Number of the current frame
+	std::chrono::steady_clock::time_point frameStart;		// CPU start of the current frame
+	std::chrono::steady_clock::time_point sectionStart[ProfileSectionCount];	// CPU start of the open sections
+
+	// Latest resolved frame, shown by the overlay
+	double frameMilliseconds = 0.0;							// CPU time of the whole frame
+	double cpuMilliseconds[ProfileSectionCount] = {};		// CPU time of each section
+	double gpuMilliseconds[ProfileSectionCount] = {};		// GPU time of each section, -1 if not measured or not ready
+	RenderCounters counters;								// Counters of the frame
+
+	std::ofstream log;										// CSV log, one line per resolved frame
+
+	/// <summary>
+	/// Names of the sections, used for the CSV columns
+	/// </summary>
+	static const char* SectionName(int section)
+	{
+		static const char* const names[ProfileSectionCount] = { "update", "prepare", "shadow", "main", "lighting", "overlay", "swap" };
+		return names[section];
+	}
 
-        glDrawArrays(GL_TRIANGLE_FAN, 0, 8);
-        glDrawArrays(GL_TRIANGLE_FAN, 8, 8);
-        glDrawArrays(GL_TRIANGLES, 16, 36);
-        
+	/// <summary>
+	/// Creates the queries and opens the CSV log. Must be called on the GL thread.
+	/// </summary>
+	/// <param name="logFilePath">Path of the CSV log, or an empty string for no log</param>
+	void Initialize(const std::string& logFilePath)
+	{
+		for (FrameRecord& record : records)
+		{
+			glGenQueries(ProfileSectionCount, record.queries);
+		}
+		if (logFilePath.empty())
+		{
+			return;
+		}
+		log.open(logFilePath);
+		if (!log)
+		{
+			std::cerr << "Failed to open profiler log " << logFilePath << std::endl;
+			return;
+		}
+		log << "frame,frame_ms";
+		for (int section = 0; section < ProfileSectionCount; ++section)
+		{
+			log << ",cpu_" << SectionName(section) << "_ms";
+		}
+		for (int section = 0; section < ProfileSectionCount; ++section)
+		{
+			log << ",gpu_" << SectionName(section) << "_ms";
+		}
+		log << ",draw_calls,instances,program_changes,texture_binds,vertex_array_binds,framebuffer_binds,instance_uploads,instance_upload_bytes,stream_waits\n";
+	}
 
-        // LEFT TALL PILLAR 1
+	/// <summary>
+	/// Starts a frame. Resolves the frame that used the same slot before, if its results are ready.
+	/// </summary>
+	void BeginFrame()
+	{
+		FrameRecord& record = records[frame % latency];
+		if (record.pending)
+		{
+			Resolve(record);
+		}
+		// Reuse the slot, keeping its query objects
+		GLuint queries[ProfileSectionCount];
+		std::copy(record.queries, record.queries + ProfileSectionCount, queries);
+		record = FrameRecord();
+		std::copy(queries, queries + ProfileSectionCount, record.queries);
+		record.frame = frame;
+		record.pending = true;
+		frameStart = std::chrono::steady_clock::now();
+	}
 
-        pillarModelMatrix = glm::mat4(1.0f);
-        pillarModelMatrix = glm::translate(pillarModelMatrix, glm::vec3(-10.0f, 15.0f, 70.0f));
-        pillarModelMatrix = glm::scale(pillarModelMatrix, glm::vec3(2.0f, 15.0f, 2.0f));
-        pillarModelMatrix = glm::rotate(pillarModelMatrix, glm::radians(90.0f), glm::vec3(1.0f, 0.0f, 0.0f));
+	/// <summary>
+	/// Starts measuring a section. Only one GPU-timed section can be open at a time.
+	/// </summary>
+	/// <param name="section">Section to measure</param>
+	/// <param name="gpu">True to also measure the GPU time of the commands issued in the section</param>
+	void BeginSection(ProfilerSection section, bool gpu)
+	{
+		FrameRecord& record = records[frame % latency];
+		if (gpu)
+		{
+			glBeginQuery(GL_TIME_ELAPSED, record.queries[section]);
+			record.queryIssued[section] = true;
+		}
+		sectionStart[section] = std::chrono::steady_clock::now();
+	}
 
-        finalMatrix = projectionMatrix * viewMatrix * pillarModelMatrix;
+	/// <summary>
+	/// Stops measuring a section.
+	/// </summary>
+	/// <param name="section">Section being measured</param>
+	void EndSection(ProfilerSection section)
+	{
+		FrameRecord& record = records[frame % latency];
+		record.cpuMilliseconds[section] += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - sectionStart[section]).count();
+		if (record.queryIssued[section])
+		{
+			glEndQuery(GL_TIME_ELAPSED);
+		}
+	}
 
-        matUniformLocation = glGetUniformLocation(depthProgram, "mat");
-        glUniformMatrix4fv(matUniformLocation, 1, GL_FALSE, glm::value_ptr(finalMatrix));
+	/// <summary>
+	/// Records the CPU time of a section measured elsewhere, e.g. on another thread.
+	/// </summary>
+	/// <param name="section">Section that was measured</param>
+	/// <param name="milliseconds">CPU time of the section</param>
+	void RecordCpuTime(ProfilerSection section, double milliseconds)
+	{
+		records[frame % latency].cpuMilliseconds[section] += milliseconds;
+	}
 
-        glDrawArrays(GL_TRIANGLE_FAN, 0, 8);
-        glDrawArrays(GL_TRIANGLE_FAN, 8, 8);
-        glDrawArrays(GL_TRIANGLES, 16, 36);
-        
+	/// <summary>
+	/// Ends the frame: stores its CPU time and counters, and resets the counters.
+	/// </summary>
+	void EndFrame()
+	{
+		FrameRecord& record = records[frame % latency];
+		record.frameMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frameStart).count();
+		record.counters = renderCounters;
+		renderCounters = RenderCounters();
+		++frame;
+	}
 
-        // RIGHT TALL PILLAR 1
+	/// <summary>
+	/// Reads the GPU results of a frame without waiting, publishes the frame to the overlay and logs it.
+	/// GPU times whose results are not available yet are reported as -1.
+	/// </summary>
+	/// <param name="record">Frame to resolve</param>
+	void Resolve(FrameRecord& record)
+	{
+		for (int section = 0; section < ProfileSectionCount; ++section)
+		{
+			gpuMilliseconds[section] = -1.0;
+			if (!record.queryIssued[section])
+			{
+				continue;
+			}
+			GLint available = GL_FALSE;
+			glGetQueryObjectiv(record.queries[section], GL_QUERY_RESULT_AVAILABLE, &available);
+			if (available == GL_TRUE)
+			{
+				GLuint64 nanoseconds = 0;
+				glGetQueryObjectui64v(record.queries[section], GL_QUERY_RESULT, &nanoseconds);
+				gpuMilliseconds[section] = nanoseconds / 1.0e6;
+			}
+		}
+		frameMilliseconds = record.frameMilliseconds;
+		std::copy(record.cpuMilliseconds, record.cpuMilliseconds + ProfileSectionCount, cpuMilliseconds);
+		counters = record.counters;
+		record.pending = false;
+
+		if (log.is_open())
+		{
+			log << record.frame << "," << frameMilliseconds;
+			for (double milliseconds : cpuMilliseconds)
+			{
+				log << "," << milliseconds;
+			}
+			for (double milliseconds : gpuMilliseconds)
+			{
+				log << "," << milliseconds;
+			}
+			log << "," << counters.drawCalls << "," << counters.instances << "," << counters.programChanges << "," << counters.textureBinds
+				<< "," << counters.vertexArrayBinds << "," << counters.framebufferBinds << "," << counters.instanceUploads << "," << counters.instanceUploadBytes << "," << counters.streamWaits << "\n";
+		}
+	}
 
-        pillarModelMatrix = glm::mat4(1.0f);
-        pillarModelMatrix = glm::translate(pillarModelMatrix, glm::vec3(10.0f, 15.0f, 70.0f));
-        pillarModelMatrix = glm::scale(pillarModelMatrix, glm::vec3(2.0f, 15.0f, 2.0f));
-        pillarModelMatrix = glm::rotate(pillarModelMatrix, glm::radians(90.0f), glm::vec3(1.0f, 0.0f, 0.0f));
+	/// <summary>
+	/// Deletes the queries and closes the log.
+	/// </summary>
+	void Destroy()
+	{
+		for (FrameRecord& record : records)
+		{
+			glDeleteQueries(ProfileSectionCount, record.queries);
+		}
+		log.close();
+	}
+};
 
-        finalMatrix = projectionMatrix * viewMatrix * pillarModelMatrix;
+/// <summary>
+/// Measures the CPU time (and optionally GPU time) of the enclosing scope
+/// </summary>
+struct ScopedProfilerSection
+{
+	FrameProfiler& profiler;	// Profiler receiving the measurement
+	ProfilerSection section;	// Section being measured
 
-        matUniformLocation = glGetUniformLocation(depthProgram, "mat");
-        glUniformMatrix4fv(matUniformLocation, 1, GL_FALSE, glm::value_ptr(finalMatrix));
+	ScopedProfilerSection(FrameProfiler& profiler, ProfilerSection section, bool gpu) : profiler(profiler), section(section)
+	{
+		profiler.BeginSection(section, gpu);
+	}
 
-        glDrawArrays(GL_TRIANGLE_FAN, 0, 8);
-        glDrawArrays(GL_TRIANGLE_FAN, 8, 8);
-        glDrawArrays(GL_TRIANGLES, 16, 36);
-        
+	~ScopedProfilerSection()
+	{
+		profiler.EndSection(section);
+	}
+};
 
-        // CUBE ON TOP OF LEFT PILLARS
+/// <summary>
+/// Draws the profiler overlay in the top-left corner of the default framebuffer with scissored clears (no shaders or fonts).
+/// One row per section, in the section's color: CPU milliseconds, GPU milliseconds, then a bar for the CPU time and a thinner
+/// bar below it for the GPU time (the white tick marks 16.7 ms). The last row shows the frame time, draw calls and state changes.
+/// </summary>
+/// <param name="profiler">Profiler with the latest resolved frame</param>
+/// <param name="framebufferHeight">Height of the default framebuffer</param>
+void DrawProfilerOverlay(const FrameProfiler& profiler, int framebufferHeight);
 
-        glBindVertexArray(vaoCube);
-        glBindTexture(GL_TEXTURE_2D, pillarTex);
+/// <summary>
+/// Loads a scene file. Each line is one of
+///   texture name file path
+///   object mesh texture tx ty tz sx sy sz [rotate ax ay az degrees] [spin ax ay az degreesPerSecond]
+///   light x y z r g b radius intensity
+/// Empty lines and lines starting with # are ignored. Textures start loading as they are declared.
+/// </summary>
+/// <param name="filePath">Path to the scene file</param>
+/// <param name="textureManager">Texture manager loading the textures</param>
+/// <param name="scene">Scene receiving the textures and objects</param>
+/// <returns>True if the file was read without errors</returns>
+bool LoadScene(const std::string& filePath, TextureManager& textureManager, Scene& scene);
 
-        glm::mat4 cubeModelMatrix = glm::mat4(1.0f);
-        cubeModelMatrix = glm::translate(cubeModelMatrix, glm::vec3(-43.0f, 11.0f, 0.0f));
-        cubeModelMatrix = glm::scale(cubeModelMatrix, glm::vec3(31.0f, 1.0f, 2.1f));
+/// <summary>
+/// Groups the objects of a scene into instance batches (one per program, mesh and texture) sorted in that order.
+/// Spinning objects get batches of their own so that the static ones can be cached in the shadow maps.
+/// Objects using an unknown mesh or texture are reported and skipped.
+/// </summary>
+/// <param name="scene">Scene to draw</param>
+/// <param name="meshes">Meshes by name</param>
+/// <param name="program">Program used by the objects in the main pass</param>
+/// <returns>Render queue with the instance attributes computed</returns>
+RenderQueue BuildRenderQueue(const Scene& scene, const std::unordered_map<std::string, Mesh>& meshes, GLuint program);
 
-        finalMatrix = projectionMatrix * viewMatrix * cubeModelMatrix;
+glm::vec3 cameraPosition = glm::vec3(0.0f, 20.0f, 80.0f);
+glm::vec3 cameraFront = glm::vec3(0.0f, 0.0f, -1.0f);
+glm::vec3 cameraUp = glm::vec3(0.0f, 1.0f, 0.0f);
 
-        matUniformLocation = glGetUniformLocation(depthProgram, "mat");
-        glUniformMatrix4fv(matUniformLocation, 1, GL_FALSE, glm::value_ptr(finalMatrix));
-        glDrawArrays(GL_TRIANGLES, 0, 36);
-        
 
-        // CUBE ON TOP OF RIGHT PILLARS
+float deltaTime = 0.0f;
+float lastFrame = 0.0f;
 
-        glBindVertexArray(vaoCube);
-        glBindTexture(GL_TEXTURE_2D, pillarTex);
+bool firstMouseMovement = true;
+float lastX = 800.0f / 2.0;
+float lastY = 600.0f / 2.0;
 
-        cubeModelMatrix = glm::mat4(1.0f);
-        cubeModelMatrix = glm::translate(cubeModelMatrix, glm::vec3(43.0f, 11.0f, 0.0f));
-        cubeModelMatrix = glm::scale(cubeModelMatrix, glm::vec3(31.0f, 1.0f, 2.1f));
+float yaw = -90.0f;
+float pitch = 0.0f;
+float fov = 50.0f;
 
-        finalMatrix = projectionMatrix * viewMatrix * cubeModelMatrix;
+bool showProfilerOverlay = true;
 
-        matUniformLocation = glGetUniformLocation(depthProgram, "mat");
-        glUniformMatrix4fv(matUniformLocation, 1, GL_FALSE, glm::value_ptr(finalMatrix));
-        glDrawArrays(GL_TRIANGLES, 0, 36);
-        
+// Size of the default framebuffer, kept up to date by FramebufferSizeChangedCallback
+int framebufferWidth = 0;
+int framebufferHeight = 0;
 
-        // CUBE ON TOP OF MIDDLE PILLARS
+// Vsync (toggled with V) and frame rate limit
+FramePacing framePacing;
 
-        glBindVertexArray(vaoCube);
-        glBindTexture(GL_TEXTURE_2D, pillarTex);
+/// <summary>
+/// Main function.
+/// </summary>
+/// <param name="argc">Number of command line arguments</param>
+/// <param name="argv">Command line arguments (see ParseCommandLine)</param>
+/// <returns>An integer indicating whether the program ended successfully or not.
+/// A value of 0 indicates the program ended succesfully, while a non-zero value indicates
+/// something wrong happened during execution.</returns>
+int main(int argc, char* argv[])
+{
+	Benchmark benchmark;
+	if (!ParseCommandLine(argc, argv, framePacing, benchmark))
+	{
+		return 1;
+	}
+	if (benchmark.Active())
+	{
+		// Measure what the build can do, not the display
+		framePacing.vsync = false;
+		framePacing.targetFps = 0.0;
+	}
 
-        cubeModelMatrix = glm::mat4(1.0f);
-        cubeModelMatrix = glm::translate(cubeModelMatrix, glm::vec3(0.0f, 15.0f, 0.0f));
-        cubeModelMatrix = glm::scale(cubeModelMatrix, glm::vec3(15.0f, 1.0f, 2.1f));
+	// Initialize GLFW
+	int glfwInitStatus = glfwInit();
+	if (glfwInitStatus == GLFW_FALSE)
+	{
+		std::cerr << "Failed to initialize GLFW!" << std::endl;
+		return 1;
+	}
 
-        finalMatrix = projectionMatrix * viewMatrix * cubeModelMatrix;
+	// Tell GLFW that we prefer to use OpenGL 3.3
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
 
-        matUniformLocation = glGetUniformLocation(depthProgram, "mat");
-        glUniformMatrix4fv(matUniformLocation, 1, GL_FALSE, glm::value_ptr(finalMatrix));
-        glDrawArrays(GL_TRIANGLES, 0, 36);
+	// Tell GLFW that we prefer to use the modern OpenGL
+	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GLFW_TRUE);
+	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
+	// Tell GLFW to create a window
+	float windowWidth = 1024;
+	float windowHeight = 576;
+	GLFWwindow* window = glfwCreateWindow(windowWidth, windowHeight, "Final Project", nullptr, nullptr);
+	if (window == nullptr)
+	{
+		std::cerr << "Failed to create GLFW window!" << std::endl;
+		glfwTerminate();
+		return 1;
+	}
 
-        // ROTATING CUBE
+	// Tell GLFW to use the OpenGL context that was assigned to the window that we just created
+	glfwMakeContextCurrent(window);
 
-        glBindVertexArray(vaoCube);
-        glBindTexture(GL_TEXTURE_2D, cubeTex);
+	// Register the callback function that handles when the framebuffer size has changed
+	glfwSetFramebufferSizeCallback(window, FramebufferSizeChangedCallback);
 
-        cubeModelMatrix = glm::mat4(1.0f);
-        cubeModelMatrix = glm::translate(cubeModelMatrix, glm::vec3(0.0f, 0.0f, 50.0f));
-        cubeModelMatrix = glm::scale(cubeModelMatrix, glm::vec3(5.0f, 5.0f, 5.1f));
-        cubeModelMatrix = glm::rotate(cubeModelMatrix, glm::radians(60.0f * time), glm::vec3(1.0f, 1.0f, 1.0f));
+	glfwSetCursorPosCallback(window, mouse_callback);
 
-        finalMatrix = projectionMatrix * viewMatrix * cubeModelMatrix;
+	glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+	// Tell GLAD to load the OpenGL function pointers
+	if (!gladLoadGLLoader(reinterpret_cast<GLADloadproc>(glfwGetProcAddress)))
+	{
+		std::cerr << "Failed to initialize GLAD!" << std::endl;
+		return 1;
+	}
 
-        matUniformLocation = glGetUniformLocation(depthProgram, "mat");
-        glUniformMatrix4fv(matUniformLocation, 1, GL_FALSE, glm::value_ptr(finalMatrix));
-        glDrawArrays(GL_TRIANGLES, 0, 36);
-        
-        // "Unuse" the vertex array object
-        glBindVertexArray(0);
-        
-        
-        
-        // SECOND PASS
-        
-        // Use the shader program that we created
-        glUseProgram(mainProgram);
+	// --- VERTEX SPECIFICATION ---
+    
+    Vertex floorVertices[6];
+    
+    // Bottom face of cube
+    floorVertices[0] = { 1.0f, -1.0f, -1.0f,      255, 255, 255,     1.0f, 0.5f }; // bottom left
+    floorVertices[1] = { -1.0f, -1.0f, 1.0f,      255, 255, 255,     0.5f, 1.0f }; // top right
+    floorVertices[2] = { 1.0f, -1.0f, 1.0f,       255, 255, 255,     0.5f, 0.5f }; // top left
+    floorVertices[3] = { -1.0f, -1.0f, -1.0f,     255, 255, 255,     1.0f, 1.0f }; // bottom right
+    floorVertices[4] = { 1.0f, -1.0f, -1.0f,      255, 255, 255,     1.0f, 0.5f }; // bottom left
+    floorVertices[5] = { -1.0f, -1.0f, 1.0f,      255, 255, 255,     0.5f, 1.0f }; // top right
+    
+    // Loop to calculate normal vertices per face
+    for( int i=0; i < (sizeof(floorVertices)/sizeof(floorVertices[0])); i+=6 )
+    {
+        glm::vec3 v1( floorVertices[i].x, floorVertices[i].y, floorVertices[i].z );
+        glm::vec3 v2( floorVertices[i+1].x, floorVertices[i+1].y, floorVertices[i+1].z );
+        glm::vec3 v3( floorVertices[i+2].x, floorVertices[i+2].y, floorVertices[i+2].z );
         
-        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        glm::vec3 a;
+        a.x = v2.x - v1.x;
+        a.y = v2.y - v1.y;
+        a.z = v2.z - v1.z;
         
-        glActiveTexture(depthTex);
-        glBindTexture(GL_TEXTURE_2D, depthTex);
+        glm::vec3 b;
+        b.x = v3.x - v1.x;
+        b.y = v3.y - v1.y;
+        b.z = v3.z - v1.z;
         
-        GLint depthTexUniformLocation = glGetUniformLocation(mainProgram, "depthTex");
-        glUniform1i(depthTexUniformLocation, 0);
+        glm::vec3 crossProd( glm::cross(b, a) );
         
-        lightProjectionUniformLocation = glGetUniformLocation(mainProgram, "lightProjection");
-        glUniformMatrix4fv(lightProjectionUniformLocation, 1, GL_FALSE, glm::value_ptr(lightProjection));
+        for( int j=i; j < (i+6); j+=1 )
+        {
+            floorVertices[j].nx = crossProd.x;
+            floorVertices[j].ny = crossProd.y;
+            floorVertices[j].nz = crossProd.z;
+        }
+    }
+    
 
-        lightViewMatrixUniformLocation = glGetUniformLocation(mainProgram, "lightViewMatrix");
-        glUniformMatrix4fv(lightViewMatrixUniformLocation, 1, GL_FALSE, glm::value_ptr(lightViewMatrix));
-        
-        int framebufferWidth, framebufferHeight;
-        glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
-        glViewport(0, 0, framebufferWidth, framebufferHeight);
-        
-        
-        // --- LIGHTING ---
-        
-        // Eye position
-        glm::vec3 eyePosition = cameraPosition;
-        GLint eyePositionUniformLocation = glGetUniformLocation(mainProgram, "eyePosition");
-        glUniform3fv(eyePositionUniformLocation, 1, glm::value_ptr(eyePosition));
-        
-        
-        // Ambient intensity FOR DIRECTIONAL LIGHT
-        float ambientDirectionalIntensity = 0.8f;
-        GLint ambientDirectionalIntensityUniformLocation = glGetUniformLocation(mainProgram, "ambientDirectionalIntensity");
-        glUniform1f(ambientDirectionalIntensityUniformLocation, ambientDirectionalIntensity);
-        
-        // Ambient component FOR DIRECTIONAL LIGHT
-        glm::vec3 ambientDirectionalComponent = glm::vec3(1.0f, 0.9f, 0.8f);
-        GLint ambientDirectionalComponentUniformLocation = glGetUniformLocation(mainProgram, "ambientDirectionalComponent");
-        glUniform3fv(ambientDirectionalComponentUniformLocation, 1, glm::value_ptr(ambientDirectionalComponent));
-        
-        
-        // Diffuse intensity
-        float diffuseIntensity = 0.8f;
-        GLint diffuseIntensityUniformLocation = glGetUniformLocation(mainProgram, "diffuseIntensity");
-        glUniform1f(diffuseIntensityUniformLocation, diffuseIntensity);
-        
-        // Diffuse component
-        glm::vec3 diffuseComponent = glm::vec3(0.8f, 0.8f, 0.8f);
-        GLint diffuseComponentUniformLocation = glGetUniformLocation(mainProgram, "diffuseComponent");
-        glUniform3fv(diffuseComponentUniformLocation, 1, glm::value_ptr(diffuseComponent));
-        
-        
-        // Specular intensity
-        float specularIntensity = 5.0f;
-        GLint specularIntensityUniformLocation = glGetUniformLocation(mainProgram, "specularIntensity");
-        glUniform1f(specularIntensityUniformLocation, specularIntensity);
-        
-        // Specular component
-        glm::vec3 specularComponent = glm::vec3(0.4f, 0.4f, 0.4f);
-        GLint specularComponentUniformLocation = glGetUniformLocation(mainProgram, "specularComponent");
-        glUniform3fv(specularComponentUniformLocation, 1, glm::value_ptr(specularComponent));
-        
-        
-        // Shininess
-        float shininess = 64.0f;
-        GLint shininessUniformLocation = glGetUniformLocation(mainProgram, "shininess");
-        glUniform1f(shininessUniformLocation, shininess);
+    Vertex cubeVertices[36];
+
+    // NOTE: NEGATIVE Z FACING FORWARD
+
+    // right
+    cubeVertices[0] = { 1.0f, -1.0f, -1.0f,       255, 255, 255,     0.0f, 0.5f }; // bottom left
+    cubeVertices[1] = { 1.0f, 1.0f, 1.0f,         255, 255, 255,     0.5f, 1.0f }; // top right
+    cubeVertices[2] = { 1.0f, 1.0f, -1.0f,        255, 255, 255,     0.0f, 1.0f }; // top left
+    cubeVertices[3] = { 1.0f, -1.0f, 1.0f,        255, 255, 255,     0.5f, 0.5f }; // bottom right
+    cubeVertices[4] = { 1.0f, 1.0f, 1.0f,         255, 255, 255,     0.5f, 1.0f }; // top right
+    cubeVertices[5] = { 1.0f, -1.0f, -1.0f,       255, 255, 255,     0.0f, 0.5f }; // bottom left
+
+    // top
+    cubeVertices[6] = { -1.0f, 1.0f, -1.0f,       255, 255, 255,     1.0f, 1.0f }; // bottom left
+    cubeVertices[7] = { 1.0f, 1.0f, 1.0f,         255, 255, 255,     0.5f, 0.5f }; // top right
+    cubeVertices[8] = { -1.0f, 1.0f, 1.0f,        255, 255, 255,     0.5f, 1.0f }; // top left
+    cubeVertices[9] = { 1.0f, 1.0f, -1.0f,        255, 255, 255,     1.0f, 0.5f }; // bottom right
+    cubeVertices[10] = { -1.0f, 1.0f, -1.0f,      255, 255, 255,     1.0f, 1.0f }; // bottom left
+    cubeVertices[11] = { 1.0f, 1.0f, 1.0f,        255, 255, 255,     0.5f, 0.5f }; // top right
+
+    // left
+    cubeVertices[12] = { -1.0f, -1.0f, 1.0f,      255, 255, 255,     0.5f, 0.5f }; // bottom left
+    cubeVertices[13] = { -1.0f, 1.0f, -1.0f,      255, 255, 255,     0.0f, 1.0f }; // top right
+    cubeVertices[14] = { -1.0f, 1.0f, 1.0f,       255, 255, 255,     0.5f, 1.0f }; // top left
+    cubeVertices[15] = { -1.0f, -1.0f, -1.0f,     255, 255, 255,     0.0f, 0.5f }; // bottom right
+    cubeVertices[16] = { -1.0f, 1.0f, -1.0f,      255, 255, 255,     0.0f, 1.0f }; // top right
+    cubeVertices[17] = { -1.0f, -1.0f, 1.0f,      255, 255, 255,     0.5f, 0.5f }; // bottom left
+
+    // bottom
+    cubeVertices[18] = { 1.0f, -1.0f, -1.0f,      255, 255, 255,     1.0f, 0.5f }; // bottom left
+    cubeVertices[19] = { -1.0f, -1.0f, 1.0f,      255, 255, 255,     0.5f, 1.0f }; // top right
+    cubeVertices[20] = { 1.0f, -1.0f, 1.0f,       255, 255, 255,     0.5f, 0.5f }; // top left
+    cubeVertices[21] = { -1.0f, -1.0f, -1.0f,     255, 255, 255,     1.0f, 1.0f }; // bottom right
+    cubeVertices[22] = { 1.0f, -1.0f, -1.0f,      255, 255, 255,     1.0f, 0.5f }; // bottom left
+    cubeVertices[23] = { -1.0f, -1.0f, 1.0f,      255, 255, 255,     0.5f, 1.0f }; // top right
+
+    // back
+    cubeVertices[24] = { 1.0f, -1.0f, 1.0f,       255, 255, 255,     0.0f, 0.5f }; // bottom left
+    cubeVertices[25] = { -1.0f, 1.0f, 1.0f,       255, 255, 255,     0.5f, 1.0f }; // top right
+    cubeVertices[26] = { 1.0f, 1.0f, 1.0f,        255, 255, 255,     0.0f, 1.0f }; // top left
+    cubeVertices[27] = { -1.0f, -1.0f, 1.0f,      255, 255, 255,     0.5f, 0.5f }; // bottom right
+    cubeVertices[28] = { -1.0f, 1.0f, 1.0f,       255, 255, 255,     0.5f, 1.0f }; // top right
+    cubeVertices[29] = { 1.0f, -1.0f, 1.0f,       255, 255, 255,     0.0f, 0.5f }; // bottom left
+    
+    // front
+    cubeVertices[30] = { -1.0f, -1.0f, -1.0f,     255, 255, 255,     0.5f, 0.5f }; // bottom left
+    cubeVertices[31] = { 1.0f, 1.0f, -1.0f,       255, 255, 255,     0.0f, 1.0f }; // top right
+    cubeVertices[32] = { -1.0f, 1.0f, -1.0f,      255, 255, 255,     0.5f, 1.0f }; // top left
+    cubeVertices[33] = { 1.0f, -1.0f, -1.0f,      255, 255, 255,     0.0f, 0.5f }; // bottom right
+    cubeVertices[34] = { 1.0f, 1.0f, -1.0f,       255, 255, 255,     0.0f, 1.0f }; // top right
+    cubeVertices[35] = { -1.0f, -1.0f, -1.0f,     255, 255, 255,     0.5f, 0.5f }; // bottom left
+    
+    // Loop to calculate normal vertices per face
+    for( int i=0; i < (sizeof(cubeVertices)/sizeof(cubeVertices[0])); i+=6 )
+    {
+        glm::vec3 v1( cubeVertices[i].x, cubeVertices[i].y, cubeVertices[i].z );
+        glm::vec3 v2( cubeVertices[i+1].x, cubeVertices[i+1].y, cubeVertices[i+1].z );
+        glm::vec3 v3( cubeVertices[i+2].x, cubeVertices[i+2].y, cubeVertices[i+2].z );
         
+        glm::vec3 a;
+        a.x = v2.x - v1.x;
+        a.y = v2.y - v1.y;
+        a.z = v2.z - v1.z;
         
-        // Clear the color and depth buffer
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        glm::vec3 b;
+        b.x = v3.x - v1.x;
+        b.y = v3.y - v1.y;
+        b.z = v3.z - v1.z;
         
+        glm::vec3 crossProd( glm::cross(b, a) );
         
+        for( int j=i; j < (i+6); j+=1 )
+        {
+            cubeVertices[j].nx = crossProd.x;
+            cubeVertices[j].ny = crossProd.y;
+            cubeVertices[j].nz = crossProd.z;
+        }
+    }
 
-		// FLOOR
+    
+	Vertex pyramidVertices[18];
 
-		// Use the vertex array object that we created
-		glBindVertexArray(vaoFloor);
+	// base
+	pyramidVertices[0] = { 1.0f, 0.0f, -1.0f,      255, 255, 255,     1.0f, 0.5f }; // bottom left
+	pyramidVertices[1] = { -1.0f, 0.0f, 1.0f,      255, 255, 255,     0.5f, 1.0f }; // top right
+	pyramidVertices[2] = { 1.0f, 0.0f, 1.0f,       255, 255, 255,     0.5f, 0.5f }; // top left
+	pyramidVertices[3] = { -1.0f, 0.0f, -1.0f,     255, 255, 255,     1.0f, 1.0f }; // bottom right
+	pyramidVertices[4] = { 1.0f, 0.0f, -1.0f,      255, 255, 255,     1.0f, 0.5f }; // bottom left
+	pyramidVertices[5] = { -1.0f, 0.0f, 1.0f,      255, 255, 255,     0.5f, 1.0f }; // top right
 
-		// Bind our texture to texture unit 0
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, floorTex);
+	// back
+	pyramidVertices[6] = { 1.0f, 0.0f, 1.0f,	255, 255, 255,		0.0f, 0.0f }; 
+	pyramidVertices[7] = { -1.0f, 0.0f, 1.0f,	255, 255, 255,		1.0f, 0.0f }; 
+	pyramidVertices[8] = { 0.0f, 1.0f, 0.0f,	255, 255, 255,		0.5f, 1.0f }; 
 
-		// Make our sampler in the fragment shader use texture unit 0
-		texUniformLocation = glGetUniformLocation(mainProgram, "tex");
-		glUniform1i(texUniformLocation, 0);
+	// right 
+	pyramidVertices[9] = { 1.0f, 0.0f, -1.0f,	255, 255, 255,		0.0f, 0.0f };
+	pyramidVertices[10] = { 1.0f, 0.0f, 1.0f,	255, 255, 255,		1.0f, 0.0f };
+	pyramidVertices[11] = { 0.0f, 1.0f, 0.0f,	255, 255, 255,		0.5f, 1.0f };
 
-		floorModelMatrix = glm::mat4(1.0f);
-		floorModelMatrix = glm::translate(floorModelMatrix, glm::vec3(0.0f, 40.0f, -50.0f));
-		floorModelMatrix = glm::scale(floorModelMatrix, glm::vec3(100.0f, 50.0f, 150.0f));
-		floorModelMatrix = glm::rotate(floorModelMatrix, glm::radians(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-        
-		viewMatrix = glm::lookAt(cameraPosition, cameraPosition + cameraFront, cameraUp);
-		projectionMatrix = glm::perspective(glm::radians(fov), windowWidth / windowHeight, 0.1f, 500.0f);
-		finalMatrix = projectionMatrix * viewMatrix * floorModelMatrix;
+	// front
+	pyramidVertices[12] = { -1.0f, 0.0f, -1.0f,	255, 255, 255,		0.0f, 0.0f };
+	pyramidVertices[13] = { 1.0f, 0.0f, -1.0f,	255, 255, 255,		1.0f, 0.0f };
+	pyramidVertices[14] = { 0.0f, 1.0f, 0.0f,	255, 255, 255,		0.5f, 1.0f };
 
-		matUniformLocation = glGetUniformLocation(mainProgram, "mat");
-		glUniformMatrix4fv(matUniformLocation, 1, GL_FALSE, glm::value_ptr(finalMatrix));
+	// left
+	pyramidVertices[15] = { -1.0f, 0.0f, 1.0f,	255, 255, 255,		0.0f, 0.0f };
+	pyramidVertices[16] = { -1.0f, 0.0f, -1.0f,	255, 255, 255,		1.0f, 0.0f };
+	pyramidVertices[17] = { 0.0f, 1.0f, 0.0f,	255, 255, 255,		0.5f, 1.0f };
+    
+    // Loop to calculate normal vertices per face
+    for( int i=0; i < (sizeof(pyramidVertices)/sizeof(pyramidVertices[0])); i+=6 )
+    {
+        glm::vec3 v1( pyramidVertices[i].x, pyramidVertices[i].y, pyramidVertices[i].z );
+        glm::vec3 v2( pyramidVertices[i+1].x, pyramidVertices[i+1].y, pyramidVertices[i+1].z );
+        glm::vec3 v3( pyramidVertices[i+2].x, pyramidVertices[i+2].y, pyramidVertices[i+2].z );
         
-        modelUniformLocation = glGetUniformLocation(mainProgram, "model");
-        glUniformMatrix4fv(modelUniformLocation, 1, GL_FALSE, glm::value_ptr(floorModelMatrix));
+        glm::vec3 a;
+        a.x = v2.x - v1.x;
+        a.y = v2.y - v1.y;
+        a.z = v2.z - v1.z;
         
-		glDrawArrays(GL_TRIANGLES, 0, 6);
+        glm::vec3 b;
+        b.x = v3.x - v1.x;
+        b.y = v3.y - v1.y;
+        b.z = v3.z - v1.z;
         
-
-		// MIDDLE PYRAMID
-
-		glBindVertexArray(vaoPyramid);
-		glBindTexture(GL_TEXTURE_2D, pyramidTex);
-
-		pyramidMiddleModelMatrix = glm::mat4(1.0f);
-        pyramidMiddleModelMatrix = glm::translate(pyramidMiddleModelMatrix, glm::vec3(0.0f, -10.0f, -80.0f));
-        pyramidMiddleModelMatrix = glm::scale(pyramidMiddleModelMatrix, glm::vec3(30.0f, 40.0f, 30.0f));
+        glm::vec3 crossProd( glm::cross(b, a) );
         
-		finalMatrix = projectionMatrix * viewMatrix * pyramidMiddleModelMatrix;
+        for( int j=i; j < (i+6); j+=1 )
+        {
+            pyramidVertices[j].nx = crossProd.x;
+            pyramidVertices[j].ny = crossProd.y;
+            pyramidVertices[j].nz = crossProd.z;
+        }
+    }
 
-		matUniformLocation = glGetUniformLocation(mainProgram, "mat");
-		glUniformMatrix4fv(matUniformLocation, 1, GL_FALSE, glm::value_ptr(finalMatrix));
-		glDrawArrays(GL_TRIANGLES, 0, 18);
-        
+    
+    Vertex hexVertices[52];
 
-		// LEFT PYRAMID
+    // front hexagon
+    hexVertices[0] = { 0.0f, 0.0f, 0.0f,	255, 255, 255,		0.5f, 0.5f };
+    hexVertices[1] = { 0.5f, 1.0f, 0.0f,	255, 255, 255,		0.75f, 1.0f };
+    hexVertices[2] = { 1.0f, 0.0f, 0.0f,	255, 255, 255,		1.0f, 0.5f };
+    hexVertices[3] = { 0.5f, -1.0f, 0.0f,	255, 255, 255,		0.75f, 0.0f };
+    hexVertices[4] = { -0.5f, -1.0f, 0.0f,	255, 255, 255,		0.25f, 0.0f };
+    hexVertices[5] = { -1.0f, 0.0f, 0.0f,	255, 255, 255,		0.0f, 0.5f };
+    hexVertices[6] = { -0.5f, 1.0f, 0.0f,	255, 255, 255,		0.25f, 1.0f };
+    hexVertices[7] = { 0.5f, 1.0f, 0.0f,	255, 255, 255,		0.75f, 1.0f };
 
-         glBindVertexArray(vaoPyramid);
-         glBindTexture(GL_TEXTURE_2D, pyramidTex);
+    // back hexagon
+    hexVertices[8] = { 0.0f, 0.0f, 2.0f,	255, 255, 255,		0.5f, 0.5f };
+    hexVertices[9] = { 0.5f, 1.0f, 2.0f,	255, 255, 255,		0.75f, 1.0f };
+    hexVertices[10] = { 1.0f, 0.0f, 2.0f,	255, 255, 255,		1.0f, 0.5f };
+    hexVertices[11] = { 0.5f, -1.0f, 2.0f,	255, 255, 255,		0.75f, 0.0f };
+    hexVertices[12] = { -0.5f, -1.0f, 2.0f,	255, 255, 255,		0.25f, 0.0f };
+    hexVertices[13] = { -1.0f, 0.0f, 2.0f,	255, 255, 255,		0.0f, 0.5f };
+    hexVertices[14] = { -0.5f, 1.0f, 2.0f,	255, 255, 255,		0.25f, 1.0f };
+    hexVertices[15] = { 0.5f, 1.0f, 2.0f,	255, 255, 255,		0.75f, 1.0f };
 
-         pyramidLeftModelMatrix = glm::mat4(1.0f);
-         pyramidLeftModelMatrix = glm::translate(pyramidLeftModelMatrix, glm::vec3(-40.0f, -10.0f, -150.0f));
-         pyramidLeftModelMatrix = glm::scale(pyramidLeftModelMatrix, glm::vec3(30.0f, 40.0f, 30.0f));
-         
-         finalMatrix = projectionMatrix * viewMatrix * pyramidLeftModelMatrix;
+    // top right
+    hexVertices[16] = { 1.0f, 0.0f, 0.0f,	255, 255, 255,		1.0f, 0.25f };
+    hexVertices[17] = { 0.5f, 1.0f, 2.0f,	255, 255, 255,		0.0f, 0.75f };
+    hexVertices[18] = { 0.5f, 1.0f, 0.0f,	255, 255, 255,		1.0f, 0.75f };
+    hexVertices[19] = { 1.0f, 0.0f, 0.0f,	255, 255, 255,		1.0f, 0.25f };
+    hexVertices[20] = { 0.5f, 1.0f, 2.0f,	255, 255, 255,		0.0f, 0.75f };
+    hexVertices[21] = { 1.0f, 0.0f, 2.0f,	255, 255, 255,		0.0f, 0.25f };
 
-         matUniformLocation = glGetUniformLocation(mainProgram, "mat");
-         glUniformMatrix4fv(matUniformLocation, 1, GL_FALSE, glm::value_ptr(finalMatrix));
-         glDrawArrays(GL_TRIANGLES, 0, 18);
-        
-        
-        // RIGHT PYRAMID
+    // top
+    hexVertices[22] = { 0.5f, 1.0f, 2.0f,	255, 255, 255,		0.25f, 0.15f };
+    hexVertices[23] = { -0.5f, 1.0f, 0.0f,	255, 255, 255,		0.25f, 0.15f };
+    hexVertices[24] = { 0.5f, 1.0f, 0.0f,	255, 255, 255,		0.25f, 0.15f };
+    hexVertices[25] = { -0.5f, 1.0f, 0.0f,	255, 255, 255,		0.25f, 0.15f };
+    hexVertices[26] = { -0.5f, 1.0f, 2.0f,	255, 255, 255,		0.25f, 0.15f };
+    hexVertices[27] = { 0.5f, 1.0f, 2.0f,	255, 255, 255,		0.25f, 0.15f };
 
-         glBindVertexArray(vaoPyramid);
-         glBindTexture(GL_TEXTURE_2D, pyramidTex);
+    // top left
+    hexVertices[28] = { -1.0f, 0.0f, 2.0f,	255, 255, 255,		1.0f, 0.25f };
+    hexVertices[29] = { -0.5f, 1.0f, 0.0f,	255, 255, 255,		0.0f, 0.75f };
+    hexVertices[30] = { -0.5f, 1.0f, 2.0f,	255, 255, 255,		1.0f, 0.75f };
+    hexVertices[31] = { -1.0f, 0.0f, 2.0f,	255, 255, 255,		1.0f, 0.25f };
+    hexVertices[32] = { -0.5f, 1.0f, 0.0f,	255, 255, 255,		0.0f, 0.75f };
+    hexVertices[33] = { -1.0f, 0.0f, 0.0f,	255, 255, 255,		0.0f, 0.25f };
 
-         pyramidRightModelMatrix = glm::mat4(1.0f);
-         pyramidRightModelMatrix = glm::translate(pyramidRightModelMatrix, glm::vec3(40.0f, -10.0f, -150.0f));
-         pyramidRightModelMatrix = glm::scale(pyramidRightModelMatrix, glm::vec3(30.0f, 40.0f, 30.0f));
-         
-         finalMatrix = projectionMatrix * viewMatrix * pyramidRightModelMatrix;
+    // bottom left
+    hexVertices[34] = { -0.5f, -1.0f, 2.0f,	255, 255, 255,		0.25f, 0.15f }; // bottom right
+    hexVertices[35] = { -1.0f, 0.0f, 0.0f,	255, 255, 255,		0.25f, 0.15f }; // top left
+    hexVertices[36] = { -1.0f, 0.0f, 2.0f,	255, 255, 255,		0.25f, 0.15f }; // top right
+    hexVertices[37] = { -0.5f, -1.0f, 2.0f,	255, 255, 255,		0.25f, 0.15f }; // bottom right
+    hexVertices[38] = { -1.0f, 0.0f, 0.0f,	255, 255, 255,		0.25f, 0.15f }; // top left
+    hexVertices[39] = { -0.5f, -1.0f, 0.0f,	255, 255, 255,		0.25f, 0.15f }; // bottom left
 
-         matUniformLocation = glGetUniformLocation(mainProgram, "mat");
-         glUniformMatrix4fv(matUniformLocation, 1, GL_FALSE, glm::value_ptr(finalMatrix));
-         glDrawArrays(GL_TRIANGLES, 0, 18);
+    // bottom
+    hexVertices[40] = { 0.5f, -1.0f, 2.0f,	255, 255, 255,		1.0f, 0.75f }; // bottom right
+    hexVertices[41] = { -0.5f, -1.0f, 0.0f,	255, 255, 255,		0.0f, 0.25f }; // top left
+    hexVertices[42] = { 0.5f, -1.0f, 0.0f,	255, 255, 255,		0.0f, 0.75f }; // top right
+    hexVertices[43] = { -0.5f, -1.0f, 0.0f,	255, 255, 255,		0.0f, 0.25f };
+    hexVertices[44] = { -0.5f, -1.0f, 2.0f,	255, 255, 255,		1.0f, 0.25f };
+    hexVertices[45] = { 0.5f, -1.0f, 2.0f,	255, 255, 255,		1.0f, 0.75f };
 
+    // bottom right
+    hexVertices[46] = { 0.5f, -1.0f, 0.0f,	255, 255, 255,		0.25f, 0.15f }; // bottom right
+    hexVertices[47] = { 1.0f, 0.0f, 2.0f,	255, 255, 255,		0.25f, 0.15f }; // top left
+    hexVertices[48] = { 1.0f, 0.0f, 0.0f,	255, 255, 255,		0.25f, 0.15f }; // top right
+    hexVertices[49] = { 0.5f, -1.0f, 0.0f,	255, 255, 255,		0.25f, 0.15f };
+    hexVertices[50] = { 1.0f, 0.0f, 2.0f,	255, 255, 255,		0.25f, 0.15f };
+    hexVertices[51] = { 0.5f, -1.0f, 2.0f,	255, 255, 255,		0.25f, 0.15f };
+    
+    // Loop to calculate normal vertices per face
+    for( int i=0; i < (sizeof(hexVertices)/sizeof(hexVertices[0])); i+=6 )
+    {
+        glm::vec3 v1( hexVertices[i].x, hexVertices[i].y, hexVertices[i].z );
+        glm::vec3 v2( hexVertices[i+1].x, hexVertices[i+1].y, hexVertices[i+1].z );
+        glm::vec3 v3( hexVertices[i+2].x, hexVertices[i+2].y, hexVertices[i+2].z );
         
-         // LEFT SHORT PILLAR 1
-
-         glBindVertexArray(vaoHex);
-         glBindTexture(GL_TEXTURE_2D, pillarTex);
-
-         pillarModelMatrix = glm::mat4(1.0f);
-         pillarModelMatrix = glm::translate(pillarModelMatrix, glm::vec3(-30.0f, 10.0f, 0.0f));
-         pillarModelMatrix = glm::scale(pillarModelMatrix, glm::vec3(2.0f, 10.0f, 2.0f));
-         pillarModelMatrix = glm::rotate(pillarModelMatrix, glm::radians(90.0f), glm::vec3(1.0f, 0.0f, 0.0f));
-
-         finalMatrix = projectionMatrix * viewMatrix * pillarModelMatrix;
-
-         matUniformLocation = glGetUniformLocation(mainProgram, "mat");
-         glUniformMatrix4fv(matUniformLocation, 1, GL_FALSE, glm::value_ptr(finalMatrix));
-
-         glDrawArrays(GL_TRIANGLE_FAN, 0, 8);
-         glDrawArrays(GL_TRIANGLE_FAN, 8, 8);
-         glDrawArrays(GL_TRIANGLES, 16, 36);
-
+        glm::vec3 a;
+        a.x = v2.x - v1.x;
+        a.y = v2.y - v1.y;
+        a.z = v2.z - v1.z;
         
-         // LEFT SHORT PILLAR 2
-
-         pillarModelMatrix = glm::mat4(1.0f);
-         pillarModelMatrix = glm::translate(pillarModelMatrix, glm::vec3(-50.0f, 10.0f, 0.0f));
-         pillarModelMatrix = glm::scale(pillarModelMatrix, glm::vec3(2.0f, 10.0f, 2.0f));
-         pillarModelMatrix = glm::rotate(pillarModelMatrix, glm::radians(90.0f), glm::vec3(1.0f, 0.0f, 0.0f));
-
-         finalMatrix = projectionMatrix * viewMatrix * pillarModelMatrix;
-
-         matUniformLocation = glGetUniformLocation(mainProgram, "mat");
-         glUniformMatrix4fv(matUniformLocation, 1, GL_FALSE, glm::value_ptr(finalMatrix));
-
-         glDrawArrays(GL_TRIANGLE_FAN, 0, 8);
-         glDrawArrays(GL_TRIANGLE_FAN, 8, 8);
-         glDrawArrays(GL_TRIANGLES, 16, 36);
-
+        glm::vec3 b;
+        b.x = v3.x - v1.x;
+        b.y = v3.y - v1.y;
+        b.z = v3.z - v1.z;
         
-         // LEFT SHORT PILLAR 3
-
-         pillarModelMatrix = glm::mat4(1.0f);
-         pillarModelMatrix = glm::translate(pillarModelMatrix, glm::vec3(-70.0f, 10.0f, 0.0f));
-         pillarModelMatrix = glm::scale(pillarModelMatrix, glm::vec3(2.0f, 10.0f, 2.0f));
-         pillarModelMatrix = glm::rotate(pillarModelMatrix, glm::radians(90.0f), glm::vec3(1.0f, 0.0f, 0.0f));
-
-         finalMatrix = projectionMatrix * viewMatrix * pillarModelMatrix;
-
-         matUniformLocation = glGetUniformLocation(mainProgram, "mat");
-         glUniformMatrix4fv(matUniformLocation, 1, GL_FALSE, glm::value_ptr(finalMatrix));
-
-         glDrawArrays(GL_TRIANGLE_FAN, 0, 8);
-         glDrawArrays(GL_TRIANGLE_FAN, 8, 8);
-         glDrawArrays(GL_TRIANGLES, 16, 36);
-
+        glm::vec3 crossProd( glm::cross(b, a) );
         
-         // RIGHT SHORT PILLAR 1
-
-         pillarModelMatrix = glm::mat4(1.0f);
-         pillarModelMatrix = glm::translate(pillarModelMatrix, glm::vec3(30.0f, 10.0f, 0.0f));
-         pillarModelMatrix = glm::scale(pillarModelMatrix, glm::vec3(2.0f, 10.0f, 2.0f));
-         pillarModelMatrix = glm::rotate(pillarModelMatrix, glm::radians(90.0f), glm::vec3(1.0f, 0.0f, 0.0f));
+        for( int j=i; j < (i+6); j+=1 )
+        {
+            hexVertices[j].nx = crossProd.x;
+            hexVertices[j].ny = crossProd.y;
+            hexVertices[j].nz = crossProd.z;
+        }
+    }
 
-         finalMatrix = projectionMatrix * viewMatrix * pillarModelMatrix;
+    
+    
+    // --- SETTING UP OF VBOs ---
 
-         matUniformLocation = glGetUniformLocation(mainProgram, "mat");
-         glUniformMatrix4fv(matUniformLocation, 1, GL_FALSE, glm::value_ptr(finalMatrix));
+    // The caps of the hexagonal prism are triangle fans; unroll them into plain triangles
+    // so that the whole prism can be drawn with a single draw call
+    std::vector<Vertex> hexTriangleVertices;
+    for (int cap = 0; cap < 2; ++cap)
+    {
+        const Vertex* fan = hexVertices + cap * 8;
+        for (int i = 1; i < 7; ++i)
+        {
+            hexTriangleVertices.push_back(fan[0]);
+            hexTriangleVertices.push_back(fan[i]);
+            hexTriangleVertices.push_back(fan[i + 1]);
+        }
+    }
+    hexTriangleVertices.insert(hexTriangleVertices.end(), hexVertices + 16, hexVertices + 52);
+
+    // Create indexed meshes, and upload our vertices data to them.
+    // The vertex array objects are created per instance batch, once the textures are loaded.
+    // Packed vertices use half-float UVs and 10-bit normals; set to false to upload the plain Vertex layout.
+    const bool packVertices = true;
+
+    std::unordered_map<std::string, Mesh> meshes;
+    meshes["floor"] = CreateMesh(floorVertices, 6, packVertices);
+    meshes["cube"] = CreateMesh(cubeVertices, 36, packVertices);
+    meshes["pyramid"] = CreateMesh(pyramidVertices, 18, packVertices);
+    meshes["hex"] = CreateMesh(hexTriangleVertices.data(), hexTriangleVertices.size(), packVertices);
+    
+    
+    
+    // FRAME BUFFER OBJECTS
 
-         glDrawArrays(GL_TRIANGLE_FAN, 0, 8);
-         glDrawArrays(GL_TRIANGLE_FAN, 8, 8);
-         glDrawArrays(GL_TRIANGLES, 16, 36);
+    // Cascaded shadow maps: change the count (up to ShadowCascades::maxCascades), resolution, depth format and
+    // PCF kernel here
+    ShadowCascades shadowCascades;
+    shadowCascades.count = 3;
+    shadowCascades.resolution = 1024;
+    shadowCascades.depthFormat = GL_DEPTH_COMPONENT24;
+    shadowCascades.pcfRadius = 1;
+    shadowCascades.CreateTextures();
 
-        
-         // RIGHT SHORT PILLAR 2
 
-         pillarModelMatrix = glm::mat4(1.0f);
-         pillarModelMatrix = glm::translate(pillarModelMatrix, glm::vec3(50.0f, 10.0f, 0.0f));
-         pillarModelMatrix = glm::scale(pillarModelMatrix, glm::vec3(2.0f, 10.0f, 2.0f));
-         pillarModelMatrix = glm::rotate(pillarModelMatrix, glm::radians(90.0f), glm::vec3(1.0f, 0.0f, 0.0f));
+    
+	// Create the shader programs. The deferred path draws the scene into a G-buffer and lights it in one
+	// full-screen pass; the forward path lights every fragment as it is drawn. Both shade with lighting.glsl.
+	const bool deferredShading = true;
+
+	// Programs come from their binary cache when it is up to date; the others compile in parallel.
+	ShaderProgram mainProgram;
+    ShaderProgram gBufferProgram;
+    ShaderProgram deferredProgram;
+    ShaderProgram depthProgram;
+    ProgramCache programCache;
+    programCache.Initialize();
+    programCache.Add(mainProgram, "main.vsh", "main.fsh");
+    programCache.Add(gBufferProgram, "main.vsh", "gbuffer.fsh");
+    programCache.Add(deferredProgram, "deferred.vsh", "deferred.fsh");
+    programCache.Add(depthProgram, "depth.vsh", "depth.fsh");
+    if (!programCache.Load(window))
+    {
+        std::cerr << "Failed to build the shader programs!" << std::endl;
+        glfwTerminate();
+        return 1;
+    }
 
-         finalMatrix = projectionMatrix * viewMatrix * pillarModelMatrix;
+    // Uniform locations, looked up once instead of every frame
+    GLint depthLightSpaceMatrixUniformLocation = depthProgram.GetUniformLocation("lightSpaceMatrix");
 
-         matUniformLocation = glGetUniformLocation(mainProgram, "mat");
-         glUniformMatrix4fv(matUniformLocation, 1, GL_FALSE, glm::value_ptr(finalMatrix));
+    // The lighting parameters live in uniform buffers shared by all programs; only the samplers are plain uniforms.
+    // Texture units: 0 object texture or G-buffer color, 1 shadow cascades, 2 and 3 G-buffer normal and depth,
+    // 4 and 5 light clusters.
+    for (ShaderProgram* program : { &mainProgram, &gBufferProgram, &deferredProgram })
+    {
+        program->BindUniformBlock("FrameUniforms", FrameUniformsBinding);
+        program->BindUniformBlock("PointLights", PointLightsBinding);
+        program->Use();
+        program->SetUniform("tex", 0);
+        program->SetUniform("gAlbedo", 0);
+        program->SetUniform("shadowMap", 1);
+        program->SetUniform("gNormal", 2);
+        program->SetUniform("gDepth", 3);
+        program->SetUniform("clusterLights", 4);
+        program->SetUniform("lightIndices", 5);
+    }
 
-         glDrawArrays(GL_TRIANGLE_FAN, 0, 8);
-         glDrawArrays(GL_TRIANGLE_FAN, 8, 8);
-         glDrawArrays(GL_TRIANGLES, 16, 36);
+    // The full-screen triangle of the lighting pass has no vertex attributes, but core profile still needs a vertex array
+    GLuint fullScreenVao;
+    glGenVertexArrays(1, &fullScreenVao);
 
-        
-         // RIGHT SHORT PILLAR 3
+    GBuffer gBuffer;
 
-         pillarModelMatrix = glm::mat4(1.0f);
-         pillarModelMatrix = glm::translate(pillarModelMatrix, glm::vec3(70.0f, 10.0f, 0.0f));
-         pillarModelMatrix = glm::scale(pillarModelMatrix, glm::vec3(2.0f, 10.0f, 2.0f));
-         pillarModelMatrix = glm::rotate(pillarModelMatrix, glm::radians(90.0f), glm::vec3(1.0f, 0.0f, 0.0f));
+	// Tell OpenGL the dimensions of the region where stuff will be drawn.
+	// For now, tell OpenGL to use the whole screen
+    
+    // FOR WINDOWS
+	// glViewport(0, 0, windowWidth, windowHeight);
+    
+    // FOR MAC
+    // The framebuffer can be larger than the window (e.g. on high-DPI displays), so the callback keeps its own size
+    glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+    glViewport(0, 0, framebufferWidth, framebufferHeight);
+    
+    
+    
+    // --- SCENE ---
 
-         finalMatrix = projectionMatrix * viewMatrix * pillarModelMatrix;
+    // Textures and objects are described by the scene file; the meshes they refer to are the ones above
 
-         matUniformLocation = glGetUniformLocation(mainProgram, "mat");
-         glUniformMatrix4fv(matUniformLocation, 1, GL_FALSE, glm::value_ptr(finalMatrix));
+    // Textures are decoded in the background and appear as soon as they are uploaded
+    TextureManager textureManager;
+    textureManager.Initialize();
 
-         glDrawArrays(GL_TRIANGLE_FAN, 0, 8);
-         glDrawArrays(GL_TRIANGLE_FAN, 8, 8);
-         glDrawArrays(GL_TRIANGLES, 16, 36);
+    Scene scene;
+    if (!LoadScene("scene.txt", textureManager, scene))
+    {
+        glfwTerminate();
+        return -1;
+    }
 
-        
-         // LEFT TALL PILLAR 1
+    RenderQueue renderQueue = BuildRenderQueue(scene, meshes, deferredShading ? gBufferProgram.id : mainProgram.id);
 
-         pillarModelMatrix = glm::mat4(1.0f);
-         pillarModelMatrix = glm::translate(pillarModelMatrix, glm::vec3(-10.0f, 15.0f, 0.0f));
-         pillarModelMatrix = glm::scale(pillarModelMatrix, glm::vec3(2.0f, 15.0f, 2.0f));
-         pillarModelMatrix = glm::rotate(pillarModelMatrix, glm::radians(90.0f), glm::vec3(1.0f, 0.0f, 0.0f));
+    // Per-frame data (instance attributes and FrameUniforms) is streamed through a ring buffer
+    size_t streamAllocations = 0;
+    size_t streamBytes = renderQueue.StreamBytesPerFrame(ShadowCascades::maxCascades, streamAllocations);
+    StreamBuffer streamBuffer;
+    streamBuffer.Create(streamBytes + sizeof(FrameUniforms), streamAllocations + 1);
 
-         finalMatrix = projectionMatrix * viewMatrix * pillarModelMatrix;
+    LightClusters lightClusters;
+    lightClusters.Create();
+    lightClusters.SetLights(scene.lights);
 
-         matUniformLocation = glGetUniformLocation(mainProgram, "mat");
-         glUniformMatrix4fv(matUniformLocation, 1, GL_FALSE, glm::value_ptr(finalMatrix));
 
-         glDrawArrays(GL_TRIANGLE_FAN, 0, 8);
-         glDrawArrays(GL_TRIANGLE_FAN, 8, 8);
-         glDrawArrays(GL_TRIANGLES, 16, 36);
+	glEnable(GL_DEPTH_TEST);
 
-        
-         // RIGHT TALL PILLAR 1
+    CullingStats lastCullingStats;
 
-         pillarModelMatrix = glm::mat4(1.0f);
-         pillarModelMatrix = glm::translate(pillarModelMatrix, glm::vec3(10.0f, 15.0f, 0.0f));
-         pillarModelMatrix = glm::scale(pillarModelMatrix, glm::vec3(2.0f, 15.0f, 2.0f));
-         pillarModelMatrix = glm::rotate(pillarModelMatrix, glm::radians(90.0f), glm::vec3(1.0f, 0.0f, 0.0f));
+    // Frame timings and counters go to the overlay (toggled with P) and to profile.csv
+    FrameProfiler profiler;
+    profiler.Initialize("profile.csv");
 
-         finalMatrix = projectionMatrix * viewMatrix * pillarModelMatrix;
+    // Frames are pipelined: while the GL thread submits frame N, the worker prepares frame N + 1 from the input
+    // sampled at the start of frame N. The first frame is prepared before entering the loop.
+    // The benchmark replaces the camera and clock with its scripted path.
+    FramePacket packets[2];
+    int currentPacket = 0;
+    int preparedFrames = 0;
+    auto sampleFrameInput = [&]()
+    {
+        FrameInput input;
+        input.cameraPosition = cameraPosition;
+        input.cameraFront = cameraFront;
+        input.cameraUp = cameraUp;
+        input.fov = fov;
+        input.time = glfwGetTime();
+        if (benchmark.Active())
+        {
+            benchmark.SetFrameInput(preparedFrames, input);
+        }
+        ++preparedFrames;
 
-         matUniformLocation = glGetUniformLocation(mainProgram, "mat");
-         glUniformMatrix4fv(matUniformLocation, 1, GL_FALSE, glm::value_ptr(finalMatrix));
+        // A minimized window has an empty framebuffer; nothing is drawn then, but the packet must stay valid
+        input.framebufferWidth = std::max(framebufferWidth, 1);
+        input.framebufferHeight = std::max(framebufferHeight, 1);
+        input.aspect = float(input.framebufferWidth) / input.framebufferHeight;
+        return input;
+    };
+    PrepareFrame(sampleFrameInput(), scene, renderQueue, shadowCascades, lightClusters, packets[currentPacket]);
 
-         glDrawArrays(GL_TRIANGLE_FAN, 0, 8);
-         glDrawArrays(GL_TRIANGLE_FAN, 8, 8);
-         glDrawArrays(GL_TRIANGLES, 16, 36);
+    FrameWorker frameWorker;
+    frameWorker.Start();
 
-        
-         // CUBE ON TOP OF LEFT PILLARS
+    framePacing.Apply();
+    benchmark.lastSwap = std::chrono::steady_clock::now();
 
-         glBindVertexArray(vaoCube);
-         glBindTexture(GL_TEXTURE_2D, pillarTex);
+	// Render loop
+	while (!glfwWindowShouldClose(window))
+	{
+		// Nothing is drawn while the window is minimized
+		if (framebufferWidth == 0 || framebufferHeight == 0)
+		{
+			glfwWaitEvents();
+			continue;
+		}
 
-         cubeModelMatrix = glm::mat4(1.0f);
-         cubeModelMatrix = glm::translate(cubeModelMatrix, glm::vec3(-43.0f, 11.0f, 0.0f));
-         cubeModelMatrix = glm::scale(cubeModelMatrix, glm::vec3(31.0f, 1.0f, 2.1f));
+		framePacing.Wait();
 
-         finalMatrix = projectionMatrix * viewMatrix * cubeModelMatrix;
+		profiler.BeginFrame();
+		profiler.BeginSection(ProfileUpdate, false);
 
-         matUniformLocation = glGetUniformLocation(mainProgram, "mat");
-         glUniformMatrix4fv(matUniformLocation, 1, GL_FALSE, glm::value_ptr(finalMatrix));
-         glDrawArrays(GL_TRIANGLES, 0, 36);
+		// The previous frame's job prepared this frame's packet; the other packet is free again
+		frameWorker.Wait();
+		FramePacket& packet = packets[currentPacket];
+		FramePacket& nextPacket = packets[1 - currentPacket];
+		profiler.RecordCpuTime(ProfilePrepare, packet.prepareMilliseconds);
 
-        
-         // CUBE ON TOP OF RIGHT PILLARS
+		streamBuffer.BeginFrame();
 
-         glBindVertexArray(vaoCube);
-         glBindTexture(GL_TEXTURE_2D, pillarTex);
+		keyboardInput(window);
+		float time = glfwGetTime();
+		deltaTime = time - lastFrame;
+		lastFrame = time;
 
-         cubeModelMatrix = glm::mat4(1.0f);
-         cubeModelMatrix = glm::translate(cubeModelMatrix, glm::vec3(43.0f, 11.0f, 0.0f));
-         cubeModelMatrix = glm::scale(cubeModelMatrix, glm::vec3(31.0f, 1.0f, 2.1f));
+        // Start preparing the next frame
+        FrameInput nextInput = sampleFrameInput();
+        FramePacket* nextPacketPointer = &nextPacket;
+        frameWorker.Run([&, nextInput, nextPacketPointer]()
+        {
+            PrepareFrame(nextInput, scene, renderQueue, shadowCascades, lightClusters, *nextPacketPointer);
+        });
 
-         finalMatrix = projectionMatrix * viewMatrix * cubeModelMatrix;
+        // Upload the textures that finished loading
+        textureManager.Update();
 
-         matUniformLocation = glGetUniformLocation(mainProgram, "mat");
-         glUniformMatrix4fv(matUniformLocation, 1, GL_FALSE, glm::value_ptr(finalMatrix));
-         glDrawArrays(GL_TRIANGLES, 0, 36);
+        // Cascades and light clusters of the frame
+        std::copy(packet.lightSpaceMatrices, packet.lightSpaceMatrices + ShadowCascades::maxCascades, shadowCascades.lightSpaceMatrices);
+        std::copy(packet.cascadeSplits, packet.cascadeSplits + ShadowCascades::maxCascades, shadowCascades.splits);
+        lightClusters.Upload(packet.clusters);
 
+        profiler.EndSection(ProfileUpdate);
         
-         // CUBE ON TOP OF MIDDLE PILLARS
+        
+        // FIRST PASS
 
-         glBindVertexArray(vaoCube);
-         glBindTexture(GL_TEXTURE_2D, pillarTex);
+        profiler.BeginSection(ProfileShadowPass, true);
+        
+        depthProgram.Use();
 
-         cubeModelMatrix = glm::mat4(1.0f);
-         cubeModelMatrix = glm::translate(cubeModelMatrix, glm::vec3(0.0f, 15.0f, 0.0f));
-         cubeModelMatrix = glm::scale(cubeModelMatrix, glm::vec3(15.0f, 1.0f, 2.1f));
+        glViewport(0, 0, shadowCascades.resolution, shadowCascades.resolution);
 
-         finalMatrix = projectionMatrix * viewMatrix * cubeModelMatrix;
+        // Push the depth values away from the light to avoid shadow acne
+        glEnable(GL_POLYGON_OFFSET_FILL);
+        glPolygonOffset(2.0f, 4.0f);
 
-         matUniformLocation = glGetUniformLocation(mainProgram, "mat");
-         glUniformMatrix4fv(matUniformLocation, 1, GL_FALSE, glm::value_ptr(finalMatrix));
-         glDrawArrays(GL_TRIANGLES, 0, 36);
+        // Static casters are rendered into a cached layer only when the cascade's light-space matrix changed;
+        // the sampled layer is the cached one with the dynamic casters drawn on top.
+        // A cascade where nothing changed is not touched at all.
+        for (int cascade = 0; cascade < shadowCascades.count; ++cascade)
+        {
+            depthProgram.SetUniform(depthLightSpaceMatrixUniformLocation, shadowCascades.lightSpaceMatrices[cascade]);
+
+            bool staticLayerChanged = shadowCascades.StaticLayerNeedsUpdate(cascade);
+            if (staticLayerChanged)
+            {
+                // Only depth is written, so the batches are drawn without binding their textures,
+                // and only the instances inside the cascade's light volume (culled by PrepareFrame) are drawn
+                shadowCascades.BeginStaticLayer(cascade);
+                renderQueue.UploadDepth(cascade, packet.batches, false, streamBuffer);
+                renderQueue.DrawDepth(cascade, false);
+            }
+
+            size_t dynamicCasterCount = renderQueue.UploadDepth(cascade, packet.batches, true, streamBuffer);
+            if (staticLayerChanged || dynamicCasterCount > 0 || shadowCascades.layerHasDynamicCasters[cascade])
+            {
+                shadowCascades.BeginFinalLayer(cascade, dynamicCasterCount > 0);
+                renderQueue.DrawDepth(cascade, true);
+            }
+        }
 
+        glDisable(GL_POLYGON_OFFSET_FILL);
 
-         // ROTATING CUBE
+        profiler.EndSection(ProfileShadowPass);
+        
+        
+        
+        // SECOND PASS
 
-         glBindVertexArray(vaoCube);
-         glBindTexture(GL_TEXTURE_2D, cubeTex);
+        profiler.BeginSection(ProfileMainPass, true);
+        
+        // The size the frame was prepared for, which may lag a resize by a frame
+        int viewportWidth = packet.input.framebufferWidth;
+        int viewportHeight = packet.input.framebufferHeight;
+        glViewport(0, 0, viewportWidth, viewportHeight);
+
+        // Every per-frame parameter is uploaded at once into the FrameUniforms buffer
+        GLintptr frameUniformsOffset = streamBuffer.Write(&packet.uniforms, sizeof(FrameUniforms));
+        glBindBufferRange(GL_UNIFORM_BUFFER, FrameUniformsBinding, streamBuffer.buffer, frameUniformsOffset, sizeof(FrameUniforms));
+
+        // The shadow cascades are bound to texture unit 1 and the light clusters to units 4 and 5
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, shadowCascades.depthTexture);
+        lightClusters.Bind(GL_TEXTURE4, GL_TEXTURE5);
+
+        // Upload the instances inside the camera frustum, and show the culling counts in the window title when they change
+        renderQueue.Upload(packet.batches, streamBuffer);
+        const CullingStats& cullingStats = packet.cullingStats;
+        if (cullingStats != lastCullingStats)
+        {
+            std::string title = "Final Project - objects drawn: " + std::to_string(cullingStats.drawnObjects) +
+                ", culled: " + std::to_string(cullingStats.culledObjects) +
+                " (draw calls: " + std::to_string(cullingStats.drawCalls) + ", culled: " + std::to_string(cullingStats.culledDrawCalls) + ")";
+            glfwSetWindowTitle(window, title.c_str());
+            lastCullingStats = cullingStats;
+        }
 
-         cubeModelMatrix = glm::mat4(1.0f);
-         cubeModelMatrix = glm::translate(cubeModelMatrix, glm::vec3(0.0f, 0.0f, 50.0f));
-         cubeModelMatrix = glm::scale(cubeModelMatrix, glm::vec3(5.0f, 5.0f, 5.1f));
-         cubeModelMatrix = glm::rotate(cubeModelMatrix, glm::radians(60.0f * time), glm::vec3(1.0f, 1.0f, 1.0f));
+        // Draw into the G-buffer, or straight to the screen for the forward path
+        if (deferredShading)
+        {
+            gBuffer.Resize(viewportWidth, viewportHeight);
+            glBindFramebuffer(GL_FRAMEBUFFER, gBuffer.framebuffer);
+        }
+        else
+        {
+            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        }
 
-         finalMatrix = projectionMatrix * viewMatrix * cubeModelMatrix;
+        // Clear the color and depth buffer
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        
+        // Bind the textures to texture unit 0
+        glActiveTexture(GL_TEXTURE0);
 
-         matUniformLocation = glGetUniformLocation(mainProgram, "mat");
-         glUniformMatrix4fv(matUniformLocation, 1, GL_FALSE, glm::value_ptr(finalMatrix));
-         glDrawArrays(GL_TRIANGLES, 0, 36);
+        renderQueue.Draw();
 
-		/*// Moving Pyramid
+        profiler.EndSection(ProfileMainPass);
 
-		glm::mat4 pyramid3ModelMatrix = glm::mat4(1.0f);
-		pyramid3ModelMatrix = glm::translate(pyramid3ModelMatrix, glm::vec3(0.0f, -6.0f, -5.0f));
-		pyramid3ModelMatrix = glm::scale(pyramid3ModelMatrix, glm::vec3(2.5f, 2.5f, 2.5f));
-		pyramid3ModelMatrix = glm::rotate(pyramid3ModelMatrix, glm::radians(45.0f * time), glm::vec3(0.0f, 1.0f, 0.0f));
-		finalMatrix = projectionMatrix * viewMatrix * pyramid3ModelMatrix;
+        // Deferred lighting: one full-screen triangle shading every covered pixel with the lights of its cluster
+        if (deferredShading)
+        {
+            ScopedProfilerSection lightingSection(profiler, ProfileLightingPass, true);
 
-		matUniformLocation = glGetUniformLocation(program, "mat");
-		glUniformMatrix4fv(matUniformLocation, 1, GL_FALSE, glm::value_ptr(finalMatrix));
-		//glDrawArrays(GL_TRIANGLES, 0, 18);*/
-		
+            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            glDisable(GL_DEPTH_TEST);
 
-		/*// Moving Hexagonal Prism
-		
-		glBindVertexArray(vaoHex);
-		glBindTexture(GL_TEXTURE_2D, tex2);
+            deferredProgram.Use();
+            gBuffer.BindTextures();
+            glBindVertexArray(fullScreenVao);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+            glBindVertexArray(0);
+            ++renderCounters.drawCalls;
 
-		glm::mat4 hexModelMatrix = glm::mat4(1.0f);
-		hexModelMatrix = glm::translate(hexModelMatrix, glm::vec3(5.0f, 0.0f, -7.0f));
-		hexModelMatrix = glm::scale(hexModelMatrix, glm::vec3(2.0f, 2.0f, 2.0f));
-		hexModelMatrix = glm::rotate(hexModelMatrix, glm::radians(50.0f * time), glm::vec3(1.0f, 1.0f, 1.0f));
-		finalMatrix = projectionMatrix * viewMatrix * hexModelMatrix;
+            glActiveTexture(GL_TEXTURE0);
+            glEnable(GL_DEPTH_TEST);
+        }
 
-		matUniformLocation = glGetUniformLocation(program, "mat");
-		glUniformMatrix4fv(matUniformLocation, 1, GL_FALSE, glm::value_ptr(finalMatrix));
+        if (showProfilerOverlay)
+        {
+            ScopedProfilerSection overlaySection(profiler, ProfileOverlay, true);
+            DrawProfilerOverlay(profiler, viewportHeight);
+        }
 
-		glDrawArrays(GL_TRIANGLE_FAN, 0, 8);
-		glDrawArrays(GL_TRIANGLE_FAN, 8, 8);
-		glDrawArrays(GL_TRIANGLES, 16, 36);
+		// The GPU is done with this frame's stream buffer segment once it passes this point
+		streamBuffer.EndFrame();
 
-		// Static Hexagonal Prism
+		{
+			ScopedProfilerSection swapSection(profiler, ProfileSwap, false);
 
-		glm::mat4 hex2ModelMatrix = glm::mat4(1.0f);
-		hex2ModelMatrix = glm::translate(hex2ModelMatrix, glm::vec3(0.0f, -6.0f, -5.0f));
-		//hex2ModelMatrix = glm::scale(hex2ModelMatrix, glm::vec3(2.0f, 2.0f, 2.0f));
-		//hex2ModelMatrix = glm::rotate(hex2ModelMatrix, glm::radians(90.0f), glm::vec3(1.0f, 0.0f, 0.0f));
-		finalMatrix = projectionMatrix * viewMatrix * hex2ModelMatrix;
+			// Tell GLFW to swap the screen buffer with the offscreen buffer
+			glfwSwapBuffers(window);
 
-		matUniformLocation = glGetUniformLocation(program, "mat");
-		glUniformMatrix4fv(matUniformLocation, 1, GL_FALSE, glm::value_ptr(finalMatrix));
-		
-		glDrawArrays(GL_TRIANGLE_FAN, 0, 8);
-		glDrawArrays(GL_TRIANGLE_FAN, 8, 8);
-		glDrawArrays(GL_TRIANGLES, 16, 36);*/
+			// Tell GLFW to process window events (e.g., input events, window closed events, etc.)
+			glfwPollEvents();
+		}
 
-		// "Unuse" the vertex array object
-		glBindVertexArray(0);
+		profiler.EndFrame();
+		currentPacket = 1 - currentPacket;
 
-		// Tell GLFW to swap the screen buffer with the offscreen buffer
-		glfwSwapBuffers(window);
+		if (benchmark.Active())
+		{
+			benchmark.EndFrame();
+			if (benchmark.Finished())
+			{
+				glfwSetWindowShouldClose(window, GLFW_TRUE);
+			}
+		}
+	}
 
-		// Tell GLFW to process window events (e.g., input events, window closed events, etc.)
-		glfwPollEvents();
+	if (benchmark.Active())
+	{
+		benchmark.Report();
 	}
 
+
 	// --- Cleanup ---
 
+	// The worker may still be preparing a frame that will never be drawn
+	frameWorker.Stop();
+
+	profiler.Destroy();
+
 	// Make sure to delete the shader program
-	glDeleteProgram(mainProgram);
+	glDeleteProgram(mainProgram.id);
+	glDeleteProgram(gBufferProgram.id);
+	glDeleteProgram(deferredProgram.id);
+	glDeleteProgram(depthProgram.id);
+
+	streamBuffer.Destroy();
+	glDeleteVertexArrays(1, &fullScreenVao);
+	gBuffer.Destroy();
+	lightClusters.Destroy();
+
+	// Delete the buffers that contain our vertices and indices
+    for (const auto& mesh : meshes)
+    {
+        glDeleteBuffers(1, &mesh.second.vbo);
+        glDeleteBuffers(1, &mesh.second.ebo);
+    }
 
-	// Delete the VBO that contains our vertices
-    glDeleteBuffers(1, &vboFloor);
-	glDeleteBuffers(1, &vboPyramid);
-    //glDeleteBuffers(1, &vboCube);
-	glDeleteBuffers(1, &vboHex);
+	// Delete the vertex array objects
+    for (InstanceBatch& batch : renderQueue.batches)
+    {
+        glDeleteVertexArrays(1, &batch.vao);
+        for (DepthView& view : batch.depthViews)
+        {
+            glDeleteVertexArrays(1, &view.vao);
+        }
+    }
 
-	// Delete the vertex array object
-    glDeleteVertexArrays(1, &vboFloor);
-	glDeleteVertexArrays(1, &vaoPyramid);
-    //glDeleteVertexArrays(1, &vaoCube);
-	glDeleteVertexArrays(1, &vaoHex);
+	// Delete the textures
+    shadowCascades.Destroy();
+    textureManager.Destroy();
+    for (const auto& texture : scene.textures)
+    {
+        glDeleteTextures(1, &texture.second);
+    }
 
 	// Remember to tell GLFW to clean itself up before exiting the application
 	glfwTerminate();
@@ -1562,6 +3564,25 @@ void keyboardInput(GLFWwindow* window)
 	{
 		cameraPosition += glm::normalize(glm::cross(cameraFront, cameraUp)) * speed;
 	}
+
+	// P toggles the profiler overlay
+	static bool profilerKeyWasPressed = false;
+	bool profilerKeyPressed = glfwGetKey(window, GLFW_KEY_P) == GLFW_PRESS;
+	if (profilerKeyPressed && !profilerKeyWasPressed)
+	{
+		showProfilerOverlay = !showProfilerOverlay;
+	}
+	profilerKeyWasPressed = profilerKeyPressed;
+
+	// V toggles vsync
+	static bool vsyncKeyWasPressed = false;
+	bool vsyncKeyPressed = glfwGetKey(window, GLFW_KEY_V) == GLFW_PRESS;
+	if (vsyncKeyPressed && !vsyncKeyWasPressed)
+	{
+		framePacing.vsync = !framePacing.vsync;
+		framePacing.Apply();
+	}
+	vsyncKeyWasPressed = vsyncKeyPressed;
 }
 
 void mouse_callback(GLFWwindow* window, double xpos, double ypos)
@@ -1598,64 +3619,53 @@ void mouse_callback(GLFWwindow* window, double xpos, double ypos)
 }
 
 /// <summary>
-/// Creates a shader program based on the provided file paths for the vertex and fragment shaders.
+/// Reads a shader source file, replacing every #include "file" line by the contents of that file
+/// (relative to the including file). Each file is included at most once per shader.
 /// </summary>
-/// <param name="vertexShaderFilePath">Vertex shader file path</param>
-/// <param name="fragmentShaderFilePath">Fragment shader file path</param>
-/// <returns>OpenGL handle to the created shader program</returns>
-GLuint CreateShaderProgram(const std::string& vertexShaderFilePath, const std::string& fragmentShaderFilePath)
+/// <param name="shaderFilePath">Path to the file containing the shader source</param>
+/// <param name="shaderSource">String the source is appended to</param>
+/// <param name="includedFiles">Files already part of the shader</param>
+/// <returns>True if the file and everything it includes could be read</returns>
+bool LoadShaderSource(const std::string& shaderFilePath, std::string& shaderSource, std::vector<std::string>& includedFiles)
 {
-	GLuint vertexShader = CreateShaderFromFile(GL_VERTEX_SHADER, vertexShaderFilePath);
-	GLuint fragmentShader = CreateShaderFromFile(GL_FRAGMENT_SHADER, fragmentShaderFilePath);
-
-	GLuint program = glCreateProgram();
-	glAttachShader(program, vertexShader);
-	glAttachShader(program, fragmentShader);
-
-	glLinkProgram(program);
-
-	glDetachShader(program, vertexShader);
-	glDeleteShader(vertexShader);
-	glDetachShader(program, fragmentShader);
-	glDeleteShader(fragmentShader);
-
-	// Check shader program link status
-	GLint linkStatus;
-	glGetProgramiv(program, GL_LINK_STATUS, &linkStatus);
-	if (linkStatus != GL_TRUE) {
-		char infoLog[512];
-		GLsizei infoLogLen = sizeof(infoLog);
-		glGetProgramInfoLog(program, infoLogLen, &infoLogLen, infoLog);
-		std::cerr << "program link error: " << infoLog << std::endl;
+	if (std::find(includedFiles.begin(), includedFiles.end(), shaderFilePath) != includedFiles.end())
+	{
+		return true;
 	}
+	includedFiles.push_back(shaderFilePath);
 
-	return program;
-}
-
-/// <summary>
-/// Creates a shader based on the provided shader type and the path to the file containing the shader source.
-/// </summary>
-/// <param name="shaderType">Shader type</param>
-/// <param name="shaderFilePath">Path to the file containing the shader source</param>
-/// <returns>OpenGL handle to the created shader</returns>
-GLuint CreateShaderFromFile(const GLuint& shaderType, const std::string& shaderFilePath)
-{
 	std::ifstream shaderFile(shaderFilePath);
 	if (shaderFile.fail())
 	{
 		std::cerr << "Unable to open shader file: " << shaderFilePath << std::endl;
-		return 0;
+		return false;
 	}
 
-	std::string shaderSource;
+	size_t separator = shaderFilePath.find_last_of("/\\");
+	std::string directory = separator == std::string::npos ? "" : shaderFilePath.substr(0, separator + 1);
+
 	std::string temp;
 	while (std::getline(shaderFile, temp))
 	{
+		size_t start = temp.find_first_not_of(" \t");
+		if (start != std::string::npos && temp.compare(start, 8, "#include") == 0)
+		{
+			size_t open = temp.find('"', start);
+			size_t close = open == std::string::npos ? std::string::npos : temp.find('"', open + 1);
+			if (close == std::string::npos)
+			{
+				std::cerr << shaderFilePath << ": expected '#include \"file\"': " << temp << std::endl;
+				return false;
+			}
+			if (!LoadShaderSource(directory + temp.substr(open + 1, close - open - 1), shaderSource, includedFiles))
+			{
+				return false;
+			}
+			continue;
+		}
 		shaderSource += temp + "\n";
 	}
-	shaderFile.close();
-
-	return CreateShaderFromSource(shaderType, shaderSource);
+	return true;
 }
 
 /// <summary>
@@ -1687,6 +3697,964 @@ GLuint CreateShaderFromSource(const GLuint& shaderType, const std::string& shade
 	return shader;
 }
 
+/// <summary>
+/// Converts a float to a half float (round to nearest, denormals flushed to zero).
+/// </summary>
+/// <param name="value">Value to convert</param>
+/// <returns>Half float bits</returns>
+static GLhalf FloatToHalf(float value)
+{
+	uint32_t bits;
+	std::memcpy(&bits, &value, sizeof(bits));
+	uint32_t sign = (bits >> 16) & 0x8000u;
+	int32_t exponent = static_cast<int32_t>((bits >> 23) & 0xFFu) - 127 + 15;
+	uint32_t mantissa = bits & 0x7FFFFFu;
+	if (exponent <= 0)
+	{
+		return static_cast<GLhalf>(sign);
+	}
+	if (exponent >= 31)
+	{
+		return static_cast<GLhalf>(sign | 0x7C00u);
+	}
+	uint32_t half = sign | (static_cast<uint32_t>(exponent) << 10) | (mantissa >> 13);
+	// Round to nearest; a carry into the exponent is still the correctly rounded value
+	if (mantissa & 0x1000u)
+	{
+		++half;
+	}
+	return static_cast<GLhalf>(half);
+}
+
+/// <summary>
+/// Packs a normal into GL_INT_2_10_10_10_REV format (x in the lowest 10 bits, w unused).
+/// </summary>
+/// <param name="normal">Normal vector, normalized before packing</param>
+/// <returns>Packed normal</returns>
+static GLuint PackNormal(glm::vec3 normal)
+{
+	float length = glm::length(normal);
+	if (length > 0.0f)
+	{
+		normal /= length;
+	}
+	auto packComponent = [](float component)
+	{
+		int value = static_cast<int>(std::round(std::min(std::max(component, -1.0f), 1.0f) * 511.0f));
+		return static_cast<GLuint>(value) & 0x3FFu;
+	};
+	return packComponent(normal.x) | (packComponent(normal.y) << 10) | (packComponent(normal.z) << 20);
+}
+
+/// <summary>
+/// Reorders the triangles of an indexed triangle list so that consecutive triangles reuse recently transformed vertices
+/// (Tom Forsyth's linear-speed vertex cache optimization).
+/// </summary>
+/// <param name="indices">Triangle list indices, reordered in place</param>
+/// <param name="vertexCount">Number of vertices referenced by the indices</param>
+void OptimizeVertexCache(std::vector<GLuint>& indices, size_t vertexCount)
+{
+	const int cacheSize = 32;
+	const size_t triangleCount = indices.size() / 3;
+
+	// Score of a vertex from its position in the simulated LRU cache (-1 if not cached) and the number of triangles still using it
+	auto vertexScore = [cacheSize](int cachePosition, int remainingTriangles)
+	{
+		if (remainingTriangles == 0)
+		{
+			return -1.0f;
+		}
+		float score = 0.0f;
+		if (cachePosition >= 0)
+		{
+			// The last triangle's vertices get a fixed score so that the next triangle does not simply reuse all three
+			score = cachePosition < 3 ? 0.75f : std::pow(1.0f - (cachePosition - 3) / float(cacheSize - 3), 1.5f);
+		}
+		// Prefer finishing vertices that have few triangles left
+		return score + 2.0f / std::sqrt(float(remainingTriangles));
+	};
+
+	// Triangles using each vertex
+	std::vector<int> remainingTriangles(vertexCount, 0);
+	for (GLuint index : indices)
+	{
+		++remainingTriangles[index];
+	}
+	std::vector<size_t> vertexTriangleStart(vertexCount + 1, 0);
+	for (size_t v = 0; v < vertexCount; ++v)
+	{
+		vertexTriangleStart[v + 1] = vertexTriangleStart[v] + remainingTriangles[v];
+	}
+	std::vector<size_t> vertexTriangles(indices.size());
+	std::vector<size_t> fill(vertexTriangleStart.begin(), vertexTriangleStart.end() - 1);
+	for (size_t i = 0; i < indices.size(); ++i)
+	{
+		vertexTriangles[fill[indices[i]]++] = i / 3;
+	}
+
+	std::vector<int> cachePosition(vertexCount, -1);
+	std::vector<float> score(vertexCount);
+	for (size_t v = 0; v < vertexCount; ++v)
+	{
+		score[v] = vertexScore(-1, remainingTriangles[v]);
+	}
+	std::vector<float> triangleScore(triangleCount);
+	for (size_t t = 0; t < triangleCount; ++t)
+	{
+		triangleScore[t] = score[indices[3 * t]] + score[indices[3 * t + 1]] + score[indices[3 * t + 2]];
+	}
+
+	std::vector<bool> emitted(triangleCount, false);
+	std::vector<GLuint> output;
+	output.reserve(indices.size());
+	std::vector<GLuint> cache;
+	size_t nextUnemitted = 0;
+
+	for (size_t emittedCount = 0; emittedCount < triangleCount; ++emittedCount)
+	{
+		// Best triangle among the ones touching cached vertices; fall back to the first one not emitted yet
+		size_t best = triangleCount;
+		float bestScore = -1.0f;
+		for (GLuint v : cache)
+		{
+			for (size_t i = vertexTriangleStart[v]; i < vertexTriangleStart[v + 1]; ++i)
+			{
+				size_t t = vertexTriangles[i];
+				if (!emitted[t] && triangleScore[t] > bestScore)
+				{
+					best = t;
+					bestScore = triangleScore[t];
+				}
+			}
+		}
+		if (best == triangleCount)
+		{
+			while (emitted[nextUnemitted])
+			{
+				++nextUnemitted;
+			}
+			best = nextUnemitted;
+		}
+
+		// Emit it and move its vertices to the front of the cache
+		emitted[best] = true;
+		std::vector<GLuint> newCache;
+		for (int k = 0; k < 3; ++k)
+		{
+			GLuint v = indices[3 * best + k];
+			output.push_back(v);
+			--remainingTriangles[v];
+			newCache.push_back(v);
+		}
+		for (GLuint v : cache)
+		{
+			if (std::find(newCache.begin(), newCache.end(), v) == newCache.end())
+			{
+				newCache.push_back(v);
+			}
+		}
+		for (size_t i = 0; i < newCache.size(); ++i)
+		{
+			cachePosition[newCache[i]] = i < size_t(cacheSize) ? int(i) : -1;
+		}
+
+		// Rescore the vertices that were or are in the cache, and the triangles using them
+		for (GLuint v : newCache)
+		{
+			score[v] = vertexScore(cachePosition[v], remainingTriangles[v]);
+		}
+		for (GLuint v : newCache)
+		{
+			for (size_t i = vertexTriangleStart[v]; i < vertexTriangleStart[v + 1]; ++i)
+			{
+				size_t t = vertexTriangles[i];
+				triangleScore[t] = score[indices[3 * t]] + score[indices[3 * t + 1]] + score[indices[3 * t + 2]];
+			}
+		}
+		if (newCache.size() > size_t(cacheSize))
+		{
+			newCache.resize(cacheSize);
+		}
+		cache.swap(newCache);
+	}
+	indices.swap(output);
+}
+
+/// <summary>
+/// Creates an indexed mesh from a triangle list: identical vertices are merged, the triangles are reordered
+/// for the post-transform vertex cache, and the vertices are renumbered in the order they are first used.
+/// </summary>
+/// <param name="vertices">Triangle list vertices</param>
+/// <param name="vertexCount">Number of vertices</param>
+/// <param name="packed">True to upload the vertices in the PackedVertex layout</param>
+/// <returns>Mesh with its vertex and index buffers</returns>
+Mesh CreateMesh(const Vertex* vertices, size_t vertexCount, bool packed)
+{
+	// Merge identical vertices. Vertex has padding after the color, so compare the members rather than the bytes.
+	auto sameVertex = [](const Vertex& a, const Vertex& b)
+	{
+		return a.x == b.x && a.y == b.y && a.z == b.z && a.r == b.r && a.g == b.g && a.b == b.b &&
+			a.u == b.u && a.v == b.v && a.nx == b.nx && a.ny == b.ny && a.nz == b.nz;
+	};
+	std::vector<Vertex> uniqueVertices;
+	std::vector<GLuint> indices;
+	indices.reserve(vertexCount);
+	for (size_t i = 0; i < vertexCount; ++i)
+	{
+		size_t index = 0;
+		while (index < uniqueVertices.size() && !sameVertex(uniqueVertices[index], vertices[i]))
+		{
+			++index;
+		}
+		if (index == uniqueVertices.size())
+		{
+			uniqueVertices.push_back(vertices[i]);
+		}
+		indices.push_back(static_cast<GLuint>(index));
+	}
+
+	OptimizeVertexCache(indices, uniqueVertices.size());
+
+	// Renumber the vertices in the order the optimized index list first uses them, so that fetches walk the buffer forward
+	std::vector<GLuint> remap(uniqueVertices.size(), ~0u);
+	std::vector<Vertex> orderedVertices;
+	orderedVertices.reserve(uniqueVertices.size());
+	for (GLuint& index : indices)
+	{
+		if (remap[index] == ~0u)
+		{
+			remap[index] = static_cast<GLuint>(orderedVertices.size());
+			orderedVertices.push_back(uniqueVertices[index]);
+		}
+		index = remap[index];
+	}
+
+	Mesh mesh;
+	mesh.vertexCount = static_cast<GLsizei>(orderedVertices.size());
+	mesh.indexCount = static_cast<GLsizei>(indices.size());
+	mesh.packed = packed;
+	mesh.boundsMin = mesh.boundsMax = glm::vec3(orderedVertices[0].x, orderedVertices[0].y, orderedVertices[0].z);
+	for (const Vertex& vertex : orderedVertices)
+	{
+		mesh.boundsMin = glm::min(mesh.boundsMin, glm::vec3(vertex.x, vertex.y, vertex.z));
+		mesh.boundsMax = glm::max(mesh.boundsMax, glm::vec3(vertex.x, vertex.y, vertex.z));
+	}
+
+	glGenBuffers(1, &mesh.vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+	if (packed)
+	{
+		std::vector<PackedVertex> packedVertices(orderedVertices.size());
+		for (size_t i = 0; i < orderedVertices.size(); ++i)
+		{
+			const Vertex& vertex = orderedVertices[i];
+			packedVertices[i] = { vertex.x, vertex.y, vertex.z, vertex.r, vertex.g, vertex.b, 255,
+				FloatToHalf(vertex.u), FloatToHalf(vertex.v), PackNormal(glm::vec3(vertex.nx, vertex.ny, vertex.nz)) };
+		}
+		glBufferData(GL_ARRAY_BUFFER, packedVertices.size() * sizeof(PackedVertex), packedVertices.data(), GL_STATIC_DRAW);
+	}
+	else
+	{
+		glBufferData(GL_ARRAY_BUFFER, orderedVertices.size() * sizeof(Vertex), orderedVertices.data(), GL_STATIC_DRAW);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	// 16-bit indices whenever they are enough
+	glGenBuffers(1, &mesh.ebo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.ebo);
+	if (orderedVertices.size() <= 0xFFFF)
+	{
+		std::vector<GLushort> shortIndices(indices.begin(), indices.end());
+		mesh.indexType = GL_UNSIGNED_SHORT;
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, shortIndices.size() * sizeof(GLushort), shortIndices.data(), GL_STATIC_DRAW);
+	}
+	else
+	{
+		mesh.indexType = GL_UNSIGNED_INT;
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
+	}
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	return mesh;
+}
+
+/// <summary>
+/// Creates an instance batch for a mesh: an empty instance buffer and a vertex array object that reads
+/// the vertex attributes and indices from the mesh and the model and normal matrices of each instance (attributes 4 to 10) from the instance buffer.
+/// </summary>
+/// <param name="mesh">Mesh of the instances</param>
+/// <param name="texture">Texture of the instances</param>
+/// <returns>Batch without any instances</returns>
+InstanceBatch CreateInstanceBatch(const Mesh& mesh, GLuint texture)
+{
+	InstanceBatch batch;
+	batch.vbo = mesh.vbo;
+	batch.indexCount = mesh.indexCount;
+	batch.indexType = mesh.indexType;
+	batch.texture = texture;
+	batch.boundsCenter = (mesh.boundsMin + mesh.boundsMax) * 0.5f;
+	batch.boundsExtent = (mesh.boundsMax - mesh.boundsMin) * 0.5f;
+	batch.ebo = mesh.ebo;
+	batch.vertexStride = mesh.packed ? sizeof(PackedVertex) : sizeof(Vertex);
+
+	// Create a vertex array object that contains data on how to map vertex attributes
+	// (e.g., position, color) to vertex shader properties.
+	glGenVertexArrays(1, &batch.vao);
+	glBindVertexArray(batch.vao);
+
+	glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+
+	// The index buffer binding is stored in the vertex array object
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.ebo);
+
+	if (mesh.packed)
+	{
+		// Vertex attribute 0 - Position
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(PackedVertex), (void*)offsetof(PackedVertex, x));
+
+		// Vertex attribute 1 - Color
+		glEnableVertexAttribArray(1);
+		glVertexAttribPointer(1, 3, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(PackedVertex), (void*)(offsetof(PackedVertex, r)));
+
+		// Vertex attribute 2 - UV coordinate
+		glEnableVertexAttribArray(2);
+		glVertexAttribPointer(2, 2, GL_HALF_FLOAT, GL_FALSE, sizeof(PackedVertex), (void*)(offsetof(PackedVertex, u)));
+
+		// Vertex attribute 3 - Normal
+		glEnableVertexAttribArray(3);
+		glVertexAttribPointer(3, 4, GL_INT_2_10_10_10_REV, GL_TRUE, sizeof(PackedVertex), (void*)(offsetof(PackedVertex, normal)));
+	}
+	else
+	{
+		// Vertex attribute 0 - Position
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, x));
+
+		// Vertex attribute 1 - Color
+		glEnableVertexAttribArray(1);
+		glVertexAttribPointer(1, 3, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Vertex), (void*)(offsetof(Vertex, r)));
+
+		// Vertex attribute 2 - UV coordinate
+		glEnableVertexAttribArray(2);
+		glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(offsetof(Vertex, u)));
+
+		// Vertex attribute 3 - Normal
+		glEnableVertexAttribArray(3);
+		glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(offsetof(Vertex, nx)));
+	}
+
+	// Vertex attributes 4 to 7 - Model matrix, and 8 to 10 - Normal matrix, one column per attribute, advancing once
+	// per instance. They read from the stream buffer, at an offset that changes every frame, so the pointers are set by Draw.
+	for (GLuint attribute = 4; attribute <= 10; ++attribute)
+	{
+		glEnableVertexAttribArray(attribute);
+		glVertexAttribDivisor(attribute, 1);
+	}
+
+	// Unbind the vertex array object first so that it keeps its index buffer
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	return batch;
+}
+
+/// <summary>
+/// Cache file layout: header, then for each level its byte size followed by the compressed blocks
+/// </summary>
+struct TextureCacheHeader
+{
+	char magic[4];			// "TXC1"
+	uint32_t levelCount;	// Number of mipmap levels
+	uint64_t sourceHash;	// Hash of the source image file the cache was built from
+	uint32_t internalFormat;// Compressed format of the levels
+	uint32_t width;			// Width of level 0
+	uint32_t height;		// Height of level 0
+	uint32_t reserved;		// Padding, zero
+};
+
+/// <summary>
+/// 64-bit FNV-1a hash.
+/// </summary>
+/// <param name="data">Bytes to hash</param>
+/// <param name="size">Number of bytes</param>
+/// <returns>Hash</returns>
+static uint64_t HashBytes(const unsigned char* data, size_t size)
+{
+	uint64_t hash = 14695981039346656037ull;
+	for (size_t i = 0; i < size; ++i)
+	{
+		hash = (hash ^ data[i]) * 1099511628211ull;
+	}
+	return hash;
+}
+
+/// <summary>
+/// Reads an image on a worker thread: from its compressed cache file if it is up to date and in a supported format,
+/// otherwise by decoding the image and building its mipmaps with a box filter. No OpenGL calls are made.
+/// </summary>
+/// <param name="filePath">Path to the image file</param>
+/// <param name="compressedFormats">Compressed formats supported by the GL context</param>
+/// <param name="useCache">True to try the cache file first</param>
+/// <returns>Image data; error is set on failure</returns>
+TextureData LoadTextureData(const std::string& filePath, const std::vector<GLenum>& compressedFormats, bool useCache)
+{
+	TextureData data;
+	data.filePath = filePath;
+
+	std::ifstream file(filePath, std::ios::binary);
+	if (!file)
+	{
+		data.error = "cannot open the file";
+		return data;
+	}
+	std::vector<unsigned char> fileData((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	data.sourceHash = HashBytes(fileData.data(), fileData.size());
+
+	if (useCache)
+	{
+		std::ifstream cache(filePath + ".texcache", std::ios::binary);
+		TextureCacheHeader header;
+		if (cache.read(reinterpret_cast<char*>(&header), sizeof(header)) && std::memcmp(header.magic, "TXC1", 4) == 0 &&
+			header.sourceHash == data.sourceHash &&
+			std::find(compressedFormats.begin(), compressedFormats.end(), header.internalFormat) != compressedFormats.end())
+		{
+			GLsizei width = header.width, height = header.height;
+			for (uint32_t level = 0; level < header.levelCount && cache; ++level)
+			{
+				uint32_t size = 0;
+				cache.read(reinterpret_cast<char*>(&size), sizeof(size));
+				std::vector<unsigned char> blocks(size);
+				cache.read(reinterpret_cast<char*>(blocks.data()), size);
+				data.levels.push_back(std::move(blocks));
+				data.widths.push_back(width);
+				data.heights.push_back(height);
+				width = std::max(width / 2, 1);
+				height = std::max(height / 2, 1);
+			}
+			if (cache && data.levels.size() == header.levelCount)
+			{
+				data.compressed = true;
+				data.internalFormat = header.internalFormat;
+				return data;
+			}
+			// Truncated cache file: fall back to decoding the image
+			data.levels.clear();
+			data.widths.clear();
+			data.heights.clear();
+		}
+	}
+
+	// 'imageWidth' and imageHeight will contain the width and height of the loaded image respectively
+	int imageWidth, imageHeight, numChannels;
+
+	// Always decode to RGBA so that every row is 4-byte aligned and PNGs with alpha upload correctly
+	unsigned char* imageData = stbi_load_from_memory(fileData.data(), static_cast<int>(fileData.size()), &imageWidth, &imageHeight, &numChannels, 4);
+	if (imageData == nullptr)
+	{
+		data.error = stbi_failure_reason();
+		return data;
+	}
+	data.levels.emplace_back(imageData, imageData + size_t(imageWidth) * imageHeight * 4);
+	data.widths.push_back(imageWidth);
+	data.heights.push_back(imageHeight);
+	stbi_image_free(imageData);
+
+	// Each mipmap level averages 2x2 texels of the previous one (edge texels are repeated for odd sizes)
+	while (data.widths.back() > 1 || data.heights.back() > 1)
+	{
+		const std::vector<unsigned char>& source = data.levels.back();
+		GLsizei sourceWidth = data.widths.back(), sourceHeight = data.heights.back();
+		GLsizei width = std::max(sourceWidth / 2, 1), height = std::max(sourceHeight / 2, 1);
+		std::vector<unsigned char> level(size_t(width) * height * 4);
+		for (GLsizei y = 0; y < height; ++y)
+		{
+			GLsizei y0 = std::min(2 * y, sourceHeight - 1), y1 = std::min(2 * y + 1, sourceHeight - 1);
+			for (GLsizei x = 0; x < width; ++x)
+			{
+				GLsizei x0 = std::min(2 * x, sourceWidth - 1), x1 = std::min(2 * x + 1, sourceWidth - 1);
+				for (int c = 0; c < 4; ++c)
+				{
+					int sum = source[(size_t(y0) * sourceWidth + x0) * 4 + c] + source[(size_t(y0) * sourceWidth + x1) * 4 + c] +
+						source[(size_t(y1) * sourceWidth + x0) * 4 + c] + source[(size_t(y1) * sourceWidth + x1) * 4 + c];
+					level[(size_t(y) * width + x) * 4 + c] = static_cast<unsigned char>((sum + 2) / 4);
+				}
+			}
+		}
+		data.levels.push_back(std::move(level));
+		data.widths.push_back(width);
+		data.heights.push_back(height);
+	}
+	return data;
+}
+
+/// <summary>
+/// Writes the compressed levels of an uploaded texture to its cache file. Does nothing if the driver did not compress it.
+/// </summary>
+/// <param name="data">Data the texture was uploaded from</param>
+void WriteTextureCache(const TextureData& data)
+{
+	// The texture must be bound to GL_TEXTURE_2D
+	GLint compressed = GL_FALSE;
+	glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_COMPRESSED, &compressed);
+	if (compressed != GL_TRUE)
+	{
+		return;
+	}
+
+	TextureCacheHeader header = {};
+	std::memcpy(header.magic, "TXC1", 4);
+	header.levelCount = static_cast<uint32_t>(data.levels.size());
+	header.sourceHash = data.sourceHash;
+	GLint internalFormat = 0;
+	glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_INTERNAL_FORMAT, &internalFormat);
+	header.internalFormat = static_cast<uint32_t>(internalFormat);
+	header.width = data.widths[0];
+	header.height = data.heights[0];
+
+	std::ofstream cache(data.filePath + ".texcache", std::ios::binary);
+	cache.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	std::vector<unsigned char> blocks;
+	for (GLint level = 0; level < GLint(data.levels.size()); ++level)
+	{
+		GLint size = 0;
+		glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &size);
+		blocks.resize(size);
+		glGetCompressedTexImage(GL_TEXTURE_2D, level, blocks.data());
+		uint32_t blockSize = static_cast<uint32_t>(size);
+		cache.write(reinterpret_cast<const char*>(&blockSize), sizeof(blockSize));
+		cache.write(reinterpret_cast<const char*>(blocks.data()), size);
+	}
+	if (!cache)
+	{
+		std::cerr << "Failed to write texture cache for " << data.filePath << std::endl;
+	}
+}
+
+/// <summary>
+/// Loads a scene file. Each line is one of
+///   texture name file path
+///   object mesh texture tx ty tz sx sy sz [rotate ax ay az degrees] [spin ax ay az degreesPerSecond]
+///   light x y z r g b radius intensity
+/// Empty lines and lines starting with # are ignored. Textures start loading as they are declared.
+/// </summary>
+/// <param name="filePath">Path to the scene file</param>
+/// <param name="textureManager">Texture manager loading the textures</param>
+/// <param name="scene">Scene receiving the textures and objects</param>
+/// <returns>True if the file was read without errors</returns>
+bool LoadScene(const std::string& filePath, TextureManager& textureManager, Scene& scene)
+{
+	std::ifstream file(filePath);
+	if (!file)
+	{
+		std::cerr << "Failed to open scene file " << filePath << std::endl;
+		return false;
+	}
+
+	std::string line;
+	int lineNumber = 0;
+	while (std::getline(file, line))
+	{
+		++lineNumber;
+		std::istringstream stream(line);
+		std::string command;
+		if (!(stream >> command) || command[0] == '#')
+		{
+			continue;
+		}
+
+		if (command == "texture")
+		{
+			// The file path is the rest of the line, since texture file names contain spaces
+			std::string name, textureFilePath;
+			stream >> name >> std::ws;
+			std::getline(stream, textureFilePath);
+			if (name.empty() || textureFilePath.empty())
+			{
+				std::cerr << filePath << ":" << lineNumber << ": expected 'texture name file'" << std::endl;
+				return false;
+			}
+			scene.textures[name] = textureManager.Request(textureFilePath);
+		}
+		else if (command == "object")
+		{
+			SceneObject object;
+			glm::vec3 translation, scale;
+			stream >> object.mesh >> object.texture >> translation.x >> translation.y >> translation.z >> scale.x >> scale.y >> scale.z;
+			if (!stream)
+			{
+				std::cerr << filePath << ":" << lineNumber << ": expected 'object mesh texture tx ty tz sx sy sz'" << std::endl;
+				return false;
+			}
+
+			// Same order as the hand-written transforms: translate, then scale, then rotate
+			object.modelMatrix = glm::translate(glm::mat4(1.0f), translation);
+			object.modelMatrix = glm::scale(object.modelMatrix, scale);
+			object.spinAxis = glm::vec3(0.0f, 1.0f, 0.0f);
+			object.spinSpeed = 0.0f;
+
+			std::string option;
+			while (stream >> option)
+			{
+				glm::vec3 axis;
+				float angle;
+				stream >> axis.x >> axis.y >> axis.z >> angle;
+				if (!stream || (option != "rotate" && option != "spin"))
+				{
+					std::cerr << filePath << ":" << lineNumber << ": expected 'rotate ax ay az degrees' or 'spin ax ay az degreesPerSecond'" << std::endl;
+					return false;
+				}
+				if (option == "rotate")
+				{
+					object.modelMatrix = glm::rotate(object.modelMatrix, glm::radians(angle), axis);
+				}
+				else
+				{
+					object.spinAxis = axis;
+					object.spinSpeed = angle;
+				}
+			}
+			scene.objects.push_back(object);
+		}
+		else if (command == "light")
+		{
+			PointLight light;
+			stream >> light.position.x >> light.position.y >> light.position.z >> light.color.r >> light.color.g >> light.color.b >> light.radius >> light.intensity;
+			if (!stream || light.radius <= 0.0f)
+			{
+				std::cerr << filePath << ":" << lineNumber << ": expected 'light x y z r g b radius intensity'" << std::endl;
+				return false;
+			}
+			if (scene.lights.size() == LightClusters::maxLights)
+			{
+				std::cerr << filePath << ":" << lineNumber << ": too many lights, at most " << LightClusters::maxLights << " are supported" << std::endl;
+				return false;
+			}
+			scene.lights.push_back(light);
+		}
+		else
+		{
+			std::cerr << filePath << ":" << lineNumber << ": unknown command '" << command << "'" << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+/// <summary>
+/// Groups the objects of a scene into instance batches (one per program, mesh and texture) sorted in that order.
+/// Spinning objects get batches of their own so that the static ones can be cached in the shadow maps.
+/// Objects using an unknown mesh or texture are reported and skipped.
+/// </summary>
+/// <param name="scene">Scene to draw</param>
+/// <param name="meshes">Meshes by name</param>
+/// <param name="program">Program used by the objects in the main pass</param>
+/// <returns>Render queue with the instance attributes computed</returns>
+RenderQueue BuildRenderQueue(const Scene& scene, const std::unordered_map<std::string, Mesh>& meshes, GLuint program)
+{
+	// The map keeps the batch keys sorted, which gives the draw order directly
+	std::map<std::tuple<GLuint, GLuint, GLuint, bool>, std::vector<size_t>> objectsByKey;
+	for (size_t i = 0; i < scene.objects.size(); ++i)
+	{
+		const SceneObject& object = scene.objects[i];
+		auto mesh = meshes.find(object.mesh);
+		auto texture = scene.textures.find(object.texture);
+		if (mesh == meshes.end() || texture == scene.textures.end())
+		{
+			std::cerr << "Skipping scene object with unknown mesh '" << object.mesh << "' or texture '" << object.texture << "'" << std::endl;
+			continue;
+		}
+		objectsByKey[std::make_tuple(program, mesh->second.vbo, texture->second, object.spinSpeed != 0.0f)].push_back(i);
+	}
+
+	RenderQueue queue;
+	for (const auto& entry : objectsByKey)
+	{
+		const SceneObject& first = scene.objects[entry.second.front()];
+		InstanceBatch batch = CreateInstanceBatch(meshes.at(first.mesh), std::get<2>(entry.first));
+		batch.program = std::get<0>(entry.first);
+		batch.dynamic = std::get<3>(entry.first);
+
+		for (size_t objectIndex : entry.second)
+		{
+			batch.modelMatrices.push_back(scene.objects[objectIndex].GetModelMatrix(0.0f));
+		}
+		batch.UpdateInstances();
+
+		if (batch.dynamic)
+		{
+			queue.animatedBatches.push_back(queue.batches.size());
+		}
+		queue.batches.push_back(batch);
+		queue.batchObjects.push_back(entry.second);
+	}
+	return queue;
+}
+
+/// <summary>
+/// Prepares a frame without any OpenGL calls, so that it can run on a worker thread while the GL thread submits
+/// the previous frame: animates the spinning objects, sets up the camera, fits the shadow cascades, bins the point lights,
+/// fills the frame uniforms, and culls every batch against the camera frustum and every cascade.
+/// </summary>
+/// <param name="input">Camera and time of the frame</param>
+/// <param name="scene">Scene being drawn</param>
+/// <param name="renderQueue">Render queue; only its frame preparation members are touched</param>
+/// <param name="shadowCascades">Shadow cascade settings</param>
+/// <param name="lightClusters">Light cluster settings</param>
+/// <param name="packet">Receives the prepared frame</param>
+void PrepareFrame(const FrameInput& input, const Scene& scene, RenderQueue& renderQueue, const ShadowCascades& shadowCascades,
+	const LightClusters& lightClusters, FramePacket& packet)
+{
+	auto start = std::chrono::steady_clock::now();
+	packet.input = input;
+
+	// Move the spinning objects
+	renderQueue.Update(scene, input.time);
+
+	// Camera
+	packet.viewMatrix = glm::lookAt(input.cameraPosition, input.cameraPosition + input.cameraFront, input.cameraUp);
+	packet.projectionMatrix = glm::perspective(glm::radians(input.fov), input.aspect, packet.nearPlane, packet.farPlane);
+	glm::mat4 viewProjectionMatrix = packet.projectionMatrix * packet.viewMatrix;
+
+	// One light-space matrix per cascade, computed once per frame instead of once per vertex in the shaders
+	glm::vec3 directionalLightDirection = glm::vec3(1.0f, -1.0f, 0.0f);
+	shadowCascades.Fit(packet.viewMatrix, glm::radians(input.fov), input.aspect, packet.nearPlane, directionalLightDirection,
+		packet.lightSpaceMatrices, packet.cascadeSplits);
+
+	// Bin the point lights into the clusters of the camera
+	lightClusters.Bin(scene.lights, packet.viewMatrix, packet.projectionMatrix, packet.nearPlane, packet.farPlane, packet.clusters);
+
+	// --- LIGHTING ---
+
+	FrameUniforms& frameUniforms = packet.uniforms;
+	frameUniforms.viewMatrix = packet.viewMatrix;
+	frameUniforms.viewProjection = viewProjectionMatrix;
+	frameUniforms.inverseViewProjection = glm::inverse(viewProjectionMatrix);
+	for (int cascade = 0; cascade < ShadowCascades::maxCascades; ++cascade)
+	{
+		frameUniforms.lightSpaceMatrices[cascade] = packet.lightSpaceMatrices[cascade];
+		frameUniforms.cascadeSplits[cascade] = packet.cascadeSplits[cascade];
+	}
+
+	// Eye position
+	frameUniforms.eyePosition = glm::vec4(input.cameraPosition, 1.0f);
+	frameUniforms.directionalLightDirection = glm::vec4(directionalLightDirection, 0.0f);
+
+	// Ambient intensity and component FOR DIRECTIONAL LIGHT
+	float ambientDirectionalIntensity = 0.8f;
+	glm::vec3 ambientDirectionalComponent = glm::vec3(1.0f, 0.9f, 0.8f);
+	frameUniforms.ambientColor = glm::vec4(ambientDirectionalIntensity * ambientDirectionalComponent, 1.0f);
+
+	// Diffuse intensity and component
+	float diffuseIntensity = 0.8f;
+	glm::vec3 diffuseComponent = glm::vec3(0.8f, 0.8f, 0.8f);
+	frameUniforms.diffuseColor = glm::vec4(diffuseIntensity * diffuseComponent, 1.0f);
+
+	// Specular intensity and component, and shininess
+	float specularIntensity = 5.0f;
+	glm::vec3 specularComponent = glm::vec3(0.4f, 0.4f, 0.4f);
+	float shininess = 64.0f;
+	frameUniforms.specularColor = glm::vec4(specularIntensity * specularComponent, shininess);
+
+	// Light clusters
+	frameUniforms.viewportSize = glm::vec4(input.framebufferWidth, input.framebufferHeight, 1.0f / input.framebufferWidth, 1.0f / input.framebufferHeight);
+	frameUniforms.clusterDepthParameters = glm::vec4(lightClusters.DepthSliceScale(packet.nearPlane, packet.farPlane), lightClusters.DepthSliceBias(packet.nearPlane, packet.farPlane), 0.0f, 0.0f);
+	frameUniforms.clusterCounts = glm::ivec4(lightClusters.tilesX, lightClusters.tilesY, lightClusters.slices, 0);
+	frameUniforms.lightCounts = glm::ivec4(lightClusters.lightCount, shadowCascades.count, 0, 0);
+
+	// Shadow filtering
+	frameUniforms.shadowParameters = glm::vec4(shadowCascades.slopeBias, shadowCascades.minBias, shadowCascades.pcfRadius, 1.0f / shadowCascades.resolution);
+
+	// Drop the instances outside the camera frustum and outside each cascade's light volume. Static casters are culled
+	// for every cascade even though the GL thread only draws them when the cached layer is stale.
+	packet.cullingStats = renderQueue.Cull(Frustum(viewProjectionMatrix), packet.batches);
+	for (int cascade = 0; cascade < shadowCascades.count; ++cascade)
+	{
+		renderQueue.CullDepth(cascade, Frustum(packet.lightSpaceMatrices[cascade]), packet.batches);
+	}
+
+	packet.prepareMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+/// <summary>
+/// Fills a rectangle of the default framebuffer with a color. The scissor test must be enabled.
+/// </summary>
+/// <param name="x">Left edge in pixels</param>
+/// <param name="y">Top edge in pixels, from the top of the framebuffer</param>
+/// <param name="width">Width in pixels</param>
+/// <param name="height">Height in pixels</param>
+/// <param name="color">Fill color</param>
+/// <param name="framebufferHeight">Height of the framebuffer</param>
+static void FillOverlayRect(int x, int y, int width, int height, const glm::vec3& color, int framebufferHeight)
+{
+	if (width <= 0 || height <= 0)
+	{
+		return;
+	}
+	glScissor(x, framebufferHeight - y - height, width, height);
+	glClearColor(color.r, color.g, color.b, 1.0f);
+	glClear(GL_COLOR_BUFFER_BIT);
+}
+
+/// <summary>
+/// Draws a number with a 3x5 pixel font, one scissored clear per lit pixel.
+/// </summary>
+/// <param name="text">Digits, '.' and '-' only</param>
+/// <param name="x">Left edge in pixels</param>
+/// <param name="y">Top edge in pixels, from the top of the framebuffer</param>
+/// <param name="scale">Size of a font pixel</param>
+/// <param name="color">Text color</param>
+/// <param name="framebufferHeight">Height of the framebuffer</param>
+/// <returns>Width of the drawn text in pixels</returns>
+static int DrawOverlayNumber(const std::string& text, int x, int y, int scale, const glm::vec3& color, int framebufferHeight)
+{
+	// 15 bits per glyph, rows from the top, most significant bit is the top-left pixel
+	static const unsigned short digitGlyphs[10] = {
+		0x7B6F, 0x2C97, 0x73E7, 0x73CF, 0x5BC9, 0x79CF, 0x79EF, 0x7249, 0x7BEF, 0x7BCF };
+	const unsigned short pointGlyph = 0x0002;
+	const unsigned short minusGlyph = 0x01C0;
+
+	int startX = x;
+	for (char character : text)
+	{
+		unsigned short glyph = 0;
+		if (character >= '0' && character <= '9')
+		{
+			glyph = digitGlyphs[character - '0'];
+		}
+		else if (character == '.')
+		{
+			glyph = pointGlyph;
+		}
+		else if (character == '-')
+		{
+			glyph = minusGlyph;
+		}
+		for (int bit = 0; bit < 15; ++bit)
+		{
+			if (glyph & (1 << (14 - bit)))
+			{
+				FillOverlayRect(x + (bit % 3) * scale, y + (bit / 3) * scale, scale, scale, color, framebufferHeight);
+			}
+		}
+		x += 4 * scale;
+	}
+	return x - startX;
+}
+
+/// <summary>
+/// Formats milliseconds with two decimals, or "-" if the value is not available.
+/// </summary>
+/// <param name="milliseconds">Value to format</param>
+/// <returns>Formatted value</returns>
+static std::string FormatMilliseconds(double milliseconds)
+{
+	if (milliseconds < 0.0)
+	{
+		return "-";
+	}
+	char buffer[32];
+	std::snprintf(buffer, sizeof(buffer), "%.2f", milliseconds);
+	return buffer;
+}
+
+/// <summary>
+/// Draws the profiler overlay in the top-left corner of the default framebuffer with scissored clears (no shaders or fonts).
+/// One row per section, in the section's color: CPU milliseconds, GPU milliseconds, then a bar for the CPU time and a thinner
+/// bar below it for the GPU time (the white tick marks 16.7 ms). The last row shows the frame time, draw calls and state changes.
+/// </summary>
+/// <param name="profiler">Profiler with the latest resolved frame</param>
+/// <param name="framebufferHeight">Height of the default framebuffer</param>
+void DrawProfilerOverlay(const FrameProfiler& profiler, int framebufferHeight)
+{
+	const glm::vec3 sectionColors[ProfileSectionCount] = {
+		glm::vec3(0.9f, 0.9f, 0.3f),	// Update
+		glm::vec3(0.7f, 0.7f, 0.7f),	// Prepare
+		glm::vec3(0.4f, 0.6f, 1.0f),	// Shadow pass
+		glm::vec3(0.4f, 1.0f, 0.4f),	// Main pass
+		glm::vec3(0.3f, 1.0f, 0.9f),	// Lighting pass
+		glm::vec3(1.0f, 0.5f, 1.0f),	// Overlay
+		glm::vec3(1.0f, 0.5f, 0.3f)		// Swap
+	};
+	const glm::vec3 white(1.0f);
+	const int scale = 2;					// Font pixel size
+	const int rowHeight = 7 * scale;
+	const int margin = 8;
+	const int columnWidth = 28 * scale;		// Room for "99.99" plus a gap
+	const float pixelsPerMillisecond = 12.0f;
+	const int barX = margin + 2 * columnWidth + 12;
+
+	glEnable(GL_SCISSOR_TEST);
+
+	// Background
+	FillOverlayRect(0, 0, barX + int(20.0f * pixelsPerMillisecond) + margin, margin * 2 + rowHeight * (ProfileSectionCount + 1), glm::vec3(0.05f), framebufferHeight);
+
+	int y = margin;
+	for (int section = 0; section < ProfileSectionCount; ++section)
+	{
+		const glm::vec3& color = sectionColors[section];
+		DrawOverlayNumber(FormatMilliseconds(profiler.cpuMilliseconds[section]), margin, y, scale, color, framebufferHeight);
+		DrawOverlayNumber(FormatMilliseconds(profiler.gpuMilliseconds[section]), margin + columnWidth, y, scale, color, framebufferHeight);
+		FillOverlayRect(barX, y, int(profiler.cpuMilliseconds[section] * pixelsPerMillisecond), 3 * scale, color, framebufferHeight);
+		FillOverlayRect(barX, y + 4 * scale, int(profiler.gpuMilliseconds[section] * pixelsPerMillisecond), scale, color * 0.7f, framebufferHeight);
+		y += rowHeight;
+	}
+
+	// Frame time, draw calls, and state changes (program, texture, vertex array and framebuffer binds)
+	const RenderCounters& counters = profiler.counters;
+	uint64_t stateChanges = counters.programChanges + counters.textureBinds + counters.vertexArrayBinds + counters.framebufferBinds;
+	int x = margin;
+	x += DrawOverlayNumber(FormatMilliseconds(profiler.frameMilliseconds), x, y, scale, white, framebufferHeight) + 4 * scale;
+	x += DrawOverlayNumber(std::to_string(counters.drawCalls), x, y, scale, glm::vec3(0.6f, 0.9f, 1.0f), framebufferHeight) + 4 * scale;
+	DrawOverlayNumber(std::to_string(stateChanges), x, y, scale, glm::vec3(1.0f, 0.8f, 0.6f), framebufferHeight);
+
+	// 16.7 ms tick
+	FillOverlayRect(barX + int(16.7f * pixelsPerMillisecond), margin, 1, rowHeight * ProfileSectionCount, white, framebufferHeight);
+
+	glDisable(GL_SCISSOR_TEST);
+	glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+}
+
+/// <summary>
+/// Reads the command line options:
+///   --benchmark [frames]	run the scripted benchmark uncapped (default 1000 frames) and exit
+///   --no-vsync			swap without waiting for the vertical blank
+///   --fps limit			cap the frame rate
+/// </summary>
+/// <param name="argc">Number of arguments</param>
+/// <param name="argv">Arguments, starting with the program name</param>
+/// <param name="pacing">Receives the frame pacing options</param>
+/// <param name="benchmark">Receives the benchmark options</param>
+/// <returns>True if every option was understood</returns>
+bool ParseCommandLine(int argc, char* argv[], FramePacing& pacing, Benchmark& benchmark)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string option = argv[i];
+		if (option == "--benchmark")
+		{
+			benchmark.frameCount = 1000;
+			if (i + 1 < argc && std::isdigit(static_cast<unsigned char>(argv[i + 1][0])))
+			{
+				benchmark.frameCount = std::max(std::atoi(argv[++i]), 1);
+			}
+		}
+		else if (option == "--no-vsync")
+		{
+			pacing.vsync = false;
+		}
+		else if (option == "--fps" && i + 1 < argc)
+		{
+			pacing.targetFps = std::atof(argv[++i]);
+		}
+		else
+		{
+			std::cerr << "Unknown option '" << option << "'. Options: --benchmark [frames], --no-vsync, --fps limit" << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
 /// <summary>
 /// Function for handling the event when the size of the framebuffer changed.
 /// </summary>
@@ -1698,4 +4666,6 @@ void FramebufferSizeChangedCallback(GLFWwindow* window, int width, int height)
 	// Whenever the size of the framebuffer changed (due to window resizing, etc.),
 	// update the dimensions of the region to the new size
 	glViewport(0, 0, width, height);
+	framebufferWidth = width;
+	framebufferHeight = height;
 }
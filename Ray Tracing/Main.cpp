@@ -1,14 +1,49 @@
 #include <glm/glm.hpp>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 #include <fstream>
 
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <direct.h>
+#include <psapi.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
+// SIMD kernels are picked at compile time (e.g. -mavx2 or an ARM NEON target); otherwise the scalar path is used
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 using namespace std;
 
 struct Ray
@@ -25,18 +60,123 @@ struct Material
     float shininess; // Shininess
 };
 
+// Axis-aligned bounding box
+struct AABB
+{
+    glm::vec3 minPoint; // Minimum corner
+    glm::vec3 maxPoint; // Maximum corner
+
+    /**
+     * @brief Constructor. Creates an empty box that any point or box can be expanded into.
+     */
+    AABB()
+        : minPoint(std::numeric_limits<float>::max())
+        , maxPoint(-std::numeric_limits<float>::max())
+    {
+    }
+
+    /**
+     * @brief Grows the box so that it contains the provided point
+     * @param[in] point Point to include
+     */
+    void Expand(const glm::vec3& point)
+    {
+        minPoint = glm::min(minPoint, point);
+        maxPoint = glm::max(maxPoint, point);
+    }
+
+    /**
+     * @brief Grows the box so that it contains the provided box
+     * @param[in] box Box to include
+     */
+    void Expand(const AABB& box)
+    {
+        minPoint = glm::min(minPoint, box.minPoint);
+        maxPoint = glm::max(maxPoint, box.maxPoint);
+    }
+
+    /**
+     * @brief Surface area of the box, used by the SAH cost estimate
+     * @return Surface area, or 0 for an empty box
+     */
+    float SurfaceArea() const
+    {
+        glm::vec3 extent = maxPoint - minPoint;
+        if (extent.x < 0 || extent.y < 0 || extent.z < 0)
+        {
+            return 0.0f;
+        }
+        return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+    }
+
+    /**
+     * @brief Ray-box intersection (slab test)
+     * @param[in]   origin          Ray origin
+     * @param[in]   inverseDirection Component-wise reciprocal of the ray direction
+     * @param[in]   maxDistance     Hits farther than this distance are ignored
+     * @param[out]  outNear         Distance at which the ray enters the box (in case there is an intersection)
+     * @return True if the ray overlaps the box within [0, maxDistance]
+     */
+    bool IntersectRay(const glm::vec3& origin, const glm::vec3& inverseDirection, float maxDistance, float& outNear) const
+    {
+        glm::vec3 t1 = (minPoint - origin) * inverseDirection;
+        glm::vec3 t2 = (maxPoint - origin) * inverseDirection;
+        glm::vec3 tMin = glm::min(t1, t2);
+        glm::vec3 tMax = glm::max(t1, t2);
+
+        float tNear = std::max(std::max(tMin.x, tMin.y), tMin.z);
+        float tFar = std::min(std::min(tMax.x, tMax.y), tMax.z);
+
+        outNear = tNear;
+        return tFar >= std::max(tNear, 0.0f) && tNear <= maxDistance;
+    }
+};
+
+// Kind of primitive a SceneObject is. SceneObject's functions dispatch on it instead of through a virtual table.
+enum class ObjectType : uint8_t
+{
+    Sphere, // The object is a Sphere
+    Triangle // The object is a Triangle
+};
+
+// Common part of all primitives. Objects are stored by value in the scene's per-type pools and refer to a shared material.
 struct SceneObject
 {
-    Material material; // Material
+    ObjectType type; // Subclass of the object
+    bool dynamic; // Moves between frames: kept in Scene::dynamicBvh, which is refitted instead of rebuilt
+    uint32_t material; // Index into Scene::materials
+
+    /**
+     * @brief Constructor
+     * @param[in] objectType Subclass of the object
+     */
+    explicit SceneObject(ObjectType objectType)
+        : type(objectType)
+        , dynamic(false)
+        , material(0)
+    {
+    }
 
     /**
-     * Template function for calculating the intersection of this object with the provided ray.
+     * Calculates the intersection of this object with the provided ray by calling the subclass' Intersect().
      * @param[in]   incomingRay             Ray that will be checked for intersection with this object
      * @param[out]  outIntersectionPoint    Point of intersection (in case there is an intersection)
      * @param[out]  outIntersectionNormal   Normal vector at the point of intersection (in case there is an intersection)
      * @return If there is an intersection, returns the distance from the ray origin to the intersection point. Otherwise, returns a negative number.
      */
-    virtual float Intersect(const Ray& incomingRay, glm::vec3& outIntersectionPoint, glm::vec3& outIntersectionNormal) = 0;
+    float Intersect(const Ray& incomingRay, glm::vec3& outIntersectionPoint, glm::vec3& outIntersectionNormal) const;
+
+    /**
+     * Calculates the bounding box of this object by calling the subclass' GetBounds().
+     * @return Axis-aligned box that fully contains this object
+     */
+    AABB GetBounds() const;
+
+    /**
+     * Moves this object by calling the subclass' Translate().
+     * @param[in] offset Distance to move the object by
+     */
+    void Translate(const glm::vec3& offset);
 };
 
 // Subclass of SceneObject representing a Sphere scene object
@@ -45,6 +185,16 @@ struct Sphere : public SceneObject
     glm::vec3 center; // center
     float radius; // radius
 
+    /**
+     * @brief Constructor. Creates a sphere of radius 0 at the origin.
+     */
+    Sphere()
+        : SceneObject(ObjectType::Sphere)
+        , center(0.0f)
+        , radius(0.0f)
+    {
+    }
+
     /**
      * @brief Ray-sphere intersection
      * @param[in]   incomingRay             Ray that will be checked for intersection with this object
@@ -52,7 +202,7 @@ struct Sphere : public SceneObject
      * @param[out]  outIntersectionNormal   Normal vector at the point of intersection (in case there is an intersection)
      * @return If there is an intersection, returns the distance from the ray origin to the intersection point. Otherwise, returns a negative number.
      */
-    virtual float Intersect(const Ray& incomingRay, glm::vec3& outIntersectionPoint, glm::vec3& outIntersectionNormal)
+    float Intersect(const Ray& incomingRay, glm::vec3& outIntersectionPoint, glm::vec3& outIntersectionNormal) const
     {
         // In case there is an intersection, place the intersection point and intersection normal
         // that you calculated to the outIntersectionPoint and outIntersectionNormal variables.
@@ -126,6 +276,27 @@ struct Sphere : public SceneObject
             }
         }
     }
+
+    /**
+     * @brief Sphere bounding box
+     * @return Axis-aligned box that fully contains the sphere
+     */
+    AABB GetBounds() const
+    {
+        AABB bounds;
+        bounds.Expand(center - glm::vec3(radius));
+        bounds.Expand(center + glm::vec3(radius));
+        return bounds;
+    }
+
+    /**
+     * @brief Moves the sphere
+     * @param[in] offset Distance to move the center by
+     */
+    void Translate(const glm::vec3& offset)
+    {
+        center += offset;
+    }
 };
 
 // Subclass of SceneObject representing a Triangle scene object
@@ -135,6 +306,17 @@ struct Triangle : public SceneObject
     glm::vec3 B; // Second point
     glm::vec3 C; // Third point
 
+    /**
+     * @brief Constructor. Creates a degenerate triangle at the origin.
+     */
+    Triangle()
+        : SceneObject(ObjectType::Triangle)
+        , A(0.0f)
+        , B(0.0f)
+        , C(0.0f)
+    {
+    }
+
     /**
      * @brief Ray-Triangle intersection
      * @param[in]   incomingRay             Ray that will be checked for intersection with this object
@@ -142,7 +324,7 @@ struct Triangle : public SceneObject
      * @param[out]  outIntersectionNormal   Normal vector at the point of intersection (in case there is an intersection)
      * @return If there is an intersection, returns the distance from the ray origin to the intersection point. Otherwise, returns a negative number.
      */
-    virtual float Intersect(const Ray& incomingRay, glm::vec3& outIntersectionPoint, glm::vec3& outIntersectionNormal)
+    float Intersect(const Ray& incomingRay, glm::vec3& outIntersectionPoint, glm::vec3& outIntersectionNormal) const
     {
         // The same idea for the outIntersectionPoint and outIntersectionNormal applies here
         
@@ -179,8 +361,64 @@ struct Triangle : public SceneObject
             }
         }
     }
+
+    /**
+     * @brief Triangle bounding box
+     * @return Axis-aligned box that fully contains the triangle
+     */
+    AABB GetBounds() const
+    {
+        AABB bounds;
+        bounds.Expand(A);
+        bounds.Expand(B);
+        bounds.Expand(C);
+        return bounds;
+    }
+
+    /**
+     * @brief Moves the triangle
+     * @param[in] offset Distance to move all three points by
+     */
+    void Translate(const glm::vec3& offset)
+    {
+        A += offset;
+        B += offset;
+        C += offset;
+    }
 };
 
+// Type-tag dispatch of the SceneObject functions to the subclass implementations
+
+float SceneObject::Intersect(const Ray& incomingRay, glm::vec3& outIntersectionPoint, glm::vec3& outIntersectionNormal) const
+{
+    if (type == ObjectType::Triangle)
+    {
+        return static_cast<const Triangle*>(this)->Intersect(incomingRay, outIntersectionPoint, outIntersectionNormal);
+    }
+    return static_cast<const Sphere*>(this)->Intersect(incomingRay, outIntersectionPoint, outIntersectionNormal);
+}
+
+AABB SceneObject::GetBounds() const
+{
+    if (type == ObjectType::Triangle)
+    {
+        return static_cast<const Triangle*>(this)->GetBounds();
+    }
+    return static_cast<const Sphere*>(this)->GetBounds();
+}
+
+void SceneObject::Translate(const glm::vec3& offset)
+{
+    if (type == ObjectType::Triangle)
+    {
+        static_cast<Triangle*>(this)->Translate(offset);
+    }
+    else
+    {
+        static_cast<Sphere*>(this)->Translate(offset);
+    }
+}
+
 struct Camera
 {
     glm::vec3 position; // Position
@@ -211,844 +449,3758 @@ struct IntersectionInfo
 {
     Ray incomingRay; // Ray used to calculate the intersection
     float t; // Distance from the ray's origin to the point of intersection (if there was an intersection).
-    SceneObject* obj; // Object that the ray intersected with. If this is equal to nullptr, then no intersection occured.
+    const SceneObject* obj; // Object that the ray intersected with. If this is equal to nullptr, then no intersection occured.
     glm::vec3 intersectionPoint; // Point where the intersection occured (if there was an intersection)
     glm::vec3 intersectionNormal; // Normal vector at the point of intersection (if there was an intersection)
 };
 
-struct Scene
+// Camera rays through up to eight neighbouring pixels of an image row, in structure-of-arrays layout
+struct RayPacket
 {
-    std::vector<SceneObject*> objects; // List of all objects in the scene
-    std::vector<Light> lights; // List of all lights in the scene
+    static const int size = 8; // Largest number of rays in a packet
+
+    float originX[size], originY[size], originZ[size]; // Ray origins
+    float directionX[size], directionY[size], directionZ[size]; // Ray directions
+    int count; // Number of lanes in use
+
+    /**
+     * @brief Gets one ray of the packet
+     * @param[in] lane Index of the ray, below count
+     * @return Ray of the lane
+     */
+    Ray GetRay(int lane) const
+    {
+        Ray ray;
+        ray.origin = glm::vec3(originX[lane], originY[lane], originZ[lane]);
+        ray.direction = glm::vec3(directionX[lane], directionY[lane], directionZ[lane]);
+        return ray;
+    }
 };
 
-struct Image
+// Precomputed triangle data in structure-of-arrays layout.
+// Slot i describes the object at the same index of the list it was built from. Slots of non-triangle
+// objects are left degenerate (zero normal) so the kernels never report a hit for them.
+struct TriangleSoup
 {
-    std::vector<unsigned char> data; // Image data
-    int width; // Image width
-    int height; // Image height
+    static const int packetSize = 8; // Number of triangles tested per kernel call
+
+    std::vector<float> ax, ay, az; // Vertex A
+    std::vector<float> abx, aby, abz; // Edge B - A
+    std::vector<float> acx, acy, acz; // Edge C - A
+    std::vector<float> nx, ny, nz; // Unnormalized geometric normal cross(B - A, C - A)
+    std::vector<glm::vec3> unitNormals; // Normalized geometric normal, returned as the intersection normal
+    std::vector<unsigned char> isTriangle; // 1 if the slot holds a triangle, 0 if the object has to be intersected through SceneObject::Intersect
+    int count; // Number of slots (the arrays are padded by one packet so that kernels may read past the end)
 
     /**
      * @brief Constructor
-     * @param[in] w Width
-     * @param[in] h Height
      */
-    Image(const int& w, const int& h)
-        : width(w)
-        , height(h)
+    TriangleSoup()
+        : count(0)
     {
-        data.resize(w * h * 3, 0);
     }
 
     /**
-     * @brief Converts the provided color value from [0, 1] to [0, 255]
-     * @param[in] c Color value in [0, 1] range
-     * @return Color value in [0, 255] range
+     * @brief Fills the soup from a list of objects
+     * @param[in] objects Objects to precompute. Non-triangles get an empty slot.
      */
-    unsigned char ToChar(float c)
+    void Build(const std::vector<const SceneObject*>& objects)
     {
-        c = glm::clamp(c, 0.0f, 1.0f);
-        return static_cast<unsigned char>(c * 255);
+        count = static_cast<int>(objects.size());
+        int padded = count + packetSize;
+        std::vector<float>* arrays[] = { &ax, &ay, &az, &abx, &aby, &abz, &acx, &acy, &acz, &nx, &ny, &nz };
+        for (std::vector<float>* array : arrays)
+        {
+            array->assign(padded, 0.0f);
+        }
+        unitNormals.assign(padded, glm::vec3(0.0f));
+        isTriangle.assign(padded, 0);
+
+        for (int i = 0; i < count; ++i)
+        {
+            if (objects[i]->type != ObjectType::Triangle)
+            {
+                continue;
+            }
+            const Triangle* triangle = static_cast<const Triangle*>(objects[i]);
+
+            glm::vec3 ab = triangle->B - triangle->A;
+            glm::vec3 ac = triangle->C - triangle->A;
+            glm::vec3 n = glm::cross(ab, ac);
+            ax[i] = triangle->A.x; ay[i] = triangle->A.y; az[i] = triangle->A.z;
+            abx[i] = ab.x; aby[i] = ab.y; abz[i] = ab.z;
+            acx[i] = ac.x; acy[i] = ac.y; acz[i] = ac.z;
+            nx[i] = n.x; ny[i] = n.y; nz[i] = n.z;
+            unitNormals[i] = glm::normalize(n);
+            isTriangle[i] = 1;
+        }
     }
 
     /**
-     * @brief Sets the color at the specified pixel location
-     * @param[in] x     X-coordinate of the pixel
-     * @param[in] y     Y-coordinate of the pixel
-     * @param[in] color Pixel color
+     * @brief Tests one ray against up to packetSize consecutive slots. Uses the same math as Triangle::Intersect.
+     * @param[in]   ray     Ray to test
+     * @param[in]   first   First slot to test
+     * @param[in]   lanes   Number of slots to test (at most packetSize)
+     * @param[out]  outT    Distance to the intersection for every lane (only meaningful for lanes reported as hits)
+     * @return Bit mask of the lanes whose triangle is hit at a positive distance
      */
-    void SetColor(const int& x, const int& y, const glm::vec3& color)
+    int Intersect(const Ray& ray, int first, int lanes, float* outT) const
     {
-        int index = (y * width + x) * 3;
-        data[index] = ToChar(color.r);
-        data[index + 1] = ToChar(color.g);
-        data[index + 2] = ToChar(color.b);
-    }
-};
+#if defined(__AVX2__)
+        __m256 ndx = _mm256_set1_ps(-ray.direction.x);
+        __m256 ndy = _mm256_set1_ps(-ray.direction.y);
+        __m256 ndz = _mm256_set1_ps(-ray.direction.z);
 
-/**
- * @brief Gets the ray that goes from the camera's position to the specified pixel at (x, y)
- * @param[in] camera Camera data
- * @param[in] x X-coordinate of the pixel (upper-left corner of the pixel)
- * @param[in] y Y-coordinate of the pixel (upper-left corner of the pixel)
- * @return Ray that passes through the pixel at (x, y)
- */
+        __m256 pax = _mm256_sub_ps(_mm256_set1_ps(ray.origin.x), _mm256_loadu_ps(&ax[first]));
+        __m256 pay = _mm256_sub_ps(_mm256_set1_ps(ray.origin.y), _mm256_loadu_ps(&ay[first]));
+        __m256 paz = _mm256_sub_ps(_mm256_set1_ps(ray.origin.z), _mm256_loadu_ps(&az[first]));
+        __m256 vnx = _mm256_loadu_ps(&nx[first]);
+        __m256 vny = _mm256_loadu_ps(&ny[first]);
+        __m256 vnz = _mm256_loadu_ps(&nz[first]);
 
-Ray GetRayThruPixel(const Camera &camera, const int& pixelX, const int& pixelY)
-{
-    // Step 4
-    
-    Ray ray;
-    ray.origin = camera.position; 
+        // e = cross(-d, P - A)
+        __m256 ex = _mm256_sub_ps(_mm256_mul_ps(ndy, paz), _mm256_mul_ps(ndz, pay));
+        __m256 ey = _mm256_sub_ps(_mm256_mul_ps(ndz, pax), _mm256_mul_ps(ndx, paz));
+        __m256 ez = _mm256_sub_ps(_mm256_mul_ps(ndx, pay), _mm256_mul_ps(ndy, pax));
 
-    float aspect = camera.imageWidth / camera.imageHeight;
-    float viewportHeight = 2 * camera.focalLength * glm::tan(camera.fovY / 2);
-    float viewportWidth = aspect * viewportHeight;
+        __m256 f = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ndx, vnx), _mm256_mul_ps(ndy, vny)), _mm256_mul_ps(ndz, vnz));
+        __m256 t = _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(pax, vnx), _mm256_mul_ps(pay, vny)), _mm256_mul_ps(paz, vnz)), f);
+        __m256 u = _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(&acx[first]), ex), _mm256_mul_ps(_mm256_loadu_ps(&acy[first]), ey)), _mm256_mul_ps(_mm256_loadu_ps(&acz[first]), ez)), f);
+        __m256 v = _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(&abx[first]), ex), _mm256_mul_ps(_mm256_loadu_ps(&aby[first]), ey)), _mm256_mul_ps(_mm256_loadu_ps(&abz[first]), ez)), f);
+        v = _mm256_sub_ps(_mm256_setzero_ps(), v);
 
-    glm::vec3 lookDirection = glm::normalize(camera.lookTarget - ray.origin);
-    glm::vec3 upVector = camera.globalUp;
+        __m256 zero = _mm256_setzero_ps();
+        __m256 hit = _mm256_and_ps(_mm256_cmp_ps(t, zero, _CMP_GT_OQ), _mm256_cmp_ps(f, zero, _CMP_GT_OQ));
+        hit = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GT_OQ), _mm256_cmp_ps(v, zero, _CMP_GT_OQ)));
+        hit = _mm256_and_ps(hit, _mm256_cmp_ps(_mm256_add_ps(u, v), _mm256_set1_ps(1.0f), _CMP_LE_OQ));
 
-    glm::vec3 lcrossU = glm::cross(lookDirection, upVector);
-    glm::vec3 u = glm::normalize(lcrossU);
+        _mm256_storeu_ps(outT, t);
+        return _mm256_movemask_ps(hit) & ((1 << lanes) - 1);
+#elif defined(__ARM_NEON)
+        int mask = 0;
+        for (int half = 0; half < packetSize; half += 4)
+        {
+            int i = first + half;
+            float32x4_t ndx = vdupq_n_f32(-ray.direction.x);
+            float32x4_t ndy = vdupq_n_f32(-ray.direction.y);
+            float32x4_t ndz = vdupq_n_f32(-ray.direction.z);
 
-    glm::vec3 ucrossl = glm::cross(u, lookDirection);
-    glm::vec3 v = glm::normalize(ucrossl);
+            float32x4_t pax = vsubq_f32(vdupq_n_f32(ray.origin.x), vld1q_f32(&ax[i]));
+            float32x4_t pay = vsubq_f32(vdupq_n_f32(ray.origin.y), vld1q_f32(&ay[i]));
+            float32x4_t paz = vsubq_f32(vdupq_n_f32(ray.origin.z), vld1q_f32(&az[i]));
+            float32x4_t vnx = vld1q_f32(&nx[i]);
+            float32x4_t vny = vld1q_f32(&ny[i]);
+            float32x4_t vnz = vld1q_f32(&nz[i]);
 
-    glm::vec3 L = camera.position + lookDirection * camera.focalLength - u * (viewportWidth / 2) - v * (viewportHeight / 2);
+            // e = cross(-d, P - A)
+            float32x4_t ex = vsubq_f32(vmulq_f32(ndy, paz), vmulq_f32(ndz, pay));
+            float32x4_t ey = vsubq_f32(vmulq_f32(ndz, pax), vmulq_f32(ndx, paz));
+            float32x4_t ez = vsubq_f32(vmulq_f32(ndx, pay), vmulq_f32(ndy, pax));
 
-    float pixelSizeW = viewportWidth / camera.imageWidth;
-    float pixelSizeH = viewportHeight / camera.imageHeight;
+            float32x4_t f = vaddq_f32(vaddq_f32(vmulq_f32(ndx, vnx), vmulq_f32(ndy, vny)), vmulq_f32(ndz, vnz));
+            float32x4_t t = vdivq_f32(vaddq_f32(vaddq_f32(vmulq_f32(pax, vnx), vmulq_f32(pay, vny)), vmulq_f32(paz, vnz)), f);
+            float32x4_t u = vdivq_f32(vaddq_f32(vaddq_f32(vmulq_f32(vld1q_f32(&acx[i]), ex), vmulq_f32(vld1q_f32(&acy[i]), ey)), vmulq_f32(vld1q_f32(&acz[i]), ez)), f);
+            float32x4_t v = vnegq_f32(vdivq_f32(vaddq_f32(vaddq_f32(vmulq_f32(vld1q_f32(&abx[i]), ex), vmulq_f32(vld1q_f32(&aby[i]), ey)), vmulq_f32(vld1q_f32(&abz[i]), ez)), f));
 
-    float s = ((pixelX + pixelSizeW) / camera.imageWidth) * viewportWidth;
-    float t = ((pixelY + pixelSizeH) / camera.imageHeight) * viewportHeight;
-    glm::vec3 P = L + u * s + v * t;
-    glm::vec3 rayDirection = glm::normalize(P - ray.origin);
+            float32x4_t zero = vdupq_n_f32(0.0f);
+            uint32x4_t hit = vandq_u32(vcgtq_f32(t, zero), vcgtq_f32(f, zero));
+            hit = vandq_u32(hit, vandq_u32(vcgtq_f32(u, zero), vcgtq_f32(v, zero)));
+            hit = vandq_u32(hit, vcleq_f32(vaddq_f32(u, v), vdupq_n_f32(1.0f)));
 
-    ray.direction = rayDirection;
+            vst1q_f32(outT + half, t);
+            uint32_t lanesHit[4];
+            vst1q_u32(lanesHit, hit);
+            for (int lane = 0; lane < 4; ++lane)
+            {
+                mask |= (lanesHit[lane] ? 1 : 0) << (half + lane);
+            }
+        }
+        return mask & ((1 << lanes) - 1);
+#else
+        int mask = 0;
+        for (int lane = 0; lane < lanes; ++lane)
+        {
+            int i = first + lane;
+            glm::vec3 nd = -ray.direction;
+            glm::vec3 pa = ray.origin - glm::vec3(ax[i], ay[i], az[i]);
+            glm::vec3 n(nx[i], ny[i], nz[i]);
+            glm::vec3 e = glm::cross(nd, pa);
+            float f = glm::dot(nd, n);
 
-    return ray;
-}
+            float t = glm::dot(pa, n) / f;
+            float u = glm::dot(glm::vec3(acx[i], acy[i], acz[i]), e) / f;
+            float v = -glm::dot(glm::vec3(abx[i], aby[i], abz[i]), e) / f;
 
-/**
- * @brief Cast a ray to the scene.
- * @param[in] ray   Ray to cast to the scene
- * @param[in] scene Scene object
- * @return Returns an IntersectionInfo object that will contain the results of the raycast
- */
-IntersectionInfo Raycast(const Ray& ray, const Scene &scene)
+            outT[lane] = t;
+            if (t > 0 && f > 0 && u > 0 && v > 0 && u + v <= 1)
+            {
+                mask |= 1 << lane;
+            }
+        }
+        return mask;
+#endif
+    }
+};
+
+// Node of a flattened BVH. The two children of an interior node are stored next to each other.
+struct BVHNode
 {
-    // Step 6
+    AABB bounds; // Bounds of everything below this node
+    int leftFirst; // Interior node: index of the left child. Leaf: index of the first object in BVH::objects
+    int count; // Number of objects in the leaf, or 0 for interior nodes
+};
 
-    /*
-    // Fields that need to be populated:
-    ret.intersectionPoint = glm::vec3(0.0f); // Intersection point
-    ret.intersectionNormal = glm::vec3(0.0f); // Intersection normal
-    ret.t = 0.0f; // Distance from ray origin to intersection point
-    ret.obj = nullptr; // First object hit by the ray. Set to nullptr if the ray does not hit anything
-    */
+// Bounding volume hierarchy over the scene objects, built with the surface area heuristic (SAH)
+struct BVH
+{
+    static const int binCount = 16; // Number of SAH bins per axis
+    static const int maxLeafSize = TriangleSoup::packetSize; // Leaves never hold more objects than this unless they cannot be split
+    static const int maxDepth = 60; // Deepest level the builder will create (traversal stack is sized from it)
 
-    std::vector<IntersectionInfo> intersections;
-    IntersectionInfo ret;
+    std::vector<BVHNode> nodes; // Flattened nodes. nodes[0] is the root.
+    std::vector<const SceneObject*> objects; // Scene objects reordered so that each leaf references a contiguous range
+    TriangleSoup triangles; // Precomputed triangles in the same order as objects, used as the leaf kernel
+    float builtCost; // Cost() right after the last Build(). Refit() keeps the topology, so Cost() only grows from here as objects move.
+
+    /**
+     * @brief Constructor
+     */
+    BVH()
+        : builtCost(0.0f)
+    {
+    }
 
-    for (int i = 0; i < scene.objects.size(); i++)
+    /**
+     * @brief SAH cost of intersecting a group of objects. Triangles are tested one packet at a time, so they cost one
+     * kernel call per packet; every other object is intersected on its own and costs one call.
+     * @param[in] objectCount   Number of objects
+     * @param[in] triangleCount Number of triangles among them
+     * @return Number of intersection calls needed
+     */
+    static float LeafCost(int objectCount, int triangleCount)
     {
-        IntersectionInfo info;
-        info.incomingRay = ray;
-        float intersection = scene.objects[i]->Intersect(info.incomingRay, info.intersectionPoint, info.intersectionNormal);
+        int packets = (triangleCount + TriangleSoup::packetSize - 1) / TriangleSoup::packetSize;
+        return static_cast<float>(packets + objectCount - triangleCount);
+    }
 
-        if (intersection < 0)
+    /**
+     * @brief Builds the hierarchy over the provided objects. Must be called again whenever the objects change.
+     * @param[in] sceneObjects Objects to build the hierarchy over
+     */
+    void Build(const std::vector<SceneObject*>& sceneObjects)
+    {
+        nodes.clear();
+        objects.clear();
+        builtCost = 0.0f;
+        if (sceneObjects.empty())
         {
-            info.obj = nullptr;
+            return;
         }
-        else
+
+        std::vector<AABB> objectBounds(sceneObjects.size());
+        std::vector<glm::vec3> centroids(sceneObjects.size());
+        std::vector<int> indices(sceneObjects.size());
+        std::vector<unsigned char> isTriangle(sceneObjects.size());
+        for (size_t i = 0; i < sceneObjects.size(); ++i)
         {
-            info.obj = scene.objects[i];
+            objectBounds[i] = sceneObjects[i]->GetBounds();
+            centroids[i] = (objectBounds[i].minPoint + objectBounds[i].maxPoint) * 0.5f;
+            indices[i] = static_cast<int>(i);
+            isTriangle[i] = sceneObjects[i]->type == ObjectType::Triangle ? 1 : 0;
         }
 
-        info.t = intersection;
-        intersections.push_back(info);
-    }
+        // A binary tree over N leaves never has more than 2N - 1 nodes, so this never reallocates
+        nodes.reserve(sceneObjects.size() * 2);
+        nodes.push_back(BVHNode());
+        Subdivide(0, 0, static_cast<int>(sceneObjects.size()), 0, objectBounds, centroids, isTriangle, indices);
 
-    // checks if all objects are nullptr
-    bool noIntersection = true;
-    for (int i = 0; i < intersections.size(); i++)
-    {
-        if (intersections[i].obj != nullptr)
+        objects.resize(sceneObjects.size());
+        for (size_t i = 0; i < indices.size(); ++i)
         {
-            noIntersection = false;
-            break;
+            objects[i] = sceneObjects[indices[i]];
         }
+        triangles.Build(objects);
+        builtCost = Cost();
     }
 
-    float shortestDistance = intersections[0].t;
-    int index = 0;
-    if (noIntersection == true)
-    {
-        ret.obj = nullptr;
-        return ret;
-    }
-    else // find IntersectionInfo with the smallest positive t
+    /**
+     * @brief Updates the hierarchy after its objects moved, keeping the tree as it was built. Every node's bounds are recomputed
+     * bottom-up and the triangle soup is refilled, which is linear in the number of objects instead of the O(N log N) of Build().
+     * The tree gets worse the farther the objects move from where they were at the last Build(); compare Cost() with builtCost.
+     */
+    void Refit()
     {
-        for (int i = 0; i < intersections.size(); i++)
+        triangles.Build(objects);
+
+        // Children are always stored after their parent, so a reverse sweep updates them first
+        for (int i = static_cast<int>(nodes.size()) - 1; i >= 0; --i)
         {
-            if (shortestDistance < 0 && intersections[i].t > 0)
+            BVHNode& node = nodes[i];
+            AABB bounds;
+            if (node.count > 0)
             {
-                shortestDistance = intersections[i].t;
-                index = i;
+                for (int j = node.leftFirst; j < node.leftFirst + node.count; ++j)
+                {
+                    bounds.Expand(objects[j]->GetBounds());
+                }
             }
-            else if (shortestDistance > intersections[i].t && intersections[i].t > 0)
+            else
             {
-                shortestDistance = intersections[i].t;
-                index = i;
+                bounds.Expand(nodes[node.leftFirst].bounds);
+                bounds.Expand(nodes[node.leftFirst + 1].bounds);
             }
+            node.bounds = bounds;
         }
     }
 
-    return intersections[index];
-}
-
-// RNG; for blury reflections
-double random(double interval)
-{
-    int r = rand();
-    return double(r) / RAND_MAX * interval - interval;
-}
-
-/**
- * @brief Perform a ray-trace to the scene
- * @param[in] ray       Ray to trace
- * @param[in] scene     Scene data
- * @param[in] camera    Camera data
- * @param[in] maxDepth  Maximum depth of the trace
- * @return Resulting color after the ray bounced around the scene
- */
-glm::vec3 RayTrace(const Ray& ray, const Scene& scene, const Camera& camera, int maxDepth = 1)
-{
-    IntersectionInfo ret;
-    ret.incomingRay = ray;
-
-    vector<glm::vec3> ambientValues;
-    vector<glm::vec3> diffuseValues;
-    vector<glm::vec3> specularValues;
-    
-    Scene currentScene = scene;
-    
-    glm::vec3 color = glm::vec3(0.33f, 0.6f, 0.75f);
-  
-    glm::vec3 finalAmbient = glm::vec3(0.0);
-    glm::vec3 finalDiffuse = glm::vec3(0.0);
-    glm::vec3 finalSpecular = glm::vec3(0.0);
-    glm::vec3 finalColor(0.0f, 0.0f, 0.0f);
-    
-    // For blurry reflections
-    double px, py, pz;
-    glm::vec3 newRays;
-    
-    // Step 7
-    
-    ret = Raycast( ret.incomingRay, currentScene );
-    
-    if( ret.obj == nullptr )
-    {
-        return color;
-    }
-    else
+    /**
+     * @brief SAH cost of the whole tree with the same cost model as the builder, relative to the root's surface area
+     * @return Expected number of node visits and kernel calls of a ray that hits the root, or 0 for an empty tree
+     */
+    float Cost() const
     {
-        // Steps 13, 15
-        
-        for (int i = 0; i < scene.lights.size(); i++)
+        if (nodes.empty())
         {
-            if (scene.lights[i].position.w == 1) // if point light
-            {
-                Ray shadowRay;
-                shadowRay.origin = ret.intersectionPoint + 0.001f * ret.intersectionNormal;
-                shadowRay.direction = glm::normalize(glm::vec3(scene.lights[i].position) - shadowRay.origin);
-                IntersectionInfo shadowInfo;
-                shadowInfo = Raycast(shadowRay, currentScene);
-
-                // Step 14 : Attenuation
-                float pointDistance = glm::length(glm::vec3(scene.lights[i].position) - ret.intersectionPoint);
-                float attenuation = 1.0f / (scene.lights[i].constant + (scene.lights[i].linear * pointDistance) + scene.lights[i].quadratic * (pointDistance * pointDistance));
+            return 0.0f;
+        }
 
-                if (shadowInfo.obj == nullptr || pointDistance < shadowInfo.t)
-                {
-                    // Ambient
-                    glm::vec3 ambient = ret.obj->material.ambient * scene.lights[i].ambient * attenuation;
-                    ambientValues.push_back(ambient);
-
-                    // Diffuse
-                    glm::vec3 lightDir = glm::normalize(glm::vec3(scene.lights[i].position) - ret.intersectionPoint);
-                    float d = max(glm::dot(ret.intersectionNormal, lightDir), 0.0f);
-                    glm::vec3 diffuse = d * (ret.obj->material.diffuse * scene.lights[i].diffuse) * attenuation;
-                    diffuseValues.push_back(diffuse);
-
-                    // Specular
-                    glm::vec3 e = glm::normalize(camera.position - ret.intersectionPoint);
-                    glm::vec3 reflect = glm::reflect(lightDir, ret.intersectionNormal);
-                    float s = pow(max(glm::dot(reflect, e), 0.0f), ret.obj->material.shininess);
-                    glm::vec3 specular = s * (ret.obj->material.specular * scene.lights[i].specular) * attenuation;
-                    specularValues.push_back(specular);
-                    
-                    // Step 16: Reflection
-                    if (maxDepth >= 0)
-                    {
-                        Ray reflectionRay;
-                        reflectionRay.origin = ret.intersectionPoint + 0.001f * ret.intersectionNormal;
-                        reflectionRay.direction = glm::reflect(ret.incomingRay.direction, ret.intersectionNormal);
-                        float Kr = ret.obj->material.shininess / 128.0f;
-                        finalColor += Kr * RayTrace(reflectionRay, currentScene, camera, maxDepth - 1);
-                    }
-                }
-                else
+        float cost = 0.0f;
+        for (const BVHNode& node : nodes)
+        {
+            float nodeCost = 1.0f;
+            if (node.count > 0)
+            {
+                int triangleCount = 0;
+                for (int i = node.leftFirst; i < node.leftFirst + node.count; ++i)
                 {
-                    // Ambient
-                    glm::vec3 ambient = ret.obj->material.ambient * scene.lights[i].ambient * attenuation;
-                    ambientValues.push_back(ambient);
+                    triangleCount += triangles.isTriangle[i];
                 }
-                
+                nodeCost = LeafCost(node.count, triangleCount);
             }
-            else if (scene.lights[i].position.w == 0) // if directional light
-            {
-                Ray shadowRay;
-                shadowRay.origin = ret.intersectionPoint + 0.0001f * ret.intersectionNormal;
-                shadowRay.direction = glm::normalize(-glm::vec3(scene.lights[i].position));
-                IntersectionInfo shadowInfo;
-                shadowInfo = Raycast(shadowRay, currentScene);
-                
-                if (shadowInfo.obj == nullptr)
+            cost += nodeCost * node.bounds.SurfaceArea();
+        }
+        return cost / std::max(nodes[0].bounds.SurfaceArea(), std::numeric_limits<float>::min());
+    }
+
+    /**
+     * @brief Recursively splits a node along the cheapest SAH bin boundary
+     * @param[in]       nodeIndex       Node to split
+     * @param[in]       first           First entry of indices covered by the node
+     * @param[in]       count           Number of entries of indices covered by the node
+     * @param[in]       depth           Depth of the node
+     * @param[in]       objectBounds    Bounds of every object
+     * @param[in]       centroids       Bounds centroid of every object
+     * @param[in]       isTriangle      1 for every object that is a triangle, 0 otherwise
+     * @param[in,out]   indices         Object indices, partitioned in place
+     */
+    void Subdivide(int nodeIndex, int first, int count, int depth, const std::vector<AABB>& objectBounds, const std::vector<glm::vec3>& centroids,
+        const std::vector<unsigned char>& isTriangle, std::vector<int>& indices)
+    {
+        AABB bounds;
+        AABB centroidBounds;
+        int triangleCount = 0;
+        for (int i = first; i < first + count; ++i)
+        {
+            bounds.Expand(objectBounds[indices[i]]);
+            centroidBounds.Expand(centroids[indices[i]]);
+            triangleCount += isTriangle[indices[i]];
+        }
+        nodes[nodeIndex].bounds = bounds;
+        nodes[nodeIndex].leftFirst = first;
+        nodes[nodeIndex].count = count;
+
+        if (count <= 1 || depth >= maxDepth)
+        {
+            return;
+        }
+
+        // Find the cheapest split over all axes
+        float bestCost = std::numeric_limits<float>::max();
+        int bestAxis = -1;
+        int bestBin = -1;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            float axisMin = centroidBounds.minPoint[axis];
+            float axisExtent = centroidBounds.maxPoint[axis] - axisMin;
+            if (axisExtent <= 0.0f)
+            {
+                continue;
+            }
+
+            AABB binBounds[binCount];
+            int binObjects[binCount] = { 0 };
+            int binTriangles[binCount] = { 0 };
+            float binScale = binCount / axisExtent;
+            for (int i = first; i < first + count; ++i)
+            {
+                int bin = std::min(binCount - 1, static_cast<int>((centroids[indices[i]][axis] - axisMin) * binScale));
+                binObjects[bin]++;
+                binTriangles[bin] += isTriangle[indices[i]];
+                binBounds[bin].Expand(objectBounds[indices[i]]);
+            }
+
+            // Sweep from both sides to get the area and object count left/right of every bin boundary
+            float leftArea[binCount - 1], rightArea[binCount - 1];
+            int leftCount[binCount - 1], rightCount[binCount - 1];
+            int leftTriangles[binCount - 1], rightTriangles[binCount - 1];
+            AABB leftBox, rightBox;
+            int leftSum = 0, rightSum = 0;
+            int leftTriangleSum = 0, rightTriangleSum = 0;
+            for (int i = 0; i < binCount - 1; ++i)
+            {
+                leftSum += binObjects[i];
+                leftTriangleSum += binTriangles[i];
+                leftTriangles[i] = leftTriangleSum;
+                leftBox.Expand(binBounds[i]);
+                leftCount[i] = leftSum;
+                leftArea[i] = leftBox.SurfaceArea();
+
+                rightSum += binObjects[binCount - 1 - i];
+                rightTriangleSum += binTriangles[binCount - 1 - i];
+                rightTriangles[binCount - 2 - i] = rightTriangleSum;
+                rightBox.Expand(binBounds[binCount - 1 - i]);
+                rightCount[binCount - 2 - i] = rightSum;
+                rightArea[binCount - 2 - i] = rightBox.SurfaceArea();
+            }
+
+            for (int i = 0; i < binCount - 1; ++i)
+            {
+                if (leftCount[i] == 0 || rightCount[i] == 0)
                 {
-                    // Ambient
-                    glm::vec3 ambient = ret.obj->material.ambient * scene.lights[i].ambient;
-                    ambientValues.push_back(ambient);
-
-                    // Diffuse
-                    glm::vec3 lightDir = glm::normalize(glm::vec3(scene.lights[i].position));
-                    float d = max(glm::dot(ret.intersectionNormal, -lightDir), 0.0f);
-                    glm::vec3 diffuse = d * (ret.obj->material.diffuse * scene.lights[i].diffuse);
-                    diffuseValues.push_back(diffuse);
-
-                    // Specular
-                    glm::vec3 e = glm::normalize(camera.position - ret.intersectionPoint);
-                    glm::vec3 reflect = glm::reflect(lightDir, ret.intersectionNormal);
-                    float s = pow(max(glm::dot(reflect, e), 0.0f), ret.obj->material.shininess);
-                    glm::vec3 specular = s * (ret.obj->material.specular * scene.lights[i].specular);
-                    specularValues.push_back(specular);
-                    
-                    // Step 16: Reflection
-                    if (maxDepth >= 0)
+                    continue;
+                }
+                // One unit of traversal cost for visiting the two children
+                float cost = bounds.SurfaceArea() + LeafCost(leftCount[i], leftTriangles[i]) * leftArea[i]
+                    + LeafCost(rightCount[i], rightTriangles[i]) * rightArea[i];
+                if (cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestBin = i;
+                }
+            }
+        }
+
+        // Splitting has to beat intersecting everything in this node, unless the node is too big to be a leaf
+        float leafCost = LeafCost(count, triangleCount) * bounds.SurfaceArea();
+        if (bestAxis < 0 || (bestCost >= leafCost && count <= maxLeafSize))
+        {
+            return;
+        }
+
+        float axisMin = centroidBounds.minPoint[bestAxis];
+        float binScale = binCount / (centroidBounds.maxPoint[bestAxis] - axisMin);
+        int* middle = std::partition(indices.data() + first, indices.data() + first + count, [&](int index)
+        {
+            int bin = std::min(binCount - 1, static_cast<int>((centroids[index][bestAxis] - axisMin) * binScale));
+            return bin <= bestBin;
+        });
+        int leftCountFinal = static_cast<int>(middle - (indices.data() + first));
+        if (leftCountFinal == 0 || leftCountFinal == count)
+        {
+            return;
+        }
+
+        int leftChild = static_cast<int>(nodes.size());
+        nodes.push_back(BVHNode());
+        nodes.push_back(BVHNode());
+        nodes[nodeIndex].leftFirst = leftChild;
+        nodes[nodeIndex].count = 0;
+
+        Subdivide(leftChild, first, leftCountFinal, depth + 1, objectBounds, centroids, isTriangle, indices);
+        Subdivide(leftChild + 1, first + leftCountFinal, count - leftCountFinal, depth + 1, objectBounds, centroids, isTriangle, indices);
+    }
+
+    /**
+     * @brief Finds the closest intersection along the ray. Subtrees farther than the closest hit so far are skipped.
+     * @param[in]   ray         Ray to intersect
+     * @param[out]  outInfo     Intersection data of the closest hit (in case there is an intersection). Left untouched otherwise.
+     * @param[in]   maxDistance Only hits closer than this count, e.g. the closest hit already found in another BVH
+     * @return True if the ray hit anything closer than maxDistance
+     */
+    bool Intersect(const Ray& ray, IntersectionInfo& outInfo, float maxDistance = std::numeric_limits<float>::max()) const
+    {
+        if (nodes.empty())
+        {
+            return false;
+        }
+
+        glm::vec3 inverseDirection = 1.0f / ray.direction;
+        float closest = maxDistance;
+        bool hit = false;
+        glm::vec3 point, normal;
+
+        int stack[maxDepth + 2];
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+        while (stackSize > 0)
+        {
+            const BVHNode& node = nodes[stack[--stackSize]];
+            float nodeNear;
+            if (!node.bounds.IntersectRay(ray.origin, inverseDirection, closest, nodeNear))
+            {
+                continue;
+            }
+
+            if (node.count > 0)
+            {
+                int end = node.leftFirst + node.count;
+                for (int first = node.leftFirst; first < end; first += TriangleSoup::packetSize)
+                {
+                    float laneT[TriangleSoup::packetSize];
+                    int mask = triangles.Intersect(ray, first, std::min(TriangleSoup::packetSize, end - first), laneT);
+                    for (int lane = 0; mask != 0; ++lane, mask >>= 1)
                     {
-                        Ray reflectionRay;
-                        reflectionRay.origin = ret.intersectionPoint + 0.001f * ret.intersectionNormal;
-                        //reflectionRay.direction = glm::reflect(ret.incomingRay.direction, ret.intersectionNormal);
-                        
-                        // Async task: Blurry reflections
-                        // Referred to this source for help: https://www.cs.unc.edu/~adyilie/comp238/PA2/PA2.htm
-                        px = random(0.05);
-                        py = random(0.05);
-                        pz = random(0.05);
-                        newRays = glm::vec3(px, py, pz);
-                        
-                        reflectionRay.direction = glm::normalize(glm::reflect(ret.incomingRay.direction, ret.intersectionNormal) + newRays);
-                        
-                        float Kr = ret.obj->material.shininess / 128.0f;
-                        finalColor += Kr * RayTrace(reflectionRay, currentScene, camera, maxDepth - 1);
+                        if ((mask & 1) && laneT[lane] < closest)
+                        {
+                            closest = laneT[lane];
+                            hit = true;
+                            outInfo.t = closest;
+                            outInfo.obj = objects[first + lane];
+                            outInfo.intersectionPoint = ray.origin + closest * ray.direction;
+                            outInfo.intersectionNormal = triangles.unitNormals[first + lane];
+                        }
+                    }
+                }
+
+                // Everything that is not a triangle goes through SceneObject::Intersect
+                for (int i = node.leftFirst; i < end; ++i)
+                {
+                    if (triangles.isTriangle[i])
+                    {
+                        continue;
+                    }
+                    float t = objects[i]->Intersect(ray, point, normal);
+                    if (t > 0 && t < closest)
+                    {
+                        closest = t;
+                        hit = true;
+                        outInfo.t = t;
+                        outInfo.obj = objects[i];
+                        outInfo.intersectionPoint = point;
+                        outInfo.intersectionNormal = normal;
                     }
-                    
+                }
+                continue;
+            }
+
+            // Visit the nearer child first so that the farther one is more likely to be culled
+            int left = node.leftFirst;
+            int right = node.leftFirst + 1;
+            float leftNear, rightNear;
+            bool hitLeft = nodes[left].bounds.IntersectRay(ray.origin, inverseDirection, closest, leftNear);
+            bool hitRight = nodes[right].bounds.IntersectRay(ray.origin, inverseDirection, closest, rightNear);
+            if (hitLeft && hitRight)
+            {
+                if (leftNear <= rightNear)
+                {
+                    stack[stackSize++] = right;
+                    stack[stackSize++] = left;
                 }
                 else
                 {
-                    // Ambient
-                    glm::vec3 ambient = ret.obj->material.ambient * scene.lights[i].ambient;
-                    ambientValues.push_back(ambient);
+                    stack[stackSize++] = left;
+                    stack[stackSize++] = right;
                 }
             }
-            
-            for (glm::vec3 ambient : ambientValues)
+            else if (hitLeft)
+            {
+                stack[stackSize++] = left;
+            }
+            else if (hitRight)
             {
-                finalAmbient += ambient;
+                stack[stackSize++] = right;
             }
+        }
+
+        return hit;
+    }
+
+    /**
+     * @brief Checks whether anything blocks the ray. Returns on the first hit found instead of searching for the closest one.
+     * @param[in] ray           Ray to test
+     * @param[in] maxDistance   Only hits at distances up to (and including) this value count
+     * @return True if the ray hit anything within maxDistance
+     */
+    bool Occluded(const Ray& ray, float maxDistance) const
+    {
+        if (nodes.empty())
+        {
+            return false;
+        }
 
-            float ambientLights = ambientValues.size();
-            finalAmbient = finalAmbient / ambientLights;
+        glm::vec3 inverseDirection = 1.0f / ray.direction;
+        glm::vec3 point, normal;
 
-            for (glm::vec3 diffuse : diffuseValues)
+        int stack[maxDepth + 2];
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+        while (stackSize > 0)
+        {
+            const BVHNode& node = nodes[stack[--stackSize]];
+            float nodeNear;
+            if (!node.bounds.IntersectRay(ray.origin, inverseDirection, maxDistance, nodeNear))
             {
-                finalDiffuse += diffuse;
+                continue;
             }
 
-            for (glm::vec3 specular : specularValues)
+            if (node.count > 0)
             {
-                finalSpecular += specular;
+                int end = node.leftFirst + node.count;
+                for (int first = node.leftFirst; first < end; first += TriangleSoup::packetSize)
+                {
+                    float laneT[TriangleSoup::packetSize];
+                    int mask = triangles.Intersect(ray, first, std::min(TriangleSoup::packetSize, end - first), laneT);
+                    for (int lane = 0; mask != 0; ++lane, mask >>= 1)
+                    {
+                        if ((mask & 1) && laneT[lane] <= maxDistance)
+                        {
+                            return true;
+                        }
+                    }
+                }
+
+                for (int i = node.leftFirst; i < end; ++i)
+                {
+                    if (triangles.isTriangle[i])
+                    {
+                        continue;
+                    }
+                    float t = objects[i]->Intersect(ray, point, normal);
+                    if (t > 0 && t <= maxDistance)
+                    {
+                        return true;
+                    }
+                }
+                continue;
             }
 
-            finalColor += finalAmbient + finalDiffuse + finalSpecular;
-            
-        }
-        
-        return finalColor;
+            stack[stackSize++] = node.leftFirst + 1;
+            stack[stackSize++] = node.leftFirst;
+        }
+
+        return false;
+    }
+};
+
+// Periodic motion of a dynamic object, which oscillates around the position it was loaded at
+struct ObjectAnimation
+{
+    ObjectType type = ObjectType::Sphere; // Pool of the animated object
+    uint32_t index = 0; // Index of the animated object in its pool. Its dynamic flag is set.
+    glm::vec3 amplitude = glm::vec3(0.0f); // Largest offset from the rest position
+    float period = 1.0f; // Seconds per oscillation
+    glm::vec3 offset = glm::vec3(0.0f); // Offset from the rest position currently applied to the object
+};
+
+// The scene is only read while rendering: RayTrace and all render threads share one instance by const reference
+struct Scene
+{
+    std::vector<SceneObject*> objects; // All objects in the scene: pointers into triangles and spheres, filled by BuildAccelerationStructures()
+    std::vector<Light> lights; // List of all lights in the scene
+    BVH bvh; // Acceleration structure over the static objects. Rebuild both BVHs with BuildAccelerationStructures() after changing objects.
+    BVH dynamicBvh; // Acceleration structure over the dynamic objects, refitted by AnimateScene() every frame
+    std::vector<SceneObject*> dynamicObjects; // Objects with the dynamic flag set, in scene order
+    std::vector<ObjectAnimation> animations; // Motion of the animated objects, applied by AnimateScene()
+
+    std::vector<Triangle> triangles; // Contiguous storage of all triangles
+    std::vector<Sphere> spheres; // Contiguous storage of all spheres
+
+    std::vector<Material> materials; // Distinct materials of the objects, in order of first use. Add to it with AddMaterial().
+    std::map<std::string, uint32_t> materialIndices; // Index into materials of every material, keyed by its raw bytes
+};
+
+/**
+ * @brief Adds a material to the scene's material table, unless an identical one is already in it
+ * @param[in,out]   scene       Scene data
+ * @param[in]       material    Material to add
+ * @return Index of the material in scene.materials, to be stored in SceneObject::material
+ */
+uint32_t AddMaterial(Scene& scene, const Material& material)
+{
+    std::string key(reinterpret_cast<const char*>(&material), sizeof(Material));
+    auto found = scene.materialIndices.find(key);
+    if (found == scene.materialIndices.end())
+    {
+        found = scene.materialIndices.insert(std::make_pair(key, static_cast<uint32_t>(scene.materials.size()))).first;
+        scene.materials.push_back(material);
+    }
+    return found->second;
+}
+
+/**
+ * @brief Lists the objects of the pools in scene.objects and builds the two BVHs of the scene: one over the static objects,
+ * which is never touched again, and one over the dynamic objects, which AnimateScene() keeps up to date.
+ * Raycast() and RaycastAny() query both. Must be called again whenever objects are added to the pools.
+ * @param[in,out] scene Scene to build the BVHs of
+ */
+void BuildAccelerationStructures(Scene& scene)
+{
+    scene.objects.clear();
+    scene.objects.reserve(scene.triangles.size() + scene.spheres.size());
+    for (Triangle& triangle : scene.triangles)
+    {
+        scene.objects.push_back(&triangle);
+    }
+    for (Sphere& sphere : scene.spheres)
+    {
+        scene.objects.push_back(&sphere);
+    }
+
+    std::vector<SceneObject*> staticObjects;
+    scene.dynamicObjects.clear();
+    for (SceneObject* object : scene.objects)
+    {
+        (object->dynamic ? scene.dynamicObjects : staticObjects).push_back(object);
+    }
+    scene.bvh.Build(staticObjects);
+    scene.dynamicBvh.Build(scene.dynamicObjects);
+}
+
+/**
+ * @brief Moves the animated objects to where they are at the given time and updates the dynamic BVH. The BVH is refitted,
+ * and only rebuilt once refitting has made it more than rebuildThreshold times as expensive as right after its last build.
+ * The static BVH is not touched, so the cost depends on the number of moving objects rather than on the size of the scene.
+ * @param[in,out]   scene               Scene to animate, with the BVHs already built
+ * @param[in]       time                Animation time in seconds
+ * @param[in]       rebuildThreshold    Largest accepted ratio of the refitted to the built SAH cost of the dynamic BVH
+ * @return True if the dynamic BVH was rebuilt
+ */
+bool AnimateScene(Scene& scene, float time, float rebuildThreshold = 1.5f)
+{
+    if (scene.animations.empty())
+    {
+        return false;
+    }
+
+    for (ObjectAnimation& animation : scene.animations)
+    {
+        glm::vec3 offset = animation.amplitude * std::sin(glm::radians(360.0f) * time / animation.period);
+        SceneObject& object = animation.type == ObjectType::Triangle ? static_cast<SceneObject&>(scene.triangles[animation.index])
+            : static_cast<SceneObject&>(scene.spheres[animation.index]);
+        object.Translate(offset - animation.offset);
+        animation.offset = offset;
+    }
+
+    scene.dynamicBvh.Refit();
+    if (scene.dynamicBvh.Cost() <= rebuildThreshold * scene.dynamicBvh.builtCost)
+    {
+        return false;
+    }
+    scene.dynamicBvh.Build(scene.dynamicObjects);
+    return true;
+}
+
+// --- Binary scene format ---
+// A header followed by tightly packed arrays: materials, triangles, spheres, lights.
+// Records use the in-memory layout of this program (little-endian, 32-bit floats), so a mapped file can be read in place.
+
+const char binarySceneMagic[4] = { 'R', 'T', 'S', 'B' };
+const uint32_t binarySceneVersion = 1;
+
+struct BinarySceneHeader
+{
+    char magic[4]; // binarySceneMagic
+    uint32_t version; // binarySceneVersion
+    float imageWidth; // Image width
+    float imageHeight; // Image height
+    glm::vec3 cameraPosition; // Camera position
+    glm::vec3 cameraLookTarget; // Camera look target
+    glm::vec3 cameraGlobalUp; // Camera global up-vector
+    float fovY; // Vertical field of view in radians
+    float focalLength; // Focal length
+    int32_t maxDepth; // Maximum depth of the trace
+    uint32_t materialCount; // Number of Material records
+    uint32_t triangleCount; // Number of BinaryTriangle records
+    uint32_t sphereCount; // Number of BinarySphere records
+    uint32_t lightCount; // Number of Light records
+};
+
+struct BinaryTriangle
+{
+    glm::vec3 A, B, C; // Vertices
+    uint32_t material; // Index into the material array
+};
+
+struct BinarySphere
+{
+    glm::vec3 center; // Center
+    float radius; // Radius
+    uint32_t material; // Index into the material array
+};
+
+static_assert(sizeof(glm::vec3) == 12 && sizeof(glm::vec4) == 16, "binary scenes expect tightly packed glm vectors");
+static_assert(sizeof(BinarySceneHeader) == 80 && sizeof(Material) == 40 && sizeof(BinaryTriangle) == 40
+    && sizeof(BinarySphere) == 20 && sizeof(Light) == 64, "binary scene record layout changed");
+
+// Read-only memory mapping of a whole file
+struct MappedFile
+{
+    const unsigned char* data; // Start of the mapped file, or nullptr if nothing is mapped
+    size_t size; // Size of the mapped file in bytes
+#ifdef _WIN32
+    HANDLE file; // File handle
+    HANDLE mapping; // File mapping handle
+#endif
+
+    /**
+     * @brief Constructor
+     */
+    MappedFile()
+        : data(nullptr)
+        , size(0)
+#ifdef _WIN32
+        , file(INVALID_HANDLE_VALUE)
+        , mapping(nullptr)
+#endif
+    {
+    }
+
+    /**
+     * @brief Destructor. Unmaps the file.
+     */
+    ~MappedFile()
+    {
+        Close();
+    }
+
+    /**
+     * @brief Maps the whole file into memory
+     * @param[in] path Path to the file
+     * @return True if the file was mapped
+     */
+    bool Open(const std::string& path)
+    {
+        Close();
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            return false;
+        }
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+        {
+            Close();
+            return false;
+        }
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping == nullptr)
+        {
+            Close();
+            return false;
+        }
+        data = static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        size = static_cast<size_t>(fileSize.QuadPart);
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+        struct stat fileInfo;
+        if (fstat(fd, &fileInfo) != 0 || fileInfo.st_size == 0)
+        {
+            close(fd);
+            return false;
+        }
+        void* mapped = mmap(nullptr, fileInfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd); // The mapping keeps the file alive
+        if (mapped == MAP_FAILED)
+        {
+            return false;
+        }
+        data = static_cast<const unsigned char*>(mapped);
+        size = static_cast<size_t>(fileInfo.st_size);
+#endif
+        if (data == nullptr)
+        {
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Unmaps the file (if one is mapped)
+     */
+    void Close()
+    {
+#ifdef _WIN32
+        if (data != nullptr)
+        {
+            UnmapViewOfFile(data);
+        }
+        if (mapping != nullptr)
+        {
+            CloseHandle(mapping);
+        }
+        if (file != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(file);
+        }
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (data != nullptr)
+        {
+            munmap(const_cast<unsigned char*>(data), size);
+        }
+#endif
+        data = nullptr;
+        size = 0;
+    }
+};
+
+struct Image
+{
+    std::vector<unsigned char> data; // Image data
+    int width; // Image width
+    int height; // Image height
+
+    /**
+     * @brief Constructor
+     * @param[in] w Width
+     * @param[in] h Height
+     */
+    Image(const int& w, const int& h)
+        : width(w)
+        , height(h)
+    {
+        data.resize(w * h * 3, 0);
+    }
+
+    /**
+     * @brief Converts the provided color value from [0, 1] to [0, 255]
+     * @param[in] c Color value in [0, 1] range
+     * @return Color value in [0, 255] range
+     */
+    unsigned char ToChar(float c)
+    {
+        c = glm::clamp(c, 0.0f, 1.0f);
+        return static_cast<unsigned char>(c * 255);
+    }
+
+    /**
+     * @brief Sets the color at the specified pixel location.
+     * The data buffer is never resized after construction, so threads writing to different pixels never touch the same bytes.
+     * @param[in] x     X-coordinate of the pixel
+     * @param[in] y     Y-coordinate of the pixel
+     * @param[in] color Pixel color
+     */
+    void SetColor(const int& x, const int& y, const glm::vec3& color)
+    {
+        int index = (y * width + x) * 3;
+        data[index] = ToChar(color.r);
+        data[index + 1] = ToChar(color.g);
+        data[index + 2] = ToChar(color.b);
+    }
+};
+
+// Work-stealing thread pool: every worker owns a task deque, pops from its back,
+// and steals from the front of the other workers' deques once its own runs dry
+struct ThreadPool
+{
+    struct WorkQueue
+    {
+        std::mutex mutex; // Guards tasks
+        std::deque<std::function<void()>> tasks; // Pending tasks
+    };
+
+    std::vector<std::unique_ptr<WorkQueue>> queues; // One queue per worker
+    std::vector<std::thread> workers; // Worker threads
+    std::mutex stateMutex; // Guards sleeping/waking of workers and waiters
+    std::condition_variable workAvailable; // Signaled when a task is submitted or the pool is stopping
+    std::condition_variable allDone; // Signaled when the last pending task finishes
+    std::atomic<int> queuedTasks; // Tasks submitted but not yet picked up by a worker
+    std::atomic<int> pendingTasks; // Tasks submitted but not yet finished
+    std::atomic<unsigned int> nextQueue; // Round-robin cursor for Submit
+    bool stopping; // Set when the pool is being destroyed
+
+    /**
+     * @brief Constructor
+     * @param[in] threadCount Number of worker threads (at least 1)
+     */
+    ThreadPool(int threadCount)
+        : queuedTasks(0)
+        , pendingTasks(0)
+        , nextQueue(0)
+        , stopping(false)
+    {
+        threadCount = std::max(threadCount, 1);
+        for (int i = 0; i < threadCount; ++i)
+        {
+            queues.push_back(std::unique_ptr<WorkQueue>(new WorkQueue()));
+        }
+        for (int i = 0; i < threadCount; ++i)
+        {
+            workers.push_back(std::thread(&ThreadPool::WorkerLoop, this, i));
+        }
+    }
+
+    /**
+     * @brief Destructor. Finishes the already submitted tasks before joining the workers.
+     */
+    ~ThreadPool()
+    {
+        Wait();
+        {
+            std::lock_guard<std::mutex> lock(stateMutex);
+            stopping = true;
+        }
+        workAvailable.notify_all();
+        for (std::thread& worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    /**
+     * @brief Adds a task to the pool. Tasks are spread round-robin across the worker queues.
+     * @param[in] task Task to run on one of the workers
+     */
+    void Submit(std::function<void()> task)
+    {
+        WorkQueue& queue = *queues[nextQueue++ % queues.size()];
+        pendingTasks++;
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock(stateMutex);
+            queuedTasks++;
+        }
+        workAvailable.notify_one();
+    }
+
+    /**
+     * @brief Blocks until every submitted task has finished
+     */
+    void Wait()
+    {
+        std::unique_lock<std::mutex> lock(stateMutex);
+        allDone.wait(lock, [this] { return pendingTasks == 0; });
+    }
+
+    /**
+     * @brief Takes a task from the worker's own queue, or steals one from another worker
+     * @param[in]   worker  Index of the worker looking for work
+     * @param[out]  outTask Task that was taken (in case one was found)
+     * @return True if a task was found
+     */
+    bool TryPop(int worker, std::function<void()>& outTask)
+    {
+        for (size_t i = 0; i < queues.size(); ++i)
+        {
+            bool ownQueue = (i == 0);
+            WorkQueue& queue = *queues[(worker + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.tasks.empty())
+            {
+                if (ownQueue)
+                {
+                    outTask = std::move(queue.tasks.back());
+                    queue.tasks.pop_back();
+                }
+                else
+                {
+                    outTask = std::move(queue.tasks.front());
+                    queue.tasks.pop_front();
+                }
+                queuedTasks--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * @brief Main loop of a worker thread
+     * @param[in] worker Index of the worker
+     */
+    void WorkerLoop(int worker)
+    {
+        std::function<void()> task;
+        while (true)
+        {
+            if (TryPop(worker, task))
+            {
+                task();
+                task = nullptr;
+                if (--pendingTasks == 0)
+                {
+                    std::lock_guard<std::mutex> lock(stateMutex);
+                    allDone.notify_all();
+                }
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(stateMutex);
+            workAvailable.wait(lock, [this] { return stopping || queuedTasks > 0; });
+            if (stopping && queuedTasks == 0)
+            {
+                return;
+            }
+        }
+    }
+};
+
+// Camera with everything that does not change between pixels worked out once per frame:
+// the u/v basis, the lower-left corner of the viewport and the pixel-to-viewport scale
+struct PreparedCamera
+{
+    glm::vec3 origin; // Ray origin (camera position)
+    glm::vec3 lowerLeft; // Point on the viewport hit by the ray through pixel (0, 0)
+    glm::vec3 stepX; // Offset on the viewport between horizontally neighbouring pixels
+    glm::vec3 stepY; // Offset on the viewport between vertically neighbouring pixels
+
+    /**
+     * @brief Constructor
+     * @param[in] camera Camera data
+     */
+    explicit PreparedCamera(const Camera& camera)
+    {
+        // Step 4
+
+        origin = camera.position;
+
+        float aspect = camera.imageWidth / camera.imageHeight;
+        float viewportHeight = 2 * camera.focalLength * glm::tan(camera.fovY / 2);
+        float viewportWidth = aspect * viewportHeight;
+
+        glm::vec3 lookDirection = glm::normalize(camera.lookTarget - origin);
+        glm::vec3 upVector = camera.globalUp;
+
+        glm::vec3 lcrossU = glm::cross(lookDirection, upVector);
+        glm::vec3 u = glm::normalize(lcrossU);
+
+        glm::vec3 ucrossl = glm::cross(u, lookDirection);
+        glm::vec3 v = glm::normalize(ucrossl);
+
+        glm::vec3 L = camera.position + lookDirection * camera.focalLength - u * (viewportWidth / 2) - v * (viewportHeight / 2);
+
+        float pixelSizeW = viewportWidth / camera.imageWidth;
+        float pixelSizeH = viewportHeight / camera.imageHeight;
+
+        // s = ((pixelX + pixelSizeW) / imageWidth) * viewportWidth, split into a per-pixel step and a constant offset
+        stepX = u * pixelSizeW;
+        stepY = v * pixelSizeH;
+        lowerLeft = L + stepX * pixelSizeW + stepY * pixelSizeH;
+    }
+
+    /**
+     * @brief Gets the ray that goes from the camera's position to the specified pixel at (x, y)
+     * @param[in] pixelX X-coordinate of the pixel (upper-left corner of the pixel). Fractional values address points inside the pixel.
+     * @param[in] pixelY Y-coordinate of the pixel (upper-left corner of the pixel). Fractional values address points inside the pixel.
+     * @return Ray that passes through the pixel at (x, y)
+     */
+    Ray GetRay(float pixelX, float pixelY) const
+    {
+        Ray ray;
+        ray.origin = origin;
+        ray.direction = glm::normalize(lowerLeft + stepX * pixelX + stepY * pixelY - origin);
+        return ray;
+    }
+
+    /**
+     * @brief Gets the rays through neighbouring pixels of one row. Lane i matches GetRay(pixelX + i, pixelY).
+     * @param[in]   pixelX  X-coordinate of the first pixel
+     * @param[in]   pixelY  Y-coordinate of the row
+     * @param[in]   count   Number of pixels (at most RayPacket::size)
+     * @param[out]  packet  Rays through the pixels, from left to right
+     */
+    void GetRays(int pixelX, float pixelY, int count, RayPacket& packet) const
+    {
+        packet.count = count;
+        for (int lane = 0; lane < count; ++lane)
+        {
+            float x = static_cast<float>(pixelX + lane);
+            float dx = lowerLeft.x + stepX.x * x + stepY.x * pixelY - origin.x;
+            float dy = lowerLeft.y + stepX.y * x + stepY.y * pixelY - origin.y;
+            float dz = lowerLeft.z + stepX.z * x + stepY.z * pixelY - origin.z;
+            float inverseLength = 1.0f / std::sqrt(dx * dx + dy * dy + dz * dz);
+
+            packet.originX[lane] = origin.x;
+            packet.originY[lane] = origin.y;
+            packet.originZ[lane] = origin.z;
+            packet.directionX[lane] = dx * inverseLength;
+            packet.directionY[lane] = dy * inverseLength;
+            packet.directionZ[lane] = dz * inverseLength;
+        }
+    }
+};
+
+/**
+ * @brief Gets the ray that goes from the camera's position to the specified pixel at (x, y).
+ * Sets up the camera basis on every call; loops over many pixels should build a PreparedCamera once instead.
+ * @param[in] camera Camera data
+ * @param[in] x X-coordinate of the pixel (upper-left corner of the pixel). Fractional values address points inside the pixel.
+ * @param[in] y Y-coordinate of the pixel (upper-left corner of the pixel). Fractional values address points inside the pixel.
+ * @return Ray that passes through the pixel at (x, y)
+ */
+Ray GetRayThruPixel(const Camera &camera, float pixelX, float pixelY)
+{
+    return PreparedCamera(camera).GetRay(pixelX, pixelY);
+}
+
+/**
+ * @brief Cast a ray to the scene.
+ * @param[in] ray   Ray to cast to the scene
+ * @param[in] scene Scene object
+ * @return Returns an IntersectionInfo object that will contain the results of the raycast
+ */
+IntersectionInfo Raycast(const Ray& ray, const Scene &scene)
+{
+    // Step 6
+
+    /*
+    // Fields that need to be populated:
+    ret.intersectionPoint = glm::vec3(0.0f); // Intersection point
+    ret.intersectionNormal = glm::vec3(0.0f); // Intersection normal
+    ret.t = 0.0f; // Distance from ray origin to intersection point
+    ret.obj = nullptr; // First object hit by the ray. Set to nullptr if the ray does not hit anything
+    */
+
+    IntersectionInfo ret;
+    ret.incomingRay = ray;
+    ret.t = -1;
+    ret.obj = nullptr;
+
+    scene.bvh.Intersect(ray, ret);
+    // Dynamic objects only count if they are closer than the closest static hit
+    scene.dynamicBvh.Intersect(ray, ret, ret.obj != nullptr ? ret.t : std::numeric_limits<float>::max());
+
+    return ret;
+}
+
+/**
+ * @brief Cast a shadow ray to the scene. Stops at the first hit instead of looking for the closest one.
+ * @param[in] ray           Ray to cast to the scene
+ * @param[in] scene         Scene object
+ * @param[in] maxDistance   Only hits at distances up to (and including) this value block the ray
+ * @return True if any object blocks the ray within maxDistance
+ */
+bool RaycastAny(const Ray& ray, const Scene& scene, float maxDistance)
+{
+    return scene.bvh.Occluded(ray, maxDistance) || scene.dynamicBvh.Occluded(ray, maxDistance);
+}
+
+// PCG32 random number generator (https://www.pcg-random.org), small and fast enough to keep one per thread
+struct Pcg32
+{
+    uint64_t state; // Internal state
+    uint64_t increment; // Stream selector, always odd
+
+    /**
+     * @brief Restarts the generator
+     * @param[in] seed      Starting point in the sequence
+     * @param[in] sequence  Selects one of 2^63 independent streams
+     */
+    void Seed(uint64_t seed, uint64_t sequence)
+    {
+        state = 0;
+        increment = (sequence << 1) | 1;
+        NextUInt();
+        state += seed;
+        NextUInt();
+    }
+
+    /**
+     * @brief Advances the generator
+     * @return Uniformly distributed 32-bit value
+     */
+    uint32_t NextUInt()
+    {
+        uint64_t previous = state;
+        state = previous * 6364136223846793005ULL + increment;
+        uint32_t xorShifted = static_cast<uint32_t>(((previous >> 18) ^ previous) >> 27);
+        uint32_t rotation = static_cast<uint32_t>(previous >> 59);
+        return (xorShifted >> rotation) | (xorShifted << ((32 - rotation) & 31));
+    }
+
+    /**
+     * @brief Advances the generator
+     * @return Uniformly distributed value in [0, 1)
+     */
+    double NextDouble()
+    {
+        return NextUInt() * (1.0 / 4294967296.0);
+    }
+};
+
+// Every render thread owns a generator, so sampling never touches shared state
+thread_local Pcg32 randomGenerator = { 0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL };
+
+/**
+ * @brief Reseeds the calling thread's generator for one sample of one pixel.
+ * The random numbers of a sample then only depend on its pixel and its index, never on which thread traces it.
+ * @param[in] x         X-coordinate of the pixel
+ * @param[in] y         Y-coordinate of the pixel
+ * @param[in] sample    Index of the sample within the pixel
+ */
+void SeedRandom(int x, int y, int sample)
+{
+    uint64_t pixel = (static_cast<uint64_t>(static_cast<uint32_t>(y)) << 32) | static_cast<uint32_t>(x);
+    randomGenerator.Seed(pixel, static_cast<uint64_t>(sample));
+}
+
+// Number of rays traced, by kind
+struct RayCounts
+{
+    uint64_t primary; // Camera rays
+    uint64_t shadow; // Shadow rays towards the lights
+    uint64_t reflection; // Reflection rays
+
+    /**
+     * @brief Total number of rays
+     * @return Sum of all kinds
+     */
+    uint64_t Total() const
+    {
+        return primary + shadow + reflection;
+    }
+
+    /**
+     * @brief Adds the counts of another RayCounts
+     * @param[in] other Counts to add
+     * @return This object
+     */
+    RayCounts& operator+=(const RayCounts& other)
+    {
+        primary += other.primary;
+        shadow += other.shadow;
+        reflection += other.reflection;
+        return *this;
+    }
+
+    /**
+     * @brief Difference between two snapshots of the counters
+     * @param[in] other Earlier snapshot
+     * @return Rays counted since the earlier snapshot
+     */
+    RayCounts operator-(const RayCounts& other) const
+    {
+        RayCounts difference = { primary - other.primary, shadow - other.shadow, reflection - other.reflection };
+        return difference;
+    }
+};
+
+// Rays traced by the calling thread. Render tasks add their share to the frame's total once a tile is done,
+// so the hot path only bumps thread-local counters.
+thread_local RayCounts rayCounts = { 0, 0, 0 };
+
+// RNG; for blury reflections
+double random(double interval)
+{
+    double r = randomGenerator.NextDouble();
+    return r * interval - interval;
+}
+
+// Color of rays that leave the scene
+const glm::vec3 backgroundColor = glm::vec3(0.33f, 0.6f, 0.75f);
+
+// RayTrace() and ShadeSurface() call each other for the reflection rays
+glm::vec3 RayTrace(const Ray& ray, const Scene& scene, const Camera& camera, int maxDepth = 1);
+
+/**
+ * @brief Shades a surface point: a shadow ray towards every light, plus a reflection ray for every light that reaches the point
+ * @param[in] hit       Surface point: incoming ray, intersection point and normal (the object is not used)
+ * @param[in] material  Material of the surface
+ * @param[in] scene     Scene data
+ * @param[in] camera    Camera data
+ * @param[in] maxDepth  Maximum depth of the trace
+ * @return Color of the point seen along the incoming ray
+ */
+glm::vec3 ShadeSurface(const IntersectionInfo& hit, const Material& material, const Scene& scene, const Camera& camera, int maxDepth)
+{
+    // Running sums of the per-light terms. Fixed accumulators instead of per-call vectors, so tracing never allocates.
+    glm::vec3 ambientSum = glm::vec3(0.0f);
+    glm::vec3 diffuseSum = glm::vec3(0.0f);
+    glm::vec3 specularSum = glm::vec3(0.0f);
+    int ambientCount = 0;
+
+    glm::vec3 finalAmbient = glm::vec3(0.0);
+    glm::vec3 finalDiffuse = glm::vec3(0.0);
+    glm::vec3 finalSpecular = glm::vec3(0.0);
+    glm::vec3 finalColor(0.0f, 0.0f, 0.0f);
+    
+    // For blurry reflections
+    double px, py, pz;
+    glm::vec3 newRays;
+
+    // Steps 13, 15
+    
+    for (int i = 0; i < scene.lights.size(); i++)
+    {
+        if (scene.lights[i].position.w == 1) // if point light
+        {
+            Ray shadowRay;
+            shadowRay.origin = hit.intersectionPoint + 0.001f * hit.intersectionNormal;
+            shadowRay.direction = glm::normalize(glm::vec3(scene.lights[i].position) - shadowRay.origin);
+
+            // Step 14 : Attenuation
+            float pointDistance = glm::length(glm::vec3(scene.lights[i].position) - hit.intersectionPoint);
+            float attenuation = 1.0f / (scene.lights[i].constant + (scene.lights[i].linear * pointDistance) + scene.lights[i].quadratic * (pointDistance * pointDistance));
+
+            // Only objects between the point and the light cast a shadow
+            bool inShadow = RaycastAny(shadowRay, scene, pointDistance);
+            rayCounts.shadow++;
+
+            if (!inShadow)
+            {
+                // Ambient
+                glm::vec3 ambient = material.ambient * scene.lights[i].ambient * attenuation;
+                ambientSum += ambient;
+                ambientCount++;
+
+                // Diffuse
+                glm::vec3 lightDir = glm::normalize(glm::vec3(scene.lights[i].position) - hit.intersectionPoint);
+                float d = max(glm::dot(hit.intersectionNormal, lightDir), 0.0f);
+                glm::vec3 diffuse = d * (material.diffuse * scene.lights[i].diffuse) * attenuation;
+                diffuseSum += diffuse;
+
+                // Specular
+                glm::vec3 e = glm::normalize(camera.position - hit.intersectionPoint);
+                glm::vec3 reflect = glm::reflect(lightDir, hit.intersectionNormal);
+                float s = pow(max(glm::dot(reflect, e), 0.0f), material.shininess);
+                glm::vec3 specular = s * (material.specular * scene.lights[i].specular) * attenuation;
+                specularSum += specular;
+                
+                // Step 16: Reflection
+                if (maxDepth >= 0)
+                {
+                    Ray reflectionRay;
+                    reflectionRay.origin = hit.intersectionPoint + 0.001f * hit.intersectionNormal;
+                    reflectionRay.direction = glm::reflect(hit.incomingRay.direction, hit.intersectionNormal);
+                    float Kr = material.shininess / 128.0f;
+                    rayCounts.reflection++;
+                    finalColor += Kr * RayTrace(reflectionRay, scene, camera, maxDepth - 1);
+                }
+            }
+            else
+            {
+                // Ambient
+                glm::vec3 ambient = material.ambient * scene.lights[i].ambient * attenuation;
+                ambientSum += ambient;
+                ambientCount++;
+            }
+            
+        }
+        else if (scene.lights[i].position.w == 0) // if directional light
+        {
+            Ray shadowRay;
+            shadowRay.origin = hit.intersectionPoint + 0.0001f * hit.intersectionNormal;
+            shadowRay.direction = glm::normalize(-glm::vec3(scene.lights[i].position));
+            bool inShadow = RaycastAny(shadowRay, scene, std::numeric_limits<float>::max());
+            rayCounts.shadow++;
+            
+            if (!inShadow)
+            {
+                // Ambient
+                glm::vec3 ambient = material.ambient * scene.lights[i].ambient;
+                ambientSum += ambient;
+                ambientCount++;
+
+                // Diffuse
+                glm::vec3 lightDir = glm::normalize(glm::vec3(scene.lights[i].position));
+                float d = max(glm::dot(hit.intersectionNormal, -lightDir), 0.0f);
+                glm::vec3 diffuse = d * (material.diffuse * scene.lights[i].diffuse);
+                diffuseSum += diffuse;
+
+                // Specular
+                glm::vec3 e = glm::normalize(camera.position - hit.intersectionPoint);
+                glm::vec3 reflect = glm::reflect(lightDir, hit.intersectionNormal);
+                float s = pow(max(glm::dot(reflect, e), 0.0f), material.shininess);
+                glm::vec3 specular = s * (material.specular * scene.lights[i].specular);
+                specularSum += specular;
+                
+                // Step 16: Reflection
+                if (maxDepth >= 0)
+                {
+                    Ray reflectionRay;
+                    reflectionRay.origin = hit.intersectionPoint + 0.001f * hit.intersectionNormal;
+                    //reflectionRay.direction = glm::reflect(hit.incomingRay.direction, hit.intersectionNormal);
+                    
+                    // Async task: Blurry reflections
+                    // Referred to this source for help: https://www.cs.unc.edu/~adyilie/comp238/PA2/PA2.htm
+                    px = random(0.05);
+                    py = random(0.05);
+                    pz = random(0.05);
+                    newRays = glm::vec3(px, py, pz);
+                    
+                    reflectionRay.direction = glm::normalize(glm::reflect(hit.incomingRay.direction, hit.intersectionNormal) + newRays);
+                    
+                    float Kr = material.shininess / 128.0f;
+                    rayCounts.reflection++;
+                    finalColor += Kr * RayTrace(reflectionRay, scene, camera, maxDepth - 1);
+                }
+                
+            }
+            else
+            {
+                // Ambient
+                glm::vec3 ambient = material.ambient * scene.lights[i].ambient;
+                ambientSum += ambient;
+                ambientCount++;
+            }
+        }
+        
+        finalAmbient += ambientSum;
+
+        float ambientLights = ambientCount;
+        finalAmbient = finalAmbient / ambientLights;
+
+        finalDiffuse += diffuseSum;
+
+        finalSpecular += specularSum;
+
+        finalColor += finalAmbient + finalDiffuse + finalSpecular;
+        
+    }
+    
+    return finalColor;
+}
+
+/**
+ * @brief Perform a ray-trace to the scene
+ * @param[in] ray       Ray to trace
+ * @param[in] scene     Scene data
+ * @param[in] camera    Camera data
+ * @param[in] maxDepth  Maximum depth of the trace
+ * @return Resulting color after the ray bounced around the scene
+ */
+glm::vec3 RayTrace(const Ray& ray, const Scene& scene, const Camera& camera, int maxDepth)
+{
+    // Step 7
+    
+    IntersectionInfo ret = Raycast( ray, scene );
+    
+    if( ret.obj == nullptr )
+    {
+        return backgroundColor;
+    }
+
+    return ShadeSurface(ret, scene.materials[ret.obj->material], scene, camera, maxDepth);
+}
+
+/**
+ * @brief Renders the image as a grid of square tiles that are traced in parallel on the thread pool
+ * @param[out]  image       Image to render into
+ * @param[in]   camera      Camera data
+ * @param[in]   scene       Scene data
+ * @param[in]   maxDepth    Maximum depth of the trace
+ * @param[in]   pool        Thread pool that runs the tiles
+ * @param[in]   tileSize    Width and height of a tile in pixels
+ * @param[in]   showProgress If true, the number of finished tiles is printed while rendering
+ * @return Number of rays traced
+ */
+RayCounts RenderTiled(Image& image, const Camera& camera, const Scene& scene, int maxDepth, ThreadPool& pool, int tileSize, bool showProgress = true)
+{
+    int tilesX = (image.width + tileSize - 1) / tileSize;
+    int tilesY = (image.height + tileSize - 1) / tileSize;
+    int tileCount = tilesX * tilesY;
+    int completedTiles = 0;
+    PreparedCamera preparedCamera(camera);
+    RayCounts frameRayCounts = { 0, 0, 0 };
+    std::mutex tileMutex; // Guards completedTiles and frameRayCounts
+    std::condition_variable tileFinished; // Signaled whenever a tile is done, wakes up the progress report
+
+    for (int tileY = 0; tileY < tilesY; ++tileY)
+    {
+        for (int tileX = 0; tileX < tilesX; ++tileX)
+        {
+            int x0 = tileX * tileSize;
+            int y0 = tileY * tileSize;
+            int x1 = std::min(x0 + tileSize, image.width);
+            int y1 = std::min(y0 + tileSize, image.height);
+
+            pool.Submit([&image, &camera, &preparedCamera, &scene, &completedTiles, &frameRayCounts, &tileMutex, &tileFinished, maxDepth, x0, y0, x1, y1]
+            {
+                RayCounts countsBefore = rayCounts;
+                RayPacket packet;
+                for (int y = y0; y < y1; ++y)
+                {
+                    for (int x = x0; x < x1; x += RayPacket::size)
+                    {
+                        preparedCamera.GetRays(x, static_cast<float>(image.height - y - 1), std::min(RayPacket::size, x1 - x), packet);
+                        for (int lane = 0; lane < packet.count; ++lane)
+                        {
+                            SeedRandom(x + lane, y, 0);
+                            rayCounts.primary++;
+                            glm::vec3 color = RayTrace(packet.GetRay(lane), scene, camera, maxDepth);
+                            image.SetColor(x + lane, y, color);
+                        }
+                    }
+                }
+                {
+                    std::lock_guard<std::mutex> lock(tileMutex);
+                    frameRayCounts += rayCounts - countsBefore;
+                    completedTiles++;
+                }
+                tileFinished.notify_one();
+            });
+        }
+    }
+
+    // Workers only bump the counter; the progress line is printed from here so it never interleaves
+    if (showProgress)
+    {
+        int reported = 0;
+        while (reported < tileCount)
+        {
+            {
+                std::unique_lock<std::mutex> lock(tileMutex);
+                tileFinished.wait(lock, [&] { return completedTiles != reported; });
+                reported = completedTiles;
+            }
+            std::cout << "Tile: " << std::setfill(' ') << std::setw(5) << reported << " / " << std::setfill(' ') << std::setw(5) << tileCount << "\r" << std::flush;
+        }
+        std::cout << std::endl;
+    }
+
+    pool.Wait();
+    return frameRayCounts;
+}
+
+const char primarySurfaceMagic[4] = { 'R', 'T', 'G', 'B' };
+const uint32_t primarySurfaceVersion = 1;
+
+// Header of a primary surface file, followed by the positions, the normals (3 floats each) and the material IDs (uint32) of every pixel
+struct PrimarySurfaceHeader
+{
+    char magic[4]; // primarySurfaceMagic
+    uint32_t version; // primarySurfaceVersion
+    uint32_t width; // Width in pixels
+    uint32_t height; // Height in pixels
+    uint32_t materialCount; // Size of the material table the IDs refer to
+};
+
+// What the camera ray through the center of every pixel hits first (a G-buffer), rows from top to bottom like Image.
+// Filled by a rasterizer, so that the tracer can start shading from the surfaces instead of casting the primary rays.
+struct PrimarySurfaceBuffer
+{
+    static const uint32_t noSurface = 0xFFFFFFFF; // Material ID of pixels that see the background
+
+    std::vector<glm::vec3> positions; // World-space hit point
+    std::vector<glm::vec3> normals; // World-space unit normal at the hit point
+    std::vector<uint32_t> materialIds; // Index into Scene::materials, or noSurface
+    int width; // Buffer width
+    int height; // Buffer height
+
+    /**
+     * @brief Constructor
+     * @param[in] w Width
+     * @param[in] h Height
+     */
+    PrimarySurfaceBuffer(int w, int h)
+        : positions(w * h)
+        , normals(w * h)
+        , materialIds(w * h, noSurface)
+        , width(w)
+        , height(h)
+    {
+    }
+
+    /**
+     * @brief Writes the buffer to a file, e.g. to render the same surfaces again or to compare rasterizers
+     * @param[in] filename      Path of the file
+     * @param[in] materialCount Size of the material table the IDs refer to
+     * @return True if the file was written
+     */
+    bool Write(const std::string& filename, size_t materialCount) const
+    {
+        ofstream file(filename, std::ios::binary);
+        PrimarySurfaceHeader header;
+        std::memcpy(header.magic, primarySurfaceMagic, sizeof(header.magic));
+        header.version = primarySurfaceVersion;
+        header.width = width;
+        header.height = height;
+        header.materialCount = static_cast<uint32_t>(materialCount);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(positions.data()), positions.size() * sizeof(glm::vec3));
+        file.write(reinterpret_cast<const char*>(normals.data()), normals.size() * sizeof(glm::vec3));
+        file.write(reinterpret_cast<const char*>(materialIds.data()), materialIds.size() * sizeof(uint32_t));
+        if (!file)
+        {
+            cerr << "Error: " << filename << " could not be written" << endl;
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Reads a buffer written by Write() or by an external rasterizer. The size must match the buffer's.
+     * @param[in] filename      Path of the file
+     * @param[in] materialCount Size of the scene's material table; every ID must be below it
+     * @return True if the file was read
+     */
+    bool Read(const std::string& filename, size_t materialCount)
+    {
+        ifstream file(filename, std::ios::binary);
+        PrimarySurfaceHeader header;
+        if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) || std::memcmp(header.magic, primarySurfaceMagic, sizeof(header.magic)) != 0
+            || header.version != primarySurfaceVersion)
+        {
+            cerr << "Error: " << filename << " is not a primary surface file" << endl;
+            return false;
+        }
+        if (header.width != static_cast<uint32_t>(width) || header.height != static_cast<uint32_t>(height))
+        {
+            cerr << "Error: " << filename << " is " << header.width << "x" << header.height << ", the image is " << width << "x" << height << endl;
+            return false;
+        }
+        file.read(reinterpret_cast<char*>(positions.data()), positions.size() * sizeof(glm::vec3));
+        file.read(reinterpret_cast<char*>(normals.data()), normals.size() * sizeof(glm::vec3));
+        file.read(reinterpret_cast<char*>(materialIds.data()), materialIds.size() * sizeof(uint32_t));
+        if (!file)
+        {
+            cerr << "Error: " << filename << " is truncated" << endl;
+            return false;
+        }
+        for (uint32_t id : materialIds)
+        {
+            if (id != noSurface && id >= materialCount)
+            {
+                cerr << "Error: " << filename << " uses material " << id << " but the scene has " << materialCount << endl;
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// Triangle set up for scan conversion, in image pixel coordinates (x to the right, rows from top to bottom)
+struct RasterTriangle
+{
+    int object; // Index into Scene::objects
+    glm::vec3 edges[3]; // Edge functions e.x * x + e.y * row + e.z, all >= 0 on the pixels the triangle covers
+    glm::vec3 inverseDistance; // 1 / s = x * inverseDistance.x + row * inverseDistance.y + inverseDistance.z, where the hit is at origin + s * (unnormalized pixel direction)
+    glm::vec3 normal; // Unit normal of the triangle
+    glm::ivec4 rect; // Pixels to scan: first x, first row, last x, last row
+};
+
+/**
+ * @brief Rasterizes the primary surfaces of the scene into a depth-tested G-buffer. Front-facing triangles are clipped against a
+ * near plane, projected and scan-converted with edge functions; the hit distance comes from the reciprocal ray parameter, which is
+ * linear in screen space, so triangles cost no ray tests at all. Spheres have no scan conversion: every pixel in their projected
+ * bounds casts its camera ray against them, and those pixels are counted as primary rays. Work is split into screen tiles, each of
+ * which only visits the primitives binned into it.
+ * @param[in]   camera      Camera data
+ * @param[in]   scene       Scene data
+ * @param[out]  surfaces    Buffer of the image size receiving the surfaces
+ * @param[in]   pool        Thread pool that runs the tiles
+ * @param[in]   tileSize    Width and height of a tile in pixels
+ * @return Number of camera rays cast (the pixels tested against spheres)
+ */
+RayCounts RasterizePrimarySurfaces(const Camera& camera, const Scene& scene, PrimarySurfaceBuffer& surfaces, ThreadPool& pool, int tileSize)
+{
+    PreparedCamera preparedCamera(camera);
+    int tilesX = (surfaces.width + tileSize - 1) / tileSize;
+    int tilesY = (surfaces.height + tileSize - 1) / tileSize;
+
+    // Unnormalized direction of the camera ray through pixel (x, row): topLeft + stepX * x + stepRow * row
+    glm::vec3 origin = preparedCamera.origin;
+    glm::vec3 topLeft = preparedCamera.lowerLeft - origin + preparedCamera.stepY * static_cast<float>(surfaces.height - 1);
+    glm::vec3 stepX = preparedCamera.stepX;
+    glm::vec3 stepRow = -preparedCamera.stepY;
+    glm::vec3 forward = glm::normalize(camera.lookTarget - camera.position);
+    float planeDistance = glm::dot(topLeft, forward); // Depth of the viewport plane, shared by all pixel directions
+    float nearDepth = planeDistance * 1e-3f; // Triangles are clipped at this depth so that their projection stays finite
+    glm::vec3 axisX = stepX / glm::dot(stepX, stepX);
+    glm::vec3 axisRow = stepRow / glm::dot(stepRow, stepRow);
+
+    // Pixel coordinates of a point in front of the eye
+    auto project = [&](const glm::vec3& point)
+    {
+        glm::vec3 direction = point - origin;
+        glm::vec3 onPlane = direction * (planeDistance / glm::dot(direction, forward)) - topLeft;
+        return glm::vec2(glm::dot(onPlane, axisX), glm::dot(onPlane, axisRow));
+    };
+
+    std::vector<RasterTriangle> triangles;
+    std::vector<int> spheres;
+    std::vector<glm::ivec4> sphereRects;
+    std::vector<std::vector<int>> tileTriangles(tilesX * tilesY);
+    std::vector<std::vector<int>> tileSpheres(tilesX * tilesY);
+    auto bin = [&](const glm::ivec4& rect, std::vector<std::vector<int>>& tiles, int index)
+    {
+        for (int tileY = rect.y / tileSize; tileY <= rect.w / tileSize; ++tileY)
+        {
+            for (int tileX = rect.x / tileSize; tileX <= rect.z / tileSize; ++tileX)
+            {
+                tiles[tileY * tilesX + tileX].push_back(index);
+            }
+        }
+    };
+
+    for (size_t i = 0; i < scene.objects.size(); ++i)
+    {
+        const SceneObject* object = scene.objects[i];
+        if (object->type != ObjectType::Triangle)
+        {
+            // Screen rectangle of the box around the sphere, or the whole screen if part of the box is behind the eye
+            AABB bounds = object->GetBounds();
+            glm::vec2 rectMin(std::numeric_limits<float>::max());
+            glm::vec2 rectMax(-std::numeric_limits<float>::max());
+            bool crossesEyePlane = false;
+            for (int corner = 0; corner < 8 && !crossesEyePlane; ++corner)
+            {
+                glm::vec3 point((corner & 1) ? bounds.maxPoint.x : bounds.minPoint.x, (corner & 2) ? bounds.maxPoint.y : bounds.minPoint.y,
+                    (corner & 4) ? bounds.maxPoint.z : bounds.minPoint.z);
+                crossesEyePlane = glm::dot(point - origin, forward) <= nearDepth;
+                glm::vec2 pixel = project(point);
+                rectMin = glm::min(rectMin, pixel);
+                rectMax = glm::max(rectMax, pixel);
+            }
+            glm::ivec4 rect(0, 0, surfaces.width - 1, surfaces.height - 1);
+            if (!crossesEyePlane)
+            {
+                rect = glm::ivec4(std::max(static_cast<int>(std::floor(rectMin.x)), 0), std::max(static_cast<int>(std::floor(rectMin.y)), 0),
+                    std::min(static_cast<int>(std::ceil(rectMax.x)), surfaces.width - 1), std::min(static_cast<int>(std::ceil(rectMax.y)), surfaces.height - 1));
+            }
+            if (rect.x <= rect.z && rect.y <= rect.w)
+            {
+                bin(rect, tileSpheres, static_cast<int>(spheres.size()));
+                spheres.push_back(static_cast<int>(i));
+                sphereRects.push_back(rect);
+            }
+            continue;
+        }
+
+        // Triangle::Intersect only reports hits on the front face
+        const Triangle* triangle = static_cast<const Triangle*>(object);
+        glm::vec3 n = glm::cross(triangle->B - triangle->A, triangle->C - triangle->A);
+        float planeOffset = glm::dot(n, triangle->A - origin);
+        if (!(planeOffset < 0.0f))
+        {
+            continue;
+        }
+
+        // Clip against the near plane: the triangle becomes a polygon of up to four points
+        glm::vec3 corners[3] = { triangle->A, triangle->B, triangle->C };
+        glm::vec2 polygon[4];
+        int pointCount = 0;
+        for (int k = 0; k < 3; ++k)
+        {
+            const glm::vec3& current = corners[k];
+            const glm::vec3& next = corners[(k + 1) % 3];
+            float currentDepth = glm::dot(current - origin, forward);
+            float nextDepth = glm::dot(next - origin, forward);
+            if (currentDepth >= nearDepth)
+            {
+                polygon[pointCount++] = project(current);
+            }
+            if ((currentDepth >= nearDepth) != (nextDepth >= nearDepth))
+            {
+                polygon[pointCount++] = project(current + (next - current) * ((nearDepth - currentDepth) / (nextDepth - currentDepth)));
+            }
+        }
+
+        RasterTriangle raster;
+        raster.object = static_cast<int>(i);
+        raster.inverseDistance = glm::vec3(glm::dot(n, stepX), glm::dot(n, stepRow), glm::dot(n, topLeft)) / planeOffset;
+        raster.normal = glm::normalize(n);
+        for (int k = 1; k + 1 < pointCount; ++k)
+        {
+            // Fan of the clipped polygon, each part wound so that its inside is where all edge functions are positive
+            glm::vec2 points[3] = { polygon[0], polygon[k], polygon[k + 1] };
+            float area = (points[1].x - points[0].x) * (points[2].y - points[0].y) - (points[1].y - points[0].y) * (points[2].x - points[0].x);
+            if (area == 0.0f)
+            {
+                continue;
+            }
+            if (area < 0.0f)
+            {
+                std::swap(points[1], points[2]);
+            }
+            for (int edge = 0; edge < 3; ++edge)
+            {
+                // Both triangles on a shared edge set it up from the same end point and differ in the sign only, so the pixels
+                // on the edge, where it evaluates to exactly 0, are covered by both and no cracks open up between them
+                glm::vec2 from = points[edge];
+                glm::vec2 to = points[(edge + 1) % 3];
+                bool reversed = to.x < from.x || (to.x == from.x && to.y < from.y);
+                if (reversed)
+                {
+                    std::swap(from, to);
+                }
+                float a = from.y - to.y;
+                float b = to.x - from.x;
+                glm::vec3 function(a, b, -(a * from.x + b * from.y));
+                raster.edges[edge] = reversed ? -function : function;
+            }
+
+            // Pixel centers are at integer coordinates
+            glm::vec2 rectMin = glm::min(points[0], glm::min(points[1], points[2]));
+            glm::vec2 rectMax = glm::max(points[0], glm::max(points[1], points[2]));
+            raster.rect = glm::ivec4(std::max(static_cast<int>(std::ceil(rectMin.x)), 0), std::max(static_cast<int>(std::ceil(rectMin.y)), 0),
+                std::min(static_cast<int>(std::floor(rectMax.x)), surfaces.width - 1), std::min(static_cast<int>(std::floor(rectMax.y)), surfaces.height - 1));
+            if (raster.rect.x <= raster.rect.z && raster.rect.y <= raster.rect.w)
+            {
+                bin(raster.rect, tileTriangles, static_cast<int>(triangles.size()));
+                triangles.push_back(raster);
+            }
+        }
+    }
+
+    RayCounts frameRayCounts = { 0, 0, 0 };
+    std::mutex rayCountsMutex;
+    for (int tileY = 0; tileY < tilesY; ++tileY)
+    {
+        for (int tileX = 0; tileX < tilesX; ++tileX)
+        {
+            pool.Submit([&surfaces, &scene, &preparedCamera, &triangles, &spheres, &sphereRects, &tileTriangles, &tileSpheres, &frameRayCounts, &rayCountsMutex,
+                origin, topLeft, stepX, stepRow, forward, planeDistance, tilesX, tileX, tileY, tileSize]
+            {
+                int x0 = tileX * tileSize;
+                int y0 = tileY * tileSize;
+                int x1 = std::min(x0 + tileSize, surfaces.width);
+                int y1 = std::min(y0 + tileSize, surfaces.height);
+                int tileWidth = x1 - x0;
+
+                // Depth buffer of the tile: distance of the hit along the view direction
+                std::vector<float> depths(tileWidth * (y1 - y0), std::numeric_limits<float>::max());
+                for (int y = y0; y < y1; ++y)
+                {
+                    std::fill(surfaces.materialIds.begin() + y * surfaces.width + x0, surfaces.materialIds.begin() + y * surfaces.width + x1, PrimarySurfaceBuffer::noSurface);
+                }
+
+                for (int triangleIndex : tileTriangles[tileY * tilesX + tileX])
+                {
+                    const RasterTriangle& raster = triangles[triangleIndex];
+                    uint32_t materialId = scene.objects[raster.object]->material;
+                    int firstX = std::max(x0, raster.rect.x);
+                    int lastX = std::min(x1 - 1, raster.rect.z);
+                    for (int y = std::max(y0, raster.rect.y); y <= std::min(y1 - 1, raster.rect.w); ++y)
+                    {
+                        glm::vec3 pixel(static_cast<float>(firstX), static_cast<float>(y), 1.0f);
+                        float w0 = glm::dot(raster.edges[0], pixel);
+                        float w1 = glm::dot(raster.edges[1], pixel);
+                        float w2 = glm::dot(raster.edges[2], pixel);
+                        float inverseDistance = glm::dot(raster.inverseDistance, pixel);
+                        for (int x = firstX; x <= lastX; ++x)
+                        {
+                            if (w0 >= 0.0f && w1 >= 0.0f && w2 >= 0.0f)
+                            {
+                                int local = (y - y0) * tileWidth + x - x0;
+                                float depth = planeDistance / inverseDistance;
+                                if (depth < depths[local])
+                                {
+                                    depths[local] = depth;
+                                    int index = y * surfaces.width + x;
+                                    surfaces.positions[index] = origin + (topLeft + stepX * static_cast<float>(x) + stepRow * static_cast<float>(y)) / inverseDistance;
+                                    surfaces.normals[index] = raster.normal;
+                                    surfaces.materialIds[index] = materialId;
+                                }
+                            }
+                            w0 += raster.edges[0].x;
+                            w1 += raster.edges[1].x;
+                            w2 += raster.edges[2].x;
+                            inverseDistance += raster.inverseDistance.x;
+                        }
+                    }
+                }
+
+                // Spheres cast the camera rays of their pixels instead
+                std::vector<unsigned char> tested(depths.size(), 0);
+                RayPacket packet;
+                for (int sphereIndex : tileSpheres[tileY * tilesX + tileX])
+                {
+                    const SceneObject* object = scene.objects[spheres[sphereIndex]];
+                    const glm::ivec4& rect = sphereRects[sphereIndex];
+                    int firstX = std::max(x0, rect.x);
+                    int lastX = std::min(x1 - 1, rect.z);
+                    for (int y = std::max(y0, rect.y); y <= std::min(y1 - 1, rect.w); ++y)
+                    {
+                        for (int x = firstX; x <= lastX; x += RayPacket::size)
+                        {
+                            preparedCamera.GetRays(x, static_cast<float>(surfaces.height - y - 1), std::min(RayPacket::size, lastX + 1 - x), packet);
+                            for (int lane = 0; lane < packet.count; ++lane)
+                            {
+                                int local = (y - y0) * tileWidth + x + lane - x0;
+                                tested[local] = 1;
+                                glm::vec3 point, normal;
+                                float t = object->Intersect(packet.GetRay(lane), point, normal);
+                                float depth = glm::dot(point - origin, forward);
+                                if (t > 0.0f && depth < depths[local])
+                                {
+                                    depths[local] = depth;
+                                    int index = y * surfaces.width + x + lane;
+                                    surfaces.positions[index] = point;
+                                    surfaces.normals[index] = normal;
+                                    surfaces.materialIds[index] = object->material;
+                                }
+                            }
+                        }
+                    }
+                }
+
+                RayCounts tileCounts = { static_cast<uint64_t>(std::count(tested.begin(), tested.end(), 1)), 0, 0 };
+                std::lock_guard<std::mutex> lock(rayCountsMutex);
+                frameRayCounts += tileCounts;
+            });
+        }
+    }
+    pool.Wait();
+    return frameRayCounts;
+}
+
+/**
+ * @brief Renders the image from primary surfaces instead of camera rays: every pixel is shaded from its surface with
+ * ShadeSurface(), so only the shadow and reflection rays are traced. With surfaces from RasterizePrimarySurfaces() and the
+ * same camera, the image matches RenderTiled() except for the odd pixel that a triangle edge passes right through.
+ * @param[out]  image       Image to render into
+ * @param[in]   camera      Camera data
+ * @param[in]   scene       Scene data, with its material table built
+ * @param[in]   surfaces    Primary surfaces of the image
+ * @param[in]   maxDepth    Maximum depth of the trace
+ * @param[in]   pool        Thread pool that runs the tiles
+ * @param[in]   tileSize    Width and height of a tile in pixels
+ * @return Number of rays traced (no primary rays: those are counted by RasterizePrimarySurfaces())
+ */
+RayCounts RenderHybrid(Image& image, const Camera& camera, const Scene& scene, const PrimarySurfaceBuffer& surfaces, int maxDepth, ThreadPool& pool, int tileSize)
+{
+    int tilesX = (image.width + tileSize - 1) / tileSize;
+    int tilesY = (image.height + tileSize - 1) / tileSize;
+    RayCounts frameRayCounts = { 0, 0, 0 };
+    std::mutex rayCountsMutex;
+
+    for (int tileY = 0; tileY < tilesY; ++tileY)
+    {
+        for (int tileX = 0; tileX < tilesX; ++tileX)
+        {
+            int x0 = tileX * tileSize;
+            int y0 = tileY * tileSize;
+            int x1 = std::min(x0 + tileSize, image.width);
+            int y1 = std::min(y0 + tileSize, image.height);
+
+            pool.Submit([&image, &camera, &scene, &surfaces, &frameRayCounts, &rayCountsMutex, maxDepth, x0, y0, x1, y1]
+            {
+                RayCounts countsBefore = rayCounts;
+                for (int y = y0; y < y1; ++y)
+                {
+                    for (int x = x0; x < x1; ++x)
+                    {
+                        int index = y * surfaces.width + x;
+                        uint32_t materialId = surfaces.materialIds[index];
+                        if (materialId == PrimarySurfaceBuffer::noSurface)
+                        {
+                            image.SetColor(x, y, backgroundColor);
+                            continue;
+                        }
+
+                        SeedRandom(x, y, 0);
+                        IntersectionInfo hit;
+                        hit.incomingRay.origin = camera.position;
+                        hit.incomingRay.direction = glm::normalize(surfaces.positions[index] - camera.position);
+                        hit.t = glm::length(surfaces.positions[index] - camera.position);
+                        hit.obj = nullptr;
+                        hit.intersectionPoint = surfaces.positions[index];
+                        hit.intersectionNormal = surfaces.normals[index];
+                        image.SetColor(x, y, ShadeSurface(hit, scene.materials[materialId], scene, camera, maxDepth));
+                    }
+                }
+                std::lock_guard<std::mutex> lock(rayCountsMutex);
+                frameRayCounts += rayCounts - countsBefore;
+            });
+        }
+    }
+    pool.Wait();
+    return frameRayCounts;
+}
+
+// Settings of the progressive render mode
+struct ProgressiveSettings
+{
+    int maxSamples; // Upper limit of samples per pixel
+    int minSamples; // Samples a pixel takes before it may be considered converged
+    float tolerance; // A pixel has converged once the 95% confidence interval of its mean luminance is narrower than +/- tolerance
+    int snapshotInterval; // Writes an intermediate PNG every that many passes (0 disables snapshots)
+    std::string snapshotFileName; // Snapshots are written to this path with the pass number in front of the ".png"
+};
+
+// Per-pixel running sums of the progressive render mode
+struct AccumulationBuffer
+{
+    std::vector<glm::vec3> colorSum; // Sum of the sample colors
+    std::vector<float> luminanceSum; // Sum of the sample luminances
+    std::vector<float> luminanceSquareSum; // Sum of the squared sample luminances
+    std::vector<int> sampleCount; // Number of samples taken
+    std::vector<unsigned char> converged; // Non-zero once the pixel stopped taking samples
+    int width; // Buffer width
+    int height; // Buffer height
+
+    /**
+     * @brief Constructor
+     * @param[in] w Width
+     * @param[in] h Height
+     */
+    AccumulationBuffer(int w, int h)
+        : colorSum(w * h, glm::vec3(0.0f))
+        , luminanceSum(w * h, 0.0f)
+        , luminanceSquareSum(w * h, 0.0f)
+        , sampleCount(w * h, 0)
+        , converged(w * h, 0)
+        , width(w)
+        , height(h)
+    {
+    }
+
+    /**
+     * @brief Adds a sample to a pixel and checks whether the pixel has converged
+     * @param[in] index     Pixel index (y * width + x)
+     * @param[in] color     Sample color
+     * @param[in] settings  Convergence settings
+     */
+    void AddSample(int index, const glm::vec3& color, const ProgressiveSettings& settings)
+    {
+        // Display values are clamped to [0, 1], so anything brighter cannot add visible noise
+        glm::vec3 clamped = glm::clamp(color, 0.0f, 1.0f);
+        float luminance = glm::dot(clamped, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+
+        colorSum[index] += color;
+        luminanceSum[index] += luminance;
+        luminanceSquareSum[index] += luminance * luminance;
+        int n = ++sampleCount[index];
+
+        if (n >= settings.maxSamples)
+        {
+            converged[index] = 1;
+        }
+        else if (n >= settings.minSamples)
+        {
+            float mean = luminanceSum[index] / n;
+            float variance = std::max(luminanceSquareSum[index] / n - mean * mean, 0.0f) * n / (n - 1);
+            float halfWidth = 1.96f * std::sqrt(variance / n);
+            converged[index] = halfWidth <= settings.tolerance ? 1 : 0;
+        }
+    }
+
+    /**
+     * @brief Writes the mean color of every pixel to an image
+     * @param[out] image Image of the same size as the buffer
+     */
+    void Resolve(Image& image) const
+    {
+        for (int y = 0; y < height; ++y)
+        {
+            for (int x = 0; x < width; ++x)
+            {
+                int index = y * width + x;
+                if (sampleCount[index] > 0)
+                {
+                    image.SetColor(x, y, colorSum[index] / static_cast<float>(sampleCount[index]));
+                }
+            }
+        }
+    }
+};
+
+/**
+ * @brief Radical inverse of an integer, the building block of the Halton sequence
+ * @param[in] index Sequence index
+ * @param[in] base  Prime base
+ * @return Value in [0, 1)
+ */
+float RadicalInverse(int index, int base)
+{
+    float inverseBase = 1.0f / base;
+    float factor = inverseBase;
+    float result = 0.0f;
+    while (index > 0)
+    {
+        result += (index % base) * factor;
+        index /= base;
+        factor *= inverseBase;
+    }
+    return result;
+}
+
+/**
+ * @brief Renders the image progressively. Every pass adds one sample to each pixel that has not converged yet.
+ * The first sample goes through the same point as RenderTiled(); later samples are spread over the pixel with a Halton sequence.
+ * @param[out]  image       Image to render into
+ * @param[in]   camera      Camera data
+ * @param[in]   scene       Scene data
+ * @param[in]   maxDepth    Maximum depth of the trace
+ * @param[in]   pool        Thread pool that runs the tiles
+ * @param[in]   tileSize    Width and height of a tile in pixels
+ * @param[in]   settings    Sample limits, convergence threshold and snapshot output
+ * @param[in]   showProgress If true, every pass prints the number of pixels it sampled
+ * @return Number of rays traced
+ */
+RayCounts RenderProgressive(Image& image, const Camera& camera, const Scene& scene, int maxDepth, ThreadPool& pool, int tileSize, const ProgressiveSettings& settings, bool showProgress = true)
+{
+    AccumulationBuffer buffer(image.width, image.height);
+    int tilesX = (image.width + tileSize - 1) / tileSize;
+    int tilesY = (image.height + tileSize - 1) / tileSize;
+    int pixelCount = image.width * image.height;
+    long long totalSamples = 0;
+    PreparedCamera preparedCamera(camera);
+    RayCounts frameRayCounts = { 0, 0, 0 };
+    std::mutex rayCountsMutex;
+
+    for (int pass = 1; pass <= settings.maxSamples; ++pass)
+    {
+        std::atomic<int> tracedPixels(0);
+        for (int tileY = 0; tileY < tilesY; ++tileY)
+        {
+            for (int tileX = 0; tileX < tilesX; ++tileX)
+            {
+                int x0 = tileX * tileSize;
+                int y0 = tileY * tileSize;
+                int x1 = std::min(x0 + tileSize, image.width);
+                int y1 = std::min(y0 + tileSize, image.height);
+
+                pool.Submit([&buffer, &camera, &preparedCamera, &scene, &settings, &tracedPixels, &frameRayCounts, &rayCountsMutex, maxDepth, x0, y0, x1, y1]
+                {
+                    RayCounts countsBefore = rayCounts;
+                    int traced = 0;
+                    for (int y = y0; y < y1; ++y)
+                    {
+                        for (int x = x0; x < x1; ++x)
+                        {
+                            int index = y * buffer.width + x;
+                            if (buffer.converged[index])
+                            {
+                                continue;
+                            }
+
+                            int sample = buffer.sampleCount[index];
+                            SeedRandom(x, y, sample);
+                            float offsetX = sample == 0 ? 0.0f : RadicalInverse(sample, 2) - 0.5f;
+                            float offsetY = sample == 0 ? 0.0f : RadicalInverse(sample, 3) - 0.5f;
+                            Ray ray = preparedCamera.GetRay(x + offsetX, buffer.height - y - 1 + offsetY);
+                            rayCounts.primary++;
+                            buffer.AddSample(index, RayTrace(ray, scene, camera, maxDepth), settings);
+                            ++traced;
+                        }
+                    }
+                    tracedPixels += traced;
+                    std::lock_guard<std::mutex> lock(rayCountsMutex);
+                    frameRayCounts += rayCounts - countsBefore;
+                });
+            }
+        }
+        pool.Wait();
+
+        int traced = tracedPixels;
+        totalSamples += traced;
+        if (showProgress)
+        {
+            std::cout << "Pass " << std::setw(4) << pass << ": " << std::setw(8) << traced << " / " << pixelCount << " pixels sampled" << "\r" << std::flush;
+        }
+
+        if (settings.snapshotInterval > 0 && pass % settings.snapshotInterval == 0)
+        {
+            buffer.Resolve(image);
+            std::string snapshotFileName = settings.snapshotFileName;
+            size_t extension = snapshotFileName.rfind(".png");
+            snapshotFileName.insert(extension == std::string::npos ? snapshotFileName.size() : extension, "_" + std::to_string(pass));
+            stbi_write_png(snapshotFileName.c_str(), image.width, image.height, 3, image.data.data(), 0);
+        }
+
+        if (traced == 0)
+        {
+            break;
+        }
+    }
+    if (showProgress)
+    {
+        std::cout << std::endl;
+        std::cout << "Average samples per pixel: " << static_cast<double>(totalSamples) / pixelCount << std::endl;
+    }
+
+    buffer.Resolve(image);
+    return frameRayCounts;
+}
+
+// Camera fly-through: keyframes that are passed through in order at an even pace
+struct CameraPath
+{
+    std::vector<glm::vec3> positions; // Camera position of each keyframe
+    std::vector<glm::vec3> lookTargets; // Camera look target of each keyframe
+
+    /**
+     * @brief Loads a path file. Every non-empty line that does not start with '#' is a keyframe:
+     * position x y z followed by look target x y z.
+     * @param[in] filename Path to the file
+     * @return True if the file could be read and contains at least one keyframe
+     */
+    bool Load(const std::string& filename)
+    {
+        ifstream readFile(filename);
+        if (!readFile)
+        {
+            cerr << "Error: camera path " << filename << " could not be opened" << endl;
+            return false;
+        }
+
+        std::string line;
+        while (std::getline(readFile, line))
+        {
+            if (line.empty() || line[0] == '#')
+            {
+                continue;
+            }
+            std::istringstream values(line);
+            glm::vec3 position, lookTarget;
+            if (values >> position.x >> position.y >> position.z >> lookTarget.x >> lookTarget.y >> lookTarget.z)
+            {
+                positions.push_back(position);
+                lookTargets.push_back(lookTarget);
+            }
+        }
+
+        if (positions.empty())
+        {
+            cerr << "Error: camera path " << filename << " has no keyframes" << endl;
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Places the camera along the path. Positions and look targets are interpolated linearly between keyframes.
+     * @param[in]       frame       Frame index
+     * @param[in]       frameCount  Number of frames the path is spread over
+     * @param[in,out]   camera      Camera to place; only its position and look target change
+     */
+    void Evaluate(int frame, int frameCount, Camera& camera) const
+    {
+        int segments = static_cast<int>(positions.size()) - 1;
+        float t = frameCount > 1 ? static_cast<float>(frame) / (frameCount - 1) * segments : 0.0f;
+        int segment = std::min(static_cast<int>(t), std::max(segments - 1, 0));
+        float blend = segments > 0 ? t - segment : 0.0f;
+        int next = std::min(segment + 1, segments);
+
+        camera.position = glm::mix(positions[segment], positions[next], blend);
+        camera.lookTarget = glm::mix(lookTargets[segment], lookTargets[next], blend);
+    }
+};
+
+/**
+ * @brief Peak resident memory of the process so far
+ * @return Peak memory in bytes, or 0 if the platform cannot tell
+ */
+uint64_t PeakMemoryBytes()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    {
+        return counters.PeakWorkingSetSize;
+    }
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+    {
+        return 0;
+    }
+#ifdef __APPLE__
+    return static_cast<uint64_t>(usage.ru_maxrss); // Bytes on macOS
+#else
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024; // Kilobytes on Linux
+#endif
+#endif
+}
+
+/**
+ * @brief Creates a directory (including missing parents) if it does not exist yet
+ * @param[in] path Directory path
+ */
+void CreateDirectories(const std::string& path)
+{
+    for (size_t i = 1; i <= path.size(); ++i)
+    {
+        if (i == path.size() || path[i] == '/' || path[i] == '\\')
+        {
+            std::string prefix = path.substr(0, i);
+#ifdef _WIN32
+            _mkdir(prefix.c_str());
+#else
+            mkdir(prefix.c_str(), 0755);
+#endif
+        }
+    }
+}
+
+// Settings of a headless batch render
+struct BatchSettings
+{
+    std::string cameraPathFileName; // Camera path file
+    int frameCount; // Number of frames to render along the path
+    std::string outputDirectory; // Frames are written to <outputDirectory>/frame_<index>.png
+    std::string logFileName; // Per-frame statistics are written to this CSV file (empty: <outputDirectory>/frames.csv)
+    bool hybrid; // Frames rasterize their primary surfaces and shade them (see RasterizePrimarySurfaces() and RenderHybrid())
+    float frameRate; // Frames per second of the animation clock: frame i shows the scene's animations at i / frameRate seconds
+};
+
+/**
+ * @brief Renders a camera fly-through. The static objects and their BVH are shared by all frames; before each frame the
+ * animated objects are moved and the dynamic BVH is refitted (see AnimateScene()).
+ * Writes one PNG per frame and one CSV line per frame with its wall time, BVH update time, ray counts, rays per second and peak memory.
+ * @param[in]   camera      Camera data; the path overrides its position and look target
+ * @param[in]   scene       Scene data, with the BVHs already built. Animated objects are left where the last frame put them.
+ * @param[in]   maxDepth    Maximum depth of the trace
+ * @param[in]   pool        Thread pool that runs the tiles
+ * @param[in]   tileSize    Width and height of a tile in pixels
+ * @param[in]   progressive If true, frames use RenderProgressive() with progressiveSettings
+ * @param[in]   progressiveSettings Settings of the progressive mode
+ * @param[in]   settings    Camera path, frame count and output locations
+ * @return True if every frame was rendered and written
+ */
+bool RenderBatch(const Camera& camera, Scene& scene, int maxDepth, ThreadPool& pool, int tileSize, bool progressive, const ProgressiveSettings& progressiveSettings, const BatchSettings& settings)
+{
+    CameraPath path;
+    if (!path.Load(settings.cameraPathFileName))
+    {
+        return false;
+    }
+
+    CreateDirectories(settings.outputDirectory);
+    std::string logFileName = settings.logFileName.empty() ? settings.outputDirectory + "/frames.csv" : settings.logFileName;
+    ofstream log(logFileName);
+    if (!log)
+    {
+        cerr << "Error: " << logFileName << " could not be created" << endl;
+        return false;
+    }
+    log << "frame,seconds,bvh_update_ms,bvh_rebuilt,primary_rays,shadow_rays,reflection_rays,rays_per_second,peak_memory_bytes" << endl;
+
+    Image image(camera.imageWidth, camera.imageHeight);
+    PrimarySurfaceBuffer surfaces(image.width, settings.hybrid ? image.height : 0);
+    Camera frameCamera = camera;
+    double totalSeconds = 0.0;
+    int rebuildCount = 0;
+    for (int frame = 0; frame < settings.frameCount; ++frame)
+    {
+        path.Evaluate(frame, settings.frameCount, frameCamera);
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        bool rebuilt = AnimateScene(scene, frame / settings.frameRate);
+        rebuildCount += rebuilt ? 1 : 0;
+        double updateMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        RayCounts counts;
+        if (settings.hybrid)
+        {
+            // The rasterization pass is part of the frame: its time and the camera rays of its spheres are logged with the shading
+            counts = RasterizePrimarySurfaces(frameCamera, scene, surfaces, pool, tileSize);
+            counts += RenderHybrid(image, frameCamera, scene, surfaces, maxDepth, pool, tileSize);
+        }
+        else if (progressive)
+        {
+            ProgressiveSettings frameSettings = progressiveSettings;
+            frameSettings.snapshotInterval = 0;
+            counts = RenderProgressive(image, frameCamera, scene, maxDepth, pool, tileSize, frameSettings, false);
+        }
+        else
+        {
+            counts = RenderTiled(image, frameCamera, scene, maxDepth, pool, tileSize, false);
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        totalSeconds += seconds;
+
+        std::ostringstream frameFileName;
+        frameFileName << settings.outputDirectory << "/frame_" << std::setfill('0') << std::setw(4) << frame << ".png";
+        if (!stbi_write_png(frameFileName.str().c_str(), image.width, image.height, 3, image.data.data(), 0))
+        {
+            cerr << "Error: " << frameFileName.str() << " could not be written" << endl;
+            return false;
+        }
+
+        double raysPerSecond = seconds > 0.0 ? counts.Total() / seconds : 0.0;
+        log << frame << "," << seconds << "," << updateMilliseconds << "," << (rebuilt ? 1 : 0) << "," << counts.primary << "," << counts.shadow << "," << counts.reflection << ","
+            << raysPerSecond << "," << PeakMemoryBytes() << endl;
+        std::cout << "Frame " << std::setfill(' ') << std::setw(4) << frame + 1 << " / " << settings.frameCount << ": "
+            << std::fixed << std::setprecision(3) << seconds << " s, " << std::setprecision(2) << raysPerSecond / 1e6 << " Mrays/s"
+            << std::defaultfloat << std::setprecision(6) << "\r" << std::flush;
+    }
+    std::cout << std::endl;
+    std::cout << "Rendered " << settings.frameCount << " frames in " << totalSeconds << " s, log written to " << logFileName << std::endl;
+    if (!scene.animations.empty())
+    {
+        std::cout << scene.animations.size() << " animated object(s), dynamic BVH rebuilt in " << rebuildCount << " of " << settings.frameCount << " frames" << std::endl;
+    }
+    return true;
+}
+
+/**
+ * @brief Adds the built-in house scene (floor, two houses, a river and a stack of spheres) and its light
+ * @param[out] scene Scene to add the objects and lights to
+ */
+void CreateHouseScene(Scene& scene)
+{
+    Light light = { glm::vec4(0.0f, -1.0f, -1.0f, 0.0f), // position
+                    glm::vec3(0.2f, 0.2f, 0.2f),         // ambient
+                    glm::vec3(1.0f, 1.0f, 1.0f),         // diffuse
+                    glm::vec3(1.0f, 1.0f, 1.0f),         // specular
+                    1, 0, 0 };                           // constant, linear, quadratic
+
+    scene.lights.push_back(light);
+
+    // MATERIALS (ambient, diffuse, specular, shininess)
+
+    uint32_t floorMaterial = AddMaterial(scene, { glm::vec3(0.0f, 0.05f, 0.05f), glm::vec3(0.24f, 0.76f, 0.0f), glm::vec3(0.04f, 0.7f, 0.7f), 1 });
+    uint32_t roofMaterial = AddMaterial(scene, { glm::vec3(0.2125f, 0.1275f, 0.054f), glm::vec3(0.9, 0.22, 0.27), glm::vec3(0.393548f, 0.271906f, 0.166721f), 0.5 });
+    uint32_t wallMaterial = AddMaterial(scene, { glm::vec3(0.2125f, 0.1275f, 0.054f), glm::vec3(0.04, 0.2, 0.41), glm::vec3(0.393548f, 0.271906f, 0.166721f), 0.5 });
+    uint32_t roof2Material = AddMaterial(scene, { glm::vec3(0.2125f, 0.1275f, 0.054f), glm::vec3(1.0f, 0.8, 0.27), glm::vec3(0.393548f, 0.271906f, 0.166721f), 0.5 });
+    uint32_t riverMaterial = AddMaterial(scene, { glm::vec3(0.0f, 0.05f, 0.05f), glm::vec3(0.04, 0.2, 0.41), glm::vec3(0.04f, 0.7f, 0.7f), 60 });
+    uint32_t sphereMaterial = AddMaterial(scene, { glm::vec3(0.0f), glm::vec3(1.0f, 1.0f, 1.0f), glm::vec3(0.0f), 0 });
+
+    // FLOOR
+
+    Triangle floorT1;
+    floorT1.A = glm::vec3(-10, 0, -10);
+    floorT1.B = glm::vec3(-10, 0, 10);
+    floorT1.C = glm::vec3(10, 0, -10);
+    floorT1.material = floorMaterial;
+    scene.triangles.push_back(floorT1);
+
+    Triangle floorT2;
+    floorT2.A = glm::vec3(-10, 0, 10);
+    floorT2.B = glm::vec3(10, 0, 10);
+    floorT2.C = glm::vec3(10, 0, -10);
+    floorT2.material = floorMaterial;
+    scene.triangles.push_back(floorT2);
+
+    // ROOF 1
+
+    Triangle roofFront;
+    roofFront.A = glm::vec3(-3, 1, 1);
+    roofFront.B = glm::vec3(-2, 1, 1);
+    roofFront.C = glm::vec3(-2.5, 1.5, 0.5);
+    roofFront.material = roofMaterial;
+    scene.triangles.push_back(roofFront);
+
+    Triangle roofLeft;
+    roofLeft.A = glm::vec3(-3, 1, 0);
+    roofLeft.B = glm::vec3(-3, 1, 1);
+    roofLeft.C = glm::vec3(-2.5, 1.5, 0.5);
+    roofLeft.material = roofMaterial;
+    scene.triangles.push_back(roofLeft);
+
+    Triangle roofRight;
+    roofRight.A = glm::vec3(-2, 1, 1);
+    roofRight.B = glm::vec3(-2, 1, 0);
+    roofRight.C = glm::vec3(-2.5, 1.5, 0.5);
+    roofRight.material = roofMaterial;
+    scene.triangles.push_back(roofRight);
+
+    Triangle roofBack;
+    roofBack.A = glm::vec3(-2, 1, 0);
+    roofBack.B = glm::vec3(-3, 1, 0);
+    roofBack.C = glm::vec3(-2.5, 1.5, 0.5);
+    roofBack.material = roofMaterial;
+    scene.triangles.push_back(roofBack);
+
+    // HOUSE 1 (CUBE)
+
+    Triangle frontT1;
+    frontT1.A = glm::vec3(-3, 0, 1);
+    frontT1.B = glm::vec3(-2, 0, 1);
+    frontT1.C = glm::vec3(-2, 1, 1);
+    frontT1.material = wallMaterial;
+    scene.triangles.push_back(frontT1);
+
+    Triangle frontT2;
+    frontT2.A = glm::vec3(-2, 1, 1);
+    frontT2.B = glm::vec3(-3, 1, 1);
+    frontT2.C = glm::vec3(-3, 0, 1);
+    frontT2.material = wallMaterial;
+    scene.triangles.push_back(frontT2);
+
+    Triangle backT1;
+    backT1.A = glm::vec3(-2, 0, 0);
+    backT1.B = glm::vec3(-3, 0, 0);
+    backT1.C = glm::vec3(-3, 1, 0);
+    backT1.material = wallMaterial;
+    scene.triangles.push_back(backT1);
+
+    Triangle backT2;
+    backT2.A = glm::vec3(-3, 1, 0);
+    backT2.B = glm::vec3(-2, 1, 0);
+    backT2.C = glm::vec3(-2, 0, 0);
+    backT2.material = wallMaterial;
+    scene.triangles.push_back(backT2);
+
+    Triangle leftT1;
+    leftT1.A = glm::vec3(-3, 0, 0);
+    leftT1.B = glm::vec3(-3, 0, 1);
+    leftT1.C = glm::vec3(-3, 1, 1);
+    leftT1.material = wallMaterial;
+    scene.triangles.push_back(leftT1);
+
+    Triangle leftT2;
+    leftT2.A = glm::vec3(-3, 1, 1);
+    leftT2.B = glm::vec3(-3, 1, 0);
+    leftT2.C = glm::vec3(-3, 0, 0);
+    leftT2.material = wallMaterial;
+    scene.triangles.push_back(leftT2);
+
+    Triangle rightT1;
+    rightT1.A = glm::vec3(-2, 0, 1);
+    rightT1.B = glm::vec3(-2, 0, 0);
+    rightT1.C = glm::vec3(-2, 1, 0);
+    rightT1.material = wallMaterial;
+    scene.triangles.push_back(rightT1);
+
+    Triangle rightT2;
+    rightT2.A = glm::vec3(-2, 1, 0);
+    rightT2.B = glm::vec3(-2, 1, 1);
+    rightT2.C = glm::vec3(-2, 0, 1);
+    rightT2.material = wallMaterial;
+    scene.triangles.push_back(rightT2);
+
+    // ROOF 2
+
+    Triangle roof2Front;
+    roof2Front.A = glm::vec3(2, 1, 1);
+    roof2Front.B = glm::vec3(3, 1, 1);
+    roof2Front.C = glm::vec3(2.5, 1.5, 0.5);
+    roof2Front.material = roof2Material;
+    scene.triangles.push_back(roof2Front);
+
+    Triangle roof2Right;
+    roof2Right.A = glm::vec3(3, 1, 1);
+    roof2Right.B = glm::vec3(3, 1, 0);
+    roof2Right.C = glm::vec3(2.5, 1.5, 0.5);
+    roof2Right.material = roof2Material;
+    scene.triangles.push_back(roof2Right);
+
+    Triangle roof2Left;
+    roof2Left.A = glm::vec3(2, 1, 0);
+    roof2Left.B = glm::vec3(2, 1, 1);
+    roof2Left.C = glm::vec3(2.5, 1.5, 0.5);
+    roof2Left.material = roof2Material;
+    scene.triangles.push_back(roof2Left);
+
+    Triangle roof2Back;
+    roof2Back.A = glm::vec3(3, 1, 0);
+    roof2Back.B = glm::vec3(2, 1, 0);
+    roof2Back.C = glm::vec3(2.5, 1.5, 0.5);
+    roof2Back.material = roof2Material;
+    scene.triangles.push_back(roof2Back);
+
+    // HOUSE 2 (CUBE)
+
+    Triangle front2T1;
+    front2T1.A = glm::vec3(2, 0, 1);
+    front2T1.B = glm::vec3(3, 0, 1);
+    front2T1.C = glm::vec3(2, 1, 1);
+    front2T1.material = wallMaterial;
+    scene.triangles.push_back(front2T1);
+
+    Triangle front2T2;
+    front2T2.A = glm::vec3(3, 1, 1);
+    front2T2.B = glm::vec3(2, 1, 1);
+    front2T2.C = glm::vec3(3, 0, 1);
+    front2T2.material = wallMaterial;
+    scene.triangles.push_back(front2T2);
+
+    Triangle back2T1;
+    back2T1.A = glm::vec3(3, 0, 0);
+    back2T1.B = glm::vec3(2, 0, 0);
+    back2T1.C = glm::vec3(3, 1, 0);
+    back2T1.material = wallMaterial;
+    scene.triangles.push_back(back2T1);
+
+    Triangle back2T2;
+    back2T2.A = glm::vec3(2, 1, 0);
+    back2T2.B = glm::vec3(3, 1, 0);
+    back2T2.C = glm::vec3(2, 0, 0);
+    back2T2.material = wallMaterial;
+    scene.triangles.push_back(back2T2);
+
+    Triangle right2T1;
+    right2T1.A = glm::vec3(3, 0, 1);
+    right2T1.B = glm::vec3(3, 0, 0);
+    right2T1.C = glm::vec3(3, 1, 1);
+    right2T1.material = wallMaterial;
+    scene.triangles.push_back(right2T1);
+
+    Triangle right2T2;
+    right2T2.A = glm::vec3(3, 1, 0);
+    right2T2.B = glm::vec3(3, 1, 1);
+    right2T2.C = glm::vec3(3, 0, 0);
+    right2T2.material = wallMaterial;
+    scene.triangles.push_back(right2T2);
+
+    Triangle left2T1;
+    left2T1.A = glm::vec3(2, 0, 0);
+    left2T1.B = glm::vec3(2, 0, 1);
+    left2T1.C = glm::vec3(2, 1, 0);
+    left2T1.material = wallMaterial;
+    scene.triangles.push_back(left2T1);
+
+    Triangle left2T2;
+    left2T2.A = glm::vec3(2, 1, 1);
+    left2T2.B = glm::vec3(2, 1, 0);
+    left2T2.C = glm::vec3(2, 0, 1);
+    left2T2.material = wallMaterial;
+    scene.triangles.push_back(left2T2);
+
+    // RIVER
+
+    Triangle riverT1;
+    riverT1.A = glm::vec3(-10, 0.1, 2);
+    riverT1.B = glm::vec3(-10, 0.1, 4);
+    riverT1.C = glm::vec3(10, 0.1, 2);
+    riverT1.material = riverMaterial;
+    scene.triangles.push_back(riverT1);
+    
+    Triangle riverT2;
+    riverT2.A = glm::vec3(10, 0.1, 4);
+    riverT2.B = glm::vec3(10, 0.1, 2);
+    riverT2.C = glm::vec3(-10, 0.1, 4);
+    riverT2.material = riverMaterial;
+    scene.triangles.push_back(riverT2);
+    
+    // MODERN ART (SPHERES)
+    
+    Sphere baseSphere;
+    baseSphere.center = glm::vec3(0.0f, 0.5f, 0.0f);
+    baseSphere.radius = 0.5f;
+    baseSphere.material = sphereMaterial;
+    scene.spheres.push_back(baseSphere);
+    
+    Sphere middleSphere;
+    middleSphere.center = glm::vec3(0.0f, 1.2f, 0.0f);
+    middleSphere.radius = 0.3f;
+    middleSphere.material = sphereMaterial;
+    scene.spheres.push_back(middleSphere);
+    
+    Sphere topSphere;
+    topSphere.center = glm::vec3(0.0f, 1.68f, 0.0f);
+    topSphere.radius = 0.2f;
+    topSphere.material = sphereMaterial;
+    scene.spheres.push_back(topSphere);
+}
+
+/**
+ * @brief Loads a scene in the text format
+ * @param[in]       filename    Path to the scene file
+ * @param[out]      scene       Scene to add the objects and lights to
+ * @param[in,out]   camera      Camera data, overwritten by the camera in the file
+ * @param[out]      maxDepth    Maximum depth of the trace stored in the file
+ * @param[in]       quiet       If true, only a summary is printed instead of every object
+ * @return True if the file could be opened and its animations are valid
+ *
+ * The lights may be followed by an optional animation section that marks objects as dynamic:
+ *     animations <count>
+ *     <object index> <amplitude x> <amplitude y> <amplitude z> <period in seconds>    (one line per animated object)
+ * Object indices count the objects in the order they appear in the file, starting at 0.
+ */
+bool LoadTextScene(const std::string& filename, Scene& scene, Camera& camera, int& maxDepth, bool quiet)
+{
+    // Step 11
+    float imageWidth, imageHeight;
+    float px, py, pz, lx, ly, lz, ux, uy, uz, fov, f;
+    int numberOfObjects = 0;
+    string shape;
+    float sx, sy, sz, radius;
+    float ax, ay, az, bx, by, bz, cx, cy, cz;
+    float ar, ag, ab, dr, dg, db, sr, sg, sb, s;
+    int numberOfLights = 0;
+    float lpx, lpy, lpz, lpw, lar, lag, lab, ldr, ldg, ldb, lsr, lsg, lsb, c, l, q;
+
+    ifstream readFile;
+    readFile.open(filename);
+    if (!readFile)
+    {
+        cerr << "Error: file could not be opened" << endl;
+        return false;
+    }
+
+    readFile >> imageWidth >> imageHeight;
+
+    camera.imageWidth = imageWidth;
+    camera.imageHeight = imageHeight;
+
+    readFile >> px >> py >> pz >> lx >> ly >> lz >> ux >> uy >> uz >> fov >> f;
+
+    camera.position = glm::vec3(px, py, pz);
+    camera.lookTarget = glm::vec3(lx, ly, lz);
+    camera.globalUp = glm::vec3(ux, uy, uz);
+    camera.fovY = glm::radians(fov);
+    camera.focalLength = f;
+
+    readFile >> maxDepth;
+    readFile >> numberOfObjects;
+
+    if (!quiet)
+    {
+        cout << "Image width and height: " << camera.imageWidth << " " << camera.imageHeight << endl;
+        cout << "Camera position: " << camera.position.x << " " << camera.position.y << " " << camera.position.z << endl;
+        cout << "Camera look target: " << camera.lookTarget.x << " " << camera.lookTarget.y << " " << camera.lookTarget.z << endl;
+        cout << "Camera global up: " << camera.globalUp.x << " " << camera.globalUp.y << " " << camera.globalUp.z << endl;
+        cout << "Camera fov and focal length: " << camera.fovY << " " << camera.focalLength << endl;
+        cout << "Max Depth: " << maxDepth << endl;
+        cout << "Number of objects: " << numberOfObjects << endl;
+    }
+
+    std::vector<ObjectAnimation> fileObjects; // Pool and index of every object in the file, for the animation section
+    fileObjects.reserve(numberOfObjects);
+    int counter = 0;
+    while (counter < numberOfObjects)
+    {
+        readFile >> shape;
+        if (shape == "sphere")
+        {
+            readFile >> sx >> sy >> sz >> radius;
+            readFile >> ar >> ag >> ab >> dr >> dg >> db >> sr >> sg >> sb >> s;
+
+            Sphere sphere;
+            sphere.center = glm::vec3(sx, sy, sz);
+            sphere.radius = radius;
+
+            Material material;
+            material.ambient = glm::vec3(ar, ag, ab);
+            material.diffuse = glm::vec3(dr, dg, db);
+            material.specular = glm::vec3(sr, sg, sb);
+            material.shininess = s;
+            sphere.material = AddMaterial(scene, material);
+
+            ObjectAnimation slot;
+            slot.type = ObjectType::Sphere;
+            slot.index = static_cast<uint32_t>(scene.spheres.size());
+            fileObjects.push_back(slot);
+            scene.spheres.push_back(sphere);
+
+            if (!quiet)
+            {
+                cout << "Sphere center: " << sphere.center.x << " " << sphere.center.y << " " << sphere.center.z << endl;
+                cout << "Sphere radius: " << sphere.radius << endl;
+                cout << "-------------" << endl;
+            }
+        }
+        else if (shape == "tri")
+        {
+            readFile >> ax >> ay >> az >> bx >> by >> bz >> cx >> cy >> cz;
+            readFile >> ar >> ag >> ab >> dr >> dg >> db >> sr >> sg >> sb >> s;
+
+            Triangle triangle;
+            triangle.A = glm::vec3(ax, ay, az);
+            triangle.B = glm::vec3(bx, by, bz);
+            triangle.C = glm::vec3(cx, cy, cz);
+
+            Material material;
+            material.ambient = glm::vec3(ar, ag, ab);
+            material.diffuse = glm::vec3(dr, dg, db);
+            material.specular = glm::vec3(sr, sg, sb);
+            material.shininess = s;
+            triangle.material = AddMaterial(scene, material);
+
+            ObjectAnimation slot;
+            slot.type = ObjectType::Triangle;
+            slot.index = static_cast<uint32_t>(scene.triangles.size());
+            fileObjects.push_back(slot);
+            scene.triangles.push_back(triangle);
+
+            if (!quiet)
+            {
+                cout << "Triangle A: " << triangle.A.x << " " << triangle.A.y << " " << triangle.A.z << endl;
+                cout << "Triangle B: " << triangle.B.x << " " << triangle.B.y << " " << triangle.B.z << endl;
+                cout << "Triangle C: " << triangle.C.x << " " << triangle.C.y << " " << triangle.C.z << endl;
+                cout << "-------------" << endl;
+            }
+        }
+        counter++;
+    }
+    readFile >> numberOfLights;
+    int counter2 = 0;
+    while (counter2 < numberOfLights)
+    {
+        readFile >> lpx >> lpy >> lpz >> lpw >> lar >> lag >> lab >> ldr >> ldg >> ldb >> lsr >> lsg >> lsb >> c >> l >> q;
+
+        Light light;
+        light.position = glm::vec4(lpx, lpy, lpz, lpw);
+        light.ambient = glm::vec3(lar, lag, lab);
+        light.diffuse = glm::vec3(ldr, ldg, ldb);
+        light.specular = glm::vec3(lsr, lsg, lsb);
+        light.constant = c;
+        light.linear = l;
+        light.quadratic = q;
+
+        scene.lights.push_back(light);
+        counter2++;
+    }
+
+    string section;
+    int numberOfAnimations = 0;
+    if (readFile >> section && section == "animations")
+    {
+        readFile >> numberOfAnimations;
+        for (int i = 0; i < numberOfAnimations; ++i)
+        {
+            size_t index;
+            float amplitudeX, amplitudeY, amplitudeZ, period;
+            readFile >> index >> amplitudeX >> amplitudeY >> amplitudeZ >> period;
+            if (!readFile || index >= fileObjects.size() || period <= 0.0f)
+            {
+                cerr << "Error: animation " << i << " in " << filename << " needs an object index below " << fileObjects.size()
+                    << " and a positive period" << endl;
+                return false;
+            }
+
+            ObjectAnimation animation = fileObjects[index];
+            SceneObject& object = animation.type == ObjectType::Triangle ? static_cast<SceneObject&>(scene.triangles[animation.index])
+                : static_cast<SceneObject&>(scene.spheres[animation.index]);
+            object.dynamic = true;
+            animation.amplitude = glm::vec3(amplitudeX, amplitudeY, amplitudeZ);
+            animation.period = period;
+            animation.offset = glm::vec3(0.0f);
+            scene.animations.push_back(animation);
+        }
+    }
+    readFile.close();
+    cout << "Loaded " << numberOfObjects << " objects, " << numberOfLights << " lights and " << numberOfAnimations << " animations from " << filename << endl;
+    return true;
+}
+
+/**
+ * @brief Writes a scene in the binary format
+ * @param[in] filename  Path of the file to write
+ * @param[in] scene     Scene to write, with its material table
+ * @param[in] camera    Camera data
+ * @param[in] maxDepth  Maximum depth of the trace
+ * @return True if the file was written
+ */
+bool WriteBinaryScene(const std::string& filename, const Scene& scene, const Camera& camera, int maxDepth)
+{
+    if (!scene.animations.empty())
+    {
+        cout << "Warning: the binary format has no animations, the " << scene.animations.size() << " animated objects are written as static objects" << endl;
+    }
+
+    // The scene's material table is already deduplicated, so it is written as is
+    const std::vector<Material>& materials = scene.materials;
+    std::vector<BinaryTriangle> triangles;
+    std::vector<BinarySphere> spheres;
+    triangles.reserve(scene.triangles.size());
+    spheres.reserve(scene.spheres.size());
+    for (const Triangle& triangle : scene.triangles)
+    {
+        BinaryTriangle record = { triangle.A, triangle.B, triangle.C, triangle.material };
+        triangles.push_back(record);
+    }
+    for (const Sphere& sphere : scene.spheres)
+    {
+        BinarySphere record = { sphere.center, sphere.radius, sphere.material };
+        spheres.push_back(record);
+    }
+
+    BinarySceneHeader header;
+    memcpy(header.magic, binarySceneMagic, sizeof(header.magic));
+    header.version = binarySceneVersion;
+    header.imageWidth = camera.imageWidth;
+    header.imageHeight = camera.imageHeight;
+    header.cameraPosition = camera.position;
+    header.cameraLookTarget = camera.lookTarget;
+    header.cameraGlobalUp = camera.globalUp;
+    header.fovY = camera.fovY;
+    header.focalLength = camera.focalLength;
+    header.maxDepth = maxDepth;
+    header.materialCount = static_cast<uint32_t>(materials.size());
+    header.triangleCount = static_cast<uint32_t>(triangles.size());
+    header.sphereCount = static_cast<uint32_t>(spheres.size());
+    header.lightCount = static_cast<uint32_t>(scene.lights.size());
+
+    ofstream writeFile(filename, std::ios::binary);
+    if (!writeFile)
+    {
+        cerr << "Error: " << filename << " could not be created" << endl;
+        return false;
+    }
+    writeFile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    writeFile.write(reinterpret_cast<const char*>(materials.data()), materials.size() * sizeof(Material));
+    writeFile.write(reinterpret_cast<const char*>(triangles.data()), triangles.size() * sizeof(BinaryTriangle));
+    writeFile.write(reinterpret_cast<const char*>(spheres.data()), spheres.size() * sizeof(BinarySphere));
+    writeFile.write(reinterpret_cast<const char*>(scene.lights.data()), scene.lights.size() * sizeof(Light));
+    return static_cast<bool>(writeFile);
+}
+
+/**
+ * @brief Loads a scene in the binary format. The file is memory-mapped and its arrays are read in place;
+ * triangles and spheres are constructed straight into the scene's pools, one allocation per pool.
+ * @param[in]   file        Mapped scene file
+ * @param[out]  scene       Scene to add the objects and lights to
+ * @param[out]  camera      Camera data stored in the file
+ * @param[out]  maxDepth    Maximum depth of the trace stored in the file
+ * @return True if the file is a valid binary scene
+ */
+bool LoadBinaryScene(const MappedFile& file, Scene& scene, Camera& camera, int& maxDepth)
+{
+    if (file.size < sizeof(BinarySceneHeader))
+    {
+        cerr << "Error: binary scene is truncated" << endl;
+        return false;
+    }
+    const BinarySceneHeader* header = reinterpret_cast<const BinarySceneHeader*>(file.data);
+    if (memcmp(header->magic, binarySceneMagic, sizeof(header->magic)) != 0 || header->version != binarySceneVersion)
+    {
+        cerr << "Error: unsupported binary scene version" << endl;
+        return false;
+    }
+
+    size_t expectedSize = sizeof(BinarySceneHeader)
+        + header->materialCount * sizeof(Material)
+        + header->triangleCount * sizeof(BinaryTriangle)
+        + header->sphereCount * sizeof(BinarySphere)
+        + header->lightCount * sizeof(Light);
+    if (file.size < expectedSize)
+    {
+        cerr << "Error: binary scene is truncated" << endl;
+        return false;
+    }
+
+    const Material* materials = reinterpret_cast<const Material*>(file.data + sizeof(BinarySceneHeader));
+    const BinaryTriangle* triangles = reinterpret_cast<const BinaryTriangle*>(materials + header->materialCount);
+    const BinarySphere* spheres = reinterpret_cast<const BinarySphere*>(triangles + header->triangleCount);
+    const Light* lights = reinterpret_cast<const Light*>(spheres + header->sphereCount);
+
+    // Everything is validated before the scene is touched, so a broken file leaves it as it was
+    for (uint32_t i = 0; i < header->triangleCount; ++i)
+    {
+        if (triangles[i].material >= header->materialCount)
+        {
+            cerr << "Error: triangle " << i << " references a missing material" << endl;
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < header->sphereCount; ++i)
+    {
+        if (spheres[i].material >= header->materialCount)
+        {
+            cerr << "Error: sphere " << i << " references a missing material" << endl;
+            return false;
+        }
+    }
+
+    camera.imageWidth = header->imageWidth;
+    camera.imageHeight = header->imageHeight;
+    camera.position = header->cameraPosition;
+    camera.lookTarget = header->cameraLookTarget;
+    camera.globalUp = header->cameraGlobalUp;
+    camera.fovY = header->fovY;
+    camera.focalLength = header->focalLength;
+    maxDepth = header->maxDepth;
+
+    // Material indices of the file, mapped to the scene's table
+    std::vector<uint32_t> materialIndices(header->materialCount);
+    for (uint32_t i = 0; i < header->materialCount; ++i)
+    {
+        materialIndices[i] = AddMaterial(scene, materials[i]);
+    }
+
+    size_t firstTriangle = scene.triangles.size();
+    size_t firstSphere = scene.spheres.size();
+    scene.triangles.resize(firstTriangle + header->triangleCount);
+    scene.spheres.resize(firstSphere + header->sphereCount);
+    for (uint32_t i = 0; i < header->triangleCount; ++i)
+    {
+        Triangle& triangle = scene.triangles[firstTriangle + i];
+        triangle.A = triangles[i].A;
+        triangle.B = triangles[i].B;
+        triangle.C = triangles[i].C;
+        triangle.material = materialIndices[triangles[i].material];
+    }
+    for (uint32_t i = 0; i < header->sphereCount; ++i)
+    {
+        Sphere& sphere = scene.spheres[firstSphere + i];
+        sphere.center = spheres[i].center;
+        sphere.radius = spheres[i].radius;
+        sphere.material = materialIndices[spheres[i].material];
+    }
+    scene.lights.insert(scene.lights.end(), lights, lights + header->lightCount);
+
+    cout << "Loaded " << header->triangleCount << " triangles, " << header->sphereCount << " spheres, " << header->materialCount << " materials and " << header->lightCount << " lights" << endl;
+    return true;
+}
+
+/**
+ * @brief Frees the objects and materials of a scene
+ * @param[in,out] scene Scene whose objects to free
+ */
+void DeleteSceneObjects(Scene& scene)
+{
+    scene.triangles.clear();
+    scene.spheres.clear();
+    scene.materials.clear();
+    scene.materialIndices.clear();
+    scene.objects.clear();
+    scene.dynamicObjects.clear();
+    scene.animations.clear();
+}
+
+/**
+ * @brief Loads a scene file, picking the binary or the text loader based on the file's magic bytes
+ * @param[in]       filename    Path to the scene file
+ * @param[out]      scene       Scene to fill
+ * @param[in,out]   camera      Camera data, overwritten by the camera in the file
+ * @param[out]      maxDepth    Maximum depth of the trace stored in the file
+ * @param[in]       quiet       If true, the text loader does not print every object
+ * @return True if the scene was loaded
+ */
+bool LoadScene(const std::string& filename, Scene& scene, Camera& camera, int& maxDepth, bool quiet)
+{
+    MappedFile file;
+    if (!file.Open(filename))
+    {
+        cerr << "Error: file could not be opened" << endl;
+        return false;
+    }
+
+    if (file.size >= sizeof(binarySceneMagic) && memcmp(file.data, binarySceneMagic, sizeof(binarySceneMagic)) == 0)
+    {
+        return LoadBinaryScene(file, scene, camera, maxDepth);
+    }
+
+    file.Close();
+    return LoadTextScene(filename, scene, camera, maxDepth, quiet);
+}
+
+// --- Benchmarks ---
+
+// Throughput of one benchmark scene
+struct BenchmarkResult
+{
+    std::string name; // Scene name
+    size_t objectCount; // Number of objects
+    size_t bvhNodeCount; // Number of BVH nodes
+    double bvhBuildSeconds; // Time to build the BVH
+    double primaryRaysPerSecond; // Closest-hit camera rays per second
+    double shadowRaysPerSecond; // Any-hit rays from the primary hits towards the light per second
+    double reflectionRaysPerSecond; // Closest-hit rays reflected at the primary hits per second
+    double shadedRaysPerSecond; // Rays per second of complete RayTrace() calls, counting every ray they spawn
+};
+
+/**
+ * @brief Runs work(begin, end) over [0, count) in chunks on the thread pool and measures the wall time
+ * @param[in] pool  Thread pool
+ * @param[in] count Number of work items
+ * @param[in] work  Function that processes the items in [begin, end)
+ * @return Seconds until all chunks were done
+ */
+double TimeParallel(ThreadPool& pool, int count, const std::function<void(int, int)>& work)
+{
+    const int chunkSize = 1024;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int begin = 0; begin < count; begin += chunkSize)
+    {
+        int end = std::min(begin + chunkSize, count);
+        pool.Submit([&work, begin, end] { work(begin, end); });
     }
+    pool.Wait();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 }
 
 /**
- * Main function
+ * @brief Creates a random material; every third one is shiny enough to spawn visible reflections
+ * @param[in,out] rng Random number generator
+ * @return Material
  */
-int main()
+Material RandomMaterial(Pcg32& rng)
 {
-    Scene scene;
-    int maxDepth = 5;
+    Material material;
+    glm::vec3 color(rng.NextDouble(), rng.NextDouble(), rng.NextDouble());
+    material.ambient = color * 0.2f;
+    material.diffuse = color;
+    material.specular = glm::vec3(1.0f);
+    material.shininess = rng.NextUInt() % 3 == 0 ? 96.0f : 8.0f;
+    return material;
+}
 
-    Camera camera = { glm::vec3(-5.0f, 1.0f, 5.0f),  // position
-                      glm::vec3(0.0f, 1.0f, 0.0f),  // look target
-                      glm::vec3(0.0f, 1.0f, 0.0f),  // global up
-                      glm::radians(60.0f), 1.0f,                  // fov and focal length
-                      640, 480 };                   // image width and height;
-    
-    Light light = { glm::vec4(0.0f, -1.0f, -1.0f, 0.0f), // position
-                    glm::vec3(0.2f, 0.2f, 0.2f),         // ambient
-                    glm::vec3(1.0f, 1.0f, 1.0f),         // diffuse
-                    glm::vec3(1.0f, 1.0f, 1.0f),         // specular
-                    1, 0, 0 };                           // constant, linear, quadratic
+/**
+ * @brief Adds a floor quad made of two triangles
+ * @param[out]  scene       Scene to add the triangles to
+ * @param[in]   halfSize    Half of the edge length of the quad
+ * @param[in]   material    Material of the floor
+ */
+void AddBenchmarkFloor(Scene& scene, float halfSize, const Material& material)
+{
+    glm::vec3 corners[4] = { glm::vec3(-halfSize, 0.0f, -halfSize), glm::vec3(halfSize, 0.0f, -halfSize),
+                             glm::vec3(halfSize, 0.0f, halfSize), glm::vec3(-halfSize, 0.0f, halfSize) };
+    for (int i = 0; i < 2; ++i)
+    {
+        Triangle triangle;
+        triangle.A = corners[0];
+        triangle.B = corners[i == 0 ? 2 : 1];
+        triangle.C = corners[i == 0 ? 1 : 3];
+        triangle.material = AddMaterial(scene, material);
+        scene.triangles.push_back(triangle);
+    }
+}
+
+/**
+ * @brief Creates a field of random spheres on a floor, lit by a directional light
+ * @param[out]  scene       Scene to fill
+ * @param[out]  camera      Camera looking at the field
+ * @param[in]   sphereCount Number of spheres
+ */
+void CreateSphereFieldScene(Scene& scene, Camera& camera, int sphereCount)
+{
+    Pcg32 rng;
+    rng.Seed(1, 1);
+    scene.spheres.reserve(sphereCount);
+    for (int i = 0; i < sphereCount; ++i)
+    {
+        Sphere sphere;
+        sphere.radius = 0.1f + 0.5f * rng.NextDouble();
+        sphere.center = glm::vec3(40.0f * rng.NextDouble() - 20.0f, sphere.radius + 10.0f * rng.NextDouble(), 40.0f * rng.NextDouble() - 20.0f);
+        sphere.material = AddMaterial(scene, RandomMaterial(rng));
+        scene.spheres.push_back(sphere);
+    }
+    AddBenchmarkFloor(scene, 25.0f, RandomMaterial(rng));
 
+    Light light = { glm::vec4(-0.3f, -1.0f, -0.5f, 0.0f), glm::vec3(0.2f), glm::vec3(1.0f), glm::vec3(1.0f), 1.0f, 0.0f, 0.0f };
     scene.lights.push_back(light);
+    camera.position = glm::vec3(0.0f, 12.0f, 32.0f);
+    camera.lookTarget = glm::vec3(0.0f, 2.0f, 0.0f);
+}
 
-    // FLOOR
+/**
+ * @brief Creates a finely tessellated rippled surface (2 * resolution^2 triangles), lit by a point light
+ * @param[out]  scene       Scene to fill
+ * @param[out]  camera      Camera looking at the surface
+ * @param[in]   resolution  Number of grid cells along each side
+ */
+void CreateTriangleMeshScene(Scene& scene, Camera& camera, int resolution)
+{
+    Pcg32 rng;
+    rng.Seed(2, 1);
+    Material material = RandomMaterial(rng);
+    material.shininess = 64.0f;
+    uint32_t materialIndex = AddMaterial(scene, material);
 
-    Triangle *floorT1 = new Triangle();
-    floorT1->A = glm::vec3(-10, 0, -10);
-    floorT1->B = glm::vec3(-10, 0, 10);
-    floorT1->C = glm::vec3(10, 0, -10);
-    floorT1->material.ambient = glm::vec3(0.0f, 0.05f, 0.05f);
-    floorT1->material.diffuse = glm::vec3(0.24f, 0.76f, 0.0f);
-    floorT1->material.specular = glm::vec3(0.04f, 0.7f, 0.7f);
-    floorT1->material.shininess = 1;
-    scene.objects.push_back(floorT1);
-
-    Triangle* floorT2 = new Triangle();
-    floorT2->A = glm::vec3(-10, 0, 10);
-    floorT2->B = glm::vec3(10, 0, 10);
-    floorT2->C = glm::vec3(10, 0, -10);
-    floorT2->material.ambient = glm::vec3(0.0f, 0.05f, 0.05f);
-    floorT2->material.diffuse = glm::vec3(0.24f, 0.76f, 0.0f);
-    floorT2->material.specular = glm::vec3(0.04f, 0.7f, 0.7f);
-    floorT2->material.shininess = 1;
-    scene.objects.push_back(floorT2);
+    auto height = [](float x, float z) { return 0.5f * std::sin(x * 1.7f) * std::cos(z * 1.3f) + 0.2f * std::sin((x + z) * 4.0f); };
+    const float size = 20.0f;
+    float cell = size / resolution;
+    scene.triangles.reserve(2 * resolution * resolution);
+    for (int j = 0; j < resolution; ++j)
+    {
+        for (int i = 0; i < resolution; ++i)
+        {
+            float x0 = -size / 2 + i * cell, x1 = x0 + cell;
+            float z0 = -size / 2 + j * cell, z1 = z0 + cell;
+            glm::vec3 p00(x0, height(x0, z0), z0), p10(x1, height(x1, z0), z0);
+            glm::vec3 p01(x0, height(x0, z1), z1), p11(x1, height(x1, z1), z1);
 
-    // ROOF 1
+            Triangle first;
+            first.A = p00;
+            first.B = p01;
+            first.C = p10;
+            first.material = materialIndex;
+            scene.triangles.push_back(first);
 
-    Triangle* roofFront = new Triangle();
-    roofFront->A = glm::vec3(-3, 1, 1);
-    roofFront->B = glm::vec3(-2, 1, 1);
-    roofFront->C = glm::vec3(-2.5, 1.5, 0.5);
-    roofFront->material.ambient = glm::vec3(0.2125f, 0.1275f, 0.054f);
-    roofFront->material.diffuse = glm::vec3(0.9, 0.22, 0.27);
-    roofFront->material.specular = glm::vec3(0.393548f, 0.271906f, 0.166721f);
-    roofFront->material.shininess = 0.5;
-    scene.objects.push_back(roofFront);
-
-    Triangle* roofLeft = new Triangle();
-    roofLeft->A = glm::vec3(-3, 1, 0);
-    roofLeft->B = glm::vec3(-3, 1, 1);
-    roofLeft->C = glm::vec3(-2.5, 1.5, 0.5);
-    roofLeft->material.ambient = glm::vec3(0.2125f, 0.1275f, 0.054f);
-    roofLeft->material.diffuse = glm::vec3(0.9, 0.22, 0.27);
-    roofLeft->material.specular = glm::vec3(0.393548f, 0.271906f, 0.166721f);
-    roofLeft->material.shininess = 0.5;
-    scene.objects.push_back(roofLeft);
-
-    Triangle* roofRight = new Triangle();
-    roofRight->A = glm::vec3(-2, 1, 1);
-    roofRight->B = glm::vec3(-2, 1, 0);
-    roofRight->C = glm::vec3(-2.5, 1.5, 0.5);
-    roofRight->material.ambient = glm::vec3(0.2125f, 0.1275f, 0.054f);
-    roofRight->material.diffuse = glm::vec3(0.9, 0.22, 0.27);
-    roofRight->material.specular = glm::vec3(0.393548f, 0.271906f, 0.166721f);
-    roofRight->material.shininess = 0.5;
-    scene.objects.push_back(roofRight);
-
-    Triangle* roofBack = new Triangle();
-    roofBack->A = glm::vec3(-2, 1, 0);
-    roofBack->B = glm::vec3(-3, 1, 0);
-    roofBack->C = glm::vec3(-2.5, 1.5, 0.5);
-    roofBack->material.ambient = glm::vec3(0.2125f, 0.1275f, 0.054f);
-    roofBack->material.diffuse = glm::vec3(0.9, 0.22, 0.27);
-    roofBack->material.specular = glm::vec3(0.393548f, 0.271906f, 0.166721f);
-    roofBack->material.shininess = 0.5;
-    scene.objects.push_back(roofBack);
+            Triangle second;
+            second.A = p10;
+            second.B = p01;
+            second.C = p11;
+            second.material = materialIndex;
+            scene.triangles.push_back(second);
+        }
+    }
 
-    // HOUSE 1 (CUBE)
+    Light light = { glm::vec4(3.0f, 8.0f, 4.0f, 1.0f), glm::vec3(0.2f), glm::vec3(1.0f), glm::vec3(1.0f), 1.0f, 0.01f, 0.001f };
+    scene.lights.push_back(light);
+    camera.position = glm::vec3(-8.0f, 6.0f, 12.0f);
+    camera.lookTarget = glm::vec3(0.0f, 0.0f, 0.0f);
+}
 
-    Triangle* frontT1 = new Triangle();
-    frontT1->A = glm::vec3(-3, 0, 1);
-    frontT1->B = glm::vec3(-2, 0, 1);
-    frontT1->C = glm::vec3(-2, 1, 1);
-    frontT1->material.ambient = glm::vec3(0.2125f, 0.1275f, 0.054f);
-    frontT1->material.diffuse = glm::vec3(0.04, 0.2, 0.41);
-    frontT1->material.specular = glm::vec3(0.393548f, 0.271906f, 0.166721f);
-    frontT1->material.shininess = 0.5;
-    scene.objects.push_back(frontT1);
-
-    Triangle* frontT2 = new Triangle();
-    frontT2->A = glm::vec3(-2, 1, 1);
-    frontT2->B = glm::vec3(-3, 1, 1);
-    frontT2->C = glm::vec3(-3, 0, 1);
-    frontT2->material.ambient = glm::vec3(0.2125f, 0.1275f, 0.054f);
-    frontT2->material.diffuse = glm::vec3(0.04, 0.2, 0.41);
-    frontT2->material.specular = glm::vec3(0.393548f, 0.271906f, 0.166721f);
-    frontT2->material.shininess = 0.5;
-    scene.objects.push_back(frontT2);
-
-    Triangle* backT1 = new Triangle();
-    backT1->A = glm::vec3(-2, 0, 0);
-    backT1->B = glm::vec3(-3, 0, 0);
-    backT1->C = glm::vec3(-3, 1, 0);
-    backT1->material.ambient = glm::vec3(0.2125f, 0.1275f, 0.054f);
-    backT1->material.diffuse = glm::vec3(0.04, 0.2, 0.41);
-    backT1->material.specular = glm::vec3(0.393548f, 0.271906f, 0.166721f);
-    backT1->material.shininess = 0.5;
-    scene.objects.push_back(backT1);
-
-    Triangle* backT2 = new Triangle();
-    backT2->A = glm::vec3(-3, 1, 0);
-    backT2->B = glm::vec3(-2, 1, 0);
-    backT2->C = glm::vec3(-2, 0, 0);
-    backT2->material.ambient = glm::vec3(0.2125f, 0.1275f, 0.054f);
-    backT2->material.diffuse = glm::vec3(0.04, 0.2, 0.41);
-    backT2->material.specular = glm::vec3(0.393548f, 0.271906f, 0.166721f);
-    backT2->material.shininess = 0.5;
-    scene.objects.push_back(backT2);
-
-    Triangle* leftT1 = new Triangle();
-    leftT1->A = glm::vec3(-3, 0, 0);
-    leftT1->B = glm::vec3(-3, 0, 1);
-    leftT1->C = glm::vec3(-3, 1, 1);
-    leftT1->material.ambient = glm::vec3(0.2125f, 0.1275f, 0.054f);
-    leftT1->material.diffuse = glm::vec3(0.04, 0.2, 0.41);
-    leftT1->material.specular = glm::vec3(0.393548f, 0.271906f, 0.166721f);
-    leftT1->material.shininess = 0.5;
-    scene.objects.push_back(leftT1);
-
-    Triangle* leftT2 = new Triangle();
-    leftT2->A = glm::vec3(-3, 1, 1);
-    leftT2->B = glm::vec3(-3, 1, 0);
-    leftT2->C = glm::vec3(-3, 0, 0);
-    leftT2->material.ambient = glm::vec3(0.2125f, 0.1275f, 0.054f);
-    leftT2->material.diffuse = glm::vec3(0.04, 0.2, 0.41);
-    leftT2->material.specular = glm::vec3(0.393548f, 0.271906f, 0.166721f);
-    leftT2->material.shininess = 0.5;
-    scene.objects.push_back(leftT2);
-
-    Triangle* rightT1 = new Triangle();
-    rightT1->A = glm::vec3(-2, 0, 1);
-    rightT1->B = glm::vec3(-2, 0, 0);
-    rightT1->C = glm::vec3(-2, 1, 0);
-    rightT1->material.ambient = glm::vec3(0.2125f, 0.1275f, 0.054f);
-    rightT1->material.diffuse = glm::vec3(0.04, 0.2, 0.41);
-    rightT1->material.specular = glm::vec3(0.393548f, 0.271906f, 0.166721f);
-    rightT1->material.shininess = 0.5;
-    scene.objects.push_back(rightT1);
-
-    Triangle* rightT2 = new Triangle();
-    rightT2->A = glm::vec3(-2, 1, 0);
-    rightT2->B = glm::vec3(-2, 1, 1);
-    rightT2->C = glm::vec3(-2, 0, 1);
-    rightT2->material.ambient = glm::vec3(0.2125f, 0.1275f, 0.054f);
-    rightT2->material.diffuse = glm::vec3(0.04, 0.2, 0.41);
-    rightT2->material.specular = glm::vec3(0.393548f, 0.271906f, 0.166721f);
-    rightT2->material.shininess = 0.5;
-    scene.objects.push_back(rightT2);
+/**
+ * @brief Measures primary, shadow, reflection and fully shaded ray throughput of one scene.
+ * Every measurement is repeated and the fastest run is kept.
+ * @param[in]   name        Scene name for the report
+ * @param[in]   scene       Scene with objects and lights; the BVH is built here
+ * @param[in]   camera      Camera for the primary rays
+ * @param[in]   maxDepth    Maximum depth of the shaded trace
+ * @param[in]   pool        Thread pool
+ * @param[in]   iterations  Number of runs per measurement
+ * @return Throughput figures
+ */
+BenchmarkResult BenchmarkScene(const std::string& name, Scene& scene, const Camera& camera, int maxDepth, ThreadPool& pool, int iterations)
+{
+    BenchmarkResult result;
+    result.name = name;
+    result.objectCount = scene.triangles.size() + scene.spheres.size();
 
-    // ROOF 2
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    BuildAccelerationStructures(scene);
+    result.bvhBuildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.bvhNodeCount = scene.bvh.nodes.size();
 
-    Triangle* roof2Front = new Triangle();
-    roof2Front->A = glm::vec3(2, 1, 1);
-    roof2Front->B = glm::vec3(3, 1, 1);
-    roof2Front->C = glm::vec3(2.5, 1.5, 0.5);
-    roof2Front->material.ambient = glm::vec3(0.2125f, 0.1275f, 0.054f);
-    roof2Front->material.diffuse = glm::vec3(1.0f, 0.8, 0.27);
-    roof2Front->material.specular = glm::vec3(0.393548f, 0.271906f, 0.166721f);
-    roof2Front->material.shininess = 0.5;
-    scene.objects.push_back(roof2Front);
-
-    Triangle* roof2Right = new Triangle();
-    roof2Right->A = glm::vec3(3, 1, 1);
-    roof2Right->B = glm::vec3(3, 1, 0);
-    roof2Right->C = glm::vec3(2.5, 1.5, 0.5);
-    roof2Right->material.ambient = glm::vec3(0.2125f, 0.1275f, 0.054f);
-    roof2Right->material.diffuse = glm::vec3(1.0f, 0.8, 0.27);
-    roof2Right->material.specular = glm::vec3(0.393548f, 0.271906f, 0.166721f);
-    roof2Right->material.shininess = 0.5;
-    scene.objects.push_back(roof2Right);
-
-    Triangle* roof2Left = new Triangle();
-    roof2Left->A = glm::vec3(2, 1, 0);
-    roof2Left->B = glm::vec3(2, 1, 1);
-    roof2Left->C = glm::vec3(2.5, 1.5, 0.5);
-    roof2Left->material.ambient = glm::vec3(0.2125f, 0.1275f, 0.054f);
-    roof2Left->material.diffuse = glm::vec3(1.0f, 0.8, 0.27);
-    roof2Left->material.specular = glm::vec3(0.393548f, 0.271906f, 0.166721f);
-    roof2Left->material.shininess = 0.5;
-    scene.objects.push_back(roof2Left);
-
-    Triangle* roof2Back = new Triangle();
-    roof2Back->A = glm::vec3(3, 1, 0);
-    roof2Back->B = glm::vec3(2, 1, 0);
-    roof2Back->C = glm::vec3(2.5, 1.5, 0.5);
-    roof2Back->material.ambient = glm::vec3(0.2125f, 0.1275f, 0.054f);
-    roof2Back->material.diffuse = glm::vec3(1.0f, 0.8, 0.27);
-    roof2Back->material.specular = glm::vec3(0.393548f, 0.271906f, 0.166721f);
-    roof2Back->material.shininess = 0.5;
-    scene.objects.push_back(roof2Back);
+    int width = static_cast<int>(camera.imageWidth);
+    int height = static_cast<int>(camera.imageHeight);
+    int pixelCount = width * height;
+    PreparedCamera preparedCamera(camera);
+    std::vector<Ray> primaryRays(pixelCount);
+    for (int i = 0; i < pixelCount; ++i)
+    {
+        primaryRays[i] = preparedCamera.GetRay(i % width, i / width);
+    }
 
-    // HOUSE 2 (CUBE)
+    std::vector<IntersectionInfo> hits(pixelCount);
+    std::atomic<int> sink(0); // Keeps the any-hit results alive
+    double primarySeconds = std::numeric_limits<double>::max();
+    double shadowSeconds = std::numeric_limits<double>::max();
+    double reflectionSeconds = std::numeric_limits<double>::max();
+    double shadedSeconds = std::numeric_limits<double>::max();
+    uint64_t shadedRays = 0;
+    const Light& light = scene.lights[0];
 
-    Triangle* front2T1 = new Triangle();
-    front2T1->A = glm::vec3(2, 0, 1);
-    front2T1->B = glm::vec3(3, 0, 1);
-    front2T1->C = glm::vec3(2, 1, 1);
-    front2T1->material.ambient = glm::vec3(0.2125f, 0.1275f, 0.054f);
-    front2T1->material.diffuse = glm::vec3(0.04, 0.2, 0.41);
-    front2T1->material.specular = glm::vec3(0.393548f, 0.271906f, 0.166721f);
-    front2T1->material.shininess = 0.5;
-    scene.objects.push_back(front2T1);
-
-    Triangle* front2T2 = new Triangle();
-    front2T2->A = glm::vec3(3, 1, 1);
-    front2T2->B = glm::vec3(2, 1, 1);
-    front2T2->C = glm::vec3(3, 0, 1);
-    front2T2->material.ambient = glm::vec3(0.2125f, 0.1275f, 0.054f);
-    front2T2->material.diffuse = glm::vec3(0.04, 0.2, 0.41);
-    front2T2->material.specular = glm::vec3(0.393548f, 0.271906f, 0.166721f);
-    front2T2->material.shininess = 0.5;
-    scene.objects.push_back(front2T2);
-
-    Triangle* back2T1 = new Triangle();
-    back2T1->A = glm::vec3(3, 0, 0);
-    back2T1->B = glm::vec3(2, 0, 0);
-    back2T1->C = glm::vec3(3, 1, 0);
-    back2T1->material.ambient = glm::vec3(0.2125f, 0.1275f, 0.054f);
-    back2T1->material.diffuse = glm::vec3(0.04, 0.2, 0.41);
-    back2T1->material.specular = glm::vec3(0.393548f, 0.271906f, 0.166721f);
-    back2T1->material.shininess = 0.5;
-    scene.objects.push_back(back2T1);
-
-    Triangle* back2T2 = new Triangle();
-    back2T2->A = glm::vec3(2, 1, 0);
-    back2T2->B = glm::vec3(3, 1, 0);
-    back2T2->C = glm::vec3(2, 0, 0);
-    back2T2->material.ambient = glm::vec3(0.2125f, 0.1275f, 0.054f);
-    back2T2->material.diffuse = glm::vec3(0.04, 0.2, 0.41);
-    back2T2->material.specular = glm::vec3(0.393548f, 0.271906f, 0.166721f);
-    back2T2->material.shininess = 0.5;
-    scene.objects.push_back(back2T2);
-
-    Triangle* right2T1 = new Triangle();
-    right2T1->A = glm::vec3(3, 0, 1);
-    right2T1->B = glm::vec3(3, 0, 0);
-    right2T1->C = glm::vec3(3, 1, 1);
-    right2T1->material.ambient = glm::vec3(0.2125f, 0.1275f, 0.054f);
-    right2T1->material.diffuse = glm::vec3(0.04, 0.2, 0.41);
-    right2T1->material.specular = glm::vec3(0.393548f, 0.271906f, 0.166721f);
-    right2T1->material.shininess = 0.5;
-    scene.objects.push_back(right2T1);
-
-    Triangle* right2T2 = new Triangle();
-    right2T2->A = glm::vec3(3, 1, 0);
-    right2T2->B = glm::vec3(3, 1, 1);
-    right2T2->C = glm::vec3(3, 0, 0);
-    right2T2->material.ambient = glm::vec3(0.2125f, 0.1275f, 0.054f);
-    right2T2->material.diffuse = glm::vec3(0.04, 0.2, 0.41);
-    right2T2->material.specular = glm::vec3(0.393548f, 0.271906f, 0.166721f);
-    right2T2->material.shininess = 0.5;
-    scene.objects.push_back(right2T2);
-
-    Triangle* left2T1 = new Triangle();
-    left2T1->A = glm::vec3(2, 0, 0);
-    left2T1->B = glm::vec3(2, 0, 1);
-    left2T1->C = glm::vec3(2, 1, 0);
-    left2T1->material.ambient = glm::vec3(0.2125f, 0.1275f, 0.054f);
-    left2T1->material.diffuse = glm::vec3(0.04, 0.2, 0.41);
-    left2T1->material.specular = glm::vec3(0.393548f, 0.271906f, 0.166721f);
-    left2T1->material.shininess = 0.5;
-    scene.objects.push_back(left2T1);
-
-    Triangle* left2T2 = new Triangle();
-    left2T2->A = glm::vec3(2, 1, 1);
-    left2T2->B = glm::vec3(2, 1, 0);
-    left2T2->C = glm::vec3(2, 0, 1);
-    left2T2->material.ambient = glm::vec3(0.2125f, 0.1275f, 0.054f);
-    left2T2->material.diffuse = glm::vec3(0.04, 0.2, 0.41);
-    left2T2->material.specular = glm::vec3(0.393548f, 0.271906f, 0.166721f);
-    left2T2->material.shininess = 0.5;
-    scene.objects.push_back(left2T2);
+    for (int iteration = 0; iteration < iterations; ++iteration)
+    {
+        primarySeconds = std::min(primarySeconds, TimeParallel(pool, pixelCount, [&](int begin, int end)
+        {
+            for (int i = begin; i < end; ++i)
+            {
+                hits[i] = Raycast(primaryRays[i], scene);
+            }
+        }));
 
-    // RIVER
+        shadowSeconds = std::min(shadowSeconds, TimeParallel(pool, pixelCount, [&](int begin, int end)
+        {
+            int occluded = 0;
+            for (int i = begin; i < end; ++i)
+            {
+                if (hits[i].obj == nullptr)
+                {
+                    continue;
+                }
+                Ray shadowRay;
+                shadowRay.origin = hits[i].intersectionPoint + 0.001f * hits[i].intersectionNormal;
+                float maxDistance = std::numeric_limits<float>::max();
+                if (light.position.w == 1)
+                {
+                    glm::vec3 toLight = glm::vec3(light.position) - shadowRay.origin;
+                    maxDistance = glm::length(toLight);
+                    shadowRay.direction = toLight / maxDistance;
+                }
+                else
+                {
+                    shadowRay.direction = glm::normalize(-glm::vec3(light.position));
+                }
+                occluded += RaycastAny(shadowRay, scene, maxDistance) ? 1 : 0;
+            }
+            sink += occluded;
+        }));
 
-    Triangle* riverT1 = new Triangle();
-    riverT1->A = glm::vec3(-10, 0.1, 2);
-    riverT1->B = glm::vec3(-10, 0.1, 4);
-    riverT1->C = glm::vec3(10, 0.1, 2);
-    riverT1->material.ambient = glm::vec3(0.0f, 0.05f, 0.05f);
-    riverT1->material.diffuse = glm::vec3(0.04, 0.2, 0.41);
-    riverT1->material.specular = glm::vec3(0.04f, 0.7f, 0.7f);
-    riverT1->material.shininess = 60;
-    scene.objects.push_back(riverT1);
-    
-    Triangle* riverT2 = new Triangle();
-    riverT2->A = glm::vec3(10, 0.1, 4);
-    riverT2->B = glm::vec3(10, 0.1, 2);
-    riverT2->C = glm::vec3(-10, 0.1, 4);
-    riverT2->material.ambient = glm::vec3(0.0f, 0.05f, 0.05f);
-    riverT2->material.diffuse = glm::vec3(0.04, 0.2, 0.41);
-    riverT2->material.specular = glm::vec3(0.04f, 0.7f, 0.7f);
-    riverT2->material.shininess = 60;
-    scene.objects.push_back(riverT2);
-    
-    // MODERN ART (SPHERES)
-    
-    Sphere *baseSphere = new Sphere();
-    baseSphere->center = glm::vec3(0.0f, 0.5f, 0.0f);
-    baseSphere->radius = 0.5f;
-    baseSphere->material.diffuse = glm::vec3(1.0f, 1.0f, 1.0f);
-    scene.objects.push_back(baseSphere);
-    
-    Sphere *middleSphere = new Sphere();
-    middleSphere->center = glm::vec3(0.0f, 1.2f, 0.0f);
-    middleSphere->radius = 0.3f;
-    middleSphere->material.diffuse = glm::vec3(1.0f, 1.0f, 1.0f);
-    scene.objects.push_back(middleSphere);
-    
-    Sphere *topSphere = new Sphere();
-    topSphere->center = glm::vec3(0.0f, 1.68f, 0.0f);
-    topSphere->radius = 0.2f;
-    topSphere->material.diffuse = glm::vec3(1.0f, 1.0f, 1.0f);
-    scene.objects.push_back(topSphere);
-    
+        reflectionSeconds = std::min(reflectionSeconds, TimeParallel(pool, pixelCount, [&](int begin, int end)
+        {
+            int reflected = 0;
+            for (int i = begin; i < end; ++i)
+            {
+                if (hits[i].obj == nullptr)
+                {
+                    continue;
+                }
+                Ray reflectionRay;
+                reflectionRay.origin = hits[i].intersectionPoint + 0.001f * hits[i].intersectionNormal;
+                reflectionRay.direction = glm::reflect(hits[i].incomingRay.direction, hits[i].intersectionNormal);
+                reflected += Raycast(reflectionRay, scene).obj != nullptr ? 1 : 0;
+            }
+            sink += reflected;
+        }));
 
-    //*/
-    /**
-    // Step 11
-    string filename;
-    float imageWidth, imageHeight;
-    float px, py, pz, lx, ly, lz, ux, uy, uz, fov, f;
-    int maxDepth = 1;
-    int numberOfObjects = 0;
-    string shape;
-    float sx, sy, sz, radius;
-    float ax, ay, az, bx, by, bz, cx, cy, cz;
-    float ar, ag, ab, dr, dg, db, sr, sg, sb, s;
-    int numberOfLights = 0;
-    float lpx, lpy, lpz, lpw, lar, lag, lab, ldr, ldg, ldb, lsr, lsg, lsb, c, l, q;
+        std::atomic<uint64_t> tracedRays(0);
+        shadedSeconds = std::min(shadedSeconds, TimeParallel(pool, pixelCount, [&](int begin, int end)
+        {
+            RayCounts countsBefore = rayCounts;
+            for (int i = begin; i < end; ++i)
+            {
+                SeedRandom(i % width, i / width, 0);
+                RayTrace(primaryRays[i], scene, camera, maxDepth);
+            }
+            tracedRays += (rayCounts - countsBefore).Total() + (end - begin);
+        }));
+        shadedRays = tracedRays;
+    }
 
-    ifstream readFile; 
-    std::cout << "Enter filename: ";
-    std::cin >> filename;
-    readFile.open(filename); 
-    if (!readFile) 
-    { 
-        cerr << "Error: file could not be opened" << endl;
-        exit(1);
+    int hitCount = 0;
+    for (const IntersectionInfo& hit : hits)
+    {
+        hitCount += hit.obj != nullptr ? 1 : 0;
     }
+    result.primaryRaysPerSecond = pixelCount / primarySeconds;
+    result.shadowRaysPerSecond = hitCount / shadowSeconds;
+    result.reflectionRaysPerSecond = hitCount / reflectionSeconds;
+    result.shadedRaysPerSecond = shadedRays / shadedSeconds;
+    return result;
+}
 
-    readFile >> imageWidth >> imageHeight;
+/**
+ * @brief Measures the raw Sphere::Intersect() or Triangle::Intersect() rate, one object and one ray per test, on one thread
+ * @param[in] object    Object to test
+ * @param[in] testCount Number of tests
+ * @return Tests per second
+ */
+double BenchmarkIntersect(const SceneObject& object, int testCount)
+{
+    Pcg32 rng;
+    rng.Seed(3, 1);
+    std::vector<Ray> rays(4096);
+    for (Ray& ray : rays)
+    {
+        ray.origin = glm::vec3(rng.NextDouble() * 2.0 - 1.0, rng.NextDouble() * 2.0 - 1.0, 5.0);
+        ray.direction = glm::normalize(glm::vec3(rng.NextDouble() * 0.4 - 0.2, rng.NextDouble() * 0.4 - 0.2, -1.0));
+    }
 
-    camera.imageWidth = imageWidth;
-    camera.imageHeight = imageHeight;
-    cout << "Image width and height: " << camera.imageWidth << " " << camera.imageHeight << endl;
+    glm::vec3 point, normal;
+    float sum = 0.0f;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < testCount; ++i)
+    {
+        sum += object.Intersect(rays[i & 4095], point, normal);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    volatile float keep = sum; // Keeps the loop from being optimized away
+    (void)keep;
+    return testCount / seconds;
+}
 
-    readFile >> px >> py >> pz >> lx >> ly >> lz >> ux >> uy >> uz >> fov >> f;
+/**
+ * @brief Runs the benchmark suite: the built-in house scene, a random sphere field and a large triangle mesh,
+ * plus the per-object intersection kernels. Prints a table and optionally writes the results as JSON.
+ * @param[in] pool          Thread pool
+ * @param[in] threadCount   Number of threads in the pool (for the report)
+ * @param[in] iterations    Number of runs per measurement
+ * @param[in] jsonFileName  Path of the JSON report (empty: no report)
+ * @return True if the report could be written
+ */
+bool RunBenchmarks(ThreadPool& pool, int threadCount, int iterations, const std::string& jsonFileName)
+{
+    const int maxDepth = 5;
+    Camera baseCamera = { glm::vec3(-5.0f, 1.0f, 5.0f), glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f), glm::radians(60.0f), 1.0f, 640, 480 };
+    std::vector<BenchmarkResult> results;
 
-    camera.position = glm::vec3(px, py, pz);
-    camera.lookTarget = glm::vec3(lx, ly, lz);
-    camera.globalUp = glm::vec3(ux, uy, uz);
-    camera.fovY = glm::radians(fov);
-    camera.focalLength = f;
+    {
+        Scene scene;
+        CreateHouseScene(scene);
+        results.push_back(BenchmarkScene("house", scene, baseCamera, maxDepth, pool, iterations));
+        DeleteSceneObjects(scene);
+    }
+    {
+        Scene scene;
+        Camera camera = baseCamera;
+        CreateSphereFieldScene(scene, camera, 20000);
+        results.push_back(BenchmarkScene("spheres_20k", scene, camera, maxDepth, pool, iterations));
+        DeleteSceneObjects(scene);
+    }
+    {
+        Scene scene;
+        Camera camera = baseCamera;
+        CreateTriangleMeshScene(scene, camera, 320);
+        results.push_back(BenchmarkScene("mesh_200k", scene, camera, maxDepth, pool, iterations));
+        DeleteSceneObjects(scene);
+    }
 
-    cout << "Camera position: " << camera.position.x << " " << camera.position.y << " " << camera.position.z << endl;
-    cout << "Camera look target: " << camera.lookTarget.x << " " << camera.lookTarget.y << " " << camera.lookTarget.z << endl;
-    cout << "Camera global up: " << camera.globalUp.x << " " << camera.globalUp.y << " " << camera.globalUp.z << endl;
-    cout << "Camera fov and focal length: " << camera.fovY << " " << camera.focalLength << endl;
+    Sphere sphere;
+    sphere.center = glm::vec3(0.0f);
+    sphere.radius = 0.75f;
+    Triangle triangle;
+    triangle.A = glm::vec3(-1.0f, -1.0f, 0.0f);
+    triangle.B = glm::vec3(1.0f, -1.0f, 0.0f);
+    triangle.C = glm::vec3(0.0f, 1.0f, 0.0f);
+    const int testCount = 20000000;
+    double sphereTestsPerSecond = BenchmarkIntersect(sphere, testCount);
+    double triangleTestsPerSecond = BenchmarkIntersect(triangle, testCount);
 
-    readFile >> maxDepth;
-    readFile >> numberOfObjects;
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "Benchmark (" << threadCount << " thread(s), best of " << iterations << ", Mrays/s)" << std::endl;
+    std::cout << std::left << std::setw(14) << "scene" << std::right << std::setw(10) << "objects" << std::setw(12) << "build ms"
+        << std::setw(10) << "primary" << std::setw(10) << "shadow" << std::setw(12) << "reflection" << std::setw(10) << "shaded" << std::endl;
+    for (const BenchmarkResult& result : results)
+    {
+        std::cout << std::left << std::setw(14) << result.name << std::right << std::setw(10) << result.objectCount
+            << std::setw(12) << result.bvhBuildSeconds * 1e3 << std::setw(10) << result.primaryRaysPerSecond / 1e6
+            << std::setw(10) << result.shadowRaysPerSecond / 1e6 << std::setw(12) << result.reflectionRaysPerSecond / 1e6
+            << std::setw(10) << result.shadedRaysPerSecond / 1e6 << std::endl;
+    }
+    std::cout << "Sphere::Intersect:   " << sphereTestsPerSecond / 1e6 << " Mtests/s (1 thread)" << std::endl;
+    std::cout << "Triangle::Intersect: " << triangleTestsPerSecond / 1e6 << " Mtests/s (1 thread)" << std::endl;
+    std::cout << std::defaultfloat << std::setprecision(6);
 
-    cout << "Max Depth: " << maxDepth << endl;
-    cout << "Number of objects: " << numberOfObjects << endl;
+    if (jsonFileName.empty())
+    {
+        return true;
+    }
 
-    int counter = 0;
-    while (counter < numberOfObjects)
+    ofstream json(jsonFileName);
+    if (!json)
     {
-        readFile >> shape;
-        if (shape == "sphere")
-        {
-            readFile >> sx >> sy >> sz >> radius;
-            readFile >> ar >> ag >> ab >> dr >> dg >> db >> sr >> sg >> sb >> s;
+        cerr << "Error: " << jsonFileName << " could not be created" << endl;
+        return false;
+    }
+    json << "{\n";
+    json << "  \"threads\": " << threadCount << ",\n";
+    json << "  \"iterations\": " << iterations << ",\n";
+    json << "  \"scenes\": [\n";
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const BenchmarkResult& result = results[i];
+        json << "    { \"name\": \"" << result.name << "\", \"objects\": " << result.objectCount << ", \"bvh_nodes\": " << result.bvhNodeCount
+            << ", \"bvh_build_ms\": " << result.bvhBuildSeconds * 1e3
+            << ", \"primary_mrays_per_second\": " << result.primaryRaysPerSecond / 1e6
+            << ", \"shadow_mrays_per_second\": " << result.shadowRaysPerSecond / 1e6
+            << ", \"reflection_mrays_per_second\": " << result.reflectionRaysPerSecond / 1e6
+            << ", \"shaded_mrays_per_second\": " << result.shadedRaysPerSecond / 1e6 << " }"
+            << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    json << "  ],\n";
+    json << "  \"kernels\": { \"sphere_intersect_mtests_per_second\": " << sphereTestsPerSecond / 1e6
+        << ", \"triangle_intersect_mtests_per_second\": " << triangleTestsPerSecond / 1e6 << " }\n";
+    json << "}\n";
+    std::cout << "Benchmark results written to " << jsonFileName << std::endl;
+    return true;
+}
 
-            Sphere* sphere = new Sphere();
-            sphere->center = glm::vec3(sx, sy, sz);
-            sphere->radius = radius;
+/**
+ * Main function
+ * @param[in] argc  Number of command-line arguments
+ * @param[in] argv  Command-line arguments. Supported options:
+ *                  --threads <n>    Number of render threads (defaults to the number of hardware threads)
+ *                  --tile-size <n>  Width and height of a render tile in pixels (defaults to 16)
+ *                  --scene <file>   Scene to render, in the text or the binary format (defaults to the built-in house scene)
+ *                  --convert <text scene> <binary scene>  Converts a text scene to the binary format and exits
+ *                  --quiet          Do not print every object while loading a text scene
+ *                  --output <file>  Path of the PNG to write (defaults to scene.png in the working directory)
+ *                  --progressive    Keeps adding samples to noisy pixels until they converge (see the options below)
+ *                  --max-samples <n>    Upper limit of samples per pixel in progressive mode (defaults to 64)
+ *                  --min-samples <n>    Samples a pixel takes before its noise is estimated (defaults to 4)
+ *                  --tolerance <x>      Accepted noise of a pixel's mean luminance, in [0, 1] display units (defaults to 0.01)
+ *                  --snapshot-every <n> Writes an intermediate PNG every n passes (defaults to 0, off)
+ *                  --camera-path <file> Renders a fly-through along the keyframes in the file instead of a single image
+ *                  --frames <n>         Number of frames of the fly-through (defaults to 100)
+ *                  --output-dir <dir>   Directory the frames and the frame log are written to (defaults to "frames")
+ *                  --log <file>         Path of the per-frame CSV log (defaults to <output-dir>/frames.csv)
+ *                  --frame-rate <x>     Frames per second of the scene's object animations in the fly-through (defaults to 30)
+ *                  --hybrid             Scan-converts the primary surfaces instead of casting BVH camera rays (not with --progressive)
+ *                  --surfaces <file>    Hybrid mode with the primary surfaces read from a file written by a rasterizer
+ *                  --write-surfaces <file>  Hybrid mode, also writing the primary surfaces to a file
+ *                  --benchmark          Runs the benchmark suite on built-in synthetic scenes instead of rendering
+ *                  --iterations <n>     Runs per benchmark measurement; the fastest is reported (defaults to 3)
+ *                  --json <file>        Also writes the benchmark results to a JSON file
+ */
+int main(int argc, char* argv[])
+{
+    Scene scene;
+    int maxDepth = 5;
 
-            sphere->material.ambient = glm::vec3(ar, ag, ab);
-            sphere->material.diffuse = glm::vec3(dr, dg, db);
-            sphere->material.specular = glm::vec3(sr, sg, sb);
-            sphere->material.shininess = s;
+    int threadCount = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    int tileSize = 16;
+    std::string sceneFileName;
+    std::string convertInput, convertOutput;
+    bool quiet = false;
+    bool progressive = false;
+    ProgressiveSettings progressiveSettings = { 64, 4, 0.01f, 0, "" };
+    BatchSettings batchSettings = { "", 100, "frames", "", false, 30.0f };
+    bool hybrid = false;
+    std::string surfaceInputFileName, surfaceOutputFileName;
+    bool benchmark = false;
+    int benchmarkIterations = 3;
+    std::string benchmarkJsonFileName;
 
-            scene.objects.push_back(sphere);
+    // Relative to the working directory; pass --output for a full path
+    std::string imageFileName = "scene.png";
 
-            cout << "Sphere center: " << sphere->center.x << " " << sphere->center.y << " " << sphere->center.z << endl;
-            cout << "Sphere radius: " << sphere->radius << endl;
-            cout << "-------------" << endl;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc)
+        {
+            threadCount = std::max(1, atoi(argv[++i]));
         }
-        else if (shape == "tri")
+        else if (arg == "--tile-size" && i + 1 < argc)
         {
-            readFile >> ax >> ay >> az >> bx >> by >> bz >> cx >> cy >> cz;
-            readFile >> ar >> ag >> ab >> dr >> dg >> db >> sr >> sg >> sb >> s;
-
-            Triangle* triangle = new Triangle();
-            triangle->A = glm::vec3(ax, ay, az);
-            triangle->B = glm::vec3(bx, by, bz);
-            triangle->C = glm::vec3(cx, cy, cz);
-
-            triangle->material.ambient = glm::vec3(ar, ag, ab);
-            triangle->material.diffuse = glm::vec3(dr, dg, db);
-            triangle->material.specular = glm::vec3(sr, sg, sb);
-            triangle->material.shininess = s;
-
-            scene.objects.push_back(triangle);
+            tileSize = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--scene" && i + 1 < argc)
+        {
+            sceneFileName = argv[++i];
+        }
+        else if (arg == "--convert" && i + 2 < argc)
+        {
+            convertInput = argv[++i];
+            convertOutput = argv[++i];
+        }
+        else if (arg == "--quiet")
+        {
+            quiet = true;
+        }
+        else if (arg == "--output" && i + 1 < argc)
+        {
+            imageFileName = argv[++i];
+        }
+        else if (arg == "--progressive")
+        {
+            progressive = true;
+        }
+        else if (arg == "--max-samples" && i + 1 < argc)
+        {
+            progressiveSettings.maxSamples = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--min-samples" && i + 1 < argc)
+        {
+            progressiveSettings.minSamples = std::max(2, atoi(argv[++i]));
+        }
+        else if (arg == "--tolerance" && i + 1 < argc)
+        {
+            progressiveSettings.tolerance = static_cast<float>(atof(argv[++i]));
+        }
+        else if (arg == "--snapshot-every" && i + 1 < argc)
+        {
+            progressiveSettings.snapshotInterval = std::max(0, atoi(argv[++i]));
+        }
+        else if (arg == "--camera-path" && i + 1 < argc)
+        {
+            batchSettings.cameraPathFileName = argv[++i];
+        }
+        else if (arg == "--frames" && i + 1 < argc)
+        {
+            batchSettings.frameCount = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--output-dir" && i + 1 < argc)
+        {
+            batchSettings.outputDirectory = argv[++i];
+        }
+        else if (arg == "--log" && i + 1 < argc)
+        {
+            batchSettings.logFileName = argv[++i];
+        }
+        else if (arg == "--frame-rate" && i + 1 < argc)
+        {
+            batchSettings.frameRate = std::max(1e-3f, static_cast<float>(atof(argv[++i])));
+        }
+        else if (arg == "--hybrid")
+        {
+            hybrid = true;
+        }
+        else if (arg == "--surfaces" && i + 1 < argc)
+        {
+            surfaceInputFileName = argv[++i];
+            hybrid = true;
+        }
+        else if (arg == "--write-surfaces" && i + 1 < argc)
+        {
+            surfaceOutputFileName = argv[++i];
+            hybrid = true;
+        }
+        else if (arg == "--benchmark")
+        {
+            benchmark = true;
+        }
+        else if (arg == "--iterations" && i + 1 < argc)
+        {
+            benchmarkIterations = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--json" && i + 1 < argc)
+        {
+            benchmarkJsonFileName = argv[++i];
+        }
+        else
+        {
+            cerr << "Unknown option: " << arg << endl;
+            return 1;
+        }
+    }
 
-            cout << "Triangle A: " << triangle->A.x << " " << triangle->A.y << " " << triangle->A.z << endl;
-            cout << "Triangle B: " << triangle->B.x << " " << triangle->B.y << " " << triangle->B.z << endl;
-            cout << "Triangle C: " << triangle->C.x << " " << triangle->C.y << " " << triangle->C.z << endl;
-            cout << "-------------" << endl;
+    Camera camera = { glm::vec3(-5.0f, 1.0f, 5.0f),  // position
+                      glm::vec3(0.0f, 1.0f, 0.0f),  // look target
+                      glm::vec3(0.0f, 1.0f, 0.0f),  // global up
+                      glm::radians(60.0f), 1.0f,                  // fov and focal length
+                      640, 480 };                   // image width and height;
+    
+    if (benchmark)
+    {
+        ThreadPool benchmarkPool(threadCount);
+        return RunBenchmarks(benchmarkPool, threadCount, benchmarkIterations, benchmarkJsonFileName) ? 0 : 1;
+    }
 
+    if (!convertInput.empty())
+    {
+        if (!LoadTextScene(convertInput, scene, camera, maxDepth, quiet) || !WriteBinaryScene(convertOutput, scene, camera, maxDepth))
+        {
+            return 1;
         }
-        counter++;
+        std::cout << "Wrote " << convertOutput << std::endl;
+        return 0;
     }
-    readFile >> numberOfLights;
-    int counter2 = 0;
-    while (counter2 < numberOfLights)
+
+    if (sceneFileName.empty())
     {
-        readFile >> lpx >> lpy >> lpz >> lpw >> lar >> lag >> lab >> ldr >> ldg >> ldb >> lsr >> lsg >> lsb >> c >> l >> q;
+        CreateHouseScene(scene);
+    }
+    else if (!LoadScene(sceneFileName, scene, camera, maxDepth, quiet))
+    {
+        return 1;
+    }
 
-        Light light;
-        light.position = glm::vec4(lpx, lpy, lpz, lpw);
-        light.ambient = glm::vec3(lar, lag, lab);
-        light.diffuse = glm::vec3(ldr, ldg, ldb);
-        light.specular = glm::vec3(lsr, lsg, lsb);
-        light.constant = c;
-        light.linear = l;
-        light.quadratic = q;
+    BuildAccelerationStructures(scene);
+    std::cout << "BVH: " << scene.bvh.nodes.size() << " nodes over " << scene.bvh.objects.size() << " static objects, "
+        << scene.dynamicBvh.nodes.size() << " nodes over " << scene.dynamicBvh.objects.size() << " dynamic objects" << std::endl;
 
-        scene.lights.push_back(light);
-        counter2++;
+    // The hybrid mode shades one rasterized surface per pixel, so it cannot take the jittered samples of the progressive mode
+    if (hybrid && progressive)
+    {
+        cerr << "Error: --hybrid cannot be combined with --progressive" << endl;
+        DeleteSceneObjects(scene);
+        return 1;
     }
-    readFile.close();
-    cout << "End of File Reached" << endl;
-    */
+    batchSettings.hybrid = hybrid;
 
     Image image(camera.imageWidth, camera.imageHeight);
-    for (int y = 0; y < image.height; ++y)
+    ThreadPool pool(threadCount);
+    std::cout << "Rendering with " << threadCount << " thread(s), " << tileSize << "x" << tileSize << " tiles" << std::endl;
+    if (!batchSettings.cameraPathFileName.empty())
     {
-        for (int x = 0; x < image.width; ++x)
+        bool rendered = RenderBatch(camera, scene, maxDepth, pool, tileSize, progressive, progressiveSettings, batchSettings);
+        DeleteSceneObjects(scene);
+        return rendered ? 0 : 1;
+    }
+
+    if (hybrid)
+    {
+        // Primary surfaces from a file written by a rasterizer, or rasterized here
+        PrimarySurfaceBuffer surfaces(image.width, image.height);
+        if (!surfaceInputFileName.empty())
+        {
+            if (!surfaces.Read(surfaceInputFileName, scene.materials.size()))
+            {
+                DeleteSceneObjects(scene);
+                return 1;
+            }
+        }
+        else
         {
-            Ray ray = GetRayThruPixel(camera, x, image.height - y - 1);
-            glm::vec3 color = RayTrace(ray, scene, camera, maxDepth);
-            image.SetColor(x, y, color);
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            RayCounts counts = RasterizePrimarySurfaces(camera, scene, surfaces, pool, tileSize);
+            double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            std::cout << "Primary surfaces rasterized in " << milliseconds << " ms, " << counts.primary << " camera rays cast for spheres" << std::endl;
         }
-
-        std::cout << "Row: " << std::setfill(' ') << std::setw(4) << (y + 1) << " / " << std::setfill(' ') << std::setw(4) << image.height << "\r" << std::flush;
+        if (!surfaceOutputFileName.empty() && !surfaces.Write(surfaceOutputFileName, scene.materials.size()))
+        {
+            DeleteSceneObjects(scene);
+            return 1;
+        }
+        RenderHybrid(image, camera, scene, surfaces, maxDepth, pool, tileSize);
+    }
+    else if (progressive)
+    {
+        progressiveSettings.snapshotFileName = imageFileName;
+        RenderProgressive(image, camera, scene, maxDepth, pool, tileSize, progressiveSettings);
+    }
+    else
+    {
+        RenderTiled(image, camera, scene, maxDepth, pool, tileSize);
     }
-    std::cout << std::endl;
     
-    // For Windows
-    //std::string imageFileName = "scene.png"; // You might need to make this a full path if you are on Mac
-    // For Mac
-    std::string imageFileName = "/Users/alycolumbres/Desktop/admu/Y4 S2/GDEV 32/OpenGL/Projects/Final Project - Ray tracing/scene.png";
     stbi_write_png(imageFileName.c_str(), image.width, image.height, 3, image.data.data(), 0);
     
-    for (size_t i = 0; i < scene.objects.size(); ++i)
-    {
-        delete scene.objects[i];
-    }
+    DeleteSceneObjects(scene);
 
     return 0;
 }
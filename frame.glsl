@@ -0,0 +1,29 @@
+// PER-FRAME PARAMETERS
+// Uploaded once per frame into one uniform buffer and shared by every program.
+// The layout is std140 and must match the FrameUniforms struct in Main.cpp.
+
+// Must match ShadowCascades::maxCascades
+#define MAX_CASCADES 4
+
+layout(std140) uniform FrameUniforms
+{
+    mat4 viewMatrix;
+    mat4 viewProjection;
+    mat4 inverseViewProjection;
+
+    // World to light clip space of each cascade, and the view depth where each cascade ends
+    mat4 lightSpaceMatrices[MAX_CASCADES];
+    vec4 cascadeSplits;
+
+    vec4 eyePosition;                   // xyz
+    vec4 directionalLightDirection;     // xyz
+    vec4 ambientColor;                  // rgb: ambient intensity * ambient component
+    vec4 diffuseColor;                  // rgb: diffuse intensity * diffuse component
+    vec4 specularColor;                 // rgb: specular intensity * specular component, a: shininess
+
+    vec4 viewportSize;                  // xy: framebuffer size in pixels, zw: 1 / size
+    vec4 clusterDepthParameters;        // x, y: slice = log(view depth) * x + y
+    vec4 shadowParameters;              // x: slope bias, y: minimum bias, z: PCF radius, w: 1 / cascade resolution
+    ivec4 clusterCounts;                // x, y: screen tiles, z: depth slices
+    ivec4 lightCounts;                  // x: point lights, y: shadow cascades
+};
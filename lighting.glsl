@@ -0,0 +1,114 @@
+// LIGHTING
+// Shared by the forward (main.fsh) and deferred (deferred.fsh) paths.
+// One shadowed directional light, plus the point lights binned into the fragment's cluster.
+
+#include "frame.glsl"
+
+// Must match LightClusters::maxLights (light indices are stored as bytes)
+#define MAX_POINT_LIGHTS 256
+
+struct PointLight
+{
+    vec4 positionRadius;    // xyz: world position, w: radius
+    vec4 colorIntensity;    // rgb: color, a: intensity
+};
+
+layout(std140) uniform PointLights
+{
+    PointLight pointLights[MAX_POINT_LIGHTS];
+};
+
+// Offset and count of each cluster's range in lightIndices
+uniform usamplerBuffer clusterLights;
+
+// Indices into pointLights, grouped by cluster
+uniform usamplerBuffer lightIndices;
+
+// One depth layer per cascade, sampled with depth comparison (each lookup is a bilinear 2x2 PCF)
+uniform sampler2DArrayShadow shadowMap;
+
+/// Fraction of the directional light reaching the position: 0 fully shadowed, 1 fully lit
+float DirectionalShadow(vec3 position, vec3 normal, float viewDepth)
+{
+    int cascadeCount = lightCounts.y;
+
+    // Fragments beyond the last cascade are not shadowed
+    if (viewDepth > cascadeSplits[cascadeCount - 1])
+    {
+        return 1.0;
+    }
+
+    // The first cascade whose range contains the fragment
+    int cascade = 0;
+    while (cascade < cascadeCount - 1 && viewDepth > cascadeSplits[cascade])
+    {
+        cascade++;
+    }
+    vec4 positionLight = lightSpaceMatrices[cascade] * vec4(position, 1.f);
+    vec3 lightNDC = vec3(positionLight) / positionLight.w;  // homogeneous to cartesian
+    lightNDC = (lightNDC + 1) / 2;                          // [-1, 1] to [0, 1]
+
+    // Removing shadow acne: surfaces at grazing angles to the light get a larger bias
+    float cosTheta = clamp(dot(normal, -normalize(directionalLightDirection.xyz)), 0.0, 1.0);
+    float bias = max(shadowParameters.x * (1.0 - cosTheta), shadowParameters.y);
+    float reference = lightNDC.z - bias;
+
+    // Average of a square kernel of filtered compares, one texel apart
+    int radius = int(shadowParameters.z);
+    float lit = 0.0;
+    for (int y = -radius; y <= radius; ++y)
+    {
+        for (int x = -radius; x <= radius; ++x)
+        {
+            vec2 offset = vec2(x, y) * shadowParameters.w;
+            lit += texture(shadowMap, vec4(lightNDC.xy + offset, float(cascade), reference));
+        }
+    }
+    return lit / float((2 * radius + 1) * (2 * radius + 1));
+}
+
+/// Index of the cluster containing a fragment
+int ClusterIndex(vec2 fragCoord, float viewDepth)
+{
+    ivec2 tile = ivec2(fragCoord * viewportSize.zw * vec2(clusterCounts.xy));
+    int slice = int(log(viewDepth) * clusterDepthParameters.x + clusterDepthParameters.y);
+    tile = clamp(tile, ivec2(0), clusterCounts.xy - 1);
+    slice = clamp(slice, 0, clusterCounts.z - 1);
+    return (slice * clusterCounts.y + tile.y) * clusterCounts.x + tile.x;
+}
+
+/// Phong shading of a surface point by the directional light and the point lights of its cluster
+vec3 ShadeFragment(vec3 albedo, vec3 position, vec3 normal, float viewDepth, vec2 fragCoord)
+{
+    vec3 norm = normalize(normal);
+    vec3 viewDir = normalize(eyePosition.xyz - position);
+    float shininess = specularColor.a;
+
+    // DIRECTIONAL LIGHT
+    vec3 directionalLightDirNormalized = normalize(directionalLightDirection.xyz);
+    float directionalLightDiff = max(dot(norm, -directionalLightDirNormalized), 0.0f);
+    vec3 directionalLightReflectDir = reflect(directionalLightDirNormalized, norm);
+    float directionalLightSpec = pow(max(dot(directionalLightReflectDir, viewDir), 0.0), shininess);
+
+    vec3 lighting = ambientColor.rgb +
+                    DirectionalShadow(position, norm, viewDepth) * (directionalLightDiff * diffuseColor.rgb +
+                                                              directionalLightSpec * specularColor.rgb);
+
+    // POINT LIGHTS of the cluster, with a smooth falloff reaching zero at the light's radius
+    uvec2 range = texelFetch(clusterLights, ClusterIndex(fragCoord, viewDepth)).xy;
+    for (uint i = 0u; i < range.y; ++i)
+    {
+        PointLight light = pointLights[texelFetch(lightIndices, int(range.x + i)).x];
+        vec3 toLight = light.positionRadius.xyz - position;
+        float distance = length(toLight);
+        float falloff = clamp(1.0 - distance / light.positionRadius.w, 0.0, 1.0);
+        vec3 lightDir = toLight / max(distance, 0.0001);
+
+        float diff = max(dot(norm, lightDir), 0.0);
+        float spec = pow(max(dot(reflect(-lightDir, norm), viewDir), 0.0), shininess);
+        lighting += (falloff * falloff * light.colorIntensity.a) * light.colorIntensity.rgb *
+                    (diff * diffuseColor.rgb + spec * specularColor.rgb);
+    }
+
+    return lighting * albedo;
+}